@@ -0,0 +1,149 @@
+/*
+ * Local Layering arena : bump allocator for data freed all at once
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include "ll_arena.h"
+
+// Alignment of every allocation
+#define LL_ARENA_ALIGN		16
+
+//Header of a chunk, followed by its data
+struct ll_arena_chunk
+{
+	LL_ARENA_CHUNK_HDR	*next;
+	gsize			size;
+};
+
+// Size of the chunk header rounded up to keep the data aligned
+#define CHUNK_HDR_SIZE		((sizeof (LL_ARENA_CHUNK_HDR) + LL_ARENA_ALIGN - 1) & ~((gsize) LL_ARENA_ALIGN - 1))
+
+// Data of a chunk
+#define CHUNK_DATA(chunk)	((guchar *) (chunk) + CHUNK_HDR_SIZE)
+
+//Creates an empty arena whose chunks are accounted to subsystem mem
+LL_ARENA * ll_arena_new(gsize chunk_size, LL_MEM mem)
+{
+ LL_ARENA	*arena;
+
+	arena = g_new0(LL_ARENA, 1);
+
+	arena->chunk_size = MAX(chunk_size, LL_ARENA_ALIGN);
+	arena->mem = mem;
+
+	return arena;
+}
+
+//Adds a chunk of at least size bytes in front of the chunks of the arena
+static void arena_grow(LL_ARENA *arena, gsize size)
+{
+ LL_ARENA_CHUNK_HDR	*chunk;
+
+	size = MAX(size, arena->chunk_size);
+
+	chunk = g_malloc(CHUNK_HDR_SIZE + size);
+	chunk->next = arena->chunks;
+	chunk->size = size;
+
+	arena->chunks = chunk;
+	arena->pos = CHUNK_DATA(chunk);
+	arena->left = size;
+	arena->bytes += size;
+
+	LL_STATS_ALLOC(arena->mem, size);
+}
+
+//Returns size bytes (not initialized) from the arena
+gpointer ll_arena_alloc(LL_ARENA *arena, gsize size)
+{
+ gpointer	p;
+
+	size = (size + LL_ARENA_ALIGN - 1) & ~((gsize) LL_ARENA_ALIGN - 1);
+
+	if(size > arena->left)
+		arena_grow(arena, size);
+
+	p = arena->pos;
+	arena->pos += size;
+	arena->left -= size;
+
+	return p;
+}
+
+//Returns size bytes set to 0 from the arena
+gpointer ll_arena_alloc0(LL_ARENA *arena, gsize size)
+{
+	return memset(ll_arena_alloc(arena, size), 0, size);
+}
+
+//Frees all the allocations of the arena at once
+//The first chunk of the default size is kept for the next allocations
+void ll_arena_reset(LL_ARENA *arena)
+{
+ LL_ARENA_CHUNK_HDR	*chunk, *keep = NULL;
+
+	while(arena->chunks != NULL)
+	{
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+
+		if(keep == NULL && chunk->size == arena->chunk_size)
+		{
+			keep = chunk;
+			continue;
+		}
+
+		arena->bytes -= chunk->size;
+		LL_STATS_FREE(arena->mem, chunk->size);
+		g_free(chunk);
+	}
+
+	arena->chunks = keep;
+	arena->pos = NULL;
+	arena->left = 0;
+
+	if(keep != NULL)
+	{
+		keep->next = NULL;
+		arena->pos = CHUNK_DATA(keep);
+		arena->left = keep->size;
+	}
+}
+
+//Frees the arena and all its allocations
+void ll_arena_free(LL_ARENA *arena)
+{
+ LL_ARENA_CHUNK_HDR	*chunk;
+
+	if(arena == NULL)
+		return;
+
+	while(arena->chunks != NULL)
+	{
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+
+		LL_STATS_FREE(arena->mem, chunk->size);
+		g_free(chunk);
+	}
+
+	g_free(arena);
+}
@@ -0,0 +1,64 @@
+/*
+ * Local Layering arena : bump allocator for data freed all at once
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_ARENA_H__
+#define __LL_ARENA_H__
+
+#include <glib.h>
+
+#include "ll_stats.h"
+
+// Default size of the chunks of an arena
+// (larger allocations get a chunk of their own)
+#define LL_ARENA_CHUNK		(64 * 1024)
+
+//Arena : allocations are carved out of large chunks in O(1)
+//and are only freed all together by ll_arena_reset or ll_arena_free
+typedef struct ll_arena_chunk	LL_ARENA_CHUNK_HDR;
+
+typedef struct ll_arena
+{
+	LL_ARENA_CHUNK_HDR	*chunks;
+	guchar			*pos;
+	gsize			left;
+	gsize			chunk_size;
+	gsize			bytes;
+	LL_MEM			mem;
+}LL_ARENA;
+
+//Typed allocation of n elements of type in arena a (LL_ARENA_NEW0 zeroes them)
+#define LL_ARENA_NEW(a, type, n)	((type *) ll_arena_alloc ((a), sizeof (type) * (gsize) (n)))
+#define LL_ARENA_NEW0(a, type, n)	((type *) ll_arena_alloc0 ((a), sizeof (type) * (gsize) (n)))
+
+LL_ARENA *	ll_arena_new		(gsize		 chunk_size,
+					 LL_MEM		 mem);
+
+gpointer	ll_arena_alloc		(LL_ARENA	*arena,
+					 gsize		 size);
+
+gpointer	ll_arena_alloc0		(LL_ARENA	*arena,
+					 gsize		 size);
+
+void		ll_arena_reset		(LL_ARENA	*arena);
+
+void		ll_arena_free		(LL_ARENA	*arena);
+
+#endif /* __LL_ARENA_H__ */
@@ -0,0 +1,1123 @@
+/*
+ * ll_bench : synthetic layered scenes and per stage timings of Local Layering
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Generates a layered scene from a seed : every layer covers the image and is
+ * opaque inside a number of round blobs, a fraction of which are shattered into
+ * small fragments, with an anti-aliased edge of the given width.
+ * Each stage of the plug-in is then run on the scene the given number of times :
+ *
+ *	extract_layer_code	ll_map_add_layer for all the layers
+ *	extract_tags		ll_map_extract_tags
+ *	flip			ll_map_flip_up with propagation, bottom layer over the top layer
+ *				of the region with the most layers
+ *	mask_set_pixel		ll_map_top_layers and ll_map_paint_mask for all the layers, in parallel
+ *	rg_boundary_rect_regions ll_map_boundary_rects for the regions affected by the flip
+ *	parasite_attach		ll_map_tags_pack
+ *	parasite_recover	ll_map_tags_unchanged
+ *	lg_retrieval_mask	ll_map_retrieve from the painted masks
+ *
+ * The min, median and 95th percentile times (in ms) of every stage are written
+ * to stdout as JSON (or CSV), one result per layer count of --layers.
+ *
+ * With --alpha the layers are 8 bit alpha planes instead of RGBA, a quarter of the memory
+ * for very large scenes.
+ *
+ * The parallel stages run on the pool of LL_THREADS threads (the number of processors by default).
+ * With --scaling N every scene is timed with a pool of 1 to N threads instead, and the median
+ * of every stage is written for each thread count with its speedup over 1 thread.
+ *
+ * With --check nothing is timed : every scene is checked against the algorithms of the baseline
+ * plug-in instead. The regions must be the 4-connected pieces of equal layer codes found by its
+ * extract_tags, and after random flips (some not propagated, so that neighbours disagree) the
+ * lists retrieved by ll_map_retrieve from masks painted as its mask_set_pixel did must match the
+ * lists of its lg_retrieval_mask for every layer present in a region. The exit status is 1 on
+ * any mismatch. lg_retrieval_mask also gave a rank to the layers absent from a region of more
+ * than two layers, which ll_map_retrieve leaves at 0 : those are counted apart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include "ll_core.h"
+#include "ll_pool.h"
+
+enum
+{
+	STAGE_LAYER_CODE,
+	STAGE_TAGS,
+	STAGE_FLIP,
+	STAGE_MASK,
+	STAGE_BOUNDARY,
+	STAGE_PARASITE_ATTACH,
+	STAGE_PARASITE_RECOVER,
+	STAGE_RETRIEVAL,
+	STAGE_COUNT
+};
+
+static const gchar	*stage_names[STAGE_COUNT] =
+{
+	"extract_layer_code",
+	"extract_tags",
+	"flip",
+	"mask_set_pixel",
+	"rg_boundary_rect_regions",
+	"parasite_attach",
+	"parasite_recover",
+	"lg_retrieval_mask"
+};
+
+//Holds the parameters of a synthetic scene
+typedef struct ll_scene
+{
+	gint		width;
+	gint		height;
+	gint		layer_num;
+	gint		blobs;
+	gdouble		fragmentation;
+	gdouble		edge;
+	guint32		seed;
+	gint		bpp;		//4 for RGBA layers, 1 for alpha planes
+}LL_SCENE;
+
+//Holds the timings (in ms) of every run of every stage and the counters of a scene
+typedef struct ll_result
+{
+	LL_SCENE	scene;
+	gint		num_regions;
+	gint		num_codes;
+	gint		flips;
+	gint		affected;
+	gdouble		*samples[STAGE_COUNT];
+}LL_RESULT;
+
+//Holds the masks of a scene being painted on the pool
+typedef struct ll_paint
+{
+	LL_MAP		*map;
+	const gint	*top;
+	LL_PLANE	*planes;
+}LL_PAINT;
+
+static gint		width = 1024;
+static gint		height = 768;
+static gchar		*layer_counts = NULL;
+static gint		blobs = 6;
+static gdouble		fragmentation = 0.25;
+static gdouble		edge = 1.5;
+static gint		seed = 1;
+static gint		runs = 15;
+static gboolean		csv = FALSE;
+static gboolean		alpha_only = FALSE;
+static gint		scaling = 0;
+static gboolean		check = FALSE;
+
+static GOptionEntry	entries[] =
+{
+	{ "width",		'W', 0, G_OPTION_ARG_INT,	&width,		"Image width (default 1024)", "W" },
+	{ "height",		'H', 0, G_OPTION_ARG_INT,	&height,	"Image height (default 768)", "H" },
+	{ "layers",		'l', 0, G_OPTION_ARG_STRING,	&layer_counts,	"Comma separated layer counts (default 2,4,8,16,31,48)", "N,..." },
+	{ "blobs",		'b', 0, G_OPTION_ARG_INT,	&blobs,		"Blobs per layer (default 6)", "N" },
+	{ "fragmentation",	'f', 0, G_OPTION_ARG_DOUBLE,	&fragmentation,	"Fraction of blobs shattered into fragments (default 0.25)", "F" },
+	{ "edge",		'e', 0, G_OPTION_ARG_DOUBLE,	&edge,		"Anti-aliased edge width in pixels (default 1.5)", "PX" },
+	{ "seed",		's', 0, G_OPTION_ARG_INT,	&seed,		"Seed of the scene (default 1)", "N" },
+	{ "runs",		'r', 0, G_OPTION_ARG_INT,	&runs,		"Runs of every stage (default 15)", "N" },
+	{ "csv",		'c', 0, G_OPTION_ARG_NONE,	&csv,		"Write CSV instead of JSON", NULL },
+	{ "alpha",		'a', 0, G_OPTION_ARG_NONE,	&alpha_only,	"Layers as 8 bit alpha planes (for very large scenes)", NULL },
+	{ "scaling",		't', 0, G_OPTION_ARG_INT,	&scaling,	"Time every stage with 1 to N threads and write the speedups", "N" },
+	{ "check",		'k', 0, G_OPTION_ARG_NONE,	&check,		"Check the regions and retrieved lists against the baseline plug-in", NULL },
+	{ NULL }
+};
+
+//Paints a disc of radius r at cx, cy into the alpha channel of a layer (RGBA or alpha plane)
+//the alpha falls from 255 to 0 across the edge width, and is kept at its maximum where discs overlap
+static void scene_disc(guchar *pixels, LL_SCENE *scene, gdouble cx, gdouble cy, gdouble r)
+{
+ gint		x0, y0, x1, y1, x, y;
+ gdouble	d, a;
+ guchar		*alpha;
+
+	x0 = MAX(0, (gint) floor(cx - r - scene->edge));
+	y0 = MAX(0, (gint) floor(cy - r - scene->edge));
+	x1 = MIN(scene->width - 1, (gint) ceil(cx + r + scene->edge));
+	y1 = MIN(scene->height - 1, (gint) ceil(cy + r + scene->edge));
+
+	for(y = y0; y <= y1; y++)
+	{
+		for(x = x0; x <= x1; x++)
+		{
+			d = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+
+			if(scene->edge > 0)
+				a = CLAMP((r + scene->edge / 2 - d) / scene->edge, 0.0, 1.0);
+			else
+				a = (d <= r) ? 1.0 : 0.0;
+
+			alpha = pixels + ((gsize) y * scene->width + x) * scene->bpp + scene->bpp - 1;
+			*alpha = MAX(*alpha, (guchar) floor(a * 255 + 0.5));
+		}
+	}
+}
+
+//Generates the pixels (RGBA or alpha) of every layer of the scene
+static guchar ** scene_new(LL_SCENE *scene)
+{
+ GRand		*rand;
+ guchar		**layers;
+ gdouble	cx, cy, r, t;
+ gint		i, j, k, side;
+ gsize		p, pixels;
+
+	rand = g_rand_new_with_seed(scene->seed);
+	layers = g_new(guchar *, scene->layer_num);
+	side = MIN(scene->width, scene->height);
+	pixels = ll_pixels(scene->width, scene->height);
+
+	for(i = 0; i < scene->layer_num; i++)
+	{
+		layers[i] = g_new0(guchar, pixels * scene->bpp);
+
+		//One flat colour per layer
+		for(p = 0; p < pixels && scene->bpp == 4; p++)
+		{
+			layers[i][p * 4]     = 64 + 23 * i;
+			layers[i][p * 4 + 1] = 128 + 41 * i;
+			layers[i][p * 4 + 2] = 192 + 59 * i;
+		}
+
+		for(j = 0; j < scene->blobs; j++)
+		{
+			cx = g_rand_double_range(rand, 0, scene->width);
+			cy = g_rand_double_range(rand, 0, scene->height);
+			r  = g_rand_double_range(rand, side / 16.0, side / 4.0);
+
+			if(g_rand_double(rand) >= scene->fragmentation)
+			{
+				scene_disc(layers[i], scene, cx, cy, r);
+				continue;
+			}
+
+			//Shattered blob : 8 fragments scattered around the blob
+			for(k = 0; k < 8; k++)
+			{
+				t = g_rand_double_range(rand, 0, 2 * G_PI);
+				scene_disc(layers[i], scene, cx + 0.8 * r * cos(t), cy + 0.8 * r * sin(t),
+					   g_rand_double_range(rand, r / 8, r / 3));
+			}
+		}
+	}
+
+	g_rand_free(rand);
+
+	return layers;
+}
+
+//Copies the ListGraph Lists of the map into lists (or back into the map if restore is set)
+static void lists_copy(LL_MAP *map, gint **lists, gboolean restore)
+{
+ gint	i;
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		if(restore)
+			memcpy(map->graph->lists[i], lists[i], map->layer_num * sizeof(gint));
+		else
+			memcpy(lists[i], map->graph->lists[i], map->layer_num * sizeof(gint));
+	}
+}
+
+//Counts the recursive flips made by ll_map_flip_up
+static void count_flip(gint i1, gint i2, gint l, gpointer data)
+{
+	(*(gint *) data)++;
+}
+
+//Returns the region with the most layers, and its top and bottom most layers
+static gint busiest_region(LL_MAP *map, gint *top, gint *bottom)
+{
+ gint	i, j, n, best, best_n;
+
+	best = -1;
+	best_n = 1;
+	*top = *bottom = -1;
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		n = 0;
+		for(j = 0; j < map->layer_num; j++)
+		{
+			if(map->graph->lists[i][j] != 0)
+				n++;
+		}
+
+		if(n > best_n)
+		{
+			best = i;
+			best_n = n;
+		}
+	}
+
+	if(best == -1)
+		return -1;
+
+	for(j = 0; j < map->layer_num; j++)
+	{
+		if(map->graph->lists[best][j] == 1)
+			*top = j;
+		if(map->graph->lists[best][j] == best_n)
+			*bottom = j;
+	}
+
+	return best;
+}
+
+//Paints the masks of the layers first to last - 1
+static void paint_layers(gint first, gint last, gpointer data)
+{
+ LL_PAINT	*p = data;
+ gint		l;
+
+	for(l = first; l < last; l++)
+		ll_map_paint_mask(p->map, p->top, l, p->planes[l].buf, 0, 0, p->planes[l].w, p->planes[l].h);
+}
+
+//Runs every stage of Local Layering on the scene, runs times
+static void bench_scene(LL_RESULT *res)
+{
+ LL_SCENE	*scene = &res->scene;
+ LL_MAP		*map = NULL;
+ LL_PLANE	*planes;
+ LL_RECT	*rects;
+ LL_PAINT	paint;
+ GTimer		*timer;
+ guchar		**layers;
+ gint		**lists;
+ gint		*top;
+ gpointer	data;
+ gsize		size;
+ gint		run, i, l, region, top_layer, bottom_layer;
+
+	layers = scene_new(scene);
+	timer = g_timer_new();
+
+	for(i = 0; i < STAGE_COUNT; i++)
+		res->samples[i] = g_new0(gdouble, runs);
+
+	//extract_layer_code : a fresh Region Map every run
+	for(run = 0; run < runs; run++)
+	{
+		ll_map_free(map);
+		map = ll_map_new(scene->width, scene->height, scene->layer_num);
+
+		g_timer_start(timer);
+		for(l = 0; l < scene->layer_num; l++)
+			ll_map_add_layer(map, l, layers[l], scene->bpp, TRUE, 0, 0, scene->width, scene->height);
+		res->samples[STAGE_LAYER_CODE][run] = g_timer_elapsed(timer, NULL) * 1000;
+	}
+
+	//extract_tags
+	for(run = 0; run < runs; run++)
+	{
+		g_timer_start(timer);
+		ll_map_extract_tags(map);
+		res->samples[STAGE_TAGS][run] = g_timer_elapsed(timer, NULL) * 1000;
+	}
+
+	res->num_regions = map->num_regions;
+	res->num_codes = map->num_codes;
+
+	lists = g_new(gint *, map->num_regions);
+	for(i = 0; i < map->num_regions; i++)
+		lists[i] = g_new(gint, map->layer_num);
+	lists_copy(map, lists, FALSE);
+
+	//flip : the ListGraph Lists are restored after every run
+	region = busiest_region(map, &top_layer, &bottom_layer);
+
+	for(run = 0; run < runs && region != -1; run++)
+	{
+		lists_copy(map, lists, TRUE);
+		ll_map_set_affected(map, FALSE);
+		res->flips = 0;
+
+		g_timer_start(timer);
+		ll_map_flip_up(map, bottom_layer, top_layer, region, TRUE, count_flip, &res->flips);
+		res->samples[STAGE_FLIP][run] = g_timer_elapsed(timer, NULL) * 1000;
+	}
+
+	//rg_boundary_rect_regions : the regions affected by the last flip
+	for(i = 0; i < map->num_regions; i++)
+	{
+		if(map->reg_affected[i])
+			res->affected++;
+	}
+
+	rects = g_new(LL_RECT, MAX(map->num_regions, 1));
+
+	for(run = 0; run < runs; run++)
+	{
+		g_timer_start(timer);
+		ll_map_boundary_rects(map, map->reg_affected, rects);
+		res->samples[STAGE_BOUNDARY][run] = g_timer_elapsed(timer, NULL) * 1000;
+	}
+
+	g_free(rects);
+
+	lists_copy(map, lists, TRUE);
+
+	//mask_set_pixel : all the regions, as for the first painting of a session
+	planes = g_new0(LL_PLANE, scene->layer_num);
+	for(l = 0; l < scene->layer_num; l++)
+	{
+		planes[l].w = scene->width;
+		planes[l].h = scene->height;
+		planes[l].buf = g_new0(guchar, ll_pixels(scene->width, scene->height));
+	}
+
+	ll_map_set_affected(map, TRUE);
+
+	for(run = 0; run < runs; run++)
+	{
+		g_timer_start(timer);
+		top = ll_map_top_layers(map);
+		paint.map = map;
+		paint.top = top;
+		paint.planes = planes;
+		if(map->tag_tiles != NULL)
+			paint_layers(0, scene->layer_num, &paint);
+		else
+			ll_pool_for(0, scene->layer_num, 1, paint_layers, &paint);
+		g_free(top);
+		res->samples[STAGE_MASK][run] = g_timer_elapsed(timer, NULL) * 1000;
+	}
+
+	//parasite_attach and parasite_recover : the TAGS parasite
+	for(run = 0; run < runs; run++)
+	{
+		g_timer_start(timer);
+		data = ll_map_tags_pack(map, &size);
+		res->samples[STAGE_PARASITE_ATTACH][run] = g_timer_elapsed(timer, NULL) * 1000;
+
+		g_timer_start(timer);
+		ll_map_tags_unchanged(map, data, size, NULL);
+		res->samples[STAGE_PARASITE_RECOVER][run] = g_timer_elapsed(timer, NULL) * 1000;
+
+		g_free(data);
+	}
+
+	//lg_retrieval_mask : from the masks painted above
+	for(run = 0; run < runs; run++)
+	{
+		g_timer_start(timer);
+		ll_map_retrieve(map, planes);
+		res->samples[STAGE_RETRIEVAL][run] = g_timer_elapsed(timer, NULL) * 1000;
+
+		lists_copy(map, lists, TRUE);
+	}
+
+	for(l = 0; l < scene->layer_num; l++)
+	{
+		g_free(planes[l].buf);
+		g_free(layers[l]);
+	}
+	for(i = 0; i < map->num_regions; i++)
+		g_free(lists[i]);
+
+	g_free(planes);
+	g_free(layers);
+	g_free(lists);
+	g_timer_destroy(timer);
+	ll_map_free(map);
+}
+
+//TRUE if layer l is present at pixel p of the scene, as extract_layer_code read it (non zero alpha)
+static gboolean scene_present(guchar **layers, LL_SCENE *scene, gint l, gsize p)
+{
+	return layers[l][p * scene->bpp + scene->bpp - 1] != 0;
+}
+
+//TRUE if the pixels p and q of the scene have the same layer code
+static gboolean scene_same_code(guchar **layers, LL_SCENE *scene, gsize p, gsize q)
+{
+ gint	l;
+
+	for(l = 0; l < scene->layer_num; l++)
+	{
+		if(scene_present(layers, scene, l, p) != scene_present(layers, scene, l, q))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Labels the scene as the first region growing of the baseline extract_tags did and checks
+//that its regions are those of the map : both the labellings must map one to one onto each other
+//and the ListGraph Lists must hold the layers of the code of every region
+//Returns the number of mismatching pixels
+static gsize check_regions(LL_MAP *map, guchar **layers, LL_SCENE *scene)
+{
+ const gint	ofs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+ gint		*tags, *to_map, *from_map;
+ GArray		*seeds, *to_expand;
+ gsize		pixels, seed, p, q, bad;
+ guint		front, front1;
+ gint		cur_tag, r, c, i, k, l;
+
+	pixels = ll_pixels(scene->width, scene->height);
+	tags = g_new0(gint, pixels);
+	seeds = g_array_new(FALSE, FALSE, sizeof(gsize));
+	to_expand = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+	seed = 0;
+	tags[0] = -1;
+	g_array_append_val(seeds, seed);
+	cur_tag = 0;
+
+	for(front = 0; front < seeds->len; front++)
+	{
+		seed = g_array_index(seeds, gsize, front);
+		if(tags[seed] != -1)
+			continue;
+
+		tags[seed] = ++cur_tag;
+		g_array_set_size(to_expand, 0);
+		g_array_append_val(to_expand, seed);
+
+		for(front1 = 0; front1 < to_expand->len; front1++)
+		{
+			p = g_array_index(to_expand, gsize, front1);
+			r = p / scene->width;
+			c = p % scene->width;
+
+			for(i = 0; i < 4; i++)
+			{
+				if(r + ofs[i][0] < 0 || r + ofs[i][0] >= scene->height ||
+				   c + ofs[i][1] < 0 || c + ofs[i][1] >= scene->width)
+					continue;
+
+				q = (gsize) (r + ofs[i][0]) * scene->width + c + ofs[i][1];
+
+				if(scene_same_code(layers, scene, seed, q))
+				{
+					if(tags[q] == cur_tag)
+						continue;
+
+					tags[q] = cur_tag;
+					g_array_append_val(to_expand, q);
+				}
+				else if(tags[q] == 0)
+				{
+					tags[q] = -1;
+					g_array_append_val(seeds, q);
+				}
+			}
+		}
+	}
+
+	bad = 0;
+
+	if(cur_tag != map->num_regions)
+	{
+		printf("  regions : %d in the baseline, %d in the map\n", cur_tag, map->num_regions);
+		bad++;
+	}
+
+	to_map = g_new0(gint, cur_tag + 1);
+	from_map = g_new0(gint, MAX(map->num_regions, 1));
+
+	for(p = 0; p < pixels; p++)
+	{
+		k = ll_map_region_at(map, p % scene->width, p / scene->width);
+
+		if(to_map[tags[p]] == 0)
+			to_map[tags[p]] = k + 1;
+		if(from_map[k] == 0)
+			from_map[k] = tags[p];
+
+		if(to_map[tags[p]] != k + 1 || from_map[k] != tags[p])
+		{
+			bad++;
+			continue;
+		}
+
+		for(l = 0; l < scene->layer_num; l++)
+		{
+			if((map->graph->lists[k][l] != 0) != scene_present(layers, scene, l, p))
+			{
+				bad++;
+				break;
+			}
+		}
+	}
+
+	g_free(to_map);
+	g_free(from_map);
+	g_free(tags);
+	g_array_free(seeds, TRUE);
+	g_array_free(to_expand, TRUE);
+
+	return bad;
+}
+
+//Paints the masks of all the layers as the baseline mask_set_pixel did :
+//white for the layer of the smallest rank of the region, black for the others
+static void paint_baseline(LL_MAP *map, LL_PLANE *planes)
+{
+ gint	m, n, i, k, min, min_index;
+
+	for(m = 0; m < map->height; m++)
+	{
+		for(n = 0; n < map->width; n++)
+		{
+			k = ll_map_region_at(map, n, m);
+
+			min_index = -1;
+			min = map->layer_num;
+
+			for(i = 0; i < map->layer_num; i++)
+			{
+				if(map->graph->lists[k][i] != 0 && map->graph->lists[k][i] < min)
+				{
+					min = map->graph->lists[k][i];
+					min_index = i;
+				}
+			}
+
+			for(i = 0; i < map->layer_num; i++)
+				planes[i].buf[(gsize) m * map->width + n] = (i == min_index) ? LL_MASK_SHOW : 0;
+		}
+	}
+}
+
+//TRUE if the pair {higher, lower} is among the count pairs (held as higher, lower, ...)
+static gboolean baseline_pair_known(const gint *pairs, gint count, gint higher, gint lower)
+{
+ gint	i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(pairs[2 * i] == higher && pairs[2 * i + 1] == lower)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+//Retrieves the lists from the masks as the baseline lg_retrieval_mask did, into lists
+//The pairs have room for both the orders of every pair of layers, where the baseline
+//only had room for one and overflowed when neighbours disagreed
+static void baseline_retrieve(LL_MAP *map, const LL_PLANE *masks, gint **lists)
+{
+ gint		**pairs;
+ gint		*count_layers, *pair_count, *covered, *q;
+ GArray		*queue;
+ gint		n[3];
+ gint		i, j, k, m, c, e, top;
+ guint		front;
+
+	count_layers = g_new0(gint, map->num_regions);
+	pair_count = g_new0(gint, map->num_regions);
+	covered = g_new0(gint, map->num_regions);
+	pairs = g_new(gint *, map->num_regions);
+	queue = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	//init_retrieval_list, count_layers_init and init_pair_lists
+	for(i = 0; i < map->num_regions; i++)
+	{
+		for(j = 0; j < map->layer_num; j++)
+		{
+			lists[i][j] = (map->graph->lists[i][j] != 0) ? 0 : -1;
+			if(lists[i][j] == 0)
+				count_layers[i]++;
+		}
+
+		pairs[i] = g_new(gint, 2 * MAX(count_layers[i] * (count_layers[i] - 1), 1));
+	}
+
+	//masks_retrieve_top
+	for(m = 0; m < map->height; m++)
+	{
+		for(n[0] = 0; n[0] < map->width; n[0]++)
+		{
+			k = ll_map_region_at(map, n[0], m);
+			if(covered[k])
+				continue;
+
+			for(i = 0; i < map->layer_num; i++)
+			{
+				if(masks[i].buf[(gsize) m * masks[i].w + n[0]] == LL_MASK_SHOW)
+				{
+					lists[k][i] = 1;
+					covered[k] = 1;
+				}
+			}
+		}
+	}
+
+	//list_retrieve_second and p_queue_fill
+	for(i = 0; i < map->num_regions; i++)
+	{
+		if(count_layers[i] < 2)
+			continue;
+
+		top = -1;
+		for(j = 0; j < map->layer_num; j++)
+		{
+			if(lists[i][j] == 1)
+				top = j;
+		}
+
+		if(top == -1)
+			continue;
+
+		for(j = 0; j < map->layer_num; j++)
+		{
+			if(lists[i][j] != 0)
+				continue;
+
+			if(count_layers[i] == 2)
+				lists[i][j] = 2;
+
+			pairs[i][2 * pair_count[i]] = top;
+			pairs[i][2 * pair_count[i] + 1] = j;
+			pair_count[i]++;
+
+			n[0] = i;
+			n[1] = top;
+			n[2] = j;
+			g_array_append_vals(queue, n, 3);
+		}
+	}
+
+	//p_queue_process
+	for(front = 0; front < queue->len; front += 3)
+	{
+		q = &g_array_index(queue, gint, front);
+		n[1] = q[1];
+		n[2] = q[2];
+
+		for(e = map->graph->edge_start[q[0]]; e < map->graph->edge_start[q[0] + 1]; e++)
+		{
+			i = map->graph->edges[e];
+
+			if(lists[i][n[1]] == -1 || lists[i][n[2]] == -1)
+				continue;
+
+			if(baseline_pair_known(pairs[i], pair_count[i], n[1], n[2]))
+				continue;
+
+			pairs[i][2 * pair_count[i]] = n[1];
+			pairs[i][2 * pair_count[i] + 1] = n[2];
+			pair_count[i]++;
+
+			n[0] = i;
+			g_array_append_vals(queue, n, 3);
+			q = &g_array_index(queue, gint, front);
+		}
+	}
+
+	//complete_pair_lists and pair_lists_process : c counts the complete pairs led by layer j,
+	//the known order of every pair of the region (the lower index first when both are known)
+	//or else the lower index first
+	for(i = 0; i < map->num_regions; i++)
+	{
+		if(count_layers[i] <= 2)
+			continue;
+
+		for(j = 0; j < map->layer_num; j++)
+		{
+			c = 0;
+
+			for(k = 0; k < map->layer_num && lists[i][j] != -1; k++)
+			{
+				if(k == j || lists[i][k] == -1)
+					continue;
+
+				if(j < k && (baseline_pair_known(pairs[i], pair_count[i], j, k) ||
+					     !baseline_pair_known(pairs[i], pair_count[i], k, j)))
+					c++;
+				else if(j > k && !baseline_pair_known(pairs[i], pair_count[i], k, j) &&
+					 baseline_pair_known(pairs[i], pair_count[i], j, k))
+					c++;
+			}
+
+			lists[i][j] = count_layers[i] - c;
+		}
+	}
+
+	//assign_lists_to_graph_lists
+	for(i = 0; i < map->num_regions; i++)
+	{
+		for(j = 0; j < map->layer_num; j++)
+		{
+			if(lists[i][j] == -1)
+				lists[i][j] = 0;
+		}
+
+		g_free(pairs[i]);
+	}
+
+	g_free(pairs);
+	g_free(count_layers);
+	g_free(pair_count);
+	g_free(covered);
+	g_array_free(queue, TRUE);
+}
+
+//Checks the regions of the scene and the lists retrieved from its masks against the baseline plug-in
+//Returns TRUE if both match
+static gboolean check_scene(LL_SCENE *scene)
+{
+ LL_MAP		*map;
+ LL_PLANE	*planes;
+ GRand		*rand;
+ guchar		**layers;
+ gint		**lists, **expected;
+ gsize		bad_regions;
+ gint		i, j, l, i1, i2, flips, ranked, bad_ranks, absent;
+
+	layers = scene_new(scene);
+	map = ll_map_new(scene->width, scene->height, scene->layer_num);
+
+	for(l = 0; l < scene->layer_num; l++)
+		ll_map_add_layer(map, l, layers[l], scene->bpp, TRUE, 0, 0, scene->width, scene->height);
+	ll_map_extract_tags(map);
+
+	bad_regions = check_regions(map, layers, scene);
+
+	//Random flips, half of them not propagated
+	rand = g_rand_new_with_seed(scene->seed);
+	flips = MIN(map->num_regions, 200);
+
+	for(i = 0; i < flips && scene->layer_num > 1; i++)
+	{
+		j = g_rand_int_range(rand, 0, map->num_regions);
+		i1 = g_rand_int_range(rand, 0, scene->layer_num);
+		i2 = g_rand_int_range(rand, 0, scene->layer_num);
+
+		if(map->graph->lists[j][i1] > map->graph->lists[j][i2])
+			ll_map_flip_up(map, i1, i2, j, g_rand_int_range(rand, 0, 2), NULL, NULL);
+	}
+
+	g_rand_free(rand);
+
+	planes = g_new0(LL_PLANE, scene->layer_num);
+	for(l = 0; l < scene->layer_num; l++)
+	{
+		planes[l].w = scene->width;
+		planes[l].h = scene->height;
+		planes[l].buf = g_new0(guchar, ll_pixels(scene->width, scene->height));
+	}
+
+	paint_baseline(map, planes);
+
+	lists = g_new(gint *, map->num_regions);
+	expected = g_new(gint *, map->num_regions);
+	for(i = 0; i < map->num_regions; i++)
+	{
+		lists[i] = g_new(gint, map->layer_num);
+		expected[i] = g_new(gint, map->layer_num);
+	}
+
+	baseline_retrieve(map, planes, expected);
+	ll_map_retrieve(map, planes);
+	lists_copy(map, lists, FALSE);
+
+	ranked = bad_ranks = absent = 0;
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		for(l = 0; l < map->layer_num; l++)
+		{
+			if(lists[i][l] == 0 && expected[i][l] != 0)
+				absent++;
+			else if(lists[i][l] != expected[i][l])
+				bad_ranks++;
+
+			if(lists[i][l] != 0)
+				ranked++;
+		}
+	}
+
+	printf("layers %d : %d regions, %" G_GSIZE_FORMAT " pixels off the baseline regions, "
+	       "%d of %d ranks off the baseline lists, %d absent layers ranked by the baseline\n",
+	       scene->layer_num, map->num_regions, bad_regions, bad_ranks, ranked, absent);
+
+	for(l = 0; l < scene->layer_num; l++)
+	{
+		g_free(planes[l].buf);
+		g_free(layers[l]);
+	}
+	for(i = 0; i < map->num_regions; i++)
+	{
+		g_free(lists[i]);
+		g_free(expected[i]);
+	}
+
+	g_free(planes);
+	g_free(layers);
+	g_free(lists);
+	g_free(expected);
+	ll_map_free(map);
+
+	return bad_regions == 0 && bad_ranks == 0;
+}
+
+static gint sample_compare(gconstpointer a, gconstpointer b)
+{
+ gdouble	x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+	return (x > y) - (x < y);
+}
+
+//Sorts the samples of a stage and returns its min, median and 95th percentile
+static void stage_stats(gdouble *samples, gint n, gdouble *min, gdouble *median, gdouble *p95)
+{
+	qsort(samples, n, sizeof(gdouble), sample_compare);
+
+	*min = samples[0];
+	*median = (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	*p95 = samples[MAX((gint) ceil(0.95 * n) - 1, 0)];
+}
+
+static void print_csv_header(void)
+{
+	if(scaling > 0)
+		printf("layers,width,height,blobs,fragmentation,edge,seed,regions,codes,stage,runs,threads,median_ms,speedup\n");
+	else
+		printf("layers,width,height,blobs,fragmentation,edge,seed,regions,codes,stage,runs,min_ms,median_ms,p95_ms\n");
+}
+
+//Writes the JSON scene and counters of a result
+static void print_scene(LL_RESULT *res, gboolean first)
+{
+ LL_SCENE	*scene = &res->scene;
+
+	printf("%s\n  {\n", first ? "" : ",");
+	printf("    \"scene\": {\"width\": %d, \"height\": %d, \"layers\": %d, \"blobs\": %d, "
+	       "\"fragmentation\": %g, \"edge\": %g, \"seed\": %u},\n",
+	       scene->width, scene->height, scene->layer_num, scene->blobs,
+	       scene->fragmentation, scene->edge, scene->seed);
+	printf("    \"counters\": {\"regions\": %d, \"codes\": %d, \"flips\": %d, \"affected\": %d},\n",
+	       res->num_regions, res->num_codes, res->flips, res->affected);
+}
+
+static void print_result(LL_RESULT *res, gboolean first)
+{
+ LL_SCENE	*scene = &res->scene;
+ gdouble	min, median, p95;
+ gint		i;
+
+	if(!csv)
+	{
+		print_scene(res, first);
+		printf("    \"runs\": %d,\n    \"stages\": {", runs);
+	}
+
+	for(i = 0; i < STAGE_COUNT; i++)
+	{
+		stage_stats(res->samples[i], runs, &min, &median, &p95);
+
+		if(csv)
+			printf("%d,%d,%d,%d,%g,%g,%u,%d,%d,%s,%d,%.4f,%.4f,%.4f\n",
+			       scene->layer_num, scene->width, scene->height, scene->blobs,
+			       scene->fragmentation, scene->edge, scene->seed,
+			       res->num_regions, res->num_codes, stage_names[i], runs, min, median, p95);
+		else
+			printf("%s\n      \"%s\": {\"min_ms\": %.4f, \"median_ms\": %.4f, \"p95_ms\": %.4f}",
+			       i ? "," : "", stage_names[i], min, median, p95);
+	}
+
+	if(!csv)
+		printf("\n    }\n  }");
+}
+
+//Writes the median of every stage of results[0 ... threads - 1], timed with 1 to threads threads,
+//and its speedup over 1 thread
+static void print_scaling(LL_RESULT *results, gint threads, gboolean first)
+{
+ LL_SCENE	*scene = &results[0].scene;
+ gdouble	min, p95;
+ gdouble	*median;
+ gint		i, t;
+
+	median = g_new(gdouble, threads);
+
+	if(!csv)
+	{
+		print_scene(&results[0], first);
+		printf("    \"runs\": %d,\n    \"threads\": [", runs);
+		for(t = 0; t < threads; t++)
+			printf("%s%d", t ? ", " : "", t + 1);
+		printf("],\n    \"stages\": {");
+	}
+
+	for(i = 0; i < STAGE_COUNT; i++)
+	{
+		for(t = 0; t < threads; t++)
+			stage_stats(results[t].samples[i], runs, &min, &median[t], &p95);
+
+		if(csv)
+		{
+			for(t = 0; t < threads; t++)
+				printf("%d,%d,%d,%d,%g,%g,%u,%d,%d,%s,%d,%d,%.4f,%.3f\n",
+				       scene->layer_num, scene->width, scene->height, scene->blobs,
+				       scene->fragmentation, scene->edge, scene->seed,
+				       results[0].num_regions, results[0].num_codes, stage_names[i], runs,
+				       t + 1, median[t], (median[t] > 0) ? median[0] / median[t] : 1.0);
+			continue;
+		}
+
+		printf("%s\n      \"%s\": {\"median_ms\": [", i ? "," : "", stage_names[i]);
+		for(t = 0; t < threads; t++)
+			printf("%s%.4f", t ? ", " : "", median[t]);
+		printf("], \"speedup\": [");
+		for(t = 0; t < threads; t++)
+			printf("%s%.3f", t ? ", " : "", (median[t] > 0) ? median[0] / median[t] : 1.0);
+		printf("]}");
+	}
+
+	if(!csv)
+		printf("\n    }\n  }");
+
+	g_free(median);
+}
+
+int main(int argc, char **argv)
+{
+ GOptionContext	*context;
+ GError		*error = NULL;
+ LL_RESULT	res;
+ LL_RESULT	*results;
+ gchar		**counts;
+ gint		i, j, n, t, done;
+ gboolean	ok;
+
+	context = g_option_context_new("- time the stages of Local Layering on synthetic scenes");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 2;
+	}
+	g_option_context_free(context);
+
+	if(width < 1 || height < 1 || runs < 1 || blobs < 0)
+	{
+		g_printerr("Invalid scene : width, height and runs must be positive\n");
+		return 2;
+	}
+
+	if(scaling < 0 || scaling > LL_POOL_MAX)
+	{
+		g_printerr("Invalid scaling : from 1 to %d threads\n", LL_POOL_MAX);
+		return 2;
+	}
+
+	if(ll_pixels(width, height) == 0)
+	{
+		g_printerr("Invalid scene : %d x %d is too large for this system\n", width, height);
+		return 2;
+	}
+
+	counts = g_strsplit(layer_counts ? layer_counts : "2,4,8,16,31,48", ",", 0);
+
+	if(check)
+		ok = TRUE;
+	else if(csv)
+		print_csv_header();
+	else
+		printf("{\n\"results\": [");
+
+	done = 0;
+
+	for(i = 0; counts[i] != NULL; i++)
+	{
+		n = atoi(counts[i]);
+		if(n < 1)
+		{
+			g_printerr("Invalid layer count '%s'\n", counts[i]);
+			continue;
+		}
+
+		memset(&res, 0, sizeof(res));
+		res.scene.width		= width;
+		res.scene.height	= height;
+		res.scene.layer_num	= n;
+		res.scene.blobs		= blobs;
+		res.scene.fragmentation	= CLAMP(fragmentation, 0.0, 1.0);
+		res.scene.edge		= MAX(edge, 0.0);
+		res.scene.seed		= seed;
+		res.scene.bpp		= alpha_only ? 1 : 4;
+
+		if(check)
+		{
+			ok = check_scene(&res.scene) && ok;
+			fflush(stdout);
+			continue;
+		}
+
+		if(scaling > 0)
+		{
+			results = g_new0(LL_RESULT, scaling);
+
+			for(t = 0; t < scaling; t++)
+			{
+				ll_pool_set_threads(t + 1);
+				results[t].scene = res.scene;
+				bench_scene(&results[t]);
+			}
+
+			print_scaling(results, scaling, done++ == 0);
+			fflush(stdout);
+
+			for(t = 0; t < scaling; t++)
+			{
+				for(j = 0; j < STAGE_COUNT; j++)
+					g_free(results[t].samples[j]);
+			}
+			g_free(results);
+			continue;
+		}
+
+		bench_scene(&res);
+		print_result(&res, done++ == 0);
+		fflush(stdout);
+
+		for(j = 0; j < STAGE_COUNT; j++)
+			g_free(res.samples[j]);
+	}
+
+	g_strfreev(counts);
+
+	if(check)
+		return ok ? 0 : 1;
+
+	if(!csv)
+		printf("\n]\n}\n");
+
+	return 0;
+}
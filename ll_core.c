@@ -0,0 +1,2362 @@
+/*
+ * Local Layering core : the region map, List Graph and flips
+ * independent of GIMP, shared by the plug-in and the locallayer tool
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ll_core.h"
+#include "ll_pool.h"
+#include "ll_scratch.h"
+#include "ll_tiles.h"
+#include "ll_stats.h"
+#include "ll_trace.h"
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+// Marks a layer code whose set has not been extended yet in ll_map_add_layer
+#define LL_CODE_NONE		G_MAXUINT32
+
+// Initial number of entries of a region growing queue (a power of 2)
+#define LL_QUEUE_MIN		4096
+
+// Least pixels of the band of rows a task of a parallel stage covers
+#define LL_BAND_PIXELS		(64 * 1024)
+
+// Regions a task of the ranking of the retrieval covers
+#define LL_RANK_REGIONS		256
+
+// Pixels the region growing expands between two looks at the cancel flag of the map (a power of 2)
+#define LL_CANCEL_PIXELS	(64 * 1024)
+
+//Simple queue data structure of pixel indices
+//A ring of size entries (a power of 2) : front and back only grow and are taken modulo size
+//It doubles when full, so it holds as many entries as are waiting, not one per pixel
+typedef struct ll_queue
+{
+	gsize * data;
+	gsize size;
+	gsize front;
+	gsize back;
+}LL_QUEUE;
+
+//Offsets for Region Growing ie. ll_map_extract_tags function
+typedef struct ll_ofs
+{
+	gint x;
+	gint y;
+}LL_OFS;
+
+static const LL_OFS	ofs[CONNECTIVITY] = {{-1,0},{1,0},{0,-1},{0,1}};
+
+//Working data of the retrieval of the ListGraph Lists from the layer masks, kept in arena
+//lists hold -1 for an absent layer, 0 for a present layer not yet ranked and 1 for the top most layer
+//layers[i] holds the count_layers[i] layers present in region i and pos[i][j] the place of layer j among them
+//known holds a bitset of count_layers[i] x count_layers[i] bits for every region i, from word known_start[i] :
+//bit pos[i][higher] * count_layers[i] + pos[i][lower] is set once the pair {higher, lower} is known
+//seeds holds the {region, higher layer} seeds of every pair of layers {a, b} (a < b, key a * layer_num + b)
+//from seed_start[key], and keys the keys of the pairs with seeds
+typedef struct ll_retrieval
+{
+	LL_MAP		*map;
+	gint		**lists;
+	gint		**layers;
+	gint		**pos;
+	gint		*count_layers;
+	guint32		*known;
+	gsize		*known_start;
+	gint		*seeds;
+	gint		*seed_start;
+	GArray		*keys;
+	LL_ARENA	*arena;
+}LL_RETRIEVAL;
+
+//Arguments of a stage run in bands of rows on the pool (see map_rows_for)
+//ie. the layer (or mask) i of w pixels a row placed at x, y in the image space
+typedef struct ll_band
+{
+	LL_MAP		*map;
+	gint		i;
+	const guchar	*src;
+	guchar		*dest;
+	gint		bpp;
+	gboolean	alpha;
+	const gint	*top;
+	gint		num_codes;
+	gint		x;
+	gint		y;
+	gint		w;
+}LL_BAND;
+
+//Guards the creation of layer codes while ll_map_add_layer runs in bands
+static GStaticMutex	code_mutex = G_STATIC_MUTEX_INIT;
+
+//Initializes the elements of the queue
+//borrows memory for LL_QUEUE_MIN entries from the scratch pool
+static void queue_init(LL_QUEUE * queue_l)
+{
+	queue_l->front = 0;
+	queue_l->back = 0;
+	queue_l->size = LL_QUEUE_MIN;
+	queue_l->data = ll_scratch_get(queue_l->size * sizeof(gsize));
+}
+
+//Gives the queue array back to the scratch pool
+static void queue_free(LL_QUEUE * queue_l)
+{
+	ll_scratch_put(queue_l->data);
+	queue_l->data = NULL;
+}
+
+//checks whether the queue is empty
+static gboolean queue_isempty(LL_QUEUE * queue_l)
+{
+	return (queue_l->front == queue_l->back);
+}
+
+//Doubles the size of a full queue, its entries are moved to the start of the new ring
+static void queue_grow(LL_QUEUE * queue_l)
+{
+ gsize	*data, count, head;
+
+	count = queue_l->back - queue_l->front;
+	head  = queue_l->front & (queue_l->size - 1);
+
+	data = ll_scratch_get(2 * queue_l->size * sizeof(gsize));
+	memcpy(data, queue_l->data + head, (queue_l->size - head) * sizeof(gsize));
+	memcpy(data + (queue_l->size - head), queue_l->data, head * sizeof(gsize));
+	ll_scratch_put(queue_l->data);
+
+	queue_l->data  = data;
+	queue_l->size  = 2 * queue_l->size;
+	queue_l->front = 0;
+	queue_l->back  = count;
+}
+
+//Pushes the value passed as parameter to the back of the queue
+//increments back to point to space for next element
+static void queue_push(LL_QUEUE * queue_l, gsize n)
+{
+	if(queue_l->back - queue_l->front == queue_l->size)
+		queue_grow(queue_l);
+
+	queue_l->data[queue_l->back & (queue_l->size - 1)] = n;
+	queue_l->back++;
+}
+
+//returns the front element from the queue passed as parameter
+//increments front to point to a next value in queue
+static gsize queue_pop(LL_QUEUE * queue_l)
+{
+ gsize	n = G_MAXSIZE;
+
+	if(!queue_isempty(queue_l))
+	{
+		n = queue_l->data[queue_l->front & (queue_l->size - 1)];
+		queue_l->front++;
+	}
+ return n;
+}
+
+//Number of pixels of a width x height image
+//0 if the image is empty or too large for buffers of LL_PIXEL_BYTES bytes per pixel to be addressed
+gsize ll_pixels(gint width, gint height)
+{
+	if(width <= 0 || height <= 0)
+		return 0;
+
+	if((guint64) width * (guint64) height > G_MAXSIZE / LL_PIXEL_BYTES)
+		return 0;
+
+	return (gsize) width * height;
+}
+
+// Memory the per pixel maps of a Region Map may use, 0 until read from LL_MEMORY_ENV
+static gsize	map_memory;
+
+// Part of the physical memory the per pixel maps may use when LL_MEMORY_ENV is not set
+#define MAP_MEMORY_SHARE	2
+
+//Sets the memory (in bytes) the per pixel maps of a Region Map may use
+//Maps created afterwards needing more (LL_MAP_PIXEL_BYTES per pixel) are paged from a temporary file
+void ll_map_set_memory(gsize bytes)
+{
+	map_memory = MAX(bytes, 1);
+}
+
+//1 / MAP_MEMORY_SHARE of the physical memory, or no limit where it cannot be read
+static gsize memory_physical(void)
+{
+#if defined(G_OS_UNIX) && defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+ glong		pages, page;
+ guint64	bytes;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	page  = sysconf(_SC_PAGESIZE);
+
+	if(pages > 0 && page > 0)
+	{
+		bytes = (guint64) pages * (guint64) page / MAP_MEMORY_SHARE;
+
+		if(bytes > 0 && bytes < G_MAXSIZE)
+			return (gsize) bytes;
+	}
+#endif
+
+	return G_MAXSIZE;
+}
+
+//Memory the per pixel maps may use : set by ll_map_set_memory, else LL_MEMORY_ENV megabytes,
+//else a share of the physical memory
+static gsize map_memory_get(void)
+{
+ const gchar	*env;
+ guint64	mb;
+
+	if(map_memory == 0)
+	{
+		env = g_getenv(LL_MEMORY_ENV);
+		mb  = (env != NULL) ? g_ascii_strtoull(env, NULL, 10) : 0;
+
+		map_memory = (mb > 0 && mb < G_MAXSIZE / (1024 * 1024)) ? (gsize) mb * 1024 * 1024 : memory_physical();
+	}
+
+	return map_memory;
+}
+
+//Hash of the set of layers of code plus layer l (none if l < 0)
+static guint code_hash(LL_MAP *map, guint32 code, gint l)
+{
+ const guint32	*set;
+ guint32	word;
+ guint		h = 0;
+ gint		n;
+
+	set = map->code_sets + (gsize) code * map->code_words;
+
+	for(n = 0; n < map->code_words; n++)
+	{
+		word = set[n];
+
+		if(l >= 0 && n == (l >> 5))
+			word |= 1u << (l & 31);
+
+		h = (h ^ word) * 0x9E3779B1u;
+	}
+
+	return h ^ (h >> 16);
+}
+
+//TRUE if layer code c holds the set of layers of code plus layer l
+static gboolean code_equal(LL_MAP *map, guint32 c, guint32 code, gint l)
+{
+ const guint32	*a, *b;
+ guint32	word;
+ gint		n;
+
+	a = map->code_sets + (gsize) c * map->code_words;
+	b = map->code_sets + (gsize) code * map->code_words;
+
+	for(n = 0; n < map->code_words; n++)
+	{
+		word = b[n];
+
+		if(n == (l >> 5))
+			word |= 1u << (l & 31);
+
+		if(a[n] != word)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Puts layer code c in code_index, doubling the index first if it would be more than half full
+static void code_index_add(LL_MAP *map, guint32 c)
+{
+ guint32	*old;
+ gsize		old_size, n, slot;
+
+	if(2 * (gsize) map->num_codes > map->code_index_size)
+	{
+		old = map->code_index;
+		old_size = map->code_index_size;
+
+		map->code_index_size = MAX(2 * old_size, 16);
+		map->code_index = g_new(guint32, map->code_index_size);
+		LL_STATS_ALLOC(LL_MEM_MAP, (map->code_index_size - old_size) * sizeof(guint32));
+
+		for(n = 0; n < map->code_index_size; n++)
+			map->code_index[n] = LL_CODE_NONE;
+
+		for(n = 0; n < old_size; n++)
+		{
+			if(old[n] != LL_CODE_NONE)
+			{
+				slot = code_hash(map, old[n], -1) & (map->code_index_size - 1);
+
+				while(map->code_index[slot] != LL_CODE_NONE)
+					slot = (slot + 1) & (map->code_index_size - 1);
+
+				map->code_index[slot] = old[n];
+			}
+		}
+
+		g_free(old);
+	}
+
+	slot = code_hash(map, c, -1) & (map->code_index_size - 1);
+
+	while(map->code_index[slot] != LL_CODE_NONE)
+		slot = (slot + 1) & (map->code_index_size - 1);
+
+	map->code_index[slot] = c;
+}
+
+//Allocates a Region Map of width x height pixels for layer_num layers
+//with the empty layer code (0) at every pixel
+//If the map does not fit in the memory given to it (see ll_map_set_memory) its layer codes
+//and tags are kept in tiles, each store paging through a third of that memory
+//Returns NULL if the image is empty or too large (see ll_pixels)
+LL_MAP * ll_map_new(gint width, gint height, gint layer_num)
+{
+ LL_MAP	*map;
+ gsize	pixels;
+
+	pixels = ll_pixels(width, height);
+
+	if(pixels == 0)
+	{
+		g_warning("ll_map_new: a %d x %d image is empty or too large", width, height);
+		return NULL;
+	}
+
+	map = g_new0(LL_MAP, 1);
+
+	map->width	= width;
+	map->height	= height;
+	map->layer_num	= layer_num;
+
+	if(pixels > map_memory_get() / LL_MAP_PIXEL_BYTES)
+		map->code_tiles = ll_tiles_new(height, width * sizeof(guint32), map_memory_get() / 3, LL_MEM_MAP);
+
+	if(map->code_tiles == NULL)
+	{
+		map->layer_code = g_new0(guint32, pixels);
+		LL_STATS_ALLOC(LL_MEM_MAP, pixels * sizeof(guint32));
+	}
+
+	map->code_words	= MAX(1, (layer_num + 31) / 32);
+	map->code_sets	= g_new0(guint32, map->code_words);
+	map->num_codes	= 1;
+
+	LL_STATS_ALLOC(LL_MEM_MAP, map->code_words * sizeof(guint32));
+
+	code_index_add(map, 0);
+
+	return map;
+}
+
+//Expands KERNEL (a macro taking the type of the tags) for the width of the tags of map
+//so that every consumer of the tags runs a loop specialized for 8, 16 or 32 bit tags
+#define TAGS_DISPATCH(map, KERNEL) \
+	G_STMT_START \
+	{ \
+		switch((map)->tag_bytes) \
+		{ \
+			case 1:  KERNEL(guint8);  break; \
+			case 2:  KERNEL(guint16); break; \
+			default: KERNEL(guint32); break; \
+		} \
+	} \
+	G_STMT_END
+
+//Runs func over the rows 0 to rows - 1 of a stage of map, for rows of w pixels :
+//in bands of about LL_BAND_PIXELS on the pool for a map in memory,
+//at once on the calling thread for a map in tiles (whose stores are used from one thread at a time)
+static void map_rows_for(LL_MAP *map, gint rows, gint w, LL_POOL_FUNC func, gpointer data)
+{
+	if(map->code_tiles != NULL || map->tag_tiles != NULL)
+		func(0, rows, data);
+	else
+		ll_pool_for(0, rows, MAX(1, LL_BAND_PIXELS / MAX(w, 1)), func, data);
+}
+
+//Returns the layer codes of row y (valid until LL_TILES_MIN - 1 other tiles of the map are touched)
+guint32 * ll_map_code_row(LL_MAP *map, gint y)
+{
+	if(map->code_tiles != NULL)
+		return ll_tiles_row(map->code_tiles, y);
+
+	return map->layer_code + (gsize) y * map->width;
+}
+
+//Returns the tags of row y, of tag_bytes bytes each (valid as the rows of ll_map_code_row)
+gpointer ll_map_tag_row(LL_MAP *map, gint y)
+{
+	if(map->tag_tiles != NULL)
+		return ll_tiles_row(map->tag_tiles, y);
+
+	return (guchar *) map->tags + (gsize) y * map->width * map->tag_bytes;
+}
+
+//Tag of pixel x of a row of tags
+static guint32 tag_get(LL_MAP *map, gconstpointer row, gint x)
+{
+	switch(map->tag_bytes)
+	{
+		case 1:  return ((const guint8 *) row)[x];
+		case 2:  return ((const guint16 *) row)[x];
+		default: return ((const guint32 *) row)[x];
+	}
+}
+
+//Frees the tags of the map
+static void tags_free(LL_MAP *map)
+{
+	if(map->tags != NULL)
+		LL_STATS_FREE(LL_MEM_MAP, ll_pixels(map->width, map->height) * map->tag_bytes);
+
+	ll_tiles_free(map->tag_tiles);
+	g_free(map->tags);
+
+	map->tag_tiles = NULL;
+	map->tags = NULL;
+	map->tag_bytes = 0;
+}
+
+//Allocates the tags of the map at the smallest width which holds num_regions
+//in tiles if the layer codes are
+static void tags_alloc(LL_MAP *map)
+{
+ gsize	size;
+
+	tags_free(map);
+
+	if(map->num_regions <= G_MAXUINT8)
+		map->tag_bytes = 1;
+	else if(map->num_regions <= G_MAXUINT16)
+		map->tag_bytes = 2;
+	else
+		map->tag_bytes = 4;
+
+	if(map->code_tiles != NULL)
+		map->tag_tiles = ll_tiles_new(map->height, (gsize) map->width * map->tag_bytes, map_memory_get() / 3, LL_MEM_MAP);
+
+	if(map->tag_tiles == NULL)
+	{
+		size = ll_pixels(map->width, map->height) * map->tag_bytes;
+		map->tags = g_malloc(size);
+		LL_STATS_ALLOC(LL_MEM_MAP, size);
+	}
+}
+
+//Number of codes code_sets has room for : the smallest power of 2 not below num_codes
+static gint code_capacity(LL_MAP *map)
+{
+ gint	n = 1;
+
+	while(n < map->num_codes)
+		n *= 2;
+
+	return n;
+}
+
+//Frees the List Graph of the map (all of it is in its arena)
+static void graph_free(LL_MAP *map)
+{
+	if(map->graph == NULL)
+		return;
+
+	ll_arena_free(map->graph->arena);
+
+	map->graph = NULL;
+}
+
+//First pass of the labelling of a map kept in tiles (see label_tiles)
+struct ll_labels
+{
+	LL_TILES	*tiles;		//provisional label of every pixel
+	GArray		*parent;	//union find of the provisional labels
+	GArray		*codes;		//layer code of every provisional label
+	gint		rows;		//rows labelled so far
+};
+
+//Frees the first pass of the labelling of the map
+static void labels_free(LL_MAP *map)
+{
+	if(map->labels == NULL)
+		return;
+
+	ll_tiles_free(map->labels->tiles);
+	g_array_free(map->labels->parent, TRUE);
+	g_array_free(map->labels->codes, TRUE);
+	g_free(map->labels);
+
+	map->labels = NULL;
+}
+
+//TRUE if the labelling of the map is cancelled (see ll_map_cancel) : what it has made is then freed
+//and the map is left unlabelled, without tags, regions or ListGraph
+static gboolean labels_cancelled(LL_MAP *map)
+{
+	if(!g_atomic_int_get(&map->cancel))
+		return FALSE;
+
+	tags_free(map);
+	labels_free(map);
+	map->num_regions = 0;
+
+	return TRUE;
+}
+
+//Frees the Region Map and everything it holds
+void ll_map_free(LL_MAP *map)
+{
+	if(map == NULL)
+		return;
+
+	graph_free(map);
+	tags_free(map);
+	labels_free(map);
+
+	if(map->layer_code != NULL)
+		LL_STATS_FREE(LL_MEM_MAP, ll_pixels(map->width, map->height) * sizeof(guint32));
+
+	LL_STATS_FREE(LL_MEM_MAP, code_capacity(map) * map->code_words * sizeof(guint32)
+				  + map->code_index_size * sizeof(guint32)
+				  + map->num_regions * (sizeof(gboolean) + sizeof(gsize)));
+
+	g_free(map->reg_affected);
+	g_free(map->seeds);
+	g_free(map->code_sets);
+	g_free(map->code_index);
+	g_free(map->layer_code);
+	ll_tiles_free(map->code_tiles);
+	g_free(map);
+}
+
+//Allocates a Region Map sampling map every factor pixels, ie. of the layer code of pixel
+//x * factor, y * factor at every pixel x, y, with the layer codes (and code_sets) of map
+//so that a coarse region holds the layers of the regions of map it samples
+//Returns NULL as ll_map_new does
+LL_MAP * ll_map_coarse(LL_MAP *map, gint factor)
+{
+ LL_MAP		*coarse;
+ guint32	*src, *dest;
+ gsize		sets;
+ gint		x, y;
+
+	coarse = ll_map_new((map->width - 1) / factor + 1, (map->height - 1) / factor + 1, map->layer_num);
+
+	if(coarse == NULL)
+		return NULL;
+
+	LL_STATS_FREE(LL_MEM_MAP, code_capacity(coarse) * coarse->code_words * sizeof(guint32)
+				  + coarse->code_index_size * sizeof(guint32));
+	g_free(coarse->code_sets);
+	g_free(coarse->code_index);
+
+	sets = (gsize) code_capacity(map) * map->code_words;
+
+	coarse->code_sets	= g_memdup(map->code_sets, sets * sizeof(guint32));
+	coarse->code_index	= g_memdup(map->code_index, map->code_index_size * sizeof(guint32));
+	coarse->code_index_size	= map->code_index_size;
+	coarse->num_codes	= map->num_codes;
+
+	LL_STATS_ALLOC(LL_MEM_MAP, sets * sizeof(guint32) + map->code_index_size * sizeof(guint32));
+
+	for(y = 0; y < coarse->height; y++)
+	{
+		src  = ll_map_code_row(map, y * factor);
+		dest = ll_map_code_row(coarse, y);
+
+		for(x = 0; x < coarse->width; x++)
+			dest[x] = src[x * factor];
+	}
+
+	return coarse;
+}
+
+//Carries the stacking of coarse (a map of ll_map_coarse, factor) over to map, both labelled :
+//a region of map takes the lists of the coarse region of its first sampled pixel
+//The regions of map no pixel of coarse samples keep their lists
+//The regions whose lists change are the ones set affected
+//Returns a newly allocated array holding, for every region of map, the coarse region it is carried from
+//(-1 for the regions which keep their lists) so that anything else kept per coarse region can follow
+gint * ll_map_carry_lists(LL_MAP *map, LL_MAP *coarse, gint factor)
+{
+ gint		*carried;
+ gpointer	row;
+ gint		x, y, l, c;
+
+	carried = g_new(gint, MAX(map->num_regions, 1));
+	ll_map_set_affected(map, FALSE);
+
+	for(l = 0; l < map->num_regions; l++)
+		carried[l] = -1;
+
+	for(y = 0; y < map->height; y += factor)
+	{
+		row = ll_map_tag_row(map, y);
+
+		for(x = 0; x < map->width; x += factor)
+		{
+			l = (gint) tag_get(map, row, x) - 1;
+
+			if(carried[l] != -1)
+				continue;
+
+			c = ll_map_region_at(coarse, x / factor, y / factor);
+			carried[l] = c;
+
+			if(memcmp(map->graph->lists[l], coarse->graph->lists[c], map->layer_num * sizeof(gint)) != 0)
+			{
+				memcpy(map->graph->lists[l], coarse->graph->lists[c], map->layer_num * sizeof(gint));
+				map->reg_affected[l] = TRUE;
+			}
+		}
+	}
+
+	return carried;
+}
+
+//Returns the layer code holding the set of layers of code plus layer l
+//which is created the first time that set is met : a set has one code
+//whatever the order or the parts of the image its layers are added in
+static guint32 code_add_layer(LL_MAP *map, guint32 code, gint l)
+{
+ guint32	*set;
+ gsize		slot;
+
+	slot = code_hash(map, code, l) & (map->code_index_size - 1);
+
+	while(map->code_index[slot] != LL_CODE_NONE)
+	{
+		if(code_equal(map, map->code_index[slot], code, l))
+			return map->code_index[slot];
+
+		slot = (slot + 1) & (map->code_index_size - 1);
+	}
+
+	//code_sets grows by doubling : its size is a power of 2 whenever it is full
+	if((map->num_codes & (map->num_codes - 1)) == 0)
+	{
+		map->code_sets = g_renew(guint32, map->code_sets, 2 * map->num_codes * map->code_words);
+		LL_STATS_ALLOC(LL_MEM_MAP, map->num_codes * map->code_words * sizeof(guint32));
+	}
+
+	set = map->code_sets + map->num_codes * map->code_words;
+	memcpy(set, map->code_sets + code * map->code_words, map->code_words * sizeof(guint32));
+	set[l >> 5] |= 1u << (l & 31);
+
+	map->num_codes++;
+	code_index_add(map, map->num_codes - 1);
+
+	return map->num_codes - 1;
+}
+
+//Adds the layer of band to the layer codes of its rows first to last - 1
+//The codes of a band are extended through its own next[] (the codes before the call are the only ones met)
+//and the codes made by all the bands are made one at a time
+static void add_layer_band(gint first, gint last, gpointer data)
+{
+ LL_BAND	*band = data;
+ LL_MAP		*map = band->map;
+ const guchar	*src;
+ guint32	*dest, *next;
+ guint32	code;
+ gint		m, n;
+
+	next = g_new(guint32, band->num_codes);
+	LL_STATS_ALLOC(LL_MEM_SCRATCH, band->num_codes * sizeof(guint32));
+
+	for(n = 0; n < band->num_codes; n++)
+		next[n] = LL_CODE_NONE;
+
+	for(m = first; m < last; m++)
+	{
+		src  = band->src + ((gsize) m * band->w * band->bpp) + (band->bpp - 1);
+		dest = ll_map_code_row(map, band->y + m) + band->x;
+
+		for(n = 0; n < band->w; n++)
+		{
+			if(!band->alpha || *src != 0)
+			{
+				code = dest[n];
+
+				if(next[code] == LL_CODE_NONE)
+				{
+					g_static_mutex_lock(&code_mutex);
+					next[code] = code_add_layer(map, code, band->i);
+					g_static_mutex_unlock(&code_mutex);
+				}
+
+				dest[n] = next[code];
+			}
+			src += band->bpp;
+		}
+	}
+
+	LL_STATS_FREE(LL_MEM_SCRATCH, band->num_codes * sizeof(guint32));
+	g_free(next);
+}
+
+//Adds layer l to the layer code of every pixel where the layer is present
+//buf holds w x h pixels of bpp bytes placed at x, y in the image space
+//If the layer has an alpha channel it is present wherever the alpha value is non zero
+//else it is present at all its pixel locations
+//All the pixels of a code gain the same layer, so next[] maps every code to its extended code
+//which is created the first time it is needed (each layer is to be added once)
+//The rows are done in bands on the pool : as a set has a single code, the codes do not depend on the bands
+void ll_map_add_layer(LL_MAP *map, gint l, const guchar *buf, gint bpp, gboolean alpha, gint x, gint y, gint w, gint h)
+{
+ LL_BAND	band = { 0 };
+
+	band.map	= map;
+	band.i		= l;
+	band.src	= buf;
+	band.bpp	= bpp;
+	band.alpha	= alpha;
+	band.num_codes	= map->num_codes;
+	band.x		= x;
+	band.y		= y;
+	band.w		= w;
+
+	map_rows_for(map, h, w, add_layer_band, &band);
+}
+
+//Allocate memory for the ListGraph Lists and initializes them to 0 values
+//The rows of the lists are one contiguous block of the graph arena ; the edges are added by graph_edges
+static void graph_mem_alloc(LL_MAP *map)
+{
+ LL_ARENA	*arena;
+ gint		*lists;
+ gint		i;
+
+	arena = ll_arena_new(LL_ARENA_CHUNK, LL_MEM_GRAPH);
+
+	map->graph = LL_ARENA_NEW0(arena, LIST_GRAPH, 1);
+	map->graph->arena = arena;
+
+	map->graph->lists = LL_ARENA_NEW(arena, gint *, map->num_regions);
+
+	lists = LL_ARENA_NEW0(arena, gint, (gsize) map->num_regions * map->layer_num);
+
+	for(i = 0; i < map->num_regions; i++)
+		map->graph->lists[i] = lists + (gsize) i * map->layer_num;
+}
+
+//Set of the ListGraph Edges met while the tags are scanned (open addressing, size a power of 2)
+//An edge a < b is kept as (a + 1) << 32 | (b + 1), 0 is an empty slot
+typedef struct ll_edge_set
+{
+	guint64		*keys;
+	gsize		size;
+	gsize		count;
+	guint64		last;		//the edge added last, met again all along a boundary
+}LL_EDGE_SET;
+
+//Adds the ListGraph Edge between regions a and b to the set
+static void edge_set_add(LL_EDGE_SET *set, gint a, gint b)
+{
+ guint64	key, *old;
+ gsize		i, n, old_size;
+
+	key = (a < b) ? ((guint64) (a + 1) << 32 | (guint64) (b + 1)) : ((guint64) (b + 1) << 32 | (guint64) (a + 1));
+
+	if(key == set->last)
+		return;
+
+	set->last = key;
+
+	//grown to keep the set at most half full
+	if(2 * (set->count + 1) > set->size)
+	{
+		old = set->keys;
+		old_size = set->size;
+
+		set->size = MAX(old_size * 2, 1024);
+		set->keys = g_new0(guint64, set->size);
+		LL_STATS_ALLOC(LL_MEM_SCRATCH, set->size * sizeof(guint64));
+
+		for(n = 0; n < old_size; n++)
+		{
+			if(old[n] == 0)
+				continue;
+
+			for(i = (old[n] * 0x9E3779B97F4A7C15ull) >> 40 & (set->size - 1); set->keys[i] != 0; i = (i + 1) & (set->size - 1));
+			set->keys[i] = old[n];
+		}
+
+		LL_STATS_FREE(LL_MEM_SCRATCH, old_size * sizeof(guint64));
+		g_free(old);
+	}
+
+	for(i = (key * 0x9E3779B97F4A7C15ull) >> 40 & (set->size - 1); set->keys[i] != 0; i = (i + 1) & (set->size - 1))
+	{
+		if(set->keys[i] == key)
+			return;
+	}
+
+	set->keys[i] = key;
+	set->count++;
+}
+
+static gint region_compare(gconstpointer a, gconstpointer b)
+{
+	return *(const gint *) a - *(const gint *) b;
+}
+
+//Finds the ListGraph Edges between the regions of the tags (4-connected neighbours of different regions)
+//and stores them as the adjacency lists of the graph
+//Returns the number of edges
+static gint64 graph_edges(LL_MAP *map)
+{
+ LL_EDGE_SET	set = { NULL, 0, 0, 0 };
+ gint		*fill;
+ gsize		n;
+ gint		a, b, i, x, y;
+
+#define EDGES_KERNEL(type) \
+	for(y = 0; y < map->height; y++) \
+	{ \
+		const type	*row = ll_map_tag_row(map, y); \
+		const type	*up  = (y > 0) ? ll_map_tag_row(map, y - 1) : NULL; \
+ \
+		for(x = 0; x < map->width; x++) \
+		{ \
+			if(x > 0 && row[x - 1] != row[x]) \
+				edge_set_add(&set, (gint) row[x - 1] - 1, (gint) row[x] - 1); \
+ \
+			if(up != NULL && up[x] != row[x]) \
+				edge_set_add(&set, (gint) up[x] - 1, (gint) row[x] - 1); \
+		} \
+	}
+
+	TAGS_DISPATCH(map, EDGES_KERNEL);
+
+#undef EDGES_KERNEL
+
+	//adjacency lists : the degrees, their running sums and the neighbours
+	map->graph->edge_start = LL_ARENA_NEW0(map->graph->arena, gint, map->num_regions + 1);
+	map->graph->edges = LL_ARENA_NEW(map->graph->arena, gint, MAX(2 * set.count, 1));
+	fill = g_new0(gint, MAX(map->num_regions, 1));
+
+	for(n = 0; n < set.size; n++)
+	{
+		if(set.keys[n] == 0)
+			continue;
+
+		map->graph->edge_start[(set.keys[n] >> 32) - 1 + 1]++;
+		map->graph->edge_start[(set.keys[n] & G_MAXUINT32) - 1 + 1]++;
+	}
+
+	for(i = 0; i < map->num_regions; i++)
+		map->graph->edge_start[i + 1] += map->graph->edge_start[i];
+
+	for(n = 0; n < set.size; n++)
+	{
+		if(set.keys[n] == 0)
+			continue;
+
+		a = (gint) (set.keys[n] >> 32) - 1;
+		b = (gint) (set.keys[n] & G_MAXUINT32) - 1;
+
+		map->graph->edges[map->graph->edge_start[a] + fill[a]++] = b;
+		map->graph->edges[map->graph->edge_start[b] + fill[b]++] = a;
+	}
+
+	for(i = 0; i < map->num_regions; i++)
+		qsort(map->graph->edges + map->graph->edge_start[i], fill[i], sizeof(gint), region_compare);
+
+	g_free(fill);
+
+	LL_STATS_FREE(LL_MEM_SCRATCH, set.size * sizeof(guint64));
+	g_free(set.keys);
+
+	return (gint64) set.count;
+}
+
+//Copies the 32 bit tags of the region growing to the tags of the map
+//at the smallest width which holds num_regions
+//The regions are renumbered in the order of their first pixel, as label_tiles numbers them
+static void tags_store(LL_MAP *map, const gint *tags)
+{
+ gint	*order;
+ gint	y, x, next;
+
+	tags_alloc(map);
+
+	order = g_new0(gint, map->num_regions + 1);
+	next = 0;
+
+#define STORE_KERNEL(type) \
+	for(y = 0; y < map->height; y++) \
+	{ \
+		type		*row = ll_map_tag_row(map, y); \
+		const gint	*src = tags + (gsize) y * map->width; \
+ \
+		for(x = 0; x < map->width; x++) \
+		{ \
+			if(order[src[x]] == 0) \
+				order[src[x]] = ++next; \
+ \
+			row[x] = (type) order[src[x]]; \
+		} \
+	}
+
+	TAGS_DISPATCH(map, STORE_KERNEL);
+
+#undef STORE_KERNEL
+
+	g_free(order);
+}
+
+//Allocates the reg_affected and seeds arrays of the regions just labelled
+//and makes their ListGraph : the layers present in every region, ranked in the order of the layers,
+//and the edges between adjacent regions
+static void labels_done(LL_MAP *map)
+{
+ guint32	kind;
+ gint64		num_edges;
+ gint		found = 0;
+ gint		x, y, l, i, s;
+
+	map->reg_affected = g_new0(gboolean, map->num_regions);
+	map->seeds = g_new(gsize, MAX(map->num_regions, 1));
+	LL_STATS_ALLOC(LL_MEM_MAP, map->num_regions * (sizeof(gboolean) + sizeof(gsize)));
+
+	//the first pixel of every region in row order, where its outer contour starts (see outline_trace)
+	for(l = 0; l < map->num_regions; l++)
+		map->seeds[l] = G_MAXSIZE;
+
+#define SEEDS_KERNEL(type) \
+	for(y = 0; y < map->height && found < map->num_regions; y++) \
+	{ \
+		const type	*row = ll_map_tag_row(map, y); \
+ \
+		for(x = 0; x < map->width; x++) \
+		{ \
+			l = (gint) row[x] - 1; \
+ \
+			if(map->seeds[l] == G_MAXSIZE) \
+			{ \
+				map->seeds[l] = (gsize) y * map->width + x; \
+				found++; \
+			} \
+		} \
+	}
+
+	TAGS_DISPATCH(map, SEEDS_KERNEL);
+
+#undef SEEDS_KERNEL
+
+	graph_mem_alloc(map);
+
+	for(l = 0; l < map->num_regions; l++)
+	{
+		kind = ll_map_code_row(map, map->seeds[l] / map->width)[map->seeds[l] % map->width];
+		s = 1;
+
+		for(i = 0; i < map->layer_num; i++)
+		{
+			if(LL_CODE_HAS(map, kind, i))
+				map->graph->lists[l][i] = s++;
+		}
+	}
+
+	num_edges = graph_edges(map);
+
+	LL_STATS_SET(LL_COUNT_REGIONS, map->num_regions);
+	LL_STATS_SET(LL_COUNT_EDGES, num_edges);
+}
+
+//Root of provisional label l of label_tiles, halving the paths on the way
+static guint32 label_find(guint32 *parent, guint32 l)
+{
+	while(parent[l] != l)
+	{
+		parent[l] = parent[parent[l]];
+		l = parent[l];
+	}
+
+	return l;
+}
+
+//Runs the first pass of label_tiles on the rows from the last labelled one up to row rows - 1
+//Every pixel gets a provisional label, the same as its left or upper neighbour of the same layer code,
+//and the labels found to meet are merged (union find, the lowest label is the root)
+static void label_rows(LL_MAP *map, gint rows)
+{
+ LL_LABELS	*labels;
+ guint32	*code, *up_code, *lab, *up_lab;
+ guint32	l, u, kind;
+ gint		x, y;
+
+	if(map->labels == NULL)
+	{
+		labels = g_new0(LL_LABELS, 1);
+		labels->tiles = ll_tiles_new(map->height, map->width * sizeof(guint32), map_memory_get() / 3, LL_MEM_SCRATCH);
+
+		if(labels->tiles == NULL)
+			g_error("ll_map_extract_tags: cannot page the labels of a %d x %d map", map->width, map->height);
+
+		labels->parent = g_array_new(FALSE, FALSE, sizeof(guint32));
+		labels->codes  = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+		map->labels = labels;
+	}
+
+	labels = map->labels;
+
+	for(y = labels->rows; y < rows && !g_atomic_int_get(&map->cancel); y++)
+	{
+		code    = ll_map_code_row(map, y);
+		lab     = ll_tiles_row(labels->tiles, y);
+		up_code = (y > 0) ? ll_map_code_row(map, y - 1) : NULL;
+		up_lab  = (y > 0) ? ll_tiles_row(labels->tiles, y - 1) : NULL;
+
+		for(x = 0; x < map->width; x++)
+		{
+			kind = code[x];
+			l = LL_CODE_NONE;
+
+			if(x > 0 && code[x - 1] == kind)
+				l = lab[x - 1];
+
+			if(up_code != NULL && up_code[x] == kind)
+			{
+				u = up_lab[x];
+
+				if(l == LL_CODE_NONE)
+					l = u;
+				else if(l != u)
+				{
+					l = label_find((guint32 *) labels->parent->data, l);
+					u = label_find((guint32 *) labels->parent->data, u);
+					g_array_index(labels->parent, guint32, MAX(l, u)) = MIN(l, u);
+					l = MIN(l, u);
+				}
+			}
+
+			if(l == LL_CODE_NONE)
+			{
+				l = labels->parent->len;
+				g_array_append_val(labels->parent, l);
+				g_array_append_val(labels->codes, kind);
+			}
+
+			lab[x] = l;
+		}
+	}
+
+	labels->rows = MAX(labels->rows, y);
+}
+
+//Labels the rows 0 .. rows - 1 of a map kept in tiles ahead of ll_map_extract_tags
+//(the first pass of label_tiles), so that it can run while the layer codes of the next rows are made
+//The layer codes of these rows must be complete : every layer added to them
+//A map in memory is labelled by ll_map_extract_tags alone and is left as it is
+void ll_map_label_rows(LL_MAP *map, gint rows)
+{
+	if(map->code_tiles == NULL)
+		return;
+
+	LL_STATS_BEGIN(LL_PHASE_LABEL_COUNT);
+	LL_TRACE_BEGIN_ARG("label_rows", "rows", rows);
+
+	label_rows(map, MIN(rows, map->height));
+
+	LL_TRACE_END("label_rows");
+	LL_STATS_END(LL_PHASE_LABEL_COUNT);
+}
+
+//Labelling of a map kept in tiles, in two passes in row order (so the tiles are read in turn)
+//The first pass (label_rows) gives every pixel a provisional label, which may have been done
+//in parts by ll_map_label_rows
+//The second pass writes the tags : the regions are numbered in the order of their first pixel
+//as the region growing of ll_map_extract_tags is renumbered
+//Returns FALSE if the labelling is cancelled
+static gboolean label_tiles(LL_MAP *map)
+{
+ GArray		*parent;
+ guint32	*final, *lab;
+ guint32	l, u;
+ gint		x, y;
+
+	LL_STATS_BEGIN(LL_PHASE_LABEL_COUNT);
+	LL_TRACE_BEGIN("label_count");
+
+	label_rows(map, map->height);
+
+	if(labels_cancelled(map))
+	{
+		LL_TRACE_END("label_count");
+		LL_STATS_END(LL_PHASE_LABEL_COUNT);
+
+		return FALSE;
+	}
+
+	parent = map->labels->parent;
+
+	//final region of every label : the roots in the order of their first pixel
+	final = g_new(guint32, MAX(parent->len, 1));
+	map->num_regions = 0;
+
+	for(l = 0; l < parent->len; l++)
+	{
+		u = label_find((guint32 *) parent->data, l);
+		final[l] = (u == l) ? (guint32) map->num_regions++ : final[u];
+	}
+
+	LL_TRACE_END("label_count");
+	LL_STATS_END(LL_PHASE_LABEL_COUNT);
+
+	LL_STATS_BEGIN(LL_PHASE_LABEL_TAG);
+	LL_TRACE_BEGIN("label_tag");
+
+	tags_alloc(map);
+
+	for(y = 0; y < map->height && !g_atomic_int_get(&map->cancel); y++)
+	{
+		lab = ll_tiles_row(map->labels->tiles, y);
+
+#define TAG_ROW_KERNEL(type) \
+	{ \
+		type	*row = ll_map_tag_row(map, y); \
+ \
+		for(x = 0; x < map->width; x++) \
+			row[x] = (type) (final[lab[x]] + 1); \
+	}
+
+		TAGS_DISPATCH(map, TAG_ROW_KERNEL);
+
+#undef TAG_ROW_KERNEL
+	}
+
+	g_free(final);
+
+	if(labels_cancelled(map))
+	{
+		LL_TRACE_END("label_tag");
+		LL_STATS_END(LL_PHASE_LABEL_TAG);
+
+		return FALSE;
+	}
+
+	labels_free(map);
+
+	labels_done(map);
+
+	LL_TRACE_END("label_tag");
+	LL_STATS_END(LL_PHASE_LABEL_TAG);
+
+	return TRUE;
+}
+
+//Calculates the tags array for all the pixels in the image space
+//Calculates number of regions, List_Graph : Lists and Edges
+//The region growing tags the regions, which are then renumbered in the order of their first pixel
+//and the ListGraph is made from the tags (see labels_done)
+//The map keeps the tags at 8, 16 or 32 bits per pixel as num_regions requires
+//A map kept in tiles is labelled in row order instead (see label_tiles), to the same tags
+//Returns FALSE, with the map left unlabelled, if the labelling is cancelled (see ll_map_cancel)
+gboolean ll_map_extract_tags(LL_MAP *map)
+{
+ LL_QUEUE	seeds, to_expand;
+ gint		*tags1;
+ guint32	*layer_code, kind;
+ gint		cur_tag1;
+ gsize		seed, seed_temp, n, pixels, expanded = 0;
+ gint		r, c;
+ gint		i;
+ gint		width, height;
+
+	width      = map->width;
+	height     = map->height;
+	layer_code = map->layer_code;
+	pixels     = ll_pixels(width, height);
+
+	graph_free(map);
+
+	if(map->reg_affected != NULL)
+	{
+		LL_STATS_FREE(LL_MEM_MAP, map->num_regions * (sizeof(gboolean) + sizeof(gsize)));
+		g_free(map->reg_affected);
+		g_free(map->seeds);
+		map->reg_affected = NULL;
+		map->seeds = NULL;
+	}
+
+	if(map->code_tiles != NULL)
+		return label_tiles(map);
+
+	if(labels_cancelled(map))
+		return FALSE;
+
+	tags1 = ll_scratch_get0(pixels * sizeof(gint));
+
+	queue_init(&seeds);
+	queue_init(&to_expand);
+
+	LL_STATS_BEGIN(LL_PHASE_LABEL_COUNT);
+	LL_TRACE_BEGIN("label_count");
+
+	//INITIALIZATION 1
+	tags1[0] = -1;
+	cur_tag1 = 0;
+	queue_push(&seeds, 0);
+
+	//REGION GROWING ALGORITHM 1 : To calculate Number of Regions
+	while(!queue_isempty(&seeds) && !g_atomic_int_get(&map->cancel))
+	{
+		//Get a seed from the seeds queue
+		seed = queue_pop(&seeds);
+
+		if(tags1[seed] != -1)
+		{//seed has been evaluated
+			continue;
+		}
+		//Get Fresh Tag
+		cur_tag1++;
+
+		//Assign tag to tags1[seed]
+		tags1[seed] = cur_tag1;
+
+		//Push seed into to_expand queue
+		queue_push(&to_expand, seed);
+
+		//Get Layer code for pixel
+		kind = layer_code[seed];
+
+		//while to_expand queue is not empty
+		while(!queue_isempty(&to_expand))
+		{
+			if((++expanded & (LL_CANCEL_PIXELS - 1)) == 0 && g_atomic_int_get(&map->cancel))
+				break;
+
+			seed_temp = queue_pop(&to_expand);
+			r = (gint) (seed_temp / width);
+			c = (gint) (seed_temp % width);
+
+			for(i = 0; i < CONNECTIVITY; i++)
+			{
+				if((r + ofs[i].y >= height) || (r + ofs[i].y < 0))
+					continue;
+
+				if((c + ofs[i].x >= width) || (c + ofs[i].x < 0))
+					continue;
+
+				n = (gsize) (r + ofs[i].y) * width + (c + ofs[i].x);
+
+				if(layer_code[n] == kind)
+				{
+					if(tags1[n] == cur_tag1)
+						continue;
+
+					tags1[n] = cur_tag1;
+
+					queue_push(&to_expand, n);
+				}
+				else if(tags1[n] == 0)
+				{
+					tags1[n] = -1;
+					queue_push(&seeds, n);
+				}
+			}
+		}
+	}
+
+	LL_TRACE_END("label_count");
+	LL_STATS_END(LL_PHASE_LABEL_COUNT);
+
+	queue_free(&seeds);
+	queue_free(&to_expand);
+
+	if(labels_cancelled(map))
+	{
+		ll_scratch_put(tags1);
+		return FALSE;
+	}
+
+	LL_STATS_BEGIN(LL_PHASE_LABEL_TAG);
+	LL_TRACE_BEGIN("label_tag");
+
+	//Store number of regions present in the image
+	map->num_regions = cur_tag1;
+
+	tags_store(map, tags1);
+	ll_scratch_put(tags1);
+
+	if(labels_cancelled(map))
+	{
+		LL_TRACE_END("label_tag");
+		LL_STATS_END(LL_PHASE_LABEL_TAG);
+
+		return FALSE;
+	}
+
+	labels_done(map);
+
+	LL_TRACE_END("label_tag");
+	LL_STATS_END(LL_PHASE_LABEL_TAG);
+
+	return TRUE;
+}
+
+//Has the labelling of the map (ll_map_extract_tags), running on another thread, stop early
+//The map stays cancelled : it is not labelled again
+void ll_map_cancel(LL_MAP *map)
+{
+	g_atomic_int_set(&map->cancel, TRUE);
+}
+
+//Returns the region (index into the ListGraph) at pixel x, y
+//or -1 if the pixel is outside the image
+gint ll_map_region_at(LL_MAP *map, gint x, gint y)
+{
+	if(x < 0 || y < 0 || x >= map->width || y >= map->height || map->tag_bytes == 0)
+		return -1;
+
+	return (gint) tag_get(map, ll_map_tag_row(map, y), x) - 1;
+}
+
+//Writes the regions of the pixels x .. x + w - 1 of row y into regions
+//(a row of the image, labelled)
+void ll_map_region_row(LL_MAP *map, gint y, gint x, gint w, gint *regions)
+{
+ gpointer	row;
+ gint		n;
+
+	row = ll_map_tag_row(map, y);
+
+	for(n = 0; n < w; n++)
+		regions[n] = (gint) tag_get(map, row, x + n) - 1;
+}
+
+//Returns the layer stacked immediately above layer i in region l
+//or -1 if layer i is the top most layer or is absent from the region
+gint ll_map_layer_above(LL_MAP *map, gint l, gint i)
+{
+ gint	j, rank;
+
+	rank = map->graph->lists[l][i];
+
+	if(rank <= 1)
+		return -1;
+
+	for(j = 0; j < map->layer_num; j++)
+	{
+		if(map->graph->lists[l][j] == rank - 1)
+			return j;
+	}
+
+	return -1;
+}
+
+//Returns the layer stacked immediately below layer i in region l
+//or -1 if layer i is the bottom most layer or is absent from the region
+gint ll_map_layer_below(LL_MAP *map, gint l, gint i)
+{
+ gint	j, rank;
+
+	rank = map->graph->lists[l][i];
+
+	if(rank == 0)
+		return -1;
+
+	for(j = 0; j < map->layer_num; j++)
+	{
+		if(map->graph->lists[l][j] == rank + 1)
+			return j;
+	}
+
+	return -1;
+}
+
+//Flips the layer i1 over layer i2 in region l
+//If propagate is set, takes care of consistency of the layers in the adjacent regions
+//with the help of the list graph and recursive calls, reporting each one to record
+void ll_map_flip_up(LL_MAP *map, gint i1, gint i2, gint l, gboolean propagate, LL_FLIP_FUNC record, gpointer data)
+{
+ gint		**lists = map->graph->lists;
+ gint		i, i3, e, temp;
+ gboolean 	check_affected = FALSE;
+
+	if(lists[l][i1] == 0 || lists[l][i2] == 0)
+		return;
+
+	LL_STATS_FLIP_ENTER();
+	LL_TRACE_BEGIN_ARG("flip_wave", "region", l);
+
+	while(lists[l][i1] > lists[l][i2])
+	{
+		i3 = i1;
+		for(i = 0; i < map->layer_num; i++)
+		{
+			if(lists[l][i] == (lists[l][i1]-1))
+				i3 = i;
+		}
+
+		temp = lists[l][i3];
+		lists[l][i3] = lists[l][i1];
+		lists[l][i1] = temp;
+
+		check_affected = TRUE;
+
+		if(!propagate)
+			continue;
+
+		for(e = map->graph->edge_start[l]; e < map->graph->edge_start[l + 1]; e++)
+		{
+			i = map->graph->edges[e];
+
+			if(record != NULL)
+				record(i1, i3, i, data);
+
+			ll_map_flip_up(map, i1, i3, i, propagate, record, data);
+		}
+	}
+
+	if(check_affected == TRUE)
+	{
+		map->reg_affected[l] = TRUE;
+	}
+
+	LL_TRACE_END("flip_wave");
+	LL_STATS_FLIP_LEAVE();
+}
+
+//Flips the layer i1 beneath layer i2 in region l
+//If propagate is set, takes care of consistency of the layers in the adjacent regions
+//with the help of the list graph and recursive calls, reporting each one to record
+void ll_map_flip_down(LL_MAP *map, gint i1, gint i2, gint l, gboolean propagate, LL_FLIP_FUNC record, gpointer data)
+{
+ gint		**lists = map->graph->lists;
+ gint		i, i3, e, temp;
+ gboolean 	check_affected = FALSE;
+
+	if(lists[l][i1] == 0 || lists[l][i2] == 0)
+		return;
+
+	LL_STATS_FLIP_ENTER();
+	LL_TRACE_BEGIN_ARG("flip_wave", "region", l);
+
+	while(lists[l][i1] < lists[l][i2])
+	{
+		i3 = i1;
+		for(i = 0; i < map->layer_num; i++)
+		{
+			if(lists[l][i] == (lists[l][i1]+1))
+				i3 = i;
+		}
+
+		temp = lists[l][i3];
+		lists[l][i3] = lists[l][i1];
+		lists[l][i1] = temp;
+
+		check_affected = TRUE;
+
+		if(!propagate)
+			continue;
+
+		for(e = map->graph->edge_start[l]; e < map->graph->edge_start[l + 1]; e++)
+		{
+			i = map->graph->edges[e];
+
+			if(record != NULL)
+				record(i1, i3, i, data);
+
+			ll_map_flip_down(map, i1, i3, i, propagate, record, data);
+		}
+	}
+
+	if(check_affected == TRUE)
+	{
+		map->reg_affected[l] = TRUE;
+	}
+
+	LL_TRACE_END("flip_wave");
+	LL_STATS_FLIP_LEAVE();
+}
+
+//Undoes the flips recorded for one Flip Up (call_type 0) or Flip Down (call_type 1) call
+//flips[j] holds {lower layer, higher layer, region} as stored in the plug-in's UNDO array
+//The flips are reverted latest first, without propagation
+void ll_map_undo_flips(LL_MAP *map, gint call_type, gint (*flips)[3], gint call_count)
+{
+ gint	i;
+
+	for(i = call_count; i >= 0; i--)
+	{
+		if(flips[i][0] == -1 || flips[i][1] == -1 || flips[i][2] == -1)
+			continue;
+
+		if(call_type == 1)
+		{
+			ll_map_flip_up(map, flips[i][0], flips[i][1], flips[i][2], FALSE, NULL, NULL);
+		}
+		else
+		{
+			ll_map_flip_down(map, flips[i][1], flips[i][0], flips[i][2], FALSE, NULL, NULL);
+		}
+	}
+}
+
+//Sets or clears the reg_affected array for all the regions
+void ll_map_set_affected(LL_MAP *map, gboolean affected)
+{
+ gint	i;
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		map->reg_affected[i] = affected;
+	}
+}
+
+//Returns a newly allocated array holding the top most layer of every region
+//as per the ListGraph Lists (-1 for a region where no layer is present)
+gint * ll_map_top_layers(LL_MAP *map)
+{
+ gint	*top;
+ gint	k, i, min;
+
+	top = g_new(gint, map->num_regions);
+
+	for(k = 0; k < map->num_regions; k++)
+	{
+		top[k] = -1;
+		min = G_MAXINT;
+
+		for(i = 0; i < map->layer_num; i++)
+		{
+			if(map->graph->lists[k][i] != 0 && map->graph->lists[k][i] < min)
+			{
+				min = map->graph->lists[k][i];
+				top[k] = i;
+			}
+		}
+	}
+
+	return top;
+}
+
+//Paints the mask rows first to last - 1 of band (see ll_map_paint_mask)
+static void paint_mask_band(gint first, gint last, gpointer data)
+{
+ LL_BAND	*band = data;
+ LL_MAP		*map = band->map;
+ gint		m, n, k;
+ gint64		written = 0;
+
+#define PAINT_KERNEL(type) \
+	for(m = first; m < last; m++) \
+	{ \
+		const type	*tags = (const type *) ll_map_tag_row(map, band->y + m) + band->x; \
+		guchar		*row = band->dest + (gsize) m * band->w; \
+ \
+		for(n = 0; n < band->w; n++) \
+		{ \
+			k = tags[n] - 1; \
+ \
+			if(map->reg_affected[k]) \
+			{ \
+				row[n] = (band->top[k] == band->i) ? LL_MASK_SHOW : LL_MASK_HIDE; \
+				written++; \
+			} \
+		} \
+	}
+
+	TAGS_DISPATCH(map, PAINT_KERNEL);
+
+#undef PAINT_KERNEL
+
+	LL_STATS_ADD(LL_COUNT_PIXELS_WRITTEN, written);
+}
+
+//Mask Painting of layer i
+//buf holds the w x h mask pixels of the layer placed at x, y in the image space
+//Follows the principle that at any pixel (region) only the top most layer will have a white (fully opaque) value
+//and all layers below it will have a black (fully transparent) value
+//Only the pixels of regions set in the reg_affected array are painted
+void ll_map_paint_mask(LL_MAP *map, const gint *top, gint i, guchar *buf, gint x, gint y, gint w, gint h)
+{
+ LL_BAND	band = { 0 };
+
+	LL_TRACE_BEGIN_ARG("paint_mask", "layer", i);
+
+	band.map	= map;
+	band.i		= i;
+	band.dest	= buf;
+	band.top	= top;
+	band.x		= x;
+	band.y		= y;
+	band.w		= w;
+
+	map_rows_for(map, h, w, paint_mask_band, &band);
+
+	LL_TRACE_END("paint_mask");
+}
+
+//Lowest layer in the set of layers of code (-1 for the empty code)
+static gint code_lowest(LL_MAP *map, guint32 code)
+{
+ const guint32	*set;
+ gint		n;
+
+	set = map->code_sets + (gsize) code * map->code_words;
+
+	for(n = 0; n < map->code_words; n++)
+	{
+		if(set[n] != 0)
+			return n * 32 + g_bit_nth_lsf(set[n], -1);
+	}
+
+	return -1;
+}
+
+//Paints the mask rows first to last - 1 of band from the layer codes (see ll_map_paint_codes)
+static void paint_codes_band(gint first, gint last, gpointer data)
+{
+ LL_BAND	*band = data;
+ const guint32	*code;
+ guchar		*row;
+ guint32	last_code = LL_CODE_NONE;
+ gint		m, n, top = -1;
+
+	for(m = first; m < last; m++)
+	{
+		code = ll_map_code_row(band->map, band->y + m) + band->x;
+		row  = band->dest + (gsize) m * band->w;
+
+		for(n = 0; n < band->w; n++)
+		{
+			//runs of a code are common : its top layer is looked up once
+			if(code[n] != last_code)
+			{
+				last_code = code[n];
+				top = code_lowest(band->map, last_code);
+			}
+
+			row[n] = (top == band->i) ? LL_MASK_SHOW : LL_MASK_HIDE;
+		}
+	}
+}
+
+//Mask Painting of layer i for the first stacking of the regions ie. the lists ll_map_extract_tags
+//gives them, where the lowest layer index present is the top most layer
+//buf holds the w x h mask pixels of the layer placed at x, y in the image space, all of them painted
+//Paints what ll_map_paint_mask paints for every region, from the layer codes alone :
+//so the masks of an image can be written as soon as its rows have their layer codes, before the labelling
+void ll_map_paint_codes(LL_MAP *map, gint i, guchar *buf, gint x, gint y, gint w, gint h)
+{
+ LL_BAND	band = { 0 };
+
+	LL_TRACE_BEGIN_ARG("paint_codes", "layer", i);
+
+	band.map	= map;
+	band.i		= i;
+	band.dest	= buf;
+	band.x		= x;
+	band.y		= y;
+	band.w		= w;
+
+	map_rows_for(map, h, w, paint_codes_band, &band);
+
+	LL_STATS_ADD(LL_COUNT_PIXELS_WRITTEN, (gint64) w * h);
+	LL_TRACE_END("paint_codes");
+}
+
+//TRUE if pixel x, y is in the image and of the region tagged tag
+static gboolean outline_inside(LL_MAP *map, gint x, gint y, guint32 tag)
+{
+	if(x < 0 || y < 0 || x >= map->width || y >= map->height)
+		return FALSE;
+
+	return tag_get(map, ll_map_tag_row(map, y), x) == tag;
+}
+
+//Traces the outer contour of region l along the edges of its pixels, from the top left corner
+//of its first pixel (see labels_done) with the region on the right : clockwise in the image space
+//The corners of the contour are appended to points (LL_POINT, unless points is NULL)
+//and rect is set to their bounding rectangle, which is that of the region
+//The cost is the length of the contour : the holes of the region are not traced
+//(the pixels at a diagonal are apart, as the regions are 4 connected)
+static gboolean outline_trace(LL_MAP *map, gint l, GArray *points, LL_RECT *rect)
+{
+ static const LL_OFS	step[4]   = {{1,0},{0,1},{-1,0},{0,-1}};		//east, south, west, north
+ static const LL_OFS	corner[4] = {{0,-1},{0,0},{-1,0},{-1,-1}};	//pixel ahead on the left of each
+ LL_POINT	p;
+ guint32	tag;
+ gint		sx, sy, x, y, d, turn;
+ gint		min_x, min_y, max_x, max_y;
+
+	if(l < 0 || l >= map->num_regions || map->seeds == NULL || map->seeds[l] == G_MAXSIZE)
+	{
+		rect->x = rect->y = rect->w = rect->h = 0;
+		return FALSE;
+	}
+
+	tag = l + 1;
+	sx = (gint) (map->seeds[l] % map->width);
+	sy = (gint) (map->seeds[l] / map->width);
+
+	p.x = sx;
+	p.y = sy;
+
+	if(points != NULL)
+		g_array_append_val(points, p);
+
+	//the first edge : the top of the first pixel, heading east
+	x = sx + 1;
+	y = sy;
+	d = 0;
+
+	min_x = sx;
+	min_y = sy;
+	max_x = x;
+	max_y = y;
+
+	//the contour comes back to its first corner heading north, along the left of the first pixel
+	while(x != sx || y != sy)
+	{
+		//turn right if the pixel ahead on the right is out of the region, else go on if the one on the left is,
+		//else turn left (the pixel ahead on the right of heading d is the one on the left of heading d + 1)
+		if(!outline_inside(map, x + corner[(d + 1) & 3].x, y + corner[(d + 1) & 3].y, tag))
+			turn = 1;
+		else if(!outline_inside(map, x + corner[d].x, y + corner[d].y, tag))
+			turn = 0;
+		else
+			turn = 3;
+
+		if(turn != 0 && points != NULL)
+		{
+			p.x = x;
+			p.y = y;
+			g_array_append_val(points, p);
+		}
+
+		d = (d + turn) & 3;
+		x += step[d].x;
+		y += step[d].y;
+
+		min_x = MIN(min_x, x);
+		max_x = MAX(max_x, x);
+		min_y = MIN(min_y, y);
+		max_y = MAX(max_y, y);
+	}
+
+	rect->x = min_x;
+	rect->y = min_y;
+	rect->w = max_x - min_x;
+	rect->h = max_y - min_y;
+
+	return TRUE;
+}
+
+//Calculates the bounding rectangle x, y, w, h of region l, that of its boundary pixels,
+//by tracing its outer contour (see outline_trace)
+//Returns FALSE if the region has no pixels
+gboolean ll_map_boundary_rect(LL_MAP *map, gint l, gint *x, gint *y, gint *w, gint *h)
+{
+ LL_RECT	rect;
+ gboolean	found;
+
+	found = outline_trace(map, l, NULL, &rect);
+
+	*x = rect.x;
+	*y = rect.y;
+	*w = rect.w;
+	*h = rect.h;
+
+	return found;
+}
+
+//Appends the corners of the outer contour of region l to points (LL_POINT), clockwise,
+//in the image space where pixel x, y spans the corners x, y to x + 1, y + 1 :
+//the exact outline of the region, its holes filled
+//Returns FALSE (with nothing appended) if the region has no pixels
+gboolean ll_map_region_outline(LL_MAP *map, gint l, GArray *points)
+{
+ LL_RECT	rect;
+
+	return outline_trace(map, l, points, &rect);
+}
+
+//Arguments of ll_map_boundary_rects on the pool
+typedef struct ll_rects
+{
+	LL_MAP		*map;
+	const gint	*regions;
+	LL_RECT		*rects;
+}LL_RECTS;
+
+//Boundary rectangles of the regions regions[first] to regions[last - 1]
+static void boundary_rects_range(gint first, gint last, gpointer data)
+{
+ LL_RECTS	*r = data;
+ LL_RECT	*rect;
+ gint		k;
+
+	for(k = first; k < last; k++)
+	{
+		rect = &r->rects[r->regions[k]];
+		ll_map_boundary_rect(r->map, r->regions[k], &rect->x, &rect->y, &rect->w, &rect->h);
+	}
+}
+
+//Calculates the boundary rectangle (see ll_map_boundary_rect) of every region set in regions into rects
+//(num_regions of each) ; the regions are done in parallel on the pool for a map in memory
+void ll_map_boundary_rects(LL_MAP *map, const gboolean *regions, LL_RECT *rects)
+{
+ LL_RECTS	r;
+ gint		*todo;
+ gint		i, n = 0;
+
+	LL_TRACE_BEGIN("boundary_rects");
+
+	todo = g_new(gint, MAX(map->num_regions, 1));
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		if(regions[i])
+			todo[n++] = i;
+	}
+
+	r.map = map;
+	r.regions = todo;
+	r.rects = rects;
+
+	if(map->tag_tiles != NULL)
+		boundary_rects_range(0, n, &r);
+	else
+		ll_pool_for(0, n, 1, boundary_rects_range, &r);
+
+	g_free(todo);
+
+	LL_TRACE_END("boundary_rects");
+}
+
+//Returns the data stored in the TAGS parasite, ie. the tags of all the pixels in the image space
+//at the width of the tags of the map (so the size tells the width back)
+//size is set to the number of bytes ; the data is to be freed with g_free
+gpointer ll_map_tags_pack(LL_MAP *map, gsize *size)
+{
+ guchar	*data;
+ gsize	row_bytes;
+ gint	y;
+
+	row_bytes = (gsize) map->width * map->tag_bytes;
+	*size = row_bytes * map->height;
+	data = g_malloc(*size);
+
+	for(y = 0; y < map->height; y++)
+		memcpy(data + y * row_bytes, ll_map_tag_row(map, y), row_bytes);
+
+	return data;
+}
+
+//Tag of pixel x of a row of tags of bytes bytes each
+static guint32 tag_read(gconstpointer row, gsize bytes, gint x)
+{
+	switch(bytes)
+	{
+		case 1:  return ((const guint8 *) row)[x];
+		case 2:  return ((const guint16 *) row)[x];
+		default: return ((const guint32 *) row)[x];
+	}
+}
+
+//Checks the data of a TAGS parasite against the tags of the map
+//ie. whether the regions are the same as when the parasite was attached
+//The data holds 1, 2 or 4 bytes per pixel : the width of the tags of the map if the regions are the same,
+//or 32 bits per pixel for the parasites attached before the tags were narrowed
+//If renumber is not NULL the regions may also have been numbered otherwise (in the order of the region
+//growing, before both the labellings numbered them in the order of their first pixel) : *renumber is then
+//set to the region of the map of every region of the parasite (to be freed with g_free),
+//or to NULL if the numbers are the same
+gboolean ll_map_tags_unchanged(LL_MAP *map, gconstpointer data, gsize size, gint **renumber)
+{
+ gconstpointer	old, row;
+ gint		*to_map, *from_map;
+ gsize		num, bytes, row_bytes;
+ gboolean	same = TRUE;
+ guint32	t;
+ gint		y, x, k;
+
+	if(renumber != NULL)
+		*renumber = NULL;
+
+	num = ll_pixels(map->width, map->height);
+
+	if(data == NULL || map->tag_bytes == 0 || num == 0 || size % num != 0)
+		return FALSE;
+
+	bytes = size / num;
+	row_bytes = (gsize) map->width * bytes;
+
+	if(bytes != 1 && bytes != 2 && bytes != 4)
+		return FALSE;
+
+	if(bytes == (gsize) map->tag_bytes)
+	{
+		for(y = 0; y < map->height && same; y++)
+			same = memcmp((const guchar *) data + y * row_bytes, ll_map_tag_row(map, y), row_bytes) == 0;
+
+		if(same || renumber == NULL)
+			return same;
+	}
+
+	//the regions of the parasite and of the map must map one to one onto each other
+	to_map = g_new0(gint, map->num_regions + 1);
+	from_map = g_new0(gint, MAX(map->num_regions, 1));
+	same = TRUE;
+
+	for(y = 0; y < map->height && same; y++)
+	{
+		old = (const guchar *) data + y * row_bytes;
+		row = ll_map_tag_row(map, y);
+
+		for(x = 0; x < map->width && same; x++)
+		{
+			t = tag_read(old, bytes, x);
+			k = (gint) tag_get(map, row, x);
+
+			if(t == 0 || t > (guint32) map->num_regions)
+			{
+				same = FALSE;
+				break;
+			}
+
+			if(to_map[t] == 0)
+				to_map[t] = k;
+			if(from_map[k - 1] == 0)
+				from_map[k - 1] = t;
+
+			same = (to_map[t] == k && from_map[k - 1] == (gint) t);
+		}
+	}
+
+	g_free(from_map);
+
+	for(k = 1; k <= map->num_regions && same && to_map[k] == k; k++);
+
+	if(!same || k > map->num_regions)
+	{
+		g_free(to_map);
+		return same;
+	}
+
+	if(renumber == NULL)
+	{
+		g_free(to_map);
+		return FALSE;
+	}
+
+	//region of the map of every region of the parasite
+	for(k = 0; k < map->num_regions; k++)
+		to_map[k] = to_map[k + 1] - 1;
+
+	*renumber = to_map;
+
+	return TRUE;
+}
+
+//Allocates the retrieval lists with -1 for the layers absent from a region and 0 for those present
+//and the bitsets of the pairs of the layers present in each region
+static void retrieval_init(LL_RETRIEVAL *r, LL_MAP *map)
+{
+ gsize	total;
+ gint	i, j, c;
+
+	r->map		= map;
+	r->arena	= ll_arena_new(LL_ARENA_CHUNK, LL_MEM_SCRATCH);
+
+	r->lists	= LL_ARENA_NEW(r->arena, gint *, map->num_regions);
+	r->layers	= LL_ARENA_NEW(r->arena, gint *, map->num_regions);
+	r->pos		= LL_ARENA_NEW(r->arena, gint *, map->num_regions);
+	r->count_layers	= LL_ARENA_NEW0(r->arena, gint, map->num_regions);
+	r->known_start	= LL_ARENA_NEW(r->arena, gsize, map->num_regions);
+
+	total = 0;
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		r->lists[i] = LL_ARENA_NEW(r->arena, gint, map->layer_num);
+		r->pos[i]   = LL_ARENA_NEW(r->arena, gint, map->layer_num);
+
+		for(j = 0; j < map->layer_num; j++)
+		{
+			r->pos[i][j] = r->count_layers[i];
+
+			if(map->graph->lists[i][j] != 0)
+			{
+				r->lists[i][j] = 0;
+				r->count_layers[i]++;
+			}
+			else
+				r->lists[i][j] = -1;
+		}
+
+		c = r->count_layers[i];
+		r->layers[i] = LL_ARENA_NEW(r->arena, gint, MAX(c, 1));
+
+		for(j = 0; j < map->layer_num; j++)
+		{
+			if(r->lists[i][j] == 0)
+				r->layers[i][r->pos[i][j]] = j;
+		}
+
+		r->known_start[i] = total;
+		total += ((gsize) c * c + 31) / 32;
+	}
+
+	r->known = LL_ARENA_NEW0(r->arena, guint32, MAX(total, 1));
+	r->seeds = NULL;
+	r->seed_start = NULL;
+	r->keys = g_array_new(FALSE, FALSE, sizeof(gint));
+}
+
+//Frees the retrieval working data
+static void retrieval_free(LL_RETRIEVAL *r)
+{
+	ll_arena_free(r->arena);
+	g_array_free(r->keys, TRUE);
+}
+
+//Arguments of retrieve_top on the pool
+//first[k] holds 1 + the index of the first pixel of region k where a mask is white (0 while none is found)
+typedef struct ll_top_band
+{
+	LL_MAP		*map;
+	const LL_PLANE	*masks;
+	gpointer	*first;
+}LL_TOP_BAND;
+
+//TRUE if the mask value of plane p at m, n (in the image space) is white
+static gboolean plane_shows(const LL_PLANE *p, gint m, gint n)
+{
+	if(p->buf == NULL || m < p->y || n < p->x || m >= p->y + p->h || n >= p->x + p->w)
+		return FALSE;
+
+	return p->buf[(gsize) (m - p->y) * p->w + (n - p->x)] == LL_MASK_SHOW;
+}
+
+//Finds the first pixel of every region where a mask is white in the rows first to last - 1
+//keeping the earliest of the pixels found by all the bands
+static void retrieve_top_band(gint first, gint last, gpointer data)
+{
+ LL_TOP_BAND	*t = data;
+ LL_MAP		*map = t->map;
+ gpointer	row;
+ gsize		pos, old;
+ gint		m, n, i, k;
+
+	for(m = first; m < last; m++)
+	{
+		row = ll_map_tag_row(map, m);
+
+		for(n = 0; n < map->width; n++)
+		{
+			k = (gint) tag_get(map, row, n) - 1;
+			pos = (gsize) m * map->width + n + 1;
+			old = GPOINTER_TO_SIZE(g_atomic_pointer_get(&t->first[k]));
+
+			if(old != 0 && old < pos)
+				continue;
+
+			for(i = 0; i < map->layer_num && !plane_shows(&t->masks[i], m, n); i++);
+
+			if(i == map->layer_num)
+				continue;
+
+			while((old == 0 || pos < old) &&
+			      !g_atomic_pointer_compare_and_exchange(&t->first[k], GSIZE_TO_POINTER(old), GSIZE_TO_POINTER(pos)))
+				old = GPOINTER_TO_SIZE(g_atomic_pointer_get(&t->first[k]));
+		}
+	}
+}
+
+//Finds the top most layer of every region from the masks
+//ie. the layers with a white (fully opaque) mask value at the first pixel of the region
+//where any of the masks is white
+//The rows are searched in bands on the pool
+static void retrieve_top(LL_RETRIEVAL *r, LL_MAP *map, const LL_PLANE *masks)
+{
+ LL_TOP_BAND	t;
+ gsize		pos;
+ gint		m, n, i, k;
+
+	t.map = map;
+	t.masks = masks;
+	t.first = g_new0(gpointer, MAX(map->num_regions, 1));
+
+	map_rows_for(map, map->height, map->width, retrieve_top_band, &t);
+
+	for(k = 0; k < map->num_regions; k++)
+	{
+		pos = GPOINTER_TO_SIZE(t.first[k]);
+
+		if(pos == 0)
+			continue;
+
+		m = (pos - 1) / map->width;
+		n = (pos - 1) % map->width;
+
+		for(i = 0; i < map->layer_num; i++)
+		{
+			if(plane_shows(&masks[i], m, n))
+				r->lists[k][i] = 1;
+		}
+	}
+
+	g_free(t.first);
+}
+
+//Checks whether the pair {higher, lower} is known for region l
+static gboolean pair_known(LL_RETRIEVAL *r, gint l, gint higher, gint lower)
+{
+ gsize	b = (gsize) r->pos[l][higher] * r->count_layers[l] + r->pos[l][lower];
+
+	return (r->known[r->known_start[l] + b / 32] >> (b % 32)) & 1;
+}
+
+//Sets the pair {higher, lower} of region l as known
+//Returns FALSE if it was known already
+//The pairs of a region share words, and the pairs of different layers are propagated in parallel :
+//the bit is set with an atomic compare and exchange
+static gboolean pair_set(LL_RETRIEVAL *r, gint l, gint higher, gint lower)
+{
+ volatile gint	*word;
+ gsize		b;
+ gint		old, bit;
+
+	b    = (gsize) r->pos[l][higher] * r->count_layers[l] + r->pos[l][lower];
+	word = (volatile gint *) (r->known + r->known_start[l] + b / 32);
+	bit  = (gint) (1u << (b % 32));
+
+	do
+	{
+		old = g_atomic_int_get(word);
+
+		if(old & bit)
+			return FALSE;
+	}
+	while(!g_atomic_int_compare_and_exchange(word, old, old | bit));
+
+	return TRUE;
+}
+
+//Seeds the pairs with the top most layer of every region over each of the other layers present
+//The seeds are grouped by pair of layers (see LL_RETRIEVAL) for pairs_propagate
+static void pairs_fill(LL_RETRIEVAL *r, LL_MAP *map)
+{
+ gint	*top, *fill;
+ gint	i, j, l, key, keys;
+
+	keys = map->layer_num * map->layer_num;
+	top  = g_new(gint, MAX(map->num_regions, 1));
+	r->seed_start = LL_ARENA_NEW0(r->arena, gint, keys + 1);
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		top[i] = -1;
+
+		for(j = 0; j < r->count_layers[i] && r->count_layers[i] >= 2; j++)
+		{
+			if(r->lists[i][r->layers[i][j]] == 1)
+				top[i] = r->layers[i][j];
+		}
+
+		for(j = 0; j < r->count_layers[i] && top[i] != -1; j++)
+		{
+			l = r->layers[i][j];
+
+			if(r->lists[i][l] == 0)
+				r->seed_start[MIN(l, top[i]) * map->layer_num + MAX(l, top[i]) + 1]++;
+		}
+	}
+
+	for(key = 0; key < keys; key++)
+	{
+		if(r->seed_start[key + 1] > 0)
+			g_array_append_val(r->keys, key);
+
+		r->seed_start[key + 1] += r->seed_start[key];
+	}
+
+	r->seeds = LL_ARENA_NEW(r->arena, gint, 2 * MAX(r->seed_start[keys], 1));
+	fill = g_new0(gint, keys);
+
+	for(i = 0; i < map->num_regions; i++)
+	{
+		for(j = 0; j < r->count_layers[i] && top[i] != -1; j++)
+		{
+			l = r->layers[i][j];
+
+			if(r->lists[i][l] != 0)
+				continue;
+
+			pair_set(r, i, top[i], l);
+
+			key = MIN(l, top[i]) * map->layer_num + MAX(l, top[i]);
+			r->seeds[2 * (r->seed_start[key] + fill[key])]     = i;
+			r->seeds[2 * (r->seed_start[key] + fill[key]) + 1] = top[i];
+			fill[key]++;
+		}
+	}
+
+	g_free(fill);
+	g_free(top);
+}
+
+//Propagates the known pairs of the pairs of layers keys[first] to keys[last - 1] to the adjacent regions
+//where both the layers are present, from their seeds
+//Each pair of layers spreads through the regions holding both alone, so the pairs of layers run in parallel
+static void pairs_propagate_band(gint first, gint last, gpointer data)
+{
+ LL_RETRIEVAL	*r = data;
+ LL_MAP		*map = r->map;
+ GArray		*queue;
+ gint		*n;
+ gint		k, key, a, b, i, e, reg, higher, lower, next[2];
+ guint		front;
+
+	queue = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	for(k = first; k < last; k++)
+	{
+		key = g_array_index(r->keys, gint, k);
+		a = key / map->layer_num;
+		b = key % map->layer_num;
+
+		g_array_set_size(queue, 0);
+		g_array_append_vals(queue, r->seeds + 2 * r->seed_start[key], 2 * (r->seed_start[key + 1] - r->seed_start[key]));
+
+		for(front = 0; front < queue->len; front += 2)
+		{
+			n = &g_array_index(queue, gint, front);
+			reg    = n[0];
+			higher = n[1];
+			lower  = (higher == a) ? b : a;
+
+			for(e = map->graph->edge_start[reg]; e < map->graph->edge_start[reg + 1]; e++)
+			{
+				i = map->graph->edges[e];
+
+				if(r->lists[i][a] == -1 || r->lists[i][b] == -1)
+					continue;
+
+				if(!pair_set(r, i, higher, lower))
+					continue;
+
+				next[0] = i;
+				next[1] = higher;
+				g_array_append_vals(queue, next, 2);
+			}
+		}
+	}
+
+	g_array_free(queue, TRUE);
+}
+
+//Propagates the known pairs to the adjacent regions where both the layers are present
+//ie. every pair of layers through the connected pieces of the regions holding both, on the pool
+static void pairs_propagate(LL_RETRIEVAL *r)
+{
+	ll_pool_for(0, r->keys->len, 1, pairs_propagate_band, r);
+}
+
+//TRUE if layer j is above layer k in region l, in the order lg_retrieval_mask completed the pairs :
+//in a region of two layers the top most layer read from the masks is above the other, otherwise
+//a known pair decides, the one with the lower index first if both orders were propagated to the region,
+//and the lower index is above when neither is known
+static gboolean pair_above(LL_RETRIEVAL *r, gint l, gint j, gint k)
+{
+	if(r->count_layers[l] == 2 && (r->lists[l][j] == 1 || r->lists[l][k] == 1))
+		return r->lists[l][j] == 1;
+
+	if(j > k)
+		return !pair_above(r, l, k, j);
+
+	return pair_known(r, l, j, k) || !pair_known(r, l, k, j);
+}
+
+//Ranks the layers of the regions first to last - 1 from their pairs and stores the ranks in the ListGraph Lists
+//A layer is ranked below every layer above it, the layers absent from a region are left unranked
+static void retrieval_rank_band(gint first, gint last, gpointer data)
+{
+ LL_RETRIEVAL	*r = data;
+ LL_MAP		*map = r->map;
+ gint		i, j, k, c;
+
+	for(i = first; i < last; i++)
+	{
+		memset(map->graph->lists[i], 0, map->layer_num * sizeof(gint));
+
+		for(j = 0; j < r->count_layers[i]; j++)
+		{
+			//c : number of layers of the region below layer j
+			c = 0;
+			for(k = 0; k < r->count_layers[i]; k++)
+			{
+				if(k != j && pair_above(r, i, r->layers[i][j], r->layers[i][k]))
+					c++;
+			}
+
+			map->graph->lists[i][r->layers[i][j]] = r->count_layers[i] - c;
+		}
+	}
+}
+
+//Ranks the layers of every region, the regions in parallel on the pool
+static void retrieval_rank(LL_RETRIEVAL *r, LL_MAP *map)
+{
+	ll_pool_for(0, map->num_regions, LL_RANK_REGIONS, retrieval_rank_band, r);
+}
+
+//Retrieves the ListGraph Lists of a previous session of Local Layering from the layer masks it painted
+//masks[i] holds the mask of layer i in the image space (buf is NULL for a layer without a mask)
+//The top most layer of every region is read from the masks and the orderings known between pairs of layers
+//are propagated through the ListGraph Edges to rank the remaining layers
+void ll_map_retrieve(LL_MAP *map, const LL_PLANE *masks)
+{
+ LL_RETRIEVAL	r;
+
+	LL_TRACE_BEGIN("retrieve");
+
+	retrieval_init(&r, map);
+
+	retrieve_top(&r, map, masks);
+
+	pairs_fill(&r, map);
+
+	pairs_propagate(&r);
+
+	retrieval_rank(&r, map);
+
+	retrieval_free(&r);
+
+	LL_TRACE_END("retrieve");
+}
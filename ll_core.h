@@ -0,0 +1,268 @@
+/*
+ * Local Layering core : the region map, List Graph and flips
+ * independent of GIMP, shared by the plug-in and the locallayer tool
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_CORE_H__
+#define __LL_CORE_H__
+
+#include <glib.h>
+
+#include "ll_arena.h"
+#include "ll_tiles.h"
+
+// Connectivity used in the region growing (ll_map_extract_tags)
+#define CONNECTIVITY		4
+
+// Bytes per pixel ll_pixels keeps addressable for the buffers of an image
+// (an RGBA layer copy and the 32 bit tags of the region growing take 4)
+#define LL_PIXEL_BYTES		8
+
+// Environment variable holding the memory (in MB) the per pixel maps of a Region Map may use
+// A larger map is paged from a temporary file in tiles (see ll_map_set_memory)
+#define LL_MEMORY_ENV		"LL_MEMORY"
+
+// Bytes per pixel of a Region Map while it is labelled (layer codes, 32 bit tags and the tags kept)
+#define LL_MAP_PIXEL_BYTES	12
+
+// Mask values painted for the top most layer of a region
+// and for all the layers beneath it
+#define LL_MASK_SHOW		255
+#define LL_MASK_HIDE		0
+
+//Data structure for the List Graph
+//Holds the details of the local stacking of layers at all regions
+//as well as the connected regions to maintain consistency
+//The edges are kept as adjacency lists : the regions adjacent to region i are
+//edges[edge_start[i]] ... edges[edge_start[i + 1] - 1], in increasing order
+//The graph, its rows and their pointers live in arena (rows are contiguous)
+typedef struct list_graph
+{
+	gint ** lists;
+	gint * edge_start;
+	gint * edges;
+	LL_ARENA *arena;
+}LIST_GRAPH;
+
+//Holds the Region Map of an image
+//ie. the layer code and tag of every pixel in the image space,
+//the List Graph and the regions affected by the last flips
+//A layer code indexes code_sets, which holds the set of layers present
+//as code_words words of bits per code (so any number of layers is supported)
+//code_index (open addressing, code_index_size a power of 2) finds the code of a set,
+//so that a set has a single code even if its layers were added strip by strip
+//A tag is the region + 1 ; tags holds them as tag_bytes (1, 2 or 4) bytes per pixel,
+//the smallest width num_regions fits in (tag_bytes is 0 before ll_map_extract_tags)
+//A map too large for the memory given to it keeps the layer codes and the tags in code_tiles
+//and tag_tiles (layer_code and tags are then NULL) : ll_map_code_row and ll_map_tag_row
+//return a row in either case
+//Such a map may be labelled row by row as its layer codes are completed (ll_map_label_rows) :
+//labels holds that first pass until ll_map_extract_tags ends it
+//The regions are numbered in the order of their first pixel in row order, however the map is labelled
+//seeds holds that first pixel (y * width + x) of every region, where its contour is traced from
+//cancel is set (ll_map_cancel) from another thread to have the labelling of the map stop early
+typedef struct ll_labels	LL_LABELS;
+
+typedef struct ll_map
+{
+	gint		width;
+	gint		height;
+	gint		layer_num;
+	guint32		*layer_code;
+	guint32		*code_sets;
+	gint		code_words;
+	gint		num_codes;
+	guint32		*code_index;
+	gsize		code_index_size;
+	gpointer	tags;
+	gint		tag_bytes;
+	LL_TILES	*code_tiles;
+	LL_TILES	*tag_tiles;
+	LL_LABELS	*labels;
+	gint		num_regions;
+	LIST_GRAPH	*graph;
+	gboolean	*reg_affected;
+	gsize		*seeds;
+	volatile gint	cancel;
+}LL_MAP;
+
+//TRUE if layer l is in the set of layers of the layer code
+#define LL_CODE_HAS(map, code, l) \
+	(((map)->code_sets[(code) * (map)->code_words + ((l) >> 5)] >> ((l) & 31)) & 1)
+
+//Holds a plane of 8 bit pixels (eg. a layer mask) placed at x, y in the image space
+typedef struct ll_plane
+{
+	guchar		*buf;
+	gint		x;
+	gint		y;
+	gint		w;
+	gint		h;
+}LL_PLANE;
+
+//Holds a rectangle of the image space (w and h are 0 for an empty one)
+typedef struct ll_rect
+{
+	gint		x;
+	gint		y;
+	gint		w;
+	gint		h;
+}LL_RECT;
+
+//Holds a point of the image space (eg. a corner of a pixel)
+typedef struct ll_point
+{
+	gint		x;
+	gint		y;
+}LL_POINT;
+
+//Called for every recursive flip made to keep the adjacent regions consistent
+//i1, i2 and l are the arguments of the recursive flip_up / flip_down call
+typedef void (*LL_FLIP_FUNC) (gint i1, gint i2, gint l, gpointer data);
+
+gsize		ll_pixels		(gint		width,
+					 gint		height);
+
+void		ll_map_set_memory	(gsize		bytes);
+
+LL_MAP *	ll_map_new		(gint		width,
+					 gint		height,
+					 gint		layer_num);
+
+void		ll_map_free		(LL_MAP		*map);
+
+LL_MAP *	ll_map_coarse		(LL_MAP		*map,
+					 gint		 factor);
+
+gint *		ll_map_carry_lists	(LL_MAP		*map,
+					 LL_MAP		*coarse,
+					 gint		 factor);
+
+guint32 *	ll_map_code_row		(LL_MAP		*map,
+					 gint		 y);
+
+gpointer	ll_map_tag_row		(LL_MAP		*map,
+					 gint		 y);
+
+void		ll_map_add_layer	(LL_MAP		*map,
+					 gint		 l,
+					 const guchar	*buf,
+					 gint		 bpp,
+					 gboolean	 alpha,
+					 gint		 x,
+					 gint		 y,
+					 gint		 w,
+					 gint		 h);
+
+void		ll_map_label_rows	(LL_MAP		*map,
+					 gint		 rows);
+
+gboolean	ll_map_extract_tags	(LL_MAP		*map);
+
+void		ll_map_cancel		(LL_MAP		*map);
+
+gint		ll_map_region_at	(LL_MAP		*map,
+					 gint		 x,
+					 gint		 y);
+
+void		ll_map_region_row	(LL_MAP		*map,
+					 gint		 y,
+					 gint		 x,
+					 gint		 w,
+					 gint		*regions);
+
+gint		ll_map_layer_above	(LL_MAP		*map,
+					 gint		 l,
+					 gint		 i);
+
+gint		ll_map_layer_below	(LL_MAP		*map,
+					 gint		 l,
+					 gint		 i);
+
+void		ll_map_flip_up		(LL_MAP		*map,
+					 gint		 i1,
+					 gint		 i2,
+					 gint		 l,
+					 gboolean	 propagate,
+					 LL_FLIP_FUNC	 record,
+					 gpointer	 data);
+
+void		ll_map_flip_down	(LL_MAP		*map,
+					 gint		 i1,
+					 gint		 i2,
+					 gint		 l,
+					 gboolean	 propagate,
+					 LL_FLIP_FUNC	 record,
+					 gpointer	 data);
+
+void		ll_map_undo_flips	(LL_MAP		*map,
+					 gint		 call_type,
+					 gint		 (*flips)[3],
+					 gint		 call_count);
+
+void		ll_map_set_affected	(LL_MAP		*map,
+					 gboolean	 affected);
+
+gint *		ll_map_top_layers	(LL_MAP		*map);
+
+void		ll_map_paint_mask	(LL_MAP		*map,
+					 const gint	*top,
+					 gint		 i,
+					 guchar		*buf,
+					 gint		 x,
+					 gint		 y,
+					 gint		 w,
+					 gint		 h);
+
+void		ll_map_paint_codes	(LL_MAP		*map,
+					 gint		 i,
+					 guchar		*buf,
+					 gint		 x,
+					 gint		 y,
+					 gint		 w,
+					 gint		 h);
+
+gboolean	ll_map_boundary_rect	(LL_MAP		*map,
+					 gint		 l,
+					 gint		*x,
+					 gint		*y,
+					 gint		*w,
+					 gint		*h);
+
+gboolean	ll_map_region_outline	(LL_MAP		*map,
+					 gint		 l,
+					 GArray		*points);
+
+void		ll_map_boundary_rects	(LL_MAP		*map,
+					 const gboolean	*regions,
+					 LL_RECT	*rects);
+
+gpointer	ll_map_tags_pack	(LL_MAP		*map,
+					 gsize		*size);
+
+gboolean	ll_map_tags_unchanged	(LL_MAP		*map,
+					 gconstpointer	 data,
+					 gsize		 size,
+					 gint		**renumber);
+
+void		ll_map_retrieve		(LL_MAP		*map,
+					 const LL_PLANE	*masks);
+
+#endif /* __LL_CORE_H__ */
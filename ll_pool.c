@@ -0,0 +1,425 @@
+/*
+ * Local Layering pool : work stealing threads for the parallel stages
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * One pool of threads runs the parallel stages of the plug-in and of the tools.
+ * It has ll_pool_threads() - 1 workers, the thread waiting for a group making up the last one.
+ *
+ * Every worker has a deque of tasks : it pushes the tasks it forks at the back
+ * and takes its next task from the back, while an idle worker steals from the
+ * front of the others. Threads outside the pool share deque 0.
+ * A task covering a range larger than its grain splits itself in halves, so
+ * a parallel for starts as one task and spreads over the workers as they steal.
+ * A thread joining a group runs tasks (of any group) until the group is done,
+ * so groups may be forked and joined from within a task.
+ * A long task (ll_pool_fork_long, eg. a labelling of seconds) goes to a queue of its own
+ * which only idle workers take, so that a thread joining a short group is never held by it.
+ *
+ * The pool starts with the first group, sized from LL_THREADS or else the number
+ * of processors ; with one thread the tasks are run by the joining thread.
+ */
+
+#include <stdlib.h>
+
+#include "ll_pool.h"
+#include "ll_trace.h"
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+//A range of a parallel for, or a forked task
+typedef struct ll_pool_task
+{
+	LL_POOL_FUNC	func;
+	gpointer	data;
+	gint		first;
+	gint		last;
+	gint		grain;
+	LL_POOL_GROUP	*group;
+}LL_POOL_TASK;
+
+//Tasks of a worker (of the threads outside the pool for deque 0)
+typedef struct ll_pool_deque
+{
+	GMutex		*mutex;
+	GQueue		tasks;
+}LL_POOL_DEQUE;
+
+static GStaticMutex	pool_mutex = G_STATIC_MUTEX_INIT;	//guards the start and stop of the pool and the sleeps
+static GStaticPrivate	pool_self = G_STATIC_PRIVATE_INIT;	//deque + 1 of a worker
+static GCond		*pool_cond;		//broadcast when tasks are pushed and when a group is done
+static gint		pool_size;		//threads of the pool (0 until it starts)
+static LL_POOL_DEQUE	*pool_deques;
+static GThread		**pool_workers;
+static volatile gint	pool_queued;		//tasks in the deques
+static LL_POOL_DEQUE	pool_long;		//long tasks, taken by the workers only
+static volatile gint	pool_long_queued;	//tasks in pool_long
+static gboolean		pool_quit;
+
+//Number of processors, or 1 if it is not known
+static gint pool_processors(void)
+{
+ glong		n = 0;
+
+#if defined(G_OS_UNIX) && defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	if(g_getenv("NUMBER_OF_PROCESSORS") != NULL)
+		n = atol(g_getenv("NUMBER_OF_PROCESSORS"));
+#endif
+
+	return (n > 0) ? (gint) n : 1;
+}
+
+//Deque of the calling thread
+static gint pool_self_get(void)
+{
+ gint	self = GPOINTER_TO_INT(g_static_private_get(&pool_self));
+
+	return (self > 0) ? self - 1 : 0;
+}
+
+//Pushes a task at the back of deque self and wakes the idle workers
+static void pool_push(gint self, LL_POOL_GROUP *group, gint first, gint last, gint grain, LL_POOL_FUNC func, gpointer data)
+{
+ LL_POOL_TASK	*task;
+
+	task = g_slice_new(LL_POOL_TASK);
+	task->func  = func;
+	task->data  = data;
+	task->first = first;
+	task->last  = last;
+	task->grain = grain;
+	task->group = group;
+
+	g_atomic_int_inc(&group->pending);
+
+	g_mutex_lock(pool_deques[self].mutex);
+	g_queue_push_tail(&pool_deques[self].tasks, task);
+	g_mutex_unlock(pool_deques[self].mutex);
+
+	g_atomic_int_inc(&pool_queued);
+
+	g_static_mutex_lock(&pool_mutex);
+	g_cond_broadcast(pool_cond);
+	g_static_mutex_unlock(&pool_mutex);
+}
+
+//Takes the next task of thread self : the last one it pushed,
+//else the first one of another deque (NULL if all of them are empty)
+static LL_POOL_TASK * pool_take(gint self)
+{
+ LL_POOL_TASK	*task = NULL;
+ LL_POOL_DEQUE	*deque;
+ gint		k;
+
+	if(g_atomic_int_get(&pool_queued) == 0)
+		return NULL;
+
+	for(k = 0; k < pool_size && task == NULL; k++)
+	{
+		deque = &pool_deques[(self + k) % pool_size];
+
+		g_mutex_lock(deque->mutex);
+		task = (k == 0) ? g_queue_pop_tail(&deque->tasks) : g_queue_pop_head(&deque->tasks);
+		g_mutex_unlock(deque->mutex);
+	}
+
+	if(task != NULL)
+		g_atomic_int_add(&pool_queued, -1);
+
+	return task;
+}
+
+//Runs a task on thread self, pushing the upper halves of its range while it is larger than the grain
+static void pool_run(gint self, LL_POOL_TASK *task)
+{
+ LL_POOL_GROUP	*group = task->group;
+ gint		mid;
+
+	while(task->last - task->first > task->grain)
+	{
+		mid = task->first + (task->last - task->first) / 2;
+		pool_push(self, group, mid, task->last, task->grain, task->func, task->data);
+		task->last = mid;
+	}
+
+	task->func(task->first, task->last, task->data);
+	g_slice_free(LL_POOL_TASK, task);
+
+	//the group may be gone once it is done : only the pool is touched from here
+	if(g_atomic_int_dec_and_test(&group->pending))
+	{
+		g_static_mutex_lock(&pool_mutex);
+		g_cond_broadcast(pool_cond);
+		g_static_mutex_unlock(&pool_mutex);
+	}
+}
+
+//Takes the first long task (NULL if there is none)
+static LL_POOL_TASK * pool_take_long(void)
+{
+ LL_POOL_TASK	*task;
+
+	if(g_atomic_int_get(&pool_long_queued) == 0)
+		return NULL;
+
+	g_mutex_lock(pool_long.mutex);
+	task = g_queue_pop_head(&pool_long.tasks);
+	g_mutex_unlock(pool_long.mutex);
+
+	if(task != NULL)
+		g_atomic_int_add(&pool_long_queued, -1);
+
+	return task;
+}
+
+static gpointer pool_worker(gpointer data)
+{
+ LL_POOL_TASK	*task;
+ gint		self = GPOINTER_TO_INT(data);
+ gchar		*name;
+
+	g_static_private_set(&pool_self, GINT_TO_POINTER(self + 1), NULL);
+
+	name = g_strdup_printf("worker %d", self);
+	ll_trace_thread(name);
+	g_free(name);
+
+	for(;;)
+	{
+		task = pool_take(self);
+
+		if(task == NULL)
+			task = pool_take_long();
+
+		if(task != NULL)
+		{
+			pool_run(self, task);
+			continue;
+		}
+
+		g_static_mutex_lock(&pool_mutex);
+		while(!pool_quit && g_atomic_int_get(&pool_queued) == 0 && g_atomic_int_get(&pool_long_queued) == 0)
+			g_cond_wait(pool_cond, g_static_mutex_get_mutex(&pool_mutex));
+
+		if(pool_quit)
+		{
+			g_static_mutex_unlock(&pool_mutex);
+			break;
+		}
+		g_static_mutex_unlock(&pool_mutex);
+	}
+
+	return NULL;
+}
+
+//Starts the pool with threads threads (LL_THREADS or the number of processors if threads is 0)
+//The pool mutex is held
+static void pool_start(gint threads)
+{
+ const gchar	*env;
+ gint		k;
+
+	if(threads <= 0)
+	{
+		env = g_getenv(LL_THREADS_ENV);
+		threads = (env != NULL && atoi(env) > 0) ? atoi(env) : pool_processors();
+	}
+
+	pool_size = CLAMP(threads, 1, LL_POOL_MAX);
+	pool_quit = FALSE;
+	pool_cond = g_cond_new();
+
+	pool_deques = g_new0(LL_POOL_DEQUE, pool_size);
+	for(k = 0; k < pool_size; k++)
+	{
+		pool_deques[k].mutex = g_mutex_new();
+		g_queue_init(&pool_deques[k].tasks);
+	}
+
+	pool_long.mutex = g_mutex_new();
+	g_queue_init(&pool_long.tasks);
+
+	pool_workers = g_new0(GThread *, pool_size);
+	for(k = 1; k < pool_size; k++)
+		pool_workers[k] = g_thread_create(pool_worker, GINT_TO_POINTER(k), TRUE, NULL);
+}
+
+//Stops the workers of the pool, which has no task left
+//The pool mutex is held
+static void pool_stop(void)
+{
+ gint	k;
+
+	pool_quit = TRUE;
+	g_cond_broadcast(pool_cond);
+
+	g_static_mutex_unlock(&pool_mutex);
+	for(k = 1; k < pool_size; k++)
+	{
+		if(pool_workers[k] != NULL)
+			g_thread_join(pool_workers[k]);
+	}
+	g_static_mutex_lock(&pool_mutex);
+
+	for(k = 0; k < pool_size; k++)
+		g_mutex_free(pool_deques[k].mutex);
+
+	g_mutex_free(pool_long.mutex);
+	pool_long.mutex = NULL;
+
+	g_free(pool_deques);
+	g_free(pool_workers);
+	g_cond_free(pool_cond);
+
+	pool_deques = NULL;
+	pool_workers = NULL;
+	pool_cond = NULL;
+	pool_size = 0;
+}
+
+//Returns the number of threads of the pool (starting it)
+gint ll_pool_threads(void)
+{
+ gint	threads;
+
+	//the pool mutex is only a mutex once the threads are initialised
+	if(!g_thread_supported())
+		g_thread_init(NULL);
+
+	g_static_mutex_lock(&pool_mutex);
+
+	if(pool_size == 0)
+		pool_start(0);
+	threads = pool_size;
+
+	g_static_mutex_unlock(&pool_mutex);
+
+	return threads;
+}
+
+//Restarts the pool with threads threads (LL_THREADS or the number of processors if threads is 0)
+//To be called while no group is running (eg. between the runs of a benchmark)
+void ll_pool_set_threads(gint threads)
+{
+	if(!g_thread_supported())
+		g_thread_init(NULL);
+
+	g_static_mutex_lock(&pool_mutex);
+
+	if(pool_size != 0)
+		pool_stop();
+	pool_start(threads);
+
+	g_static_mutex_unlock(&pool_mutex);
+}
+
+//Forks func over the indices first to last - 1 in group, in tasks of grain indices or less
+//(func is called on ranges no larger than grain, which is at least 1)
+void ll_pool_fork(LL_POOL_GROUP *group, gint first, gint last, gint grain, LL_POOL_FUNC func, gpointer data)
+{
+	if(last <= first)
+		return;
+
+	if(ll_pool_threads() == 1)
+		grain = last - first;
+
+	pool_push(pool_self_get(), group, first, last, MAX(grain, 1), func, data);
+}
+
+//Forks func over the single index 0 in group as a long task : a worker runs it
+//while no thread joining a group takes it (see ll_pool_join), which keeps eg. the main thread of a dialog free
+//With a pool of one thread (no worker) it is run by the calling thread at once
+void ll_pool_fork_long(LL_POOL_GROUP *group, LL_POOL_FUNC func, gpointer data)
+{
+ LL_POOL_TASK	*task;
+
+	if(ll_pool_threads() == 1)
+	{
+		func(0, 1, data);
+		return;
+	}
+
+	task = g_slice_new(LL_POOL_TASK);
+	task->func  = func;
+	task->data  = data;
+	task->first = 0;
+	task->last  = 1;
+	task->grain = 1;
+	task->group = group;
+
+	g_atomic_int_inc(&group->pending);
+
+	g_mutex_lock(pool_long.mutex);
+	g_queue_push_tail(&pool_long.tasks, task);
+	g_mutex_unlock(pool_long.mutex);
+
+	g_atomic_int_inc(&pool_long_queued);
+
+	g_static_mutex_lock(&pool_mutex);
+	g_cond_broadcast(pool_cond);
+	g_static_mutex_unlock(&pool_mutex);
+}
+
+//Waits until every task of group is done, running tasks meanwhile (but no long task)
+void ll_pool_join(LL_POOL_GROUP *group)
+{
+ LL_POOL_TASK	*task;
+ gint		self = pool_self_get();
+
+	while(g_atomic_int_get(&group->pending) > 0)
+	{
+		task = pool_take(self);
+
+		if(task != NULL)
+		{
+			pool_run(self, task);
+			continue;
+		}
+
+		g_static_mutex_lock(&pool_mutex);
+		while(g_atomic_int_get(&group->pending) > 0 && g_atomic_int_get(&pool_queued) == 0)
+			g_cond_wait(pool_cond, g_static_mutex_get_mutex(&pool_mutex));
+		g_static_mutex_unlock(&pool_mutex);
+	}
+}
+
+//Parallel for : calls func over the indices first to last - 1 in ranges of grain indices or less
+//and returns when all of them are done
+//A range no larger than grain (or a pool of one thread) is run by the calling thread at once
+void ll_pool_for(gint first, gint last, gint grain, LL_POOL_FUNC func, gpointer data)
+{
+ LL_POOL_GROUP	group = LL_POOL_GROUP_INIT;
+
+	if(last <= first)
+		return;
+
+	if(last - first <= grain || ll_pool_threads() == 1)
+	{
+		func(first, last, data);
+		return;
+	}
+
+	ll_pool_fork(&group, first, last, grain, func, data);
+	ll_pool_join(&group);
+}
@@ -0,0 +1,69 @@
+/*
+ * Local Layering pool : work stealing threads for the parallel stages
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_POOL_H__
+#define __LL_POOL_H__
+
+#include <glib.h>
+
+// Environment variable holding the number of threads of the pool
+// (the calling thread included ; the number of processors when it is not set)
+#define LL_THREADS_ENV		"LL_THREADS"
+
+// Most threads the pool is given
+#define LL_POOL_MAX		64
+
+//Runs the work of the indices first to last - 1
+typedef void (*LL_POOL_FUNC) (gint first, gint last, gpointer data);
+
+//Tasks forked together and joined together
+//pending counts the tasks not done yet (a group starts at LL_POOL_GROUP_INIT)
+typedef struct ll_pool_group
+{
+	volatile gint	pending;
+}LL_POOL_GROUP;
+
+#define LL_POOL_GROUP_INIT	{ 0 }
+
+gint		ll_pool_threads		(void);
+
+void		ll_pool_set_threads	(gint		 threads);
+
+void		ll_pool_fork		(LL_POOL_GROUP	*group,
+					 gint		 first,
+					 gint		 last,
+					 gint		 grain,
+					 LL_POOL_FUNC	 func,
+					 gpointer	 data);
+
+void		ll_pool_fork_long	(LL_POOL_GROUP	*group,
+					 LL_POOL_FUNC	 func,
+					 gpointer	 data);
+
+void		ll_pool_join		(LL_POOL_GROUP	*group);
+
+void		ll_pool_for		(gint		 first,
+					 gint		 last,
+					 gint		 grain,
+					 LL_POOL_FUNC	 func,
+					 gpointer	 data);
+
+#endif /* __LL_POOL_H__ */
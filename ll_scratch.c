@@ -0,0 +1,216 @@
+/*
+ * Local Layering scratch pool : reusable buffers for image sized temporaries
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * The stages of an open or of a flip borrow their image sized temporaries
+ * (region growing queues and tags, mask and layer copies) with ll_scratch_get
+ * and give them back with ll_scratch_put. The buffers stay in the pool, so
+ * repeated flips make no large allocation and touch no fresh pages.
+ * ll_scratch_trim releases the free buffers (at the end of a session).
+ * The pool may be used from any thread.
+ */
+
+#include <string.h>
+
+#include "ll_scratch.h"
+#include "ll_stats.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+#define LL_SCRATCH_MMAP		1
+#endif
+
+//A buffer of the pool
+typedef struct ll_scratch_buf
+{
+	gpointer	data;
+	gsize		size;
+	gboolean	mapped;		//data is a mapping of huge pages (else it was malloc'ed)
+}LL_SCRATCH_BUF;
+
+static GStaticMutex	scratch_mutex = G_STATIC_MUTEX_INIT;
+static GPtrArray	*scratch_free;		//buffers ready to be borrowed
+static GHashTable	*scratch_used;		//borrowed buffers by data
+
+//Rounds size up to pages, or to huge pages for large buffers
+static gsize scratch_round(gsize size)
+{
+	if(size >= LL_SCRATCH_HUGE)
+		return (size + LL_SCRATCH_HUGE - 1) & ~((gsize) LL_SCRATCH_HUGE - 1);
+
+	return (size + 4095) & ~((gsize) 4095);
+}
+
+//Allocates a buffer of size bytes (already rounded by scratch_round)
+static LL_SCRATCH_BUF * scratch_alloc(gsize size)
+{
+ LL_SCRATCH_BUF	*b;
+#ifdef LL_SCRATCH_MMAP
+ guchar		*map, *data;
+ gsize		head;
+#endif
+
+	b = g_new0(LL_SCRATCH_BUF, 1);
+	b->size = size;
+
+#ifdef LL_SCRATCH_MMAP
+	if(size >= LL_SCRATCH_HUGE)
+	{
+		//one huge page more to align the data on a huge page boundary
+		map = mmap(NULL, size + LL_SCRATCH_HUGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if(map != MAP_FAILED)
+		{
+			data = (guchar *) (((gsize) map + LL_SCRATCH_HUGE - 1) & ~((gsize) LL_SCRATCH_HUGE - 1));
+			head = data - map;
+
+			//give back what is outside the aligned range
+			if(head > 0)
+				munmap(map, head);
+			munmap(data + size, LL_SCRATCH_HUGE - head);
+
+			madvise(data, size, MADV_HUGEPAGE);
+
+			b->data = data;
+			b->mapped = TRUE;
+		}
+	}
+#endif
+
+	if(b->data == NULL)
+		b->data = g_malloc(size);
+
+	LL_STATS_ALLOC(LL_MEM_SCRATCH, size);
+	LL_STATS_ADD(LL_COUNT_SCRATCH_ALLOCS, 1);
+
+	return b;
+}
+
+//Frees a buffer of the pool
+static void scratch_release(LL_SCRATCH_BUF *b)
+{
+	LL_STATS_FREE(LL_MEM_SCRATCH, b->size);
+
+#ifdef LL_SCRATCH_MMAP
+	if(b->mapped)
+		munmap(b->data, b->size);
+	else
+#endif
+		g_free(b->data);
+
+	g_free(b);
+}
+
+//Borrows a buffer of at least size bytes (not initialized)
+//The smallest free buffer that fits (and is not more than twice too large) is reused
+gpointer ll_scratch_get(gsize size)
+{
+ LL_SCRATCH_BUF	*b, *best = NULL;
+ guint		i, best_i = 0;
+
+	size = scratch_round(MAX(size, 1));
+
+	g_static_mutex_lock(&scratch_mutex);
+
+	if(scratch_free == NULL)
+	{
+		scratch_free = g_ptr_array_new();
+		scratch_used = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	for(i = 0; i < scratch_free->len; i++)
+	{
+		b = g_ptr_array_index(scratch_free, i);
+
+		if(b->size >= size && b->size / 2 <= size && (best == NULL || b->size < best->size))
+		{
+			best = b;
+			best_i = i;
+		}
+	}
+
+	if(best != NULL)
+		g_ptr_array_remove_index_fast(scratch_free, best_i);
+	else
+		best = scratch_alloc(size);
+
+	g_hash_table_insert(scratch_used, best->data, best);
+
+	g_static_mutex_unlock(&scratch_mutex);
+
+	return best->data;
+}
+
+//Borrows a buffer of at least size bytes, the first size bytes set to 0
+gpointer ll_scratch_get0(gsize size)
+{
+	return memset(ll_scratch_get(size), 0, size);
+}
+
+//Gives back a buffer borrowed with ll_scratch_get
+void ll_scratch_put(gpointer buf)
+{
+ LL_SCRATCH_BUF	*b;
+
+	if(buf == NULL)
+		return;
+
+	g_static_mutex_lock(&scratch_mutex);
+
+	b = g_hash_table_lookup(scratch_used, buf);
+
+	if(b == NULL)
+	{
+		g_static_mutex_unlock(&scratch_mutex);
+		g_warning("ll_scratch_put: %p was not borrowed", buf);
+		return;
+	}
+
+	g_hash_table_remove(scratch_used, buf);
+
+	if(scratch_free->len < LL_SCRATCH_KEEP)
+		g_ptr_array_add(scratch_free, b);
+	else
+		scratch_release(b);
+
+	g_static_mutex_unlock(&scratch_mutex);
+}
+
+//Frees all the buffers of the pool which are not borrowed
+void ll_scratch_trim(void)
+{
+ guint	i;
+
+	g_static_mutex_lock(&scratch_mutex);
+
+	if(scratch_free != NULL)
+	{
+		for(i = 0; i < scratch_free->len; i++)
+			scratch_release(g_ptr_array_index(scratch_free, i));
+
+		g_ptr_array_set_size(scratch_free, 0);
+	}
+
+	g_static_mutex_unlock(&scratch_mutex);
+}
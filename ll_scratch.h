@@ -0,0 +1,41 @@
+/*
+ * Local Layering scratch pool : reusable buffers for image sized temporaries
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_SCRATCH_H__
+#define __LL_SCRATCH_H__
+
+#include <glib.h>
+
+// Buffers of at least this size are backed by (transparent) huge pages where available
+#define LL_SCRATCH_HUGE		(2 * 1024 * 1024)
+
+// Maximum number of free buffers kept by the pool
+#define LL_SCRATCH_KEEP		32
+
+gpointer	ll_scratch_get		(gsize		 size);
+
+gpointer	ll_scratch_get0		(gsize		 size);
+
+void		ll_scratch_put		(gpointer	 buf);
+
+void		ll_scratch_trim		(void);
+
+#endif /* __LL_SCRATCH_H__ */
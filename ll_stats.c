@@ -0,0 +1,335 @@
+/*
+ * Local Layering statistics : wall time of the phases and counters of a session
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * The counters and the memory may be updated from any thread ; a phase is timed
+ * by one thread at a time (the pipeline of the plug-in labels on its worker
+ * while the main thread times the layer codes).
+ * The summary written by ll_stats_write looks like :
+ *
+ *	{"start": "2010-03-01T10:00:00Z", "wall_ms": 5230.1,
+ *	 "phases": {"layer_details": {"calls": 1, "total_ms": 3.2, "max_ms": 3.2, "peak_rss_kb": 81244}, ...},
+ *	 "counters": {"layers": 5, "regions": 120, ...},
+ *	 "memory": {"map": {"live_bytes": 0, "peak_bytes": 48000000}, ...},
+ *	 "clicks": [{"event": "up", "ms": 85.0, "flip_steps": 14, "max_depth": 4}, ...]}
+ *
+ * peak_rss_kb is the peak resident set size of the process at the end of the phase
+ * (0 where getrusage is not available). live_bytes of a subsystem is what is still
+ * allocated when the summary is written, so it is 0 unless something leaks.
+ */
+
+#include <string.h>
+
+#include "ll_stats.h"
+
+#ifdef G_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+static const gchar	*phase_names[LL_PHASES] =
+{
+	"layer_details",
+	"mask_creation",
+	"layer_code",
+	"label_count",
+	"label_tag",
+	"retrieval",
+	"mask_paint",
+	"parasite_attach",
+	"parasite_recover",
+	"preview",
+	"flip_dialog",
+	"boundary"
+};
+
+static const gchar	*counter_names[LL_COUNTERS] =
+{
+	"layers",
+	"regions",
+	"edges",
+	"pixels_written",
+	"flip_steps",
+	"clicks",
+	"scratch_allocs"
+};
+
+static const gchar	*mem_names[LL_MEMS] =
+{
+	"map",
+	"graph",
+	"scratch",
+	"pixels",
+	"parasite",
+	"dialog"
+};
+
+//Holds the wall time of one phase
+typedef struct ll_stats_phase
+{
+	gint		calls;
+	gdouble		start;
+	gdouble		total;
+	gdouble		max;
+	glong		rss;
+}LL_STATS_PHASE;
+
+//Holds one UP / DOWN / UNDO click : its duration, the flips it made and how deep they propagated
+typedef struct ll_stats_click
+{
+	const gchar	*event;
+	gdouble		ms;
+	gint64		flip_steps;
+	gint		max_depth;
+}LL_STATS_CLICK;
+
+gboolean		ll_stats_on = FALSE;
+
+static gchar		*stats_path;
+static GTimeVal		stats_start;
+static GTimer		*stats_clock;
+static LL_STATS_PHASE	phases[LL_PHASES];
+static gint64		counters[LL_COUNTERS];
+static gint64		mem_live[LL_MEMS];
+static gint64		mem_peak[LL_MEMS];
+static GArray		*clicks;
+static LL_STATS_CLICK	*click;
+static gdouble		click_start;
+static gint		depth;
+static GStaticMutex	stats_mutex = G_STATIC_MUTEX_INIT;	//guards counters and memory
+
+//Enables the statistics if the LL_STATS environment variable is set
+//and resets them for a new session
+gboolean ll_stats_init(void)
+{
+ const gchar	*path;
+
+	path = g_getenv(LL_STATS_ENV);
+
+	if(path == NULL || *path == '\0')
+		return FALSE;
+
+	g_free(stats_path);
+	stats_path = g_strdup(path);
+
+	memset(phases, 0, sizeof(phases));
+	memset(counters, 0, sizeof(counters));
+	memset(mem_live, 0, sizeof(mem_live));
+	memset(mem_peak, 0, sizeof(mem_peak));
+
+	if(clicks != NULL)
+		g_array_free(clicks, TRUE);
+	clicks = g_array_new(FALSE, TRUE, sizeof(LL_STATS_CLICK));
+	click = NULL;
+	depth = 0;
+
+	if(stats_clock == NULL)
+		stats_clock = g_timer_new();
+	g_timer_start(stats_clock);
+	g_get_current_time(&stats_start);
+
+	ll_stats_on = TRUE;
+
+	return TRUE;
+}
+
+//Returns the peak resident set size of the process in KB
+static glong peak_rss()
+{
+#ifdef G_OS_UNIX
+ struct rusage	usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+		return usage.ru_maxrss;
+#endif
+	return 0;
+}
+
+//Starts timing phase p
+void ll_stats_begin(LL_PHASE p)
+{
+	phases[p].start = g_timer_elapsed(stats_clock, NULL);
+}
+
+//Stops timing phase p and adds its wall time
+void ll_stats_end(LL_PHASE p)
+{
+ gdouble	t;
+
+	t = (g_timer_elapsed(stats_clock, NULL) - phases[p].start) * 1000;
+
+	phases[p].calls++;
+	phases[p].total += t;
+	phases[p].max = MAX(phases[p].max, t);
+	phases[p].rss = peak_rss();
+}
+
+//Adds n to counter c
+void ll_stats_add(LL_COUNTER c, gint64 n)
+{
+	g_static_mutex_lock(&stats_mutex);
+	counters[c] += n;
+	g_static_mutex_unlock(&stats_mutex);
+}
+
+//Sets counter c to n
+void ll_stats_set(LL_COUNTER c, gint64 n)
+{
+	g_static_mutex_lock(&stats_mutex);
+	counters[c] = n;
+	g_static_mutex_unlock(&stats_mutex);
+}
+
+//Accounts n bytes allocated (n > 0) or freed (n < 0) by subsystem m
+void ll_stats_alloc(LL_MEM m, gint64 n)
+{
+	g_static_mutex_lock(&stats_mutex);
+	mem_live[m] += n;
+	mem_peak[m] = MAX(mem_peak[m], mem_live[m]);
+	g_static_mutex_unlock(&stats_mutex);
+}
+
+//Called on entering a (possibly recursive) flip : counts the flip steps
+//and the depth of the propagation for the current click
+void ll_stats_flip_enter(void)
+{
+	depth++;
+	counters[LL_COUNT_FLIP_STEPS]++;
+
+	if(click != NULL)
+	{
+		click->flip_steps++;
+		click->max_depth = MAX(click->max_depth, depth);
+	}
+}
+
+//Called on leaving a flip
+void ll_stats_flip_leave(void)
+{
+	depth--;
+}
+
+//Starts a click (event is "up", "down" or "undo")
+void ll_stats_click_begin(const gchar *event)
+{
+ LL_STATS_CLICK	c;
+
+	if(!ll_stats_on)
+		return;
+
+	memset(&c, 0, sizeof(c));
+	c.event = event;
+	g_array_append_val(clicks, c);
+
+	click = &g_array_index(clicks, LL_STATS_CLICK, clicks->len - 1);
+	click_start = g_timer_elapsed(stats_clock, NULL);
+	counters[LL_COUNT_CLICKS]++;
+}
+
+//Ends the current click
+void ll_stats_click_end(void)
+{
+	if(!ll_stats_on || click == NULL)
+		return;
+
+	click->ms = (g_timer_elapsed(stats_clock, NULL) - click_start) * 1000;
+	click = NULL;
+}
+
+//Writes the JSON summary of the session to the LL_STATS path
+//If the path is a directory a new file ll-stats-START.json is written in it
+//Returns FALSE if the statistics are disabled or the file cannot be written
+gboolean ll_stats_write(void)
+{
+ GString	*out;
+ GError		*error = NULL;
+ LL_STATS_CLICK	*c;
+ gchar		*start, *file, *name;
+ gboolean	ok;
+ guint		i;
+
+	if(!ll_stats_on)
+		return FALSE;
+
+	start = g_time_val_to_iso8601(&stats_start);
+	out = g_string_new(NULL);
+
+	g_string_append_printf(out, "{\"start\": \"%s\", \"wall_ms\": %.3f,\n \"phases\": {",
+			       start, g_timer_elapsed(stats_clock, NULL) * 1000);
+
+	for(i = 0; i < LL_PHASES; i++)
+	{
+		g_string_append_printf(out, "%s\n  \"%s\": {\"calls\": %d, \"total_ms\": %.3f, \"max_ms\": %.3f, \"peak_rss_kb\": %ld}",
+				       i ? "," : "", phase_names[i], phases[i].calls, phases[i].total, phases[i].max, phases[i].rss);
+	}
+
+	g_string_append(out, "},\n \"counters\": {");
+
+	for(i = 0; i < LL_COUNTERS; i++)
+	{
+		g_string_append_printf(out, "%s\"%s\": %" G_GINT64_FORMAT, i ? ", " : "", counter_names[i], counters[i]);
+	}
+
+	g_string_append(out, "},\n \"memory\": {");
+
+	for(i = 0; i < LL_MEMS; i++)
+	{
+		g_string_append_printf(out, "%s\"%s\": {\"live_bytes\": %" G_GINT64_FORMAT ", \"peak_bytes\": %" G_GINT64_FORMAT "}",
+				       i ? ", " : "", mem_names[i], mem_live[i], mem_peak[i]);
+	}
+
+	g_string_append(out, "},\n \"clicks\": [");
+
+	for(i = 0; i < clicks->len; i++)
+	{
+		c = &g_array_index(clicks, LL_STATS_CLICK, i);
+		g_string_append_printf(out, "%s\n  {\"event\": \"%s\", \"ms\": %.3f, \"flip_steps\": %" G_GINT64_FORMAT ", \"max_depth\": %d}",
+				       i ? "," : "", c->event, c->ms, c->flip_steps, c->max_depth);
+	}
+
+	g_string_append(out, "]}\n");
+
+	if(g_file_test(stats_path, G_FILE_TEST_IS_DIR))
+	{
+		//one file per session, named after its start (: is not allowed in all file systems)
+		g_strdelimit(start, ":", '-');
+		name = g_strdup_printf("ll-stats-%s.json", start);
+		file = g_build_filename(stats_path, name, NULL);
+		g_free(name);
+	}
+	else
+	{
+		file = g_strdup(stats_path);
+	}
+
+	ok = g_file_set_contents(file, out->str, out->len, &error);
+
+	if(!ok)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	}
+
+	g_free(file);
+	g_free(start);
+	g_string_free(out, TRUE);
+
+	return ok;
+}
@@ -0,0 +1,112 @@
+/*
+ * Local Layering statistics : wall time of the phases and counters of a session
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_STATS_H__
+#define __LL_STATS_H__
+
+#include <glib.h>
+
+// Environment variable holding the path of the JSON summary
+// (a file, or a directory to get one file per session)
+// Statistics are not collected unless it is set
+#define LL_STATS_ENV		"LL_STATS"
+
+//Phases of a session whose wall time is recorded
+typedef enum
+{
+	LL_PHASE_LAYER_DETAILS,
+	LL_PHASE_MASK_CREATION,
+	LL_PHASE_LAYER_CODE,
+	LL_PHASE_LABEL_COUNT,
+	LL_PHASE_LABEL_TAG,
+	LL_PHASE_RETRIEVAL,
+	LL_PHASE_MASK_PAINT,
+	LL_PHASE_PARASITE_ATTACH,
+	LL_PHASE_PARASITE_RECOVER,
+	LL_PHASE_PREVIEW,
+	LL_PHASE_FLIP_DIALOG,
+	LL_PHASE_BOUNDARY,
+	LL_PHASES
+}LL_PHASE;
+
+//Counters of a session
+typedef enum
+{
+	LL_COUNT_LAYERS,
+	LL_COUNT_REGIONS,
+	LL_COUNT_EDGES,
+	LL_COUNT_PIXELS_WRITTEN,
+	LL_COUNT_FLIP_STEPS,
+	LL_COUNT_CLICKS,
+	LL_COUNT_SCRATCH_ALLOCS,
+	LL_COUNTERS
+}LL_COUNTER;
+
+//Subsystems whose allocations are accounted
+typedef enum
+{
+	LL_MEM_MAP,		//layer codes, tags and reg_affected of the Region Map
+	LL_MEM_GRAPH,		//ListGraph lists and edges
+	LL_MEM_SCRATCH,		//queues and tables of region growing, layer codes and retrieval
+	LL_MEM_PIXELS,		//pixel region copies of layers and masks
+	LL_MEM_PARASITE,	//UNDO and TAGS parasite data
+	LL_MEM_DIALOG,		//per layer widget arrays of the flip dialog
+	LL_MEMS
+}LL_MEM;
+
+extern gboolean	ll_stats_on;
+
+//The macros below do nothing (but test ll_stats_on) unless the statistics are enabled
+#define LL_STATS_BEGIN(p)	G_STMT_START{ if(ll_stats_on) ll_stats_begin(p); }G_STMT_END
+#define LL_STATS_END(p)		G_STMT_START{ if(ll_stats_on) ll_stats_end(p); }G_STMT_END
+#define LL_STATS_ADD(c, n)	G_STMT_START{ if(ll_stats_on) ll_stats_add((c), (n)); }G_STMT_END
+#define LL_STATS_SET(c, n)	G_STMT_START{ if(ll_stats_on) ll_stats_set((c), (n)); }G_STMT_END
+#define LL_STATS_FLIP_ENTER()	G_STMT_START{ if(ll_stats_on) ll_stats_flip_enter(); }G_STMT_END
+#define LL_STATS_FLIP_LEAVE()	G_STMT_START{ if(ll_stats_on) ll_stats_flip_leave(); }G_STMT_END
+#define LL_STATS_ALLOC(m, n)	G_STMT_START{ if(ll_stats_on) ll_stats_alloc((m), (gint64) (n)); }G_STMT_END
+#define LL_STATS_FREE(m, n)	G_STMT_START{ if(ll_stats_on) ll_stats_alloc((m), -(gint64) (n)); }G_STMT_END
+
+gboolean	ll_stats_init		(void);
+
+void		ll_stats_begin		(LL_PHASE	 p);
+
+void		ll_stats_end		(LL_PHASE	 p);
+
+void		ll_stats_add		(LL_COUNTER	 c,
+					 gint64		 n);
+
+void		ll_stats_set		(LL_COUNTER	 c,
+					 gint64		 n);
+
+void		ll_stats_alloc		(LL_MEM		 m,
+					 gint64		 n);
+
+void		ll_stats_flip_enter	(void);
+
+void		ll_stats_flip_leave	(void);
+
+void		ll_stats_click_begin	(const gchar	*event);
+
+void		ll_stats_click_end	(void);
+
+gboolean	ll_stats_write		(void);
+
+#endif /* __LL_STATS_H__ */
@@ -0,0 +1,204 @@
+/*
+ * Local Layering tiles : per pixel maps paged from a temporary file
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * A store backs a per pixel map of the Region Map (layer codes, tags) which does
+ * not fit in the memory given to it. The file is unlinked as soon as it is created,
+ * so nothing is left behind if the process dies. Tiles are shared mappings of the file :
+ * unmapping a tile writes it back, and the mapped tiles are the only memory used.
+ * Where memory mappings are not available ll_tiles_new returns NULL.
+ */
+
+#include <string.h>
+
+#include "ll_tiles.h"
+
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#endif
+
+//A mapped tile
+typedef struct ll_tile_slot
+{
+	gsize		tile;
+	guchar		*data;		//NULL if the slot is free
+	guint64		used;		//clock of the last access
+}LL_TILE_SLOT;
+
+struct ll_tiles
+{
+	gint		fd;
+	gsize		row_bytes;
+	gsize		tile_rows;
+	gsize		tile_bytes;
+	gsize		num_tiles;
+	LL_TILE_SLOT	*slots;
+	gint		num_slots;
+	LL_TILE_SLOT	*last;		//slot of the last row returned
+	guint64		clock;
+	LL_MEM		mem;
+};
+
+//Creates a store of rows x row_bytes bytes set to 0, which maps at most memory bytes at once
+//(but never less than LL_TILES_MIN tiles)
+//Returns NULL if the temporary file cannot be created
+LL_TILES * ll_tiles_new(gsize rows, gsize row_bytes, gsize memory, LL_MEM mem)
+{
+#ifdef G_OS_UNIX
+ LL_TILES	*tiles;
+ GError		*error = NULL;
+ gchar		*name;
+ gsize		page;
+ gint		fd;
+
+	fd = g_file_open_tmp("ll-tiles-XXXXXX", &name, &error);
+
+	if(fd == -1)
+	{
+		g_warning("ll_tiles_new: %s", error->message);
+		g_error_free(error);
+		return NULL;
+	}
+
+	g_unlink(name);
+	g_free(name);
+
+	page = sysconf(_SC_PAGESIZE);
+
+	tiles = g_new0(LL_TILES, 1);
+
+	tiles->fd		= fd;
+	tiles->row_bytes	= row_bytes;
+	tiles->tile_rows	= MAX(1, LL_TILE_BYTES / row_bytes);
+	tiles->tile_bytes	= (tiles->tile_rows * row_bytes + page - 1) / page * page;
+	tiles->num_tiles	= (rows + tiles->tile_rows - 1) / tiles->tile_rows;
+	tiles->num_slots	= CLAMP(memory / tiles->tile_bytes, LL_TILES_MIN, MAX(tiles->num_tiles, LL_TILES_MIN));
+	tiles->slots		= g_new0(LL_TILE_SLOT, tiles->num_slots);
+	tiles->mem		= mem;
+
+	//the file is sparse : its blocks are read as 0 until written
+	if(ftruncate(fd, (off_t) (tiles->num_tiles * tiles->tile_bytes)) != 0)
+	{
+		g_warning("ll_tiles_new: cannot grow the temporary file to %" G_GSIZE_FORMAT " bytes",
+			  tiles->num_tiles * tiles->tile_bytes);
+		ll_tiles_free(tiles);
+		return NULL;
+	}
+
+	return tiles;
+#else
+	return NULL;
+#endif
+}
+
+#ifdef G_OS_UNIX
+//Maps tile into slot, unmapping the tile it held
+static void tiles_map(LL_TILES *tiles, LL_TILE_SLOT *slot, gsize tile)
+{
+	if(slot->data != NULL)
+	{
+		munmap(slot->data, tiles->tile_bytes);
+		LL_STATS_FREE(tiles->mem, tiles->tile_bytes);
+	}
+
+	slot->data = mmap(NULL, tiles->tile_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  tiles->fd, (off_t) (tile * tiles->tile_bytes));
+
+	//the Region Map cannot go on without its pixels
+	if(slot->data == MAP_FAILED)
+		g_error("ll_tiles: cannot map tile %" G_GSIZE_FORMAT, tile);
+
+	slot->tile = tile;
+	LL_STATS_ALLOC(tiles->mem, tiles->tile_bytes);
+}
+#endif
+
+//Returns the bytes of row, mapping its tile in place of the least recently used one if needed
+gpointer ll_tiles_row(LL_TILES *tiles, gsize row)
+{
+#ifdef G_OS_UNIX
+ LL_TILE_SLOT	*slot, *lru = NULL;
+ gsize		tile;
+ gint		i;
+
+	tile = row / tiles->tile_rows;
+	slot = tiles->last;
+
+	if(slot == NULL || slot->tile != tile || slot->data == NULL)
+	{
+		slot = NULL;
+
+		for(i = 0; i < tiles->num_slots; i++)
+		{
+			if(tiles->slots[i].data != NULL && tiles->slots[i].tile == tile)
+			{
+				slot = &tiles->slots[i];
+				break;
+			}
+
+			if(lru == NULL || tiles->slots[i].data == NULL ||
+			   (lru->data != NULL && tiles->slots[i].used < lru->used))
+				lru = &tiles->slots[i];
+		}
+
+		if(slot == NULL)
+		{
+			slot = lru;
+			tiles_map(tiles, slot, tile);
+		}
+
+		tiles->last = slot;
+	}
+
+	slot->used = ++tiles->clock;
+
+	return slot->data + (row % tiles->tile_rows) * tiles->row_bytes;
+#else
+	return NULL;
+#endif
+}
+
+//Frees the store, its mappings and its file
+void ll_tiles_free(LL_TILES *tiles)
+{
+#ifdef G_OS_UNIX
+ gint	i;
+
+	if(tiles == NULL)
+		return;
+
+	for(i = 0; i < tiles->num_slots; i++)
+	{
+		if(tiles->slots[i].data != NULL)
+		{
+			munmap(tiles->slots[i].data, tiles->tile_bytes);
+			LL_STATS_FREE(tiles->mem, tiles->tile_bytes);
+		}
+	}
+
+	close(tiles->fd);
+
+	g_free(tiles->slots);
+	g_free(tiles);
+#endif
+}
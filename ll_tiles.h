@@ -0,0 +1,52 @@
+/*
+ * Local Layering tiles : per pixel maps paged from a temporary file
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_TILES_H__
+#define __LL_TILES_H__
+
+#include <glib.h>
+
+#include "ll_stats.h"
+
+// Bytes of a tile (rounded to whole rows)
+#define LL_TILE_BYTES		(1024 * 1024)
+
+// Least number of tiles kept mapped : a row stays valid until
+// LL_TILES_MIN - 1 other tiles have been touched
+#define LL_TILES_MIN		4
+
+//Tiled store of rows of row_bytes bytes, set to 0 when created
+//The tiles are strips of whole rows in a temporary file,
+//as many of which are mapped at once as fit in memory bytes (the least recently used is unmapped first)
+//A store is used from one thread at a time
+typedef struct ll_tiles	LL_TILES;
+
+LL_TILES *	ll_tiles_new		(gsize		 rows,
+					 gsize		 row_bytes,
+					 gsize		 memory,
+					 LL_MEM		 mem);
+
+gpointer	ll_tiles_row		(LL_TILES	*tiles,
+					 gsize		 row);
+
+void		ll_tiles_free		(LL_TILES	*tiles);
+
+#endif /* __LL_TILES_H__ */
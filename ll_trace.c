@@ -0,0 +1,185 @@
+/*
+ * Local Layering trace : timeline of a session in the trace event format
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * The trace is a JSON object holding an array of begin (B) / end (E) events
+ * which chrome://tracing or Perfetto show as nested spans :
+ *
+ *	{"traceEvents": [
+ *	 {"name": "thread_name", "ph": "M", "pid": 1, "tid": 1, "args": {"name": "main"}},
+ *	 {"name": "flip_up", "ph": "B", "ts": 1520.250, "pid": 1, "tid": 1, "args": {"layer": 3}},
+ *	 {"name": "flip_up", "ph": "E", "ts": 1544.125, "pid": 1, "tid": 1}, ...],
+ *	 "displayTimeUnit": "ms"}
+ *
+ * Every thread gets its own track (tid), numbered in the order the threads first trace.
+ */
+
+#include "ll_trace.h"
+
+gboolean		ll_trace_on = FALSE;
+
+static GStaticMutex	trace_mutex = G_STATIC_MUTEX_INIT;
+static GStaticPrivate	trace_tid = G_STATIC_PRIVATE_INIT;
+static gint		trace_threads;
+static gchar		*trace_path;
+static GTimeVal		trace_start;
+static GTimer		*trace_clock;
+static GString		*trace_events;
+
+//Track of the calling thread, given a new one on its first event
+//Called with trace_mutex held
+static gint trace_thread_id()
+{
+ gint	tid;
+
+	tid = GPOINTER_TO_INT(g_static_private_get(&trace_tid));
+
+	if(tid == 0)
+	{
+		tid = ++trace_threads;
+		g_static_private_set(&trace_tid, GINT_TO_POINTER(tid), NULL);
+	}
+
+	return tid;
+}
+
+//Appends one event of the calling thread
+static void trace_event(const gchar *name, gchar ph, const gchar *key, gint64 n)
+{
+ gdouble	ts;
+
+	ts = g_timer_elapsed(trace_clock, NULL) * 1000000;
+
+	g_static_mutex_lock(&trace_mutex);
+
+	g_string_append_printf(trace_events, "%s\n {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d",
+			       trace_events->len ? "," : "", name, ph, ts, trace_thread_id());
+
+	if(key != NULL)
+		g_string_append_printf(trace_events, ", \"args\": {\"%s\": %" G_GINT64_FORMAT "}", key, n);
+
+	g_string_append_c(trace_events, '}');
+
+	g_static_mutex_unlock(&trace_mutex);
+}
+
+//Enables the trace if the LL_TRACE environment variable is set and starts a new one
+//The calling thread is named after process
+//Must be called before any other thread traces
+gboolean ll_trace_init(const gchar *process)
+{
+ const gchar	*path;
+
+	path = g_getenv(LL_TRACE_ENV);
+
+	if(path == NULL || *path == '\0')
+		return FALSE;
+
+	g_free(trace_path);
+	trace_path = g_strdup(path);
+
+	if(trace_events != NULL)
+		g_string_free(trace_events, TRUE);
+	trace_events = g_string_new(NULL);
+
+	if(trace_clock == NULL)
+		trace_clock = g_timer_new();
+	g_timer_start(trace_clock);
+	g_get_current_time(&trace_start);
+
+	ll_trace_on = TRUE;
+
+	ll_trace_thread(process);
+
+	return TRUE;
+}
+
+//Names the track of the calling thread
+void ll_trace_thread(const gchar *name)
+{
+	if(!ll_trace_on)
+		return;
+
+	g_static_mutex_lock(&trace_mutex);
+
+	g_string_append_printf(trace_events, "%s\n {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+			       trace_events->len ? "," : "", trace_thread_id(), name);
+
+	g_static_mutex_unlock(&trace_mutex);
+}
+
+//Begins the span name of the calling thread
+//If key is not NULL the span gets the argument key = n
+void ll_trace_begin(const gchar *name, const gchar *key, gint64 n)
+{
+	trace_event(name, 'B', key, n);
+}
+
+//Ends the span name of the calling thread
+void ll_trace_end(const gchar *name)
+{
+	trace_event(name, 'E', NULL, 0);
+}
+
+//Writes the trace to the LL_TRACE path
+//If the path is a directory a new file ll-trace-START.json is written in it
+//Returns FALSE if the trace is disabled or the file cannot be written
+gboolean ll_trace_write(void)
+{
+ GError		*error = NULL;
+ gchar		*start, *file, *name, *json;
+ gboolean	ok;
+
+	if(!ll_trace_on)
+		return FALSE;
+
+	g_static_mutex_lock(&trace_mutex);
+	json = g_strdup_printf("{\"traceEvents\": [%s],\n \"displayTimeUnit\": \"ms\"}\n", trace_events->str);
+	g_static_mutex_unlock(&trace_mutex);
+
+	if(g_file_test(trace_path, G_FILE_TEST_IS_DIR))
+	{
+		//one file per session, named after its start (: is not allowed in all file systems)
+		start = g_time_val_to_iso8601(&trace_start);
+		g_strdelimit(start, ":", '-');
+		name = g_strdup_printf("ll-trace-%s.json", start);
+		file = g_build_filename(trace_path, name, NULL);
+		g_free(name);
+		g_free(start);
+	}
+	else
+	{
+		file = g_strdup(trace_path);
+	}
+
+	ok = g_file_set_contents(file, json, -1, &error);
+
+	if(!ok)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	}
+
+	g_free(file);
+	g_free(json);
+
+	return ok;
+}
@@ -0,0 +1,52 @@
+/*
+ * Local Layering trace : timeline of a session in the trace event format
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __LL_TRACE_H__
+#define __LL_TRACE_H__
+
+#include <glib.h>
+
+// Environment variable holding the path of the trace
+// (a file, or a directory to get one file per session)
+// Nothing is traced unless it is set
+#define LL_TRACE_ENV		"LL_TRACE"
+
+extern gboolean	ll_trace_on;
+
+//The macros below do nothing (but test ll_trace_on) unless the trace is enabled
+//Spans must be ended by the thread that began them, in the reverse order
+#define LL_TRACE_BEGIN(name)		G_STMT_START{ if(ll_trace_on) ll_trace_begin((name), NULL, 0); }G_STMT_END
+#define LL_TRACE_BEGIN_ARG(name, key, n)	G_STMT_START{ if(ll_trace_on) ll_trace_begin((name), (key), (n)); }G_STMT_END
+#define LL_TRACE_END(name)		G_STMT_START{ if(ll_trace_on) ll_trace_end(name); }G_STMT_END
+
+gboolean	ll_trace_init		(const gchar	*process);
+
+void		ll_trace_thread		(const gchar	*name);
+
+void		ll_trace_begin		(const gchar	*name,
+					 const gchar	*key,
+					 gint64		 n);
+
+void		ll_trace_end		(const gchar	*name);
+
+gboolean	ll_trace_write		(void);
+
+#endif /* __LL_TRACE_H__ */
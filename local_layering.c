@@ -43,13 +43,28 @@
 //for the power function : pow() ... later discarded
 //#include <math.h>
 
+//for the recording of the session trace
+#include <stdio.h>
+#include <glib/gstdio.h>
+
+//Region Map, List Graph and flips (independent of GIMP)
+#include "ll_core.h"
+
+//Pool of the image sized temporaries
+#include "ll_scratch.h"
+
+//Work stealing threads of the parallel stages
+#include "ll_pool.h"
+
+//Phase timings and counters (enabled by the LL_STATS environment variable)
+#include "ll_stats.h"
+
+//Timeline of a session (enabled by the LL_TRACE environment variable)
+#include "ll_trace.h"
+
 #define PLUG_IN_PROC	"local-layering-retrieval-2"
 #define PLUG_IN_BINARY	"ll"
 
-// Connectivity used in the region growing (extract_tags)
-// and bounding rectangle functions 
-#define CONNECTIVITY		4
-
 // Maximum number of UNDO operations stored in the UNDO array
 // After UNDO_COUNT the initial UNDO's get overwritten
 // ie UNDO array implemented as a circular queue
@@ -59,9 +74,37 @@
 // After UNDO_FLIP_COUNT the initial flips get overwritten
 // ie flips 2D array implemented as a circular queue
 #define UNDO_FLIP_COUNT 	1000
+
+// Bytes of the strips of rows in which the masks are painted
+// (so that a mask copy stays small however large the image)
+#define MASK_STRIP_BYTES	(4 * 1024 * 1024)
+
+// Bytes of the layers read for a strip of rows by the pipeline of extract_layer_code
+// and number of strips between their reading and the writing of their masks
+#define PIPE_STRIP_BYTES	(16 * 1024 * 1024)
+#define PIPE_DEPTH		3
+
+// Bytes of the layer pixels kept in memory for the preview
+// (beyond them the rows are paged from a temporary file)
+#define PREVIEW_CACHE_BYTES	(256 * 1024 * 1024)
+
+// Levels of the mip pyramids of the layers for the preview (level k is a layer halved k times)
+// and the size of a side of n pixels at level k
+#define PREVIEW_MIP_LEVELS	12
+#define PREVIEW_MIP_SIZE(n, k)	((((n) - 1) >> (k)) + 1)
+#define PREVIEW_MIP(ses, i, k)	((ses)->layer_mips[(i) * PREVIEW_MIP_LEVELS + (k)])
+
+// Pixels of the preview rendered by a step of its idle source
+#define PREVIEW_RENDER_PIXELS	(64 * 1024)
+
+// Images of more pixels without a stacking of their own are labelled first on a Region Map
+// sampling every COARSE_FACTOR pixels, the full one being labelled in the background (see refine_start)
+#define COARSE_PIXELS		(16 * 1024 * 1024)
+#define COARSE_FACTOR		8
 
-
-#define	QUEUE_ARRAY_SIZE	1000
+// Milliseconds between two moves of the cursor dragged in the preview (about a frame)
+#define CURSOR_FRAME_MSEC	16
+
 
 
 static void query (void);
@@ -121,6 +164,8 @@ typedef struct ll_layer_mask	LL_MASK;
 
 typedef struct ll_pr_mask	LL_PR_MASK;
 
+typedef struct ll_session	LL_SESSION;
+
 //Holds values of Cursor within the Plug-in Preview
 typedef struct
 {
@@ -137,33 +182,12 @@ typedef struct
   gboolean      cursor_drawn;
   gint          curx, cury;                 /* x,y of cursor in preview */
   gint          oldx, oldy;
+  gint          motion_x, motion_y;         /* x,y of the image the drag is at */
+  guint         motion_source;
+  LL_SESSION   *ses;
 } LLCursorCenter;
 
 
-//Simple queue data structure
-typedef struct ll_queue
-{
-	gint * data;
-	gint front;
-	gint back;
-}LL_QUEUE;
-
-//Offsets for Region Growing ie. extract_tags function
-typedef struct ll_ofs
-{
-	gint x;
-	gint y;
-}LL_OFS;
-
-//Data structure for the List Graph
-//Holds the details of the local stacking of layers at all regions
-//as well as the connected regions to maintain consistency
-typedef struct list_graph
-{
-	gint ** lists;
-	gint ** edges;
-}LIST_GRAPH;
-
 //Holds the UNDO information
 struct ll_undo_array
 {
@@ -174,46 +198,219 @@ struct ll_undo_array
 
 typedef struct ll_undo_array	LL_UNDO_ARRAY;
 
-typedef struct ll_triple_queue 
-{
-	gint **data;
-	gint front;
-	gint back;
-}LL_T_QUEUE;
-
+//Holds a strip of rows of the image on its way through the pipeline of extract_layer_code
+//ie. the part of every layer and of every mask inside rows y .. y + h - 1
+//(NULL for a layer which is absent, or a mask which is not painted by the pipeline)
+struct ll_strip
+{
+ gint		y;
+ gint		h;
+ guchar		**pixels;
+ guchar		**masks;
+};
+
+typedef struct ll_strip		LL_STRIP;
+
+//Holds a strip of rows y .. y + h - 1 of the pixel region of the mask of layer
+//on its way through mask_set_pixel (read from GIMP, painted on the pool, written back)
+struct ll_mask_strip
+{
+ LL_SESSION	*ses;
+ const gint	*top;
+ gint		layer;
+ gint		y;
+ gint		h;
+ guchar		*buf;
+};
+
+typedef struct ll_mask_strip	LL_MASK_STRIP;
+
+//Holds the source of a commit, dispatched on the main loop whenever the commit can go on without waiting
+struct ll_commit_source
+{
+ GSource	source;
+ LL_SESSION	*ses;
+};
+
+typedef struct ll_commit_source	LL_COMMIT_SOURCE;
+
+//Holds all the state of a Local Layering session on one image :
+//its layers and masks, the Region Map, the UNDO array, the dialog and the recording
+//Every function of the plug-in works on the session it is given
+//so that nothing is shared between two sessions of a process
+struct ll_session
+{
+ //the image, its layers and masks
+ gint			image_id;
+ gint			image_height, image_width;
+ gint			*layers, layer_num;
+ LL_LAYER		*layer;
+ LL_PR_LAYER		*pr;
+ LL_MASK		*mask;
+ LL_PR_MASK		*pr_mask;
+
+ //the Region Map and List Graph
+ LL_MAP			*ll_map;
+ gint			num_regions;
+ LIST_GRAPH		*graph;
+ gboolean		*reg_affected;
+ gboolean		restart_LL;
+ gboolean		masks_painted;
+ GAsyncQueue		*pipe_todo;
+ GAsyncQueue		*pipe_done;
+ gint			**lists;
+ LL_ARENA		*session_arena;
+
+ //the full Region Map labelled on the pool while ll_map samples it every map_scale pixels
+ //(see refine_start ; map_scale is 1 otherwise), the idle source its task attaches once done
+ //and the label of the dialog showing the commits waiting for it
+ LL_MAP			*refine_map;
+ gint			map_scale;
+ LL_POOL_GROUP		refine_group;
+ GSource		*refine_source;
+ GtkWidget		*refine_label;
+
+ //the cursor, the preview and the flip dialog
+ LLCursorValues		vals;
+ gboolean		show_cursor;
+ gint			rg_boundary_call;
+ gint			pos_x, pos_y;
+ gint			cursor_region, boundary_region;
+ GtkWidget		*dialog;
+ GtkWidget		*main_vbox;
+ GtkWidget		*init_bar;
+ gboolean		init_done, init_cancelled, init_labelled;
+ GtkWidget		*preview;
+ GtkWidget		*frame;
+ GimpDrawable		*drawable_preview;
+ gint			drawable_preview_id;
+ gint			preview_image_id;
+ LL_TILES		**layer_mips;
+ gsize			mip_memory;
+ gdouble		*layer_opacity;
+ guchar			*view_buf, *view_dirty;
+ gint			*view_regions, *view_cols, *view_rows, *view_top;
+ gint			view_x0, view_y0, view_x1, view_y1, view_w, view_h;
+ guint			render_source;
+ gint			render_row;
+ GtkWidget		*flip_vbox;
+ GtkWidget		*LL_hbox;
+ GtkWidget		*LL_vbox;
+ GtkWidget		*lframe;
+ GtkWidget		*b_flip_up, *b_flip_down, *b_flip_undo, *b_box;
+ GtkWidget		**radio;
+ GtkWidget		**r_label, **l_label;
+ GtkWidget		**r_hbox;
+ GtkWidget		**l_button, **l_image;
+ gint			*row_layer;
+ gint			*sorted_layer_index;
+ LL_ARENA		*dialog_arena;
+
+ //the thumbnails of the layer buttons, fetched once a session (see layer_thumbnail)
+ GdkPixbuf		**thumbs;
+ guint			thumb_source;
+ gint			thumb_next;
+
+ //the commit of the masks after a flip or undo, run from an idle source (see commit_start)
+ guint			commit_source;
+ gboolean		*commit_pending;
+ gint			*commit_top, *commit_left;
+ gint			commit_layer, commit_y, commit_in_flight, commit_depth;
+ gboolean		commit_pooled;
+ LL_POOL_GROUP		commit_group;
+
+ //the UNDO array
+ LL_UNDO_ARRAY		undo_array[UNDO_COUNT];
+ gint			undo_index, undo_check;
+
+ //the recording of the session (LL_RECORD)
+ FILE			*record_file;
+ gchar			*record_dir;
+};
+
 
 //Holds the Initial Cursor values
 static LLCursorValues llvals =
 {
   0, 0  /* posx, posy */
 };
-
-static void		layer_code_mem_alloc();
 
-static void		extract_layer_code();
+static LL_SESSION *	session_new(gint image_id);
+
+static void		session_free(LL_SESSION *ses);
+
+static void		extract_layer_code(LL_SESSION *ses);
+
+static void		code_layers(LL_SESSION *ses);
+
+static void		pipe_layers(LL_SESSION *ses);
+
+static gboolean		strip_rows(gint y, gint h, const LL_STRIP *s, gint *sy, gint *sh);
+
+static LL_STRIP *	strip_read(LL_SESSION *ses, gint y, gint h, const gboolean *present, gboolean paint);
+
+static void		strip_code(LL_SESSION *ses, LL_STRIP *s);
+
+static void		pipe_worker(gint first, gint last, gpointer data);
+
+static void		strip_write(LL_SESSION *ses, LL_STRIP *s);
 
-static void		layer_mem_alloc();
+static void		layer_mem_alloc(LL_SESSION *ses);
+
+static void		layer_details(LL_SESSION *ses);
+
+static void		pr_details(LL_SESSION *ses);
+
+static void		mask_mem_alloc(LL_SESSION *ses);
+
+static void		create_masks_details(LL_SESSION *ses);
+
+static void		pr_mask_details(LL_SESSION *ses);
+
+static gboolean		init_ll_map (LL_SESSION *ses);
+
+static gboolean		init_progress(LL_SESSION *ses, const gchar *text, gdouble fraction);
 
-static void		layer_details();
+static void		init_response(GtkWidget *dialog, gint response, LL_SESSION *ses);
 
-static void		pr_details();
+static void		init_label_task(gint first, gint last, gpointer data);
 
-static void		mask_mem_alloc();
+static gboolean		init_label_done(LL_SESSION *ses);
 
-static void		create_masks_details();
+static gint		region_at(LL_SESSION *ses, gint x, gint y);
 
-static void		pr_mask_details();
+static void		map_rect_scale(LL_SESSION *ses, gint *x, gint *y, gint *w, gint *h);
 
-static void		init_ll_map ();
+static gboolean		refine_start(LL_SESSION *ses);
 
-static gboolean		LL_dialog                   ();
+static void		refine_task(gint first, gint last, gpointer data);
 
-static GtkWidget * 	LL_center_create            (GimpDrawable	*drawable,
+static gboolean		refine_done(LL_SESSION *ses);
+
+static void		refine_status(LL_SESSION *ses);
+
+static void		undo_carry(LL_SESSION *ses, const gint *carried);
+
+static void		refine_swap(LL_SESSION *ses);
+
+static void		refine_finish(LL_SESSION *ses, gboolean swap);
+
+static void		free_ll_map (LL_SESSION *ses);
+
+static gboolean		LL_dialog                   (LL_SESSION *ses);
+
+static GtkWidget * 	LL_center_create            (LL_SESSION		*ses,
+						     GimpDrawable	*drawable,
 						     GimpPreview	*preview);
 static void		LL_center_cursor_draw       (LLCursorCenter	*center);
 static void		LL_center_coords_update     (GimpSizeEntry	*coords,
                                                      LLCursorCenter	*center);
 static void		LL_center_cursor_update     (LLCursorCenter	*center);
+static void		LL_center_move              (LLCursorCenter	*center,
+                                                     gint		 x,
+                                                     gint		 y);
+static gboolean		LL_center_motion_frame      (LLCursorCenter	*center);
+static void		LL_center_free              (LLCursorCenter	*center);
 static void		LL_center_preview_realize   (GtkWidget		*widget,
                                                      LLCursorCenter	*center);
 static gboolean		LL_center_preview_expose    (GtkWidget		*widget,
@@ -223,165 +420,122 @@ static gboolean		LL_center_preview_events    (GtkWidget		*widget,
                                                      GdkEvent		*event,
                                                      LLCursorCenter	*center);
 
-static void 		queue_init(LL_QUEUE * queue_l);
+static void 		extract_tags(LL_SESSION *ses);
 
-static gboolean 	queue_isempty(LL_QUEUE * queue_l);
+static void 		mask_set_pixel(LL_SESSION *ses);
 
-static void 		queue_push(LL_QUEUE * queue_l, gint n);
+static gint		mask_strip_rows(LL_SESSION *ses, gint i);
 
-static gint 		queue_pop(LL_QUEUE * queue_l);
+static LL_MASK_STRIP *	mask_strip_read(LL_SESSION *ses, const gint *top, gint i, gint y, gint h);
 
-static gint 		queue_fetch(LL_QUEUE * queue_l);
+static void		mask_strip_paint(LL_MASK_STRIP *ms);
 
-static void 		graph_mem_alloc();
+static void		mask_strip_task(gint first, gint last, gpointer data);
 
-static void 		graph_lists_init();	
+static void		mask_strip_write(LL_SESSION *ses, LL_MASK_STRIP *ms, gint *left);
 
-static void 		graph_edges_init();
-
-static void		tags_mem_alloc();
+static void		mask_strip_free(LL_SESSION *ses, LL_MASK_STRIP *ms);
 
-static void 		extract_tags();
+static void		commit_start(LL_SESSION *ses);
 
-static void 		mask_set_pixel();
+static gboolean		commit_advance(LL_SESSION *ses, gboolean wait);
+static gboolean		commit_step(LL_SESSION *ses);
 
-static void 		add_masks();
+static void		commit_cancel(LL_SESSION *ses);
 
-void 			flip_up(gint i1, gint i2, gint l);
+static void		commit_finish(LL_SESSION *ses);
 
-void 			flip_down(gint i1, gint i2, gint l);
+static void 		add_masks(LL_SESSION *ses);
 
-static void 		get_image_pos();
+void 			flip_up(LL_SESSION *ses, gint i1, gint i2, gint l);
 
-static void 		print_layer_code();
+void 			flip_down(LL_SESSION *ses, gint i1, gint i2, gint l);
 
-static void 		print_tags();
+static void 		get_image_pos(LL_SESSION *ses);
 
-static void 		print_graph_lists();
+static void 		print_layer_code(LL_SESSION *ses);
 
-static void 		print_graph_edges();
+static void 		print_tags(LL_SESSION *ses);
 
-static void 		reg_affected_malloc();
+static void 		print_graph_lists(LL_SESSION *ses);
+
+static void 		print_graph_edges(LL_SESSION *ses);
 
-static void 		clear_reg_affected();
+static void 		clear_reg_affected(LL_SESSION *ses);
 
-static void 		set_reg_affected();
+static void 		set_reg_affected(LL_SESSION *ses);
+
+static void 		init_flip_dialog(LL_SESSION *ses);
+
+static void 		create_flip_dialog(LL_SESSION *ses);
+
+static void		flip_row_new(LL_SESSION *ses, gint i);
+
+static GdkPixbuf *	layer_thumbnail(LL_SESSION *ses, gint i);
+
+static gboolean		thumb_prefetch_step(LL_SESSION *ses);
+
+static void		thumb_prefetch_stop(LL_SESSION *ses);
+
+static void 		call_flip_up(LL_SESSION *ses);
+
+static void 		call_flip_down(LL_SESSION *ses);
+
+static void 		destroy_masks(LL_SESSION *ses);
+
+static gboolean 	ll_parasite_attach(LL_SESSION *ses);
+
+static gboolean 	ll_parasite_exists(LL_SESSION *ses);
+
+static gboolean		ll_parasite_recover(LL_SESSION *ses);
+
+static void 		ll_parasite_detach(LL_SESSION *ses);
+
+static void 		rg_boundary_rect(LL_SESSION *ses);
+
+static void 		rg_boundary_rect_regions(LL_SESSION *ses);
 
-static void 		init_flip_dialog();
+static void		select_regions(LL_SESSION *ses, const LL_RECT *rect, gint region);
 
-static void 		create_flip_dialog();
+static void 		update_preview(LL_SESSION *ses);
 
-static void 		call_flip_up();
+static void		preview_cache_new(LL_SESSION *ses);
 
-static void 		call_flip_down();
+static void		preview_cache_rows(LL_SESSION *ses, gint i, const guchar *buf, gint y, gint h);
 
-static void 		destroy_masks();
+static const guchar *	preview_level_row(LL_SESSION *ses, gint i, gint k, gint y, guchar *buf);
 
-static gboolean 	ll_parasite_attach();
+static gint		preview_mip_level(LL_SESSION *ses, gint i, gint k);
 
-static gboolean 	ll_parasite_exists();
+static void		preview_new(LL_SESSION *ses);
 
-static void		ll_parasite_recover();
+static void		preview_invalidated(LL_SESSION *ses);
 
-static void 		ll_parasite_detach();
+static void		preview_render_row(LL_SESSION *ses, gint m, gint level, guchar *tmp);
 
-static void 		rg_boundary_rect();
+static gboolean		preview_render_step(LL_SESSION *ses);
 
-static void 		rg_boundary_rect_regions();
+static void		preview_render_stop(LL_SESSION *ses);
 
-static void 		update_preview();
+static void		record_open(LL_SESSION *ses);
 
-static void 		rem_add_prev_drawable();
+static void		record_layer(LL_SESSION *ses, gint i, const guchar *buf, gint bpp, gdouble opacity, gint x, gint y, gint w, gint h);
 
-static void 		init_undo();
+static void		record_event(LL_SESSION *ses, const gchar *event, gint l);
 
-static void 		flip_undo();
+static void		record_close(LL_SESSION *ses);
+
+static void 		init_undo(LL_SESSION *ses);
+
+static void 		undo_record(gint i1, gint i2, gint l, gpointer data);
+
+static void 		flip_undo(LL_SESSION *ses);
 
 static void		print_warning();
 
-static void		masks_retrieve_top();
-
-static void		lg_retrieval_mask();
-
-static void		print_retrieved_lists();
-
-static void		init_retrieval_list();
-
-static void		t_queue_init(LL_T_QUEUE * t_queue);
-
-static gboolean		t_queue_isempty(LL_T_QUEUE *t_queue);
-
-static void		t_queue_push(LL_T_QUEUE *t_queue, gint *n);
-
-static gint*		t_queue_pop(LL_T_QUEUE *t_queue);
-
-static void		t_queue_print(LL_T_QUEUE *t_queue);
-
-static gboolean		check_pair_list(gint l, gint m, gint n);
-
-static void		print_pair_list();
-
-static void		init_pair_lists();
-
-static void		pair_lists_process();
-
-static void		p_queue_process();
+static void		lg_retrieval_mask(LL_SESSION *ses);
 
-static void		p_queue_fill();
-
-static void		list_retrieve_second();
-
-static void		print_count_layers();
-
-static void		count_layers_init();
-
-static void		print_c_pair_lists_unsolved();
-
-static void		print_c_pair_lists();
-
-static void		assign_lists_to_graph_lists();
-
-gint			image_id;
-gint			image_height, image_width;
-gint			*layers, layer_num;
-//gboolean		***layer_present; 
-gint			**layer_code;
-LL_LAYER		*layer;
-LL_PR_LAYER		*pr;
-LL_MASK			*mask;
-LL_PR_MASK		*pr_mask;
-static gboolean   	show_cursor = TRUE;
-gint			*tags, *old_tags;
-gint			num_regions;
-LIST_GRAPH		*graph;
-gboolean		restart_LL;
-gboolean		*reg_affected;	
-gint 			*rg_boundary;
-gint			rg_boundary_call;
-gint 			pos_x, pos_y;
-GtkWidget   		*dialog;
-GtkWidget		*main_vbox;
-GtkWidget		*preview;
-GtkWidget		*frame;
-GimpDrawable		*drawable_preview;
-gint			drawable_preview_id;
-GtkWidget   		*flip_dialog;
-GtkWidget 		*flip_vbox;
-GtkWidget 		*LL_hbox;
-GtkWidget 		*LL_vbox;
-GtkWidget 		*lframe;
-GtkWidget		*b_flip_up, *b_flip_down, *b_flip_undo, *b_box;
-GtkWidget 		**radio;
-GtkWidget 		**r_label, **l_label;
-GtkWidget 		**r_hbox;
-GtkWidget 		**l_button;
-gint			*sorted_layer_index;
-LL_UNDO_ARRAY		undo_array[UNDO_COUNT];
-gint			undo_index, undo_check;
-
-gint			**lists, ***pair_lists, ***c_pair_lists;
-gint			*pair_count, *count_layers, *pair_total_count;
-LL_T_QUEUE		t_queue;
+static void		assign_lists_to_graph_lists(LL_SESSION *ses);
 
 GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -394,6 +548,30 @@ GimpPlugInInfo PLUG_IN_INFO =
 
 MAIN()
 
+//Creates the session of Local Layering on image image_id
+//with the cursor values last used (see run) and nothing else set
+static LL_SESSION * session_new(gint image_id)
+{
+ LL_SESSION	*ses;
+
+	ses = g_new0(LL_SESSION, 1);
+
+	ses->image_id		= image_id;
+	ses->vals		= llvals;
+	ses->show_cursor	= TRUE;
+	ses->map_scale		= 1;
+	ses->cursor_region	= -1;
+	ses->boundary_region	= -1;
+
+	return ses;
+}
+
+//Frees a session whose data has been freed by free_ll_map
+static void session_free(LL_SESSION *ses)
+{
+	g_free(ses);
+}
+
 static void
 query (void)
 {
@@ -437,11 +615,12 @@ run (const gchar      *name,
 	static GimpParam	values[1];
   	GimpPDBStatusType	status = GIMP_PDB_SUCCESS;
   	GimpRunMode		run_mode;
+	LL_SESSION		*ses;
 	gint			k;
 
 
 	run_mode = param[0].data.d_int32;	
-  	image_id = param[1].data.d_int32;
+  	ses = session_new (param[1].data.d_int32);
 
 	*nreturn_vals = 1;
 	*return_vals  = values;
@@ -453,8 +632,26 @@ run (const gchar      *name,
 	if (run_mode != GIMP_RUN_NONINTERACTIVE)
 	{
 
-		gimp_get_data (PLUG_IN_PROC, &llvals);
+		gimp_get_data (PLUG_IN_PROC, &ses->vals);
+
+		//The region map indexes the pixels of the image with gsize
+		//which cannot address images this large on a 32 bit host
+		if(ll_pixels(gimp_image_width(ses->image_id), gimp_image_height(ses->image_id)) == 0)
+		{
+			g_message("Local Layering : the image is too large for this system");
+			values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
+			session_free(ses);
+			return;
+		}
 
+		//the layers are coded on the pool while they are read (see pipe_layers)
+		if(!g_thread_supported())
+			g_thread_init(NULL);
+
+		ll_stats_init();
+
+		ll_trace_init("local-layering");
+
 		gimp_progress_init (("Local Layering Init"));
 
 		//layers = gimp_image_get_layers (image_id, &layer_num);
@@ -464,39 +661,50 @@ run (const gchar      *name,
 		//g_printf("\n\nntiles = %d",layer_num * 2 * (gimp_image_width(image_id) / gimp_tile_width () + 1) * (gimp_image_height (image_id) / gimp_tile_height () + 1));
 
 
-		if (! LL_dialog ())
+		if (! LL_dialog (ses))
         	{
-			if(gimp_drawable_is_valid(drawable_preview_id)) 
-				gimp_image_remove_layer (image_id, drawable_preview_id);
-
 			//CANCEL OR CLOSE BUTTON CLICKED
 
-			if(ll_parasite_exists())
+			//cancelled while initialising : the masks of an earlier session are not painted yet
+			if(!ses->init_done)
+			{
+				if(!ll_parasite_exists(ses))
+					destroy_masks(ses);
+			}
+			else if(ll_parasite_exists(ses))
 			{
-				if(!restart_LL)
+				if(!ses->restart_LL)
 				{
 					//ll_parasite_recover();
 
-					assign_lists_to_graph_lists();
+					assign_lists_to_graph_lists(ses);
 
-					set_reg_affected();
+					set_reg_affected(ses);
 
-					mask_set_pixel();
+					mask_set_pixel(ses);
 				}
 				else
 				{
-					destroy_masks();
+					destroy_masks(ses);
 				}
 			}
 			else
 			{
-				destroy_masks();
+				destroy_masks(ses);
 			}
 
-			gimp_selection_none (image_id);
+			gimp_selection_none (ses->image_id);
 
 			gimp_displays_flush();
 
+			free_ll_map(ses);
+
+			ll_stats_write();
+
+			ll_trace_write();
+
+			session_free(ses);
+
           		return;
         	}
 	}
@@ -513,42 +721,49 @@ run (const gchar      *name,
 
 	//  Store data  
 	if (run_mode == GIMP_RUN_INTERACTIVE)
-		gimp_set_data (PLUG_IN_PROC, &llvals, sizeof (LLCursorValues));
+		gimp_set_data (PLUG_IN_PROC, &ses->vals, sizeof (LLCursorValues));
 
 //	}
 
 //  	values[0].data.d_status = status;
-	
-	if(gimp_drawable_is_valid(drawable_preview_id)) 
-		gimp_image_remove_layer (image_id, drawable_preview_id);
 
-	gimp_selection_none (image_id);
+	gimp_selection_none (ses->image_id);
 
 	//gimp_displays_flush();
 
-	if(ll_parasite_exists())
+	if(ll_parasite_exists(ses))
 	{
-		ll_parasite_detach();
+		ll_parasite_detach(ses);
 	}
 
-	ll_parasite_attach();
-
+	LL_STATS_BEGIN(LL_PHASE_PARASITE_ATTACH);
+	LL_TRACE_BEGIN("parasite_attach");
+
+	ll_parasite_attach(ses);
 
+	LL_TRACE_END("parasite_attach");
+	LL_STATS_END(LL_PHASE_PARASITE_ATTACH);
+
+	free_ll_map(ses);
+
+	ll_stats_write();
 
+	ll_trace_write();
+
+	session_free(ses);
 }
 
 //Main Graphical User Interface Dialog
 static gboolean 
-LL_dialog ()
+LL_dialog (LL_SESSION *ses)
 {
  gboolean     run;
 
-	init_undo();
-	init_ll_map();
+	init_undo(ses);
 
 	gimp_ui_init (PLUG_IN_PROC, TRUE);
 
-	dialog = gimp_dialog_new (("Local Layering"), PLUG_IN_PROC,
+	ses->dialog = gimp_dialog_new (("Local Layering"), PLUG_IN_PROC,
 		                      NULL, 0,
 		                      gimp_standard_help_func, PLUG_IN_PROC,
 
@@ -557,36 +772,84 @@ LL_dialog ()
 
 		                      NULL);
 
-	gtk_dialog_set_alternative_button_order (GTK_DIALOG (dialog),
+	gtk_dialog_set_alternative_button_order (GTK_DIALOG (ses->dialog),
 		                                     GTK_RESPONSE_OK,
 		                                     GTK_RESPONSE_CANCEL,
 		                                     -1);
 
-	gimp_window_set_transient (GTK_WINDOW (dialog));
+	gimp_window_set_transient (GTK_WINDOW (ses->dialog));
 
-	LL_vbox = gtk_vbox_new (FALSE, 30);
-	gtk_container_set_border_width (GTK_CONTAINER (LL_vbox), 12);
-	gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), LL_vbox);
-	gtk_widget_show (LL_vbox);
+	ses->LL_vbox = gtk_vbox_new (FALSE, 30);
+	gtk_container_set_border_width (GTK_CONTAINER (ses->LL_vbox), 12);
+	gtk_container_add (GTK_CONTAINER (GTK_DIALOG (ses->dialog)->vbox), ses->LL_vbox);
+	gtk_widget_show (ses->LL_vbox);
 	
-	LL_hbox = gtk_hbox_new (FALSE, 30);	
-	gtk_box_pack_start (GTK_BOX (LL_vbox), LL_hbox, TRUE, TRUE, 0);
-	gtk_widget_show (LL_hbox);
+	ses->LL_hbox = gtk_hbox_new (FALSE, 30);	
+	gtk_box_pack_start (GTK_BOX (ses->LL_vbox), ses->LL_hbox, TRUE, TRUE, 0);
+	gtk_widget_show (ses->LL_hbox);
 	
-	main_vbox = gtk_vbox_new (FALSE, 12);
+	ses->main_vbox = gtk_vbox_new (FALSE, 12);
 	//gtk_container_set_border_width (GTK_CONTAINER (main_vbox), 12);
 	//gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), main_vbox);
-	gtk_box_pack_start (GTK_BOX (LL_hbox), main_vbox, TRUE, TRUE, 0);
-	gtk_widget_show (main_vbox);
+	gtk_box_pack_start (GTK_BOX (ses->LL_hbox), ses->main_vbox, TRUE, TRUE, 0);
+	gtk_widget_show (ses->main_vbox);
+
+	//The dialog shows the progress of the initialisation, which Cancel stops
+	ses->init_bar = gtk_progress_bar_new ();
+	gtk_box_pack_start (GTK_BOX (ses->main_vbox), ses->init_bar, FALSE, FALSE, 0);
+	gtk_widget_show (ses->init_bar);
+
+	gtk_dialog_set_response_sensitive (GTK_DIALOG (ses->dialog), GTK_RESPONSE_OK, FALSE);
+	g_signal_connect (ses->dialog, "response", G_CALLBACK (init_response), ses);
+
+	gtk_widget_show (ses->dialog);
+
+	if(!init_ll_map(ses))
+	{
+		refine_finish(ses, FALSE);
+		commit_finish(ses);
+		gtk_widget_destroy (ses->dialog);
+
+		record_close(ses);
+
+		return FALSE;
+	}
+
+	gtk_widget_destroy (ses->init_bar);
+	ses->init_bar = NULL;
+
+	gtk_dialog_set_response_sensitive (GTK_DIALOG (ses->dialog), GTK_RESPONSE_OK, TRUE);
+
+	//while the full Region Map is labelled the dialog shows the commits waiting for it
+	if(ses->refine_map != NULL)
+	{
+		ses->refine_label = gtk_label_new (NULL);
+		gtk_box_pack_start (GTK_BOX (ses->main_vbox), ses->refine_label, FALSE, FALSE, 0);
+		gtk_widget_show (ses->refine_label);
+
+		refine_status(ses);
+	}
 
-	rg_boundary_call = 1;
+	ses->rg_boundary_call = 1;
 
-	update_preview();
+	update_preview(ses);
+
+	//the thumbnails of the layers not in the flip dialog yet, while the dialog is idle
+	ses->thumb_next = 0;
+	ses->thumb_source = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc) thumb_prefetch_step, ses, NULL);
 
-	gtk_widget_show (dialog);
+	run = (gimp_dialog_run (GIMP_DIALOG (ses->dialog)) == GTK_RESPONSE_OK);
 
-	run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
-	gtk_widget_destroy (dialog);
+	//the full Region Map is waited for : the stacking is carried over to it on OK, else it is dropped
+	//then the masks of the last flips are committed before the dialog goes
+	refine_finish(ses, run);
+	commit_finish(ses);
+	preview_render_stop(ses);
+	thumb_prefetch_stop(ses);
+
+	gtk_widget_destroy (ses->dialog);
+
+	record_close(ses);
 
   	return run;
 }
@@ -594,290 +857,712 @@ LL_dialog ()
 //Sub Dialog which shows the FLip Up , Flip Down and UNDO Buttons
 //as well as the local stacking of layers at a point in the preview
 //using raido buttons and thumbnails of layers within buttons
-static void create_flip_dialog()
+//Its widgets are made the first time and updated in place afterwards (see init_flip_dialog)
+static void create_flip_dialog(LL_SESSION *ses)
 {	
+	LL_STATS_BEGIN(LL_PHASE_FLIP_DIALOG);
+	LL_TRACE_BEGIN("create_flip_dialog");
 
-	if(flip_vbox != NULL)
+	if(ses->flip_vbox == NULL)
 	{
-		gtk_widget_destroy(flip_vbox);
+		ses->flip_vbox = gtk_vbox_new (FALSE, 12);
+		//gtk_container_set_border_width (GTK_CONTAINER (flip_vbox), 12);
+		//gtk_container_add (GTK_CONTAINER (GTK_DIALOG (flip_dialog)->vbox), flip_vbox);
+		gtk_box_pack_start (GTK_BOX (ses->LL_hbox), ses->flip_vbox, TRUE, TRUE, 0);
+	
+		ses->lframe = gimp_frame_new("LAYERS");
+		ses->b_box = gtk_hbox_new(FALSE,12);
+		ses->b_flip_up = gtk_button_new_with_label("UP");
+		ses->b_flip_down = gtk_button_new_with_label("DOWN");
+		ses->b_flip_undo = gtk_button_new_with_label("UNDO");
+		gtk_box_pack_start (GTK_BOX (ses->flip_vbox), ses->lframe, FALSE, FALSE, 0);
+		gtk_box_pack_start (GTK_BOX (ses->flip_vbox), ses->b_box , TRUE, TRUE, 0);
+		gtk_box_pack_start (GTK_BOX (ses->b_box), ses->b_flip_up, TRUE, TRUE, 0);
+		gtk_box_pack_start (GTK_BOX (ses->b_box), ses->b_flip_down, TRUE, TRUE, 0);
+		gtk_box_pack_start (GTK_BOX (ses->b_box), ses->b_flip_undo, TRUE, TRUE, 0);
+
+		gtk_widget_show (ses->flip_vbox);
+		gtk_widget_show (ses->lframe);
+		gtk_widget_show (ses->b_box);
+		gtk_widget_show (ses->b_flip_up);
+		gtk_widget_show (ses->b_flip_down);
+		gtk_widget_show (ses->b_flip_undo);
+
+		//the rows of the layers, made as deep a stack is first shown (see flip_row_new)
+		ses->l_label		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->r_label		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->r_hbox		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->l_button		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->l_image		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->radio		= LL_ARENA_NEW0 (ses->dialog_arena, GtkWidget *, ses->layer_num);
+		ses->row_layer		= LL_ARENA_NEW (ses->dialog_arena, gint, ses->layer_num);
+
+		ses->sorted_layer_index = LL_ARENA_NEW (ses->dialog_arena, gint, ses->layer_num);
+
+		//the handlers are connected once, and called with the session first (swapped)
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_up), "clicked", G_CALLBACK(call_flip_up), ses);
+
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_up), "clicked", G_CALLBACK(create_flip_dialog), ses);
+
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_down), "clicked", G_CALLBACK(call_flip_down), ses);
+
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_down), "clicked", G_CALLBACK(create_flip_dialog), ses);
+
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_undo), "clicked", G_CALLBACK(flip_undo), ses);
+
+		g_signal_connect_swapped(GTK_OBJECT(ses->b_flip_undo), "clicked", G_CALLBACK(create_flip_dialog), ses);
 	}
 
-	flip_vbox = gtk_vbox_new (FALSE, 12);
-	//gtk_container_set_border_width (GTK_CONTAINER (flip_vbox), 12);
-	//gtk_container_add (GTK_CONTAINER (GTK_DIALOG (flip_dialog)->vbox), flip_vbox);
-	gtk_box_pack_start (GTK_BOX (LL_hbox), flip_vbox, TRUE, TRUE, 0);
-	
-	lframe = gimp_frame_new("LAYERS");
-	b_box = gtk_hbox_new(FALSE,12);
-	b_flip_up = gtk_button_new_with_label("UP");
-	b_flip_down = gtk_button_new_with_label("DOWN");
-	b_flip_undo = gtk_button_new_with_label("UNDO");
-	gtk_box_pack_start (GTK_BOX (flip_vbox), lframe, FALSE, FALSE, 0);
-	gtk_box_pack_start (GTK_BOX (flip_vbox), b_box , TRUE, TRUE, 0);
-	gtk_box_pack_start (GTK_BOX (b_box), b_flip_up, TRUE, TRUE, 0);
-	gtk_box_pack_start (GTK_BOX (b_box), b_flip_down, TRUE, TRUE, 0);
-	gtk_box_pack_start (GTK_BOX (b_box), b_flip_undo, TRUE, TRUE, 0);
-
-	gtk_widget_show (flip_vbox);
-	gtk_widget_show (lframe);
-	gtk_widget_show (b_box);
-	gtk_widget_show (b_flip_up);
-	gtk_widget_show (b_flip_down);
-	gtk_widget_show (b_flip_undo);
-
-	init_flip_dialog();
+	init_flip_dialog(ses);
 
+	LL_TRACE_END("create_flip_dialog");
+	LL_STATS_END(LL_PHASE_FLIP_DIALOG);
 }
 
-//Initialization for the Flip buttons and UNDO button dialog
-//adds signals to the buttons for appropriate callback functions
-//as well as calculation of local stacking of layers at a point in the preview
-static void init_flip_dialog()
+//Calculation of the local stacking of layers at the point of the cursor in the preview
+//and update of the rows of the flip dialog to it, top most layer first :
+//a row gets its label and thumbnail only when it shows another layer than before
+//and the rows below the stack are hidden
+static void init_flip_dialog(LL_SESSION *ses)
 {
-	gint i, j, rg_tag, l;
-	gint min, min_index;
-	gchar *buf;
+	gint i, j, rg_tag;
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
 
 	//g_printf("\n\nINIT_FLIP_DIALOG\n");
 
-	get_image_pos();
+	get_image_pos(ses);
 
-	rg_tag = tags[pos_y * image_width + pos_x];
-
-
-	l_label		= (GtkWidget **) malloc (layer_num * sizeof(GtkWidget *) );
-	r_label		= (GtkWidget **) malloc (layer_num * sizeof(GtkWidget *) );
-	r_hbox		= (GtkWidget **) malloc (layer_num * sizeof(GtkWidget *) );
-	l_button	= (GtkWidget **) malloc (layer_num * sizeof(GtkWidget *) );
-	radio		= (GtkWidget **) malloc (layer_num * sizeof(GtkWidget *) );
-	for(i = 0; i < layer_num; i++)
-	{	
-		l_label[i]	= (GtkWidget *) malloc (layer_num * sizeof(GtkWidget **) );
-		r_label[i]	= (GtkWidget *) malloc (layer_num * sizeof(GtkWidget **) );
-  		r_hbox[i]	= (GtkWidget *) malloc (layer_num * sizeof(GtkWidget ** ) );
-		l_button[i]	= (GtkWidget *) malloc (layer_num * sizeof(GtkWidget **) );
-		radio[i]	= (GtkWidget *) malloc (layer_num * sizeof(GtkWidget **) );
-	}
-
-	buf = g_new(gchar,4);
+	rg_tag = region_at(ses, ses->pos_x, ses->pos_y) + 1;
 
-	sorted_layer_index = (gint *)malloc(layer_num * sizeof(gint));
+	//the region the dialog shows, which a move of the cursor inside it keeps (see LL_center_coords_update)
+	ses->cursor_region = rg_tag - 1;
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		sorted_layer_index[i] = -1;
+		ses->sorted_layer_index[i] = -1;
 	}
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		for(j = 0; j < layer_num; j++)
+		for(j = 0; j < ses->layer_num; j++)
 		{
-			if(graph->lists[rg_tag-1][j] == i+1)
+			if(ses->graph->lists[rg_tag-1][j] == i+1)
 			{
-				sorted_layer_index[i] = j;
+				ses->sorted_layer_index[i] = j;
 				break;
 			}
 		}
 	}
 
-	radio[0] = gtk_radio_button_new(NULL);
-
-	l = 0;
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		if(sorted_layer_index[i] != -1 )
+		if(ses->sorted_layer_index[i] == -1)
+		{
+			if(ses->r_hbox[i] != NULL)
+				gtk_widget_hide(ses->r_hbox[i]);
+
+			continue;
+		}
+
+		if(ses->r_hbox[i] == NULL)
+			flip_row_new(ses, i);
+
+		if(ses->row_layer[i] != ses->sorted_layer_index[i])
 		{
-			l++;
-			r_hbox[i] = gtk_hbox_new (TRUE, 12);
-			gtk_box_pack_start (GTK_BOX (flip_vbox), r_hbox[i], TRUE, TRUE, 0);
-			gtk_widget_show(r_hbox[i]);
-
-			if(i != 0)
-				radio[i] = gtk_radio_button_new_from_widget (GTK_RADIO_BUTTON (radio[0]));
-				
-			if(l == 1)
-				gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (radio[i]), TRUE);
-			gtk_box_pack_start (GTK_BOX (r_hbox[i]), radio[i], TRUE, TRUE, 0);
-			gtk_widget_show(radio[i]);
-
-				
-			l_label[i] = gtk_label_new (NULL);
-			gtk_label_set_text(GTK_LABEL (l_label[i]),"LAYER ");
-			gtk_box_pack_start (GTK_BOX (r_hbox[i]), l_label[i], TRUE, TRUE, 0);
-			gtk_widget_show(l_label[i]);
-
-			r_label[i] = gtk_label_new(NULL);
-
-			g_ascii_dtostr (buf, 4, sorted_layer_index[i] );
-			//g_printf("\n Buf = %c",buf[0]);
-			gtk_label_set_text(GTK_LABEL (r_label[i]),buf);		
-			gtk_box_pack_start (GTK_BOX (r_hbox[i]), r_label[i], TRUE, TRUE, 0);		
-			gtk_widget_show(r_label[i]);			
-
-			l_button[i] = gtk_toggle_button_new();
-			gtk_button_set_image(GTK_BUTTON(l_button[i]), gtk_image_new_from_pixbuf(gimp_drawable_get_thumbnail (layer[sorted_layer_index[i]].id, 50,50,GIMP_PIXBUF_KEEP_ALPHA)) );
-			gtk_box_pack_start (GTK_BOX (r_hbox[i]), l_button[i], TRUE, TRUE, 0);
-			gtk_widget_show(l_button[i]);
+			ses->row_layer[i] = ses->sorted_layer_index[i];
+
+			g_ascii_dtostr (buf, sizeof (buf), ses->sorted_layer_index[i] );
+			gtk_label_set_text(GTK_LABEL (ses->r_label[i]),buf);
 
+			gtk_image_set_from_pixbuf(GTK_IMAGE (ses->l_image[i]), layer_thumbnail(ses, ses->sorted_layer_index[i]));
 		}
 
+		gtk_widget_show(ses->r_hbox[i]);
 	}
 
-	g_signal_connect(GTK_OBJECT(b_flip_up), "clicked", G_CALLBACK(call_flip_up), NULL);
+	//the top most layer is the one selected
+	if(ses->sorted_layer_index[0] != -1)
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (ses->radio[0]), TRUE);
+}	
 
-	g_signal_connect(GTK_OBJECT(b_flip_up), "clicked", G_CALLBACK(create_flip_dialog), NULL);
+//Makes row i of the flip dialog (the rows above it are made already) :
+//a radio button of the group of row 0, the LAYER label, the label of the layer and its thumbnail button
+static void flip_row_new(LL_SESSION *ses, gint i)
+{
+	ses->r_hbox[i] = gtk_hbox_new (TRUE, 12);
+	gtk_box_pack_start (GTK_BOX (ses->flip_vbox), ses->r_hbox[i], TRUE, TRUE, 0);
 
-	g_signal_connect(GTK_OBJECT(b_flip_down), "clicked", G_CALLBACK(call_flip_down), NULL);
+	if(i == 0)
+		ses->radio[i] = gtk_radio_button_new(NULL);
+	else
+		ses->radio[i] = gtk_radio_button_new_from_widget (GTK_RADIO_BUTTON (ses->radio[0]));
 
-	g_signal_connect(GTK_OBJECT(b_flip_down), "clicked", G_CALLBACK(create_flip_dialog), NULL);
+	gtk_box_pack_start (GTK_BOX (ses->r_hbox[i]), ses->radio[i], TRUE, TRUE, 0);
+	gtk_widget_show(ses->radio[i]);
 
-	g_signal_connect(GTK_OBJECT(b_flip_undo), "clicked", G_CALLBACK(flip_undo), NULL);
+	ses->l_label[i] = gtk_label_new (NULL);
+	gtk_label_set_text(GTK_LABEL (ses->l_label[i]),"LAYER ");
+	gtk_box_pack_start (GTK_BOX (ses->r_hbox[i]), ses->l_label[i], TRUE, TRUE, 0);
+	gtk_widget_show(ses->l_label[i]);
 
-	g_signal_connect(GTK_OBJECT(b_flip_undo), "clicked", G_CALLBACK(create_flip_dialog), NULL);
+	ses->r_label[i] = gtk_label_new(NULL);
+	gtk_box_pack_start (GTK_BOX (ses->r_hbox[i]), ses->r_label[i], TRUE, TRUE, 0);
+	gtk_widget_show(ses->r_label[i]);
 
-}	
-
-//Removes the existing Preview Drawable
-//and adds an updated one after a flip or undo call
-static void rem_add_prev_drawable()
+	ses->l_button[i] = gtk_toggle_button_new();
+	ses->l_image[i] = gtk_image_new();
+	gtk_button_set_image(GTK_BUTTON(ses->l_button[i]), ses->l_image[i]);
+	gtk_box_pack_start (GTK_BOX (ses->r_hbox[i]), ses->l_button[i], TRUE, TRUE, 0);
+	gtk_widget_show(ses->l_button[i]);
+
+	ses->row_layer[i] = -1;
+}
+
+//Returns the thumbnail of layer i for its button in the flip dialog (owned by the session)
+//It is fetched from GIMP the first time only : the plug-in paints the masks, never the layers,
+//whose pixels are read once a session (as for the preview cache)
+static GdkPixbuf * layer_thumbnail(LL_SESSION *ses, gint i)
+{
+	if(ses->thumbs == NULL)
+		ses->thumbs = g_new0(GdkPixbuf *, ses->layer_num);
+
+	if(ses->thumbs[i] == NULL)
+	{
+		LL_TRACE_BEGIN_ARG("thumbnail", "layer", i);
+		ses->thumbs[i] = gimp_drawable_get_thumbnail ((ses->layer[i]).id, 50, 50, GIMP_PIXBUF_KEEP_ALPHA);
+		LL_TRACE_END("thumbnail");
+	}
+
+	return ses->thumbs[i];
+}
+
+//Low priority idle source of LL_dialog : fetches the thumbnail of one more layer a step
+//so that the flip dialog seldom waits for GIMP (libgimp is only called from the main thread)
+static gboolean thumb_prefetch_step(LL_SESSION *ses)
 {
-	gint dup_image_id;
+	//the layers which are not processed are in no region
+	while(ses->thumb_next < ses->layer_num && !(ses->pr[ses->thumb_next]).process)
+		ses->thumb_next++;
+
+	if(ses->thumb_next >= ses->layer_num)
+	{
+		ses->thumb_source = 0;
+		return FALSE;
+	}
 
-	gimp_selection_none (image_id);
+	layer_thumbnail(ses, ses->thumb_next++);
+
+	return TRUE;
+}
 
-	if(gimp_drawable_is_valid(drawable_preview_id))
+//Stops the fetching of thumbnails ahead of the flip dialog
+static void thumb_prefetch_stop(LL_SESSION *ses)
+{
+	if(ses->thumb_source != 0)
 	{
-		gimp_image_remove_layer (image_id, drawable_preview_id);
-	}
+		g_source_remove(ses->thumb_source);
+		ses->thumb_source = 0;
+	}
+}
 
-	//gimp_layer_new_from_visible : does not give the updated visible region after the flip or undo call
-	//on the current image. (Some unsorted issue with clearing of buffers)
-	//hence a bit of round about code to give correct preview from visible regions
+//Keeps the pixels of the layers seen in the preview as extract_layer_code reads them
+//(the visible layers of non zero opacity, over their pixel regions) as level 0 of their mip pyramids
+//so that the preview is rendered without reading GIMP again
+static void preview_cache_new(LL_SESSION *ses)
+{
+ gint	i, kept = 0;
 
-	dup_image_id = gimp_image_duplicate (image_id);
+	ses->layer_mips = g_new0(LL_TILES *, ses->layer_num * PREVIEW_MIP_LEVELS);
+	ses->layer_opacity = g_new0(gdouble, ses->layer_num);
 
-	//drawable_preview_id = gimp_image_merge_visible_layers (dup_image_id, GIMP_CLIP_TO_IMAGE);
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		if( (ses->pr[i]).process == 1 && gimp_drawable_get_visible((ses->layer[i]).id) )
+			ses->layer_opacity[i] = gimp_layer_get_opacity((ses->layer[i]).id) / 100.0;
 
-	drawable_preview_id = gimp_layer_new_from_visible (dup_image_id, image_id,"DRAW_PREVIEW");
+		if(ses->layer_opacity[i] > 0.0)
+			kept++;
+	}
 
-	gimp_image_add_layer (image_id, drawable_preview_id, layer_num);
+	ses->mip_memory = PREVIEW_CACHE_BYTES / MAX(kept, 1);
 
-	gimp_drawable_set_visible (drawable_preview_id,FALSE);
+	//a layer without a store (no temporary file) is read from GIMP by preview_level_row
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		if(ses->layer_opacity[i] > 0.0)
+			PREVIEW_MIP(ses, i, 0) = ll_tiles_new((ses->pr[i]).layer.h, (gsize) (ses->pr[i]).layer.w * (ses->pr[i]).layer.bpp,
+							      ses->mip_memory, LL_MEM_PIXELS);
+	}
 }
-
-//Updates the preview after a flip or undo call
-static void update_preview()
-{	
-	rem_add_prev_drawable();
 
-	if(preview != NULL)
-		gtk_widget_destroy(preview);
-	if(frame != NULL)
-		gtk_widget_destroy(frame);
+//Copies rows y .. y + h - 1 of the pixel region of layer i, read into buf, to the preview cache
+static void preview_cache_rows(LL_SESSION *ses, gint i, const guchar *buf, gint y, gint h)
+{
+ gsize	row_bytes;
+ gint	m;
 
-	drawable_preview = gimp_drawable_get (drawable_preview_id);
+	if(ses->layer_mips == NULL || PREVIEW_MIP(ses, i, 0) == NULL)
+		return;
 
-	preview = gimp_zoom_preview_new (drawable_preview);
+	row_bytes = (gsize) (ses->pr[i]).layer.w * (ses->pr[i]).layer.bpp;
 
-	gtk_widget_add_events (GIMP_PREVIEW (preview)->area, GDK_POINTER_MOTION_MASK);
-	gtk_box_pack_start (GTK_BOX (main_vbox), preview, TRUE, TRUE, 0);
-	gtk_widget_show (preview);
-	
-	g_signal_connect_swapped (preview, "invalidated",G_CALLBACK (gtk_widget_show), preview);
-	g_signal_connect_swapped (preview, "invalidated",G_CALLBACK (create_flip_dialog), NULL);
-	g_signal_connect_swapped (preview, "invalidated",G_CALLBACK (rg_boundary_rect_regions),NULL);
+	for(m = 0; m < h; m++)
+		memcpy(ll_tiles_row(PREVIEW_MIP(ses, i, 0), y + m), buf + m * row_bytes, row_bytes);
+}
+
+//Returns row y of level k of the mip pyramid of layer i
+//(level 0 without a cache is read from GIMP into buf, of a row of the pixel region)
+static const guchar * preview_level_row(LL_SESSION *ses, gint i, gint k, gint y, guchar *buf)
+{
+	if(PREVIEW_MIP(ses, i, k) != NULL)
+		return ll_tiles_row(PREVIEW_MIP(ses, i, k), y);
 
-	frame = LL_center_create (drawable_preview, GIMP_PREVIEW (preview));
-	gtk_box_pack_start (GTK_BOX (main_vbox), frame, FALSE, FALSE, 0);
-	gtk_widget_show (frame);
+	gimp_pixel_rgn_get_row( &((ses->pr[i]).layer), buf, (ses->pr[i]).layer.x, (ses->pr[i]).layer.y + y, (ses->pr[i]).layer.w);
 
+	return buf;
 }
-
-//Prepares the parameters from the Flip Dialog
-//and passes it to the flip_up function
-//as well as stores value in the UNDO array
-static void call_flip_up()
-{	
-	gint i, l_index, h_index, rg_tag;
-	gint k;
 
-		clear_reg_affected();
-
-		undo_check = 1;
+//Returns the level of the mip pyramid of layer i nearest below level k which can be had
+//The levels 1 .. k are built the first time they are asked for, each from the one below
+//(2 x 2 pixels averaged, weighted by their alpha) and are kept for the session
+static gint preview_mip_level(LL_SESSION *ses, gint i, gint k)
+{
+ LL_TILES	*tiles;
+ const guchar	*r0, *r1, *p[4];
+ guchar		*dest, *buf0, *buf1;
+ gint		l, x, y, c, q, w, h, pw, ph, bpp, sum, asum;
 
-		get_image_pos();
-		rg_tag = tags[pos_y * image_width + pos_x];	
+	bpp = (ses->pr[i]).layer.bpp;
 
-		k = 0;
-	   	for(i = 0; i < layer_num; i++)
+	for(l = 1; l <= k; l++)
+	{
+		if(PREVIEW_MIP(ses, i, l) != NULL)
+			continue;
+
+		pw = PREVIEW_MIP_SIZE((ses->pr[i]).layer.w, l - 1);
+		ph = PREVIEW_MIP_SIZE((ses->pr[i]).layer.h, l - 1);
+		w  = PREVIEW_MIP_SIZE((ses->pr[i]).layer.w, l);
+		h  = PREVIEW_MIP_SIZE((ses->pr[i]).layer.h, l);
+
+		tiles = ll_tiles_new(h, (gsize) w * bpp, ses->mip_memory, LL_MEM_PIXELS);
+
+		if(tiles == NULL)
+			return l - 1;
+
+		LL_TRACE_BEGIN_ARG("preview_mip", "layer", i);
+
+		buf0 = g_new(guchar, (gsize) pw * bpp);
+		buf1 = g_new(guchar, (gsize) pw * bpp);
+
+		for(y = 0; y < h; y++)
 		{
-			if ( sorted_layer_index[i] != -1)
+			r0 = preview_level_row(ses, i, l - 1, 2 * y, buf0);
+			r1 = (2 * y + 1 < ph) ? preview_level_row(ses, i, l - 1, 2 * y + 1, buf1) : r0;
+			dest = ll_tiles_row(tiles, y);
+
+			for(x = 0; x < w; x++, dest += bpp)
 			{
-				k++;
-				if(gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (radio[i])))
+				p[0] = r0 + 2 * x * bpp;
+				p[2] = r1 + 2 * x * bpp;
+				p[1] = (2 * x + 1 < pw) ? p[0] + bpp : p[0];
+				p[3] = (2 * x + 1 < pw) ? p[2] + bpp : p[2];
+
+				if((ses->layer[i]).alpha)
 				{
-					h_index = sorted_layer_index[i];
-					break;
+					asum = p[0][bpp - 1] + p[1][bpp - 1] + p[2][bpp - 1] + p[3][bpp - 1];
+
+					for(c = 0; c < bpp - 1; c++)
+					{
+						for(q = 0, sum = 0; q < 4; q++)
+							sum += p[q][c] * p[q][bpp - 1];
+
+						dest[c] = (asum > 0) ? (sum + asum / 2) / asum : 0;
+					}
+					dest[bpp - 1] = (asum + 2) / 4;
+				}
+				else
+				{
+					for(c = 0; c < bpp; c++)
+						dest[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4;
 				}
 			}
 		}
 
-		if(!(k == 0 || k == 1))
-		{
-
-			if( undo_index == UNDO_COUNT-1)
-				undo_index = 0;
-			else
-				undo_index++;
-
-			undo_array[undo_index].call_count++;
-
-			undo_array[undo_index].call_type = 0;
+		g_free(buf0);
+		g_free(buf1);
 
-			l_index = sorted_layer_index[i-1];
-	
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][1] = h_index;
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][0] = l_index;
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][2] = rg_tag-1;
-
-			flip_up(h_index, l_index, rg_tag-1);
+		PREVIEW_MIP(ses, i, l) = tiles;
+
+		LL_TRACE_END("preview_mip");
+	}
 
-			mask_set_pixel();
+	return k;
+}
 
-			gimp_displays_flush ();
+//Creates the drawable of the preview : one layer of the size of the image in an image of its own,
+//which is never displayed nor added to the user's image
+//The preview widget takes its size from it, its pixels being rendered by preview_render
+static void preview_new(LL_SESSION *ses)
+{
+ gboolean	gray = gimp_image_base_type(ses->image_id) == GIMP_GRAY;
 
-			rg_boundary_call = 0;
+	ses->preview_image_id = gimp_image_new(ses->image_width, ses->image_height, gray ? GIMP_GRAY : GIMP_RGB);
+	gimp_image_undo_disable(ses->preview_image_id);
 
-			update_preview();
+	ses->drawable_preview_id = gimp_layer_new(ses->preview_image_id, "DRAW_PREVIEW", ses->image_width, ses->image_height,
+						  gray ? GIMP_GRAYA_IMAGE : GIMP_RGBA_IMAGE, 100.0, GIMP_NORMAL_MODE);
+	gimp_image_add_layer(ses->preview_image_id, ses->drawable_preview_id, 0);
 
-		}
+	ses->drawable_preview = gimp_drawable_get(ses->drawable_preview_id);
+}
 
-}
+//Marks the pixels of the preview to render again and starts rendering them from an idle source
+//(the first handler of "invalidated") : every pixel when the view has changed,
+//else those of the regions set in reg_affected
+//A render on its way starts again from the first row with the pixels marked since
+static void preview_invalidated(LL_SESSION *ses)
+{
+ GimpPreview	*preview = GIMP_PREVIEW (ses->preview);
+ gint		w, h, x0, y0, x1, y1, m, n, r;
 
-//Prepares the parameters from the Flip Dialog
-//and passes it to the flip_down function
-//as well as stores value in the UNDO array
-static void call_flip_down()
-{	
-	gint i, l_index, h_index, rg_tag;
-	gint k;
+	gimp_preview_get_size (preview, &w, &h);
 
-		clear_reg_affected();
-
-		undo_check = 1;
+	if(w <= 0 || h <= 0)
+		return;
 
-		get_image_pos();
-		rg_tag = tags[pos_y * image_width + pos_x];	
+	//the pixels of the image under the corners of the preview
+	gimp_preview_untransform (preview, 0, 0, &x0, &y0);
+	gimp_preview_untransform (preview, w, h, &x1, &y1);
 
-		k = 0;
-   		for(i = layer_num-1; i >= 0; i--)
+	if(ses->view_buf == NULL || w != ses->view_w || h != ses->view_h ||
+	   x0 != ses->view_x0 || y0 != ses->view_y0 || x1 != ses->view_x1 || y1 != ses->view_y1)
+	{
+		g_free(ses->view_buf);
+		g_free(ses->view_dirty);
+		g_free(ses->view_regions);
+		g_free(ses->view_cols);
+		g_free(ses->view_rows);
+
+		ses->view_buf = g_new(guchar, (gsize) w * h * ses->drawable_preview->bpp);
+		ses->view_dirty = g_new(guchar, (gsize) w * h);
+		ses->view_regions = g_new(gint, (gsize) w * h);
+		ses->view_cols = g_new(gint, w);
+		ses->view_rows = g_new(gint, h);
+
+		ses->view_x0 = x0;
+		ses->view_y0 = y0;
+		ses->view_x1 = x1;
+		ses->view_y1 = y1;
+		ses->view_w = w;
+		ses->view_h = h;
+
+		//the pixel of the image at the centre of every pixel of the preview and its region (-1 outside the image)
+		for(n = 0; n < w; n++)
+			ses->view_cols[n] = x0 + (gint) ((n + 0.5) * (x1 - x0) / w);
+
+		for(m = 0; m < h; m++)
+			ses->view_rows[m] = y0 + (gint) ((m + 0.5) * (y1 - y0) / h);
+
+		for(m = 0; m < h; m++)
 		{
-			if ( sorted_layer_index[i] != -1)
+			for(n = 0; n < w; n++)
 			{
-				k++;
-				if(gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (radio[i])))
-				{
-					l_index = sorted_layer_index[i];
+				if(ses->view_cols[n] >= 0 && ses->view_rows[m] >= 0 && ses->view_cols[n] < ses->image_width && ses->view_rows[m] < ses->image_height)
+					ses->view_regions[m * w + n] = region_at(ses, ses->view_cols[n], ses->view_rows[m]);
+				else
+					ses->view_regions[m * w + n] = -1;
+			}
+		}
+
+		memset(ses->view_dirty, 1, (gsize) w * h);
+	}
+	else
+	{
+		for(n = 0; n < w * h; n++)
+		{
+			r = ses->view_regions[n];
+
+			if(r >= 0 && ses->reg_affected[r])
+				ses->view_dirty[n] = 1;
+		}
+	}
+
+	g_free(ses->view_top);
+	ses->view_top = ll_map_top_layers(ses->ll_map);
+
+	ses->render_row = 0;
+
+	if(ses->render_source == 0)
+		ses->render_source = g_idle_add((GSourceFunc) preview_render_step, ses);
+}
+
+//Renders the pixels of row m of the preview which are marked, from level level of the mip pyramids
+//Every pixel composites the layers as GIMP shows them (normal mode, bottom most layer first) :
+//a layer whose mask is painted by the plug-in is only seen in the regions it tops
+static void preview_render_row(LL_SESSION *ses, gint m, gint level, guchar *tmp)
+{
+ const guchar	*src;
+ guchar		*row, *dest, *dirty;
+ gint		*regions;
+ gdouble	a, da, oa;
+ gint		w, bpp, lbpp, kk, i, n, c, r, left;
+ gint		lx, ly, cx, cy;
+
+	w = ses->view_w;
+	bpp = ses->drawable_preview->bpp;
+	row = ses->view_buf + (gsize) m * w * bpp;
+	dirty = ses->view_dirty + (gsize) m * w;
+	regions = ses->view_regions + (gsize) m * w;
+	cy = ses->view_rows[m];
+
+	//the pixels rendered again start transparent
+	for(n = 0, left = 0; n < w; n++)
+	{
+		if(dirty[n])
+		{
+			memset(row + n * bpp, 0, bpp);
+			left++;
+		}
+	}
+
+	if(left == 0)
+		return;
+
+	for(i = ses->layer_num - 1; i >= 0; i--)
+	{
+		if(ses->layer_opacity[i] <= 0.0)
+			continue;
+
+		lx = (ses->layer[i]).off_x + (ses->pr[i]).layer.x;
+		ly = (ses->layer[i]).off_y + (ses->pr[i]).layer.y;
+
+		if(cy < ly || cy >= ly + (gint) (ses->pr[i]).layer.h)
+			continue;
+
+		kk = preview_mip_level(ses, i, level);
+		lbpp = (ses->pr[i]).layer.bpp;
+		src = preview_level_row(ses, i, kk, (cy - ly) >> kk, tmp);
+
+		for(n = 0; n < w; n++)
+		{
+			cx = ses->view_cols[n];
+			r = regions[n];
+
+			if(!dirty[n] || r < 0 || cx < lx || cx >= lx + (gint) (ses->pr[i]).layer.w)
+				continue;
+
+			if((ses->pr_mask[i]).process && ses->view_top[r] != i)
+				continue;
+
+			a = ses->layer_opacity[i];
+			if((ses->layer[i]).alpha)
+				a *= src[((cx - lx) >> kk) * lbpp + lbpp - 1] / 255.0;
+
+			if(a <= 0.0)
+				continue;
+
+			dest = row + n * bpp;
+			da = dest[bpp - 1] / 255.0;
+			oa = a + da * (1.0 - a);
+
+			for(c = 0; c < bpp - 1; c++)
+				dest[c] = (guchar) ((src[((cx - lx) >> kk) * lbpp + c] * a + dest[c] * da * (1.0 - a)) / oa + 0.5);
+			dest[bpp - 1] = (guchar) (oa * 255.0 + 0.5);
+		}
+	}
+
+	memset(dirty, 0, w);
+}
+
+//Step of the idle source rendering the preview : renders the next rows (PREVIEW_RENDER_PIXELS pixels)
+//from the level of the mip pyramids nearest below the zoom, so the cost follows the pixels of the preview
+//and not of the image, and draws the preview
+//Returns FALSE once the last row is rendered
+static gboolean preview_render_step(LL_SESSION *ses)
+{
+ guchar		*tmp;
+ gdouble	scale;
+ gint		i, m, rows, level, row_bytes = 4;
+
+	LL_TRACE_BEGIN_ARG("preview_render", "row", ses->render_row);
+
+	//the level whose pixels are no smaller than those of the preview
+	scale = (gdouble) (ses->view_x1 - ses->view_x0) / ses->view_w;
+	level = 0;
+	while(level + 1 < PREVIEW_MIP_LEVELS && (1 << (level + 1)) <= scale)
+		level++;
+
+	for(i = 0; i < ses->layer_num; i++)
+		row_bytes = MAX(row_bytes, (ses->pr[i]).layer.w * (ses->pr[i]).layer.bpp);
+
+	tmp = g_new(guchar, row_bytes);
+	rows = MAX(PREVIEW_RENDER_PIXELS / ses->view_w, 1);
+
+	for(m = ses->render_row; m < MIN(ses->render_row + rows, ses->view_h); m++)
+		preview_render_row(ses, m, level, tmp);
+
+	ses->render_row = m;
+
+	g_free(tmp);
+
+	gimp_preview_draw_buffer (GIMP_PREVIEW (ses->preview), ses->view_buf, ses->view_w * ses->drawable_preview->bpp);
+
+	LL_TRACE_END("preview_render");
+
+	if(ses->render_row < ses->view_h)
+		return TRUE;
+
+	ses->render_source = 0;
+
+	return FALSE;
+}
+
+//Stops the render of the preview on its way (when the dialog goes)
+static void preview_render_stop(LL_SESSION *ses)
+{
+	if(ses->render_source != 0)
+	{
+		g_source_remove(ses->render_source);
+		ses->render_source = 0;
+	}
+}
+
+//Updates the preview after a flip or undo call
+//The first call creates the preview and its widgets, the later ones have the preview rendered again
+//(only the pixels of the affected regions as long as the view is the same, see preview_invalidated)
+static void update_preview(LL_SESSION *ses)
+{
+	LL_STATS_BEGIN(LL_PHASE_PREVIEW);
+	LL_TRACE_BEGIN("update_preview");
+
+	gimp_selection_none (ses->image_id);
+
+	if(ses->preview != NULL)
+	{
+		gimp_preview_invalidate (GIMP_PREVIEW (ses->preview));
+	}
+	else
+	{
+		preview_new(ses);
+
+		ses->preview = gimp_zoom_preview_new (ses->drawable_preview);
+
+		gtk_widget_add_events (GIMP_PREVIEW (ses->preview)->area, GDK_POINTER_MOTION_MASK);
+		gtk_box_pack_start (GTK_BOX (ses->main_vbox), ses->preview, TRUE, TRUE, 0);
+		gtk_widget_show (ses->preview);
+
+		g_signal_connect_swapped (ses->preview, "invalidated",G_CALLBACK (preview_invalidated), ses);
+		g_signal_connect_swapped (ses->preview, "invalidated",G_CALLBACK (gtk_widget_show), ses->preview);
+		g_signal_connect_swapped (ses->preview, "invalidated",G_CALLBACK (create_flip_dialog), ses);
+		g_signal_connect_swapped (ses->preview, "invalidated",G_CALLBACK (rg_boundary_rect_regions),ses);
+
+		ses->frame = LL_center_create (ses, ses->drawable_preview, GIMP_PREVIEW (ses->preview));
+		gtk_box_pack_start (GTK_BOX (ses->main_vbox), ses->frame, FALSE, FALSE, 0);
+		gtk_widget_show (ses->frame);
+	}
+
+	LL_TRACE_END("update_preview");
+	LL_STATS_END(LL_PHASE_PREVIEW);
+}
+
+//Prepares the parameters from the Flip Dialog
+//and passes it to the flip_up function
+//as well as stores value in the UNDO array
+static void call_flip_up(LL_SESSION *ses)
+{	
+	gint i, l_index, h_index, rg_tag;
+	gint k;
+
+		//the commit on its way is done with the ListGraph before the flip
+		commit_cancel(ses);
+
+		clear_reg_affected(ses);
+
+		ses->undo_check = 1;
+
+		get_image_pos(ses);
+		rg_tag = region_at(ses, ses->pos_x, ses->pos_y) + 1;
+
+		k = 0;
+	   	for(i = 0; i < ses->layer_num; i++)
+		{
+			if ( ses->sorted_layer_index[i] != -1)
+			{
+				k++;
+				if(gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (ses->radio[i])))
+				{
+					h_index = ses->sorted_layer_index[i];
+					break;
+				}
+			}
+		}
+
+		if(!(k == 0 || k == 1))
+		{
+
+			if( ses->undo_index == UNDO_COUNT-1)
+				ses->undo_index = 0;
+			else
+				ses->undo_index++;
+
+			ses->undo_array[ses->undo_index].call_count++;
+
+			ses->undo_array[ses->undo_index].call_type = 0;
+
+			l_index = ses->sorted_layer_index[i-1];
+
+			record_event(ses, "up", h_index);
+
+			ll_stats_click_begin("up");
+			LL_TRACE_BEGIN_ARG("flip_up", "layer", h_index);
+	
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][1] = h_index;
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][0] = l_index;
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][2] = rg_tag-1;
+
+			flip_up(ses, h_index, l_index, rg_tag-1);
+
+			//the masks are committed from an idle source
+			commit_start(ses);
+
+			ses->rg_boundary_call = 0;
+
+			update_preview(ses);
+
+			LL_TRACE_END("flip_up");
+			ll_stats_click_end();
+
+		}
+
+}
+
+//Prepares the parameters from the Flip Dialog
+//and passes it to the flip_down function
+//as well as stores value in the UNDO array
+static void call_flip_down(LL_SESSION *ses)
+{	
+	gint i, l_index, h_index, rg_tag;
+	gint k;
+
+		//the commit on its way is done with the ListGraph before the flip
+		commit_cancel(ses);
+
+		clear_reg_affected(ses);
+
+		ses->undo_check = 1;
+
+		get_image_pos(ses);
+		rg_tag = region_at(ses, ses->pos_x, ses->pos_y) + 1;
+
+		k = 0;
+   		for(i = ses->layer_num-1; i >= 0; i--)
+		{
+			if ( ses->sorted_layer_index[i] != -1)
+			{
+				k++;
+				if(gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (ses->radio[i])))
+				{
+					l_index = ses->sorted_layer_index[i];
 					break;
 				}
 			}
@@ -887,109 +1572,110 @@ static void call_flip_down()
 		if(!(k == 0 || k == 1 ))
 		{
 
-			if( undo_index == UNDO_COUNT-1)
-				undo_index = 0;
+			if( ses->undo_index == UNDO_COUNT-1)
+				ses->undo_index = 0;
 			else
-				undo_index++;
+				ses->undo_index++;
 
-			undo_array[undo_index].call_count++;
+			ses->undo_array[ses->undo_index].call_count++;
 
-			undo_array[undo_index].call_type = 1;	
+			ses->undo_array[ses->undo_index].call_type = 1;	
+
+			h_index = ses->sorted_layer_index[i+1];
+
+			record_event(ses, "down", l_index);
 
-			h_index = sorted_layer_index[i+1];
+			ll_stats_click_begin("down");
+			LL_TRACE_BEGIN_ARG("flip_down", "layer", l_index);
 	
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][1] = h_index;
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][0] = l_index;
-			undo_array[undo_index].flips[undo_array[undo_index].call_count][2] = rg_tag-1;
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][1] = h_index;
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][0] = l_index;
+			ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][2] = rg_tag-1;
 
 
-			flip_down(l_index, h_index, rg_tag-1);
+			flip_down(ses, l_index, h_index, rg_tag-1);
 
-			mask_set_pixel();
+			//the masks are committed from an idle source
+			commit_start(ses);
 
-			gimp_displays_flush ();
+			ses->rg_boundary_call = 0;
 
-			rg_boundary_call = 0;
+			update_preview(ses);
 
-			update_preview();
+			LL_TRACE_END("flip_down");
+			ll_stats_click_end();
 
 		}
 	
 }
 
 //Initializes the UNDO array
-static void init_undo()
+static void init_undo(LL_SESSION *ses)
 {
 	gint i, j;
 	
-	undo_index = -1;
-	undo_check = 0;
+	ses->undo_index = -1;
+	ses->undo_check = 0;
 
 	for(i = 0; i < UNDO_COUNT; i++)
 	{
-		undo_array[i].call_type = 0;
-		undo_array[i].call_count = -1;
+		ses->undo_array[i].call_type = 0;
+		ses->undo_array[i].call_count = -1;
 		for(j = 0; j < UNDO_FLIP_COUNT; j++)
 		{
-			undo_array[i].flips[j][0] = -1;
-			undo_array[i].flips[j][1] = -1;
-			undo_array[i].flips[j][2] = -1;
+			ses->undo_array[i].flips[j][0] = -1;
+			ses->undo_array[i].flips[j][1] = -1;
+			ses->undo_array[i].flips[j][2] = -1;
 		}
 	}
 }
 
 //UNDO function to undo the previous flip / flips
-static void flip_undo()
+static void flip_undo(LL_SESSION *ses)
 {
-	gint i, j;
+	gint j;
 
-	if(undo_index == -1)// && undo_array[undo_index].call_count = 0;) //check
+	if(ses->undo_index == -1)// && undo_array[undo_index].call_count = 0;) //check
 	{
 		g_printf("\nNO UNDO DATA IN ARRAY\n");
 	}
 	else 
 	{
 
-		undo_check = 0;
-
-		clear_reg_affected();
-
-		for(i = undo_array[undo_index].call_count; i >= 0; i--)
-		//for(i = 0; i <= undo_array[undo_index].call_count; i++)
-		{
+		ses->undo_check = 0;
 
-			if((undo_array[undo_index].flips[i][0] != -1) && (undo_array[undo_index].flips[i][1] != -1) && (undo_array[undo_index].flips[i][2] != -1) )
-			{		
-				if(undo_array[undo_index].call_type == 1)	
-				{
-					flip_up( undo_array[undo_index].flips[i][0], undo_array[undo_index].flips[i][1], undo_array[undo_index].flips[i][2] );
-				}
-				else
-				{
-					flip_down( undo_array[undo_index].flips[i][1], undo_array[undo_index].flips[i][0], undo_array[undo_index].flips[i][2] );
-				}
-			}
+		record_event(ses, "undo", -1);
 
-		}
+		ll_stats_click_begin("undo");
+		LL_TRACE_BEGIN("undo");
+
+		//the commit on its way is done with the ListGraph before the undo
+		commit_cancel(ses);
+
+		clear_reg_affected(ses);
 
+		//Revert the stored flips, latest first
+		ll_map_undo_flips(ses->ll_map, ses->undo_array[ses->undo_index].call_type, ses->undo_array[ses->undo_index].flips, ses->undo_array[ses->undo_index].call_count);
 
-		for(j = 0; j <= undo_array[undo_index].call_count; j++)
+		for(j = 0; j <= ses->undo_array[ses->undo_index].call_count; j++)
 		{
-			undo_array[undo_index].flips[j][0] = -1;
-			undo_array[undo_index].flips[j][1] = -1;
-			undo_array[undo_index].flips[j][2] = -1;
+			ses->undo_array[ses->undo_index].flips[j][0] = -1;
+			ses->undo_array[ses->undo_index].flips[j][1] = -1;
+			ses->undo_array[ses->undo_index].flips[j][2] = -1;
 		}
 
-		undo_array[undo_index].call_count = -1;	
-		undo_index--;
-
-		mask_set_pixel();
+		ses->undo_array[ses->undo_index].call_count = -1;	
+		ses->undo_index--;
 
-		gimp_displays_flush ();
+		//the masks are committed from an idle source
+		commit_start(ses);
 
-		rg_boundary_call = 0;
+		ses->rg_boundary_call = 0;
 
-		update_preview();
+		update_preview(ses);
+
+		LL_TRACE_END("undo");
+		ll_stats_click_end();
 
 	}
 
@@ -997,7 +1683,8 @@ static void flip_undo()
 
 //Prepares center of coordinates for Cursor in Preview
 static GtkWidget *
-LL_center_create (GimpDrawable *drawable,
+LL_center_create (LL_SESSION   *ses,
+                  GimpDrawable *drawable,
                   GimpPreview  *preview)
 {
   LLCursorCenter *center;
@@ -1017,13 +1704,14 @@ LL_center_create (GimpDrawable *drawable,
   center->cury         = 0;
   center->oldx         = 0;
   center->oldy         = 0;
+  center->ses          = ses;
 
   frame = gimp_frame_new (("LL Cursor"));
 
   g_object_set_data (G_OBJECT (frame), "center", center);
 
   g_signal_connect_swapped (frame, "destroy",
-                            G_CALLBACK (g_free),
+                            G_CALLBACK (LL_center_free),
                             center);
 
   hbox = gtk_hbox_new (FALSE, 0);
@@ -1037,12 +1725,12 @@ LL_center_create (GimpDrawable *drawable,
                                          GIMP_SIZE_ENTRY_UPDATE_SIZE,
                                          FALSE, FALSE,
 
-                                         ("_X:"), llvals.posx, res_x,
+                                         ("_X:"), ses->vals.posx, res_x,
                                          - (gdouble) drawable->width,
                                          2 * drawable->width,
                                          0, drawable->width,
 
-                                         ("_Y:"), llvals.posy, res_y,
+                                         ("_Y:"), ses->vals.posy, res_y,
                                          - (gdouble) drawable->height,
                                          2 * drawable->height,
                                          0, drawable->height);
@@ -1061,12 +1749,12 @@ LL_center_create (GimpDrawable *drawable,
   check = gtk_check_button_new_with_mnemonic (("Show _position"));
   gtk_table_attach (GTK_TABLE (center->coords), check, 0, 5, 2, 3,
                     GTK_EXPAND | GTK_FILL, GTK_FILL, 0, 0);
-  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), show_cursor);
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), ses->show_cursor);
   gtk_widget_show (check);
 
   g_signal_connect (check, "toggled",
                     G_CALLBACK (gimp_toggle_button_update),
-                    &show_cursor);
+                    &ses->show_cursor);
   g_signal_connect_swapped (check, "toggled",
                             G_CALLBACK (gimp_preview_invalidate),
                             preview);
@@ -1090,6 +1778,7 @@ LL_center_create (GimpDrawable *drawable,
 static void
 LL_center_cursor_draw (LLCursorCenter *center)
 {
+  LL_SESSION *ses  = center->ses;
   GtkWidget *prvw  = center->preview->area;
   GtkStyle  *style = gtk_widget_get_style (prvw);
   gint       width, height;
@@ -1098,7 +1787,7 @@ LL_center_cursor_draw (LLCursorCenter *center)
 
   gdk_gc_set_function (style->black_gc, GDK_INVERT);
 
-  if (show_cursor)
+  if (ses->show_cursor)
     {
       if (center->cursor_drawn)
         {
@@ -1136,17 +1825,71 @@ LL_center_cursor_draw (LLCursorCenter *center)
 
 
 //Updates the value of the Coordinates of Cursor  in the Preview
+//The preview, the flip dialog and the selection are made again only when the cursor
+//enters another region : inside the same one it is redrawn, and the selection
+//goes back to the region if it shows the regions of the last flip
 static void
 LL_center_coords_update (GimpSizeEntry *coords,
                          LLCursorCenter   *center)
 {
-  llvals.posx = gimp_size_entry_get_refval (coords, 0);
-  llvals.posy = gimp_size_entry_get_refval (coords, 1);
+  LL_SESSION *ses = center->ses;
+  gint        region;
+
+  ses->vals.posx = gimp_size_entry_get_refval (coords, 0);
+  ses->vals.posy = gimp_size_entry_get_refval (coords, 1);
+
+  get_image_pos (ses);
+  record_event (ses, "cursor", -1);
 
   LL_center_cursor_update (center);
   LL_center_cursor_draw (center);
 
-  gimp_preview_invalidate (center->preview);
+  region = region_at (ses, ses->pos_x, ses->pos_y);
+
+  if (region != ses->cursor_region)
+    gimp_preview_invalidate (center->preview);
+  else if (region != ses->boundary_region)
+    rg_boundary_rect_regions (ses);
+}
+
+//Moves the cursor to pixel x, y of the image (as a click in the preview does)
+static void
+LL_center_move (LLCursorCenter *center,
+                gint            x,
+                gint            y)
+{
+  LL_center_cursor_draw (center);
+
+  g_signal_handlers_block_by_func (center->coords, LL_center_coords_update, center);
+
+  gimp_size_entry_set_refval (GIMP_SIZE_ENTRY (center->coords), 0, x);
+  gimp_size_entry_set_refval (GIMP_SIZE_ENTRY (center->coords), 1, y);
+
+  g_signal_handlers_unblock_by_func (center->coords, LL_center_coords_update, center);
+
+  LL_center_coords_update (GIMP_SIZE_ENTRY (center->coords), center);
+}
+
+//Timeout of a drag in the preview : moves the cursor to where the last motion left it
+//so that the motions of a frame make one move
+static gboolean
+LL_center_motion_frame (LLCursorCenter *center)
+{
+  center->motion_source = 0;
+
+  LL_center_move (center, center->motion_x, center->motion_y);
+
+  return FALSE;
+}
+
+//Frees the center of coordinates with its frame, dropping a move on its way
+static void
+LL_center_free (LLCursorCenter *center)
+{
+  if (center->motion_source != 0)
+    g_source_remove (center->motion_source);
+
+  g_free (center);
 }
 
 
@@ -1154,8 +1897,10 @@ LL_center_coords_update (GimpSizeEntry *coords,
 static void
 LL_center_cursor_update (LLCursorCenter *center)
 {
+  LL_SESSION *ses = center->ses;
+
   gimp_preview_transform (center->preview,
-                          llvals.posx, llvals.posy,
+                          ses->vals.posx, ses->vals.posy,
                           &center->curx, &center->cury);
 }
 
@@ -1199,8 +1944,19 @@ LL_center_preview_events (GtkWidget   *widget,
 	switch (event->type)
 	{
 		case GDK_MOTION_NOTIFY:
-   			if (! (((GdkEventMotion *) event)->state & GDK_BUTTON1_MASK))
-     			break;
+			{
+				GdkEventMotion *mevent = (GdkEventMotion *) event;
+
+				if (! (mevent->state & GDK_BUTTON1_MASK))
+					break;
+
+				//the motions of a drag are coalesced : the cursor moves once a frame, where the last one is
+				gimp_preview_untransform (center->preview, mevent->x, mevent->y, &center->motion_x, &center->motion_y);
+
+				if (center->motion_source == 0)
+					center->motion_source = g_timeout_add (CURSOR_FRAME_MSEC, (GSourceFunc) LL_center_motion_frame, center);
+			}
+			break;
 
 		case GDK_BUTTON_PRESS:
       			{
@@ -1210,17 +1966,14 @@ LL_center_preview_events (GtkWidget   *widget,
        				{
       	   				gimp_preview_untransform (center->preview,bevent->x, bevent->y,&tx, &ty);
 
-            				LL_center_cursor_draw (center);
-
-				g_signal_handlers_block_by_func (center->coords, LL_center_coords_update, center);
-
-					gimp_size_entry_set_refval (GIMP_SIZE_ENTRY (center->coords), 0, tx);
-
-					gimp_size_entry_set_refval (GIMP_SIZE_ENTRY (center->coords), 1, ty);
-
-				g_signal_handlers_unblock_by_func (center->coords, LL_center_coords_update, center);
+					//a click moves the cursor at once, over a move of a drag still to come
+					if (center->motion_source != 0)
+					{
+						g_source_remove (center->motion_source);
+						center->motion_source = 0;
+					}
 
-					LL_center_coords_update (GIMP_SIZE_ENTRY (center->coords), center);
+					LL_center_move (center, tx, ty);
 				}
 			}
 			break;
@@ -1236,1047 +1989,1667 @@ LL_center_preview_events (GtkWidget   *widget,
 //Initialization (memory allocation + calculaion of values) of all the data structures of the plug-in
 //ie. layers, masks, tags, list_graph,
 //Calls a host of other functions
-static void init_ll_map()
+//The dialog answers meanwhile (see init_progress) : returns FALSE if it is cancelled
+//(with the masks of the layers not painted by it yet)
+static gboolean init_ll_map(LL_SESSION *ses)
 {
+	LL_TRACE_BEGIN("init_ll_map");
+
+	init_progress(ses, "Reading layers", 0.0);
  
 	// Get list of layers and no. of layers for image
-	layers = gimp_image_get_layers (image_id, &layer_num);
+	ses->layers = gimp_image_get_layers (ses->image_id, &ses->layer_num);
 
-	image_height = gimp_image_height(image_id);		
-	image_width  = gimp_image_width(image_id);
+	ses->image_height = gimp_image_height(ses->image_id);		
+	ses->image_width  = gimp_image_width(ses->image_id);
 
-	layer_code_mem_alloc();
+	ses->ll_map = ll_map_new(ses->image_width, ses->image_height, ses->layer_num);
+
+	//Arenas of the session : retrieved lists and flip dialog arrays
+	ses->session_arena = ll_arena_new(LL_ARENA_CHUNK, LL_MEM_GRAPH);
+	ses->dialog_arena = ll_arena_new(LL_ARENA_CHUNK, LL_MEM_DIALOG);
+
+	record_open(ses);
 		
-	layer_mem_alloc();
+	layer_mem_alloc(ses);
 
-	mask_mem_alloc();
+	mask_mem_alloc(ses);
 
-	extract_layer_code();
+	extract_layer_code(ses);
 
-	tags_mem_alloc();
+	if(!ses->init_cancelled)
+		extract_tags(ses);
 
-	extract_tags();
+	ses->init_done = !ses->init_cancelled;
+
+	LL_TRACE_END("init_ll_map");
+
+	return ses->init_done;
 }
-
-//Memory allocation for the layer_code array
-static void layer_code_mem_alloc()
-{
- gint	m, n;
-
-	// Dynamic memory allocation for pointer to pointer to pointer to gboolean
-	// Holds the Bitfield Pixel Map representing if a Layer exists at a particular Image Location
-	/*
-	layer_present = (gboolean ***)malloc(image_height * sizeof(*layer_present));
-	for(m = 0; m < image_height; m++)
+
+//Reports the progress of init_ll_map, fraction being done and text naming the stage (unless NULL),
+//to GIMP and in the dialog, then lets the dialog answer its events
+//Returns FALSE once the initialisation is cancelled
+static gboolean init_progress(LL_SESSION *ses, const gchar *text, gdouble fraction)
+{
+	if(text != NULL)
 	{
-		layer_present[m] = (gboolean **)malloc(image_width * sizeof(**layer_present));
-         
-		for(n = 0; n < image_width; n++)
-		{
-			layer_present[m][n] = (gboolean *)malloc(layer_num * sizeof(***layer_present));
-		}    
+		gimp_progress_set_text (text);
+
+		if(ses->init_bar != NULL)
+			gtk_progress_bar_set_text (ses->init_bar, text);
 	}
-	*/	
-	// Dynamic memory allocation for pointer to pointer to int
-	// Holds a Pixel Code which represents the layer ordering at that Pixel Location
-	layer_code = (gint **)malloc(image_height * sizeof(*layer_code));
-	for(m = 0; m < image_height; m++)
-	{
-		layer_code[m] = (gint *)malloc(image_width * sizeof(**layer_code));               
-	}
+
+	gimp_progress_update (fraction);
+
+	if(ses->init_bar != NULL)
+		gtk_progress_bar_set_fraction (ses->init_bar, fraction);
+
+	while(gtk_events_pending ())
+		gtk_main_iteration ();
+
+	return !ses->init_cancelled;
 }
 
-//Memory allocation for the layer and pr arrays
-static void layer_mem_alloc()
+//Handler of the responses of the dialog while it initialises : anything but OK cancels
+//(the labelling on the pool stops too, see extract_tags)
+static void init_response(GtkWidget *dialog, gint response, LL_SESSION *ses)
 {
-		//Dynamic memory allocation for array of layer's details
-		layer = (LL_LAYER *)malloc(layer_num * sizeof(LL_LAYER));
+	if(ses->init_done || response == GTK_RESPONSE_OK)
+		return;
 
-		//Dynamic memory allocation for array of layers as pixel regions
-		pr = (LL_PR_LAYER *)malloc(layer_num * sizeof(LL_PR_LAYER));
+	ses->init_cancelled = TRUE;
+
+	if(ses->ll_map != NULL)
+		ll_map_cancel(ses->ll_map);
 }
 
-//Initializes the values of the layer array
-static void layer_details()
+//Long task of the pool labelling the regions of the Region Map of the session (see extract_tags)
+//run by a worker only (ll_pool_fork_long), so that no join of the main thread runs it
+//Its end is posted to the main loop as an idle source
+static void init_label_task(gint first, gint last, gpointer data)
 {
- 	gint	i;
-	gboolean test;
+ LL_SESSION	*ses = data;
 
-	for(i = 0; i < layer_num; i++)
-	{
-
-		// Store layer id
-		(layer[i]).id = *(layers + i);
-
-		// Get offset values for all layers
-		test = gimp_drawable_offsets(*(layers+i), &((layer[i]).off_x), &((layer[i]).off_y));
+	ll_map_extract_tags(ses->ll_map);
 
-		// Get layer width and height
-		(layer[i]).width = gimp_drawable_width(*(layers+i));
-		(layer[i]).height = gimp_drawable_height(*(layers+i));
+	g_idle_add((GSourceFunc) init_label_done, ses);
+}
 
-		// Get layer alpha
-		(layer[i]).alpha = gimp_drawable_has_alpha(*(layers + i));
-
-		//If layer does not have an alpha channel add one	
-		if(!((layer[i]).alpha))
-		{
-			gimp_layer_add_alpha (*(layers+i));
-			(layer[i]).alpha = TRUE;
-		}
+//Idle source of init_label_task : the labelling is done (or cancelled)
+static gboolean init_label_done(LL_SESSION *ses)
+{
+	ses->init_labelled = TRUE;
 
-	}
+	return FALSE;
 }
-
-//Initializes all the layers as pixel regions
-static void pr_details()
+
+//Region of the Region Map at pixel x, y of the image (-1 outside the image)
+//ie. of the coarse map at x / map_scale, y / map_scale while the full one is labelled
+static gint region_at(LL_SESSION *ses, gint x, gint y)
 {
- GimpDrawable	*pr_drawable;
- gint		i;
- gint		rx, ry, rw, rh;
+	if(x < 0 || y < 0)
+		return -1;
+
+	return ll_map_region_at(ses->ll_map, x / ses->map_scale, y / ses->map_scale);
+}
+
+//Scales a rectangle of the Region Map up to the image space (clipped to the image)
+static void map_rect_scale(LL_SESSION *ses, gint *x, gint *y, gint *w, gint *h)
+{
+	*x *= ses->map_scale;
+	*y *= ses->map_scale;
+	*w = MIN(*w * ses->map_scale, ses->image_width - *x);
+	*h = MIN(*h * ses->map_scale, ses->image_height - *y);
+}
 
+//Coarse to fine labelling of a large image : the Region Map of the layer codes is labelled by refine_task
+//on the pool, and the session works meanwhile on a map sampling it every COARSE_FACTOR pixels (see ll_map_coarse)
+//labelled at once, so that the dialog opens without waiting for the full labelling
+//The masks painted by the pipeline stand until refine_swap (see commit_start)
+//Returns FALSE with nothing started for an image under COARSE_PIXELS or if the pool has no worker
+static gboolean refine_start(LL_SESSION *ses)
+{
+ LL_MAP		*coarse;
+
+	if(ll_pixels(ses->image_width, ses->image_height) < COARSE_PIXELS || ll_pool_threads() < 2)
+		return FALSE;
 
-	// Holds a Drawable to be Passed(Initialized) to a Pixel Region
-	pr_drawable = (GimpDrawable *)malloc(sizeof(GimpDrawable));
+	LL_TRACE_BEGIN("refine_start");
 
-	for(i = 0; i < layer_num; i++)
+	coarse = ll_map_coarse(ses->ll_map, COARSE_FACTOR);
+
+	if(coarse != NULL)
 	{
-		// Get pointer to drawable from drawable id
-		pr_drawable = gimp_drawable_get(*(layers+i));
+		ll_map_extract_tags(coarse);
 
-		//Check if Layer(Drawable) intersects with Image and get overlapping Rectangle/Region 
-		if(gimp_rectangle_intersect(0, 0 , image_width, image_height, (layer[i]).off_x, (layer[i]).off_y, (layer[i]).width, (layer[i]).height, &rx,&ry,&rw,&rh) )
-		{
-
-			//Process layer initialized as a pixel region
-			(pr[i]).process = 1;
+		ses->refine_map = ses->ll_map;
+		ses->ll_map = coarse;
+		ses->map_scale = COARSE_FACTOR;
 
-			//If Partial Overlap
-			if(rx > (layer[i]).off_x)
-			{
-				//If Partial Overlap
-				if(ry > (layer[i]).off_y)
-				{
-					gimp_pixel_rgn_init ( &((pr[i]).layer),pr_drawable,(rx - (layer[i]).off_x),(ry - (layer[i]).off_y), rw, rh, FALSE, FALSE);
-				}
-				else
-				{
+		ses->refine_source = g_idle_source_new();
+		g_source_set_callback(ses->refine_source, (GSourceFunc) refine_done, ses, NULL);
 
-					gimp_pixel_rgn_init ( &((pr[i]).layer), pr_drawable,(rx - (layer[i]).off_x),0, rw, rh, FALSE, FALSE);
-				}
+		ll_pool_fork_long(&ses->refine_group, refine_task, ses);
+	}
+
+	LL_TRACE_END("refine_start");
+
+	return coarse != NULL;
+}
+
+//Long task of the pool labelling the full Region Map of refine_start (run by a worker only, see ll_pool_fork_long)
+//Its end is posted to the main loop by attaching refine_source (see refine_done)
+static void refine_task(gint first, gint last, gpointer data)
+{
+ LL_SESSION	*ses = data;
+
+	if(ll_map_extract_tags(ses->refine_map))
+		g_source_attach(ses->refine_source, NULL);
+}
+
+//Idle source of refine_task : swaps the full Region Map in once it is labelled
+//and shows it (preview, flip dialog and selection) if the dialog is up
+static gboolean refine_done(LL_SESSION *ses)
+{
+	refine_swap(ses);
+
+	if(ses->preview != NULL)
+	{
+		ses->rg_boundary_call = 1;
+		gimp_preview_invalidate (GIMP_PREVIEW (ses->preview));
+	}
+
+	return FALSE;
+}
+
+//Shows in the dialog the regions of the coarse map whose masks wait for the full Region Map
+//(see commit_start)
+static void refine_status(LL_SESSION *ses)
+{
+ gchar	*text;
+ gint	l, n = 0;
+
+	if(ses->refine_label == NULL)
+		return;
+
+	for(l = 0; ses->commit_pending != NULL && l < ses->num_regions; l++)
+	{
+		if(ses->commit_pending[l])
+			n++;
+	}
+
+	if(n == 0)
+		text = g_strdup("Labelling the full image");
+	else
+		text = g_strdup_printf("Labelling the full image : the masks of %d region%s are committed once it is done", n, (n > 1) ? "s" : "");
+
+	gtk_label_set_text (GTK_LABEL (ses->refine_label), text);
+	g_free(text);
+}
+
+//Carries the UNDO array over from the coarse map to the full one : every flip of a coarse region
+//becomes the same flip of each region carried from it (carried, see ll_map_carry_lists)
+//An UNDO step grown beyond UNDO_FLIP_COUNT flips is dropped along with the steps before it
+static void undo_carry(LL_SESSION *ses, const gint *carried)
+{
+ LL_UNDO_ARRAY	*step, *undo;
+ gint		*first, *fine;
+ gint		i, j, k, c, f, n, coarse_regions, dropped = 0;
+
+	coarse_regions = ses->ll_map->num_regions;
+
+	//the regions carried from every coarse region : fine[first[c]] .. fine[first[c + 1] - 1]
+	first = g_new0(gint, coarse_regions + 1);
+	fine = g_new(gint, MAX(ses->refine_map->num_regions, 1));
+
+	for(i = 0; i < ses->refine_map->num_regions; i++)
+	{
+		if(carried[i] != -1)
+			first[carried[i] + 1]++;
+	}
+
+	for(c = 0; c < coarse_regions; c++)
+		first[c + 1] += first[c];
+
+	for(i = 0; i < ses->refine_map->num_regions; i++)
+	{
+		if(carried[i] != -1)
+			fine[first[carried[i]]++] = i;
+	}
+
+	for(c = coarse_regions; c > 0; c--)
+		first[c] = first[c - 1];
+
+	first[0] = 0;
+
+	step = g_new(LL_UNDO_ARRAY, 1);
+
+	//the steps undo reaches first (undo_index down to 0), then the ones beyond it
+	for(k = 0; k < UNDO_COUNT; k++)
+	{
+		i = (ses->undo_index - k + UNDO_COUNT) % UNDO_COUNT;
+		undo = &ses->undo_array[i];
+
+		if(undo->call_count < 0)
+			continue;
+
+		step->call_type = undo->call_type;
+		n = 0;
+
+		for(j = 0; j <= undo->call_count; j++)
+		{
+			c = undo->flips[j][2];
+
+			if(undo->flips[j][0] == -1 || undo->flips[j][1] == -1 || c < 0 || c >= coarse_regions)
+				continue;
+
+			if(n + first[c + 1] - first[c] > UNDO_FLIP_COUNT)
+				break;
+
+			for(f = first[c]; f < first[c + 1]; f++, n++)
+			{
+				step->flips[n][0] = undo->flips[j][0];
+				step->flips[n][1] = undo->flips[j][1];
+				step->flips[n][2] = fine[f];
+			}
+		}
+
+		//a step beyond undo_index (which undo does not reach) is emptied alone
+		if(j <= undo->call_count)
+		{
+			dropped = (i <= ses->undo_index) ? i + 1 : 0;
+			n = 0;
+
+			if(dropped > 0)
+				break;
+		}
+
+		undo->call_count = n - 1;
+		memcpy(undo->flips, step->flips, n * sizeof(undo->flips[0]));
+
+		for(j = n; j < UNDO_FLIP_COUNT; j++)
+		{
+			undo->flips[j][0] = -1;
+			undo->flips[j][1] = -1;
+			undo->flips[j][2] = -1;
+		}
+	}
+
+	//the steps left from undo_index down move to the start of the array, the rest is emptied
+	if(dropped > 0)
+	{
+		memmove(ses->undo_array, ses->undo_array + dropped, (ses->undo_index + 1 - dropped) * sizeof(LL_UNDO_ARRAY));
+		ses->undo_index -= dropped;
+
+		for(i = ses->undo_index + 1; i < UNDO_COUNT; i++)
+		{
+			ses->undo_array[i].call_type = 0;
+			ses->undo_array[i].call_count = -1;
+
+			for(j = 0; j < UNDO_FLIP_COUNT; j++)
+			{
+				ses->undo_array[i].flips[j][0] = -1;
+				ses->undo_array[i].flips[j][1] = -1;
+				ses->undo_array[i].flips[j][2] = -1;
+			}
+		}
+	}
+
+	g_free(step);
+	g_free(fine);
+	g_free(first);
+}
+
+//Swaps the full Region Map in for the coarse one, waiting for refine_task :
+//the stacking chosen on the coarse map is carried over (ll_map_carry_lists)
+//along with the UNDO array (undo_carry), and the masks of the regions it changes are committed
+static void refine_swap(LL_SESSION *ses)
+{
+ gint	*carried;
+
+	LL_TRACE_BEGIN("refine_swap");
+
+	ll_pool_join(&ses->refine_group);
+
+	g_source_destroy(ses->refine_source);
+	g_source_unref(ses->refine_source);
+	ses->refine_source = NULL;
+
+	preview_render_stop(ses);
+
+	if(ses->refine_label != NULL)
+	{
+		gtk_widget_destroy (ses->refine_label);
+		ses->refine_label = NULL;
+	}
+
+	carried = ll_map_carry_lists(ses->refine_map, ses->ll_map, ses->map_scale);
+	undo_carry(ses, carried);
+	g_free(carried);
+
+	ll_map_free(ses->ll_map);
+
+	ses->ll_map		= ses->refine_map;
+	ses->refine_map		= NULL;
+	ses->map_scale		= 1;
+	ses->num_regions	= ses->ll_map->num_regions;
+	ses->graph		= ses->ll_map->graph;
+	ses->reg_affected	= ses->ll_map->reg_affected;
+
+	//the arrays of the regions of the coarse map (the view is computed again)
+	g_free(ses->commit_pending);
+	g_free(ses->view_buf);
+	g_free(ses->view_top);
+	ses->commit_pending = NULL;
+	ses->view_buf = NULL;
+	ses->view_top = NULL;
+
+	commit_start(ses);
+
+	LL_TRACE_END("refine_swap");
+}
+
+//Ends the coarse to fine labelling of refine_start, waiting for refine_task :
+//the full Region Map is swapped in if swap, else its labelling is cancelled and it is dropped
+//with the session on the coarse map
+//Nothing is done unless the session works on a coarse map
+static void refine_finish(LL_SESSION *ses, gboolean swap)
+{
+	if(ses->refine_map == NULL)
+		return;
+
+	if(swap)
+	{
+		refine_swap(ses);
+		return;
+	}
+
+	ll_map_cancel(ses->refine_map);
+	ll_pool_join(&ses->refine_group);
+
+	ses->refine_label = NULL;
+
+	g_source_destroy(ses->refine_source);
+	g_source_unref(ses->refine_source);
+	ses->refine_source = NULL;
+
+	ll_map_free(ses->refine_map);
+	ses->refine_map = NULL;
+}
+
+//Frees everything allocated for the session by init_ll_map and the dialog
+//Detaching the drawables flushes what is left of the painted masks
+static void free_ll_map(LL_SESSION *ses)
+{
+ gint	i;
+
+	refine_finish(ses, FALSE);
+
+	ll_arena_free(ses->dialog_arena);
+	ll_arena_free(ses->session_arena);
+
+	ses->dialog_arena		= NULL;
+	ses->session_arena		= NULL;
+	ses->lists			= NULL;
+	ses->sorted_layer_index	= NULL;
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		if( (ses->pr[i]).process )
+			gimp_drawable_detach ((ses->pr[i]).layer.drawable);
+
+		if( (ses->pr_mask[i]).process )
+			gimp_drawable_detach ((ses->pr_mask[i]).mask.drawable);
+	}
+
+	if(ses->drawable_preview != NULL)
+	{
+		gimp_drawable_detach (ses->drawable_preview);
+		ses->drawable_preview = NULL;
+	}
+
+	if(ses->preview_image_id != 0)
+	{
+		gimp_image_delete (ses->preview_image_id);
+		ses->preview_image_id = 0;
+	}
+
+	if(ses->layer_mips != NULL)
+	{
+		for(i = 0; i < ses->layer_num * PREVIEW_MIP_LEVELS; i++)
+		{
+			if(ses->layer_mips[i] != NULL)
+				ll_tiles_free(ses->layer_mips[i]);
+		}
+	}
+
+	if(ses->thumbs != NULL)
+	{
+		for(i = 0; i < ses->layer_num; i++)
+		{
+			if(ses->thumbs[i] != NULL)
+				g_object_unref(ses->thumbs[i]);
+		}
+	}
+
+	g_free(ses->thumbs);
+	g_free(ses->layer_mips);
+	g_free(ses->layer_opacity);
+	g_free(ses->view_buf);
+	g_free(ses->view_dirty);
+	g_free(ses->view_regions);
+	g_free(ses->view_cols);
+	g_free(ses->view_rows);
+	g_free(ses->view_top);
+	g_free(ses->commit_pending);
+	ses->thumbs = NULL;
+	ses->layer_mips = NULL;
+	ses->layer_opacity = NULL;
+	ses->view_buf = NULL;
+	ses->view_dirty = NULL;
+	ses->view_regions = NULL;
+	ses->view_cols = NULL;
+	ses->view_rows = NULL;
+	ses->view_top = NULL;
+	ses->commit_pending = NULL;
+
+	free(ses->layer);
+	free(ses->pr);
+	free(ses->mask);
+	free(ses->pr_mask);
+	g_free(ses->layers);
+
+	ll_map_free(ses->ll_map);
+
+	//the pooled temporaries are kept between the flips of a session only
+	ll_scratch_trim();
+
+	ses->ll_map		= NULL;
+	ses->graph		= NULL;
+	ses->reg_affected	= NULL;
+}
+
+//Memory allocation for the layer and pr arrays
+static void layer_mem_alloc(LL_SESSION *ses)
+{
+		//Dynamic memory allocation for array of layer's details
+		ses->layer = (LL_LAYER *)malloc(ses->layer_num * sizeof(LL_LAYER));
+
+		//Dynamic memory allocation for array of layers as pixel regions
+		ses->pr = (LL_PR_LAYER *)malloc(ses->layer_num * sizeof(LL_PR_LAYER));
+}
+
+//Initializes the values of the layer array
+static void layer_details(LL_SESSION *ses)
+{
+ 	gint	i;
+	gboolean test;
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+
+		// Store layer id
+		(ses->layer[i]).id = *(ses->layers + i);
+
+		// Get offset values for all layers
+		test = gimp_drawable_offsets(*(ses->layers+i), &((ses->layer[i]).off_x), &((ses->layer[i]).off_y));
+
+		// Get layer width and height
+		(ses->layer[i]).width = gimp_drawable_width(*(ses->layers+i));
+		(ses->layer[i]).height = gimp_drawable_height(*(ses->layers+i));
+
+		// Get layer alpha
+		(ses->layer[i]).alpha = gimp_drawable_has_alpha(*(ses->layers + i));
+
+		//If layer does not have an alpha channel add one	
+		if(!((ses->layer[i]).alpha))
+		{
+			gimp_layer_add_alpha (*(ses->layers+i));
+			(ses->layer[i]).alpha = TRUE;
+		}
+
+	}
+}
+
+//Initializes all the layers as pixel regions
+static void pr_details(LL_SESSION *ses)
+{
+ GimpDrawable	*pr_drawable;
+ gint		i;
+ gint		rx, ry, rw, rh;
+
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		// Get pointer to drawable from drawable id
+		// Holds a Drawable to be Passed(Initialized) to a Pixel Region
+		// (detached by free_ll_map)
+		pr_drawable = gimp_drawable_get(*(ses->layers+i));
+
+		//Check if Layer(Drawable) intersects with Image and get overlapping Rectangle/Region 
+		if(gimp_rectangle_intersect(0, 0 , ses->image_width, ses->image_height, (ses->layer[i]).off_x, (ses->layer[i]).off_y, (ses->layer[i]).width, (ses->layer[i]).height, &rx,&ry,&rw,&rh) )
+		{
+
+			//Process layer initialized as a pixel region
+			(ses->pr[i]).process = 1;
+
+			//If Partial Overlap
+			if(rx > (ses->layer[i]).off_x)
+			{
+				//If Partial Overlap
+				if(ry > (ses->layer[i]).off_y)
+				{
+					gimp_pixel_rgn_init ( &((ses->pr[i]).layer),pr_drawable,(rx - (ses->layer[i]).off_x),(ry - (ses->layer[i]).off_y), rw, rh, FALSE, FALSE);
+				}
+				else
+				{
+
+					gimp_pixel_rgn_init ( &((ses->pr[i]).layer), pr_drawable,(rx - (ses->layer[i]).off_x),0, rw, rh, FALSE, FALSE);
+				}
 			}
 			//If Partial Overlap
-			else if(ry > (layer[i]).off_y)
+			else if(ry > (ses->layer[i]).off_y)
 			{
-				gimp_pixel_rgn_init ( &((pr[i]).layer),pr_drawable,0,(ry - (layer[i]).off_y), rw, rh, FALSE, FALSE);
+				gimp_pixel_rgn_init ( &((ses->pr[i]).layer),pr_drawable,0,(ry - (ses->layer[i]).off_y), rw, rh, FALSE, FALSE);
 			}
 			//If Complete Overlap || even Partial
 			else
 			{
-				gimp_pixel_rgn_init ( &((pr[i]).layer), pr_drawable, 0, 0, rw, rh, FALSE, FALSE);
+				gimp_pixel_rgn_init ( &((ses->pr[i]).layer), pr_drawable, 0, 0, rw, rh, FALSE, FALSE);
 			}
 			pr_drawable++;
 		}
 		//If No overlap then ignore Layer(Drawable) ie. dont include in processing
 		else
 		{
-			(pr[i]).process = 0;
+			(ses->pr[i]).process = 0;
+			gimp_drawable_detach(pr_drawable);
 		}
 	}
 }
 
 //Memory allocation for the mask and pr_mask arrays
-static void mask_mem_alloc()
+static void mask_mem_alloc(LL_SESSION *ses)
 {
 		//Dynamic memory allocation for array of mask's details
-		mask = (LL_MASK *)malloc(layer_num * sizeof(LL_MASK));
+		ses->mask = (LL_MASK *)malloc(ses->layer_num * sizeof(LL_MASK));
 
 		//Dynamic memory allocation for array of masks as pixel regions
-		pr_mask = (LL_PR_MASK *)malloc(layer_num * sizeof(LL_PR_MASK));
+		ses->pr_mask = (LL_PR_MASK *)malloc(ses->layer_num * sizeof(LL_PR_MASK));
 }
 
 //Initializes the values of the mask array
-static void create_masks_details()
+static void create_masks_details(LL_SESSION *ses)
 {
  	gint i;
 
-	for(i = 0 ; i < layer_num ; i++)
+	for(i = 0 ; i < ses->layer_num ; i++)
 	{
 		//if layer does not already have a mask
-		if(gimp_layer_get_mask ((layer[i]).id) == -1)
+		if(gimp_layer_get_mask ((ses->layer[i]).id) == -1)
 		{
-			(mask[i]).exists = TRUE;
-			(mask[i]).mask_id = gimp_layer_create_mask ((layer[i]).id, GIMP_ADD_ALPHA_MASK);
-			(mask[i]).layer_id = (layer[i]).id;
+			(ses->mask[i]).exists = TRUE;
+			(ses->mask[i]).mask_id = gimp_layer_create_mask ((ses->layer[i]).id, GIMP_ADD_ALPHA_MASK);
+			(ses->mask[i]).layer_id = (ses->layer[i]).id;
 			//gimp_drawable_offsets((mask[i]).mask_id,&((mask[i]).off_x),&((mask[i]).off_y));
-			gimp_drawable_offsets((mask[i]).layer_id,&((mask[i]).off_x),&((mask[i]).off_y));
-			(mask[i]).width = gimp_drawable_width ((mask[i]).mask_id);
-			(mask[i]).height = gimp_drawable_height ((mask[i]).mask_id);
+			gimp_drawable_offsets((ses->mask[i]).layer_id,&((ses->mask[i]).off_x),&((ses->mask[i]).off_y));
+			(ses->mask[i]).width = gimp_drawable_width ((ses->mask[i]).mask_id);
+			(ses->mask[i]).height = gimp_drawable_height ((ses->mask[i]).mask_id);
 		}
 		else
 		{
-			(mask[i]).exists = TRUE;
-			(mask[i]).mask_id = gimp_layer_get_mask ((layer[i]).id);
-			(mask[i]).layer_id = (layer[i]).id;
+			(ses->mask[i]).exists = TRUE;
+			(ses->mask[i]).mask_id = gimp_layer_get_mask ((ses->layer[i]).id);
+			(ses->mask[i]).layer_id = (ses->layer[i]).id;
 			//gimp_drawable_offsets((mask[i]).mask_id,&((mask[i]).off_x),&((mask[i]).off_y));
-			gimp_drawable_offsets((mask[i]).layer_id,&((mask[i]).off_x),&((mask[i]).off_y));
-			(mask[i]).width = gimp_drawable_width ((mask[i]).mask_id);
-			(mask[i]).height = gimp_drawable_height ((mask[i]).mask_id);
+			gimp_drawable_offsets((ses->mask[i]).layer_id,&((ses->mask[i]).off_x),&((ses->mask[i]).off_y));
+			(ses->mask[i]).width = gimp_drawable_width ((ses->mask[i]).mask_id);
+			(ses->mask[i]).height = gimp_drawable_height ((ses->mask[i]).mask_id);
 		}
 	}
 }
 //Initializes all the masks as pixel regions
-static void pr_mask_details()
+static void pr_mask_details(LL_SESSION *ses)
 {
 	GimpDrawable	*pr_mask_drawable;
 	gint		i;
 	gint		rx, ry, rw, rh;
 
 
-	// Holds a Drawable to be Passed(Initialized) to a Pixel Region
-	pr_mask_drawable = (GimpDrawable *)malloc(sizeof(GimpDrawable));
-
 	//g_printf("\n\nEnter PR MASK DETAILS");
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
 		//masks are initialized as pixel regions for all layers
+		//Holds a Drawable to be Passed(Initialized) to a Pixel Region (detached by free_ll_map)
 		
-		pr_mask_drawable = gimp_drawable_get( (mask[i]).mask_id );
+		pr_mask_drawable = gimp_drawable_get( (ses->mask[i]).mask_id );
 
 			//Check if Mask(Drawable) intersects with Image and get overlapping Rectangle/Region 
 			//similar to check off layers cause mask offsets are initialized as layer offsets
-			if(gimp_rectangle_intersect(0, 0 , image_width, image_height, (mask[i]).off_x, (mask[i]).off_y, (mask[i]).width, (mask[i]).height, &rx,&ry,&rw,&rh) )
+			if(gimp_rectangle_intersect(0, 0 , ses->image_width, ses->image_height, (ses->mask[i]).off_x, (ses->mask[i]).off_y, (ses->mask[i]).width, (ses->mask[i]).height, &rx,&ry,&rw,&rh) )
 			{
-				(pr_mask[i]).process = 1;
+				(ses->pr_mask[i]).process = 1;
 
 				//If Partial Overlap
-				if(rx > (mask[i]).off_x)
+				if(rx > (ses->mask[i]).off_x)
 				{
 					//If Partial Overlap
-					if(ry > (mask[i]).off_y)
+					if(ry > (ses->mask[i]).off_y)
 					{
-						gimp_pixel_rgn_init ( &((pr_mask[i]).mask),pr_mask_drawable,(rx - (mask[i]).off_x),(ry - (mask[i]).off_y), rw, rh, FALSE, FALSE);
+						gimp_pixel_rgn_init ( &((ses->pr_mask[i]).mask),pr_mask_drawable,(rx - (ses->mask[i]).off_x),(ry - (ses->mask[i]).off_y), rw, rh, FALSE, FALSE);
 					}
 					else
 					{
-						gimp_pixel_rgn_init ( &((pr_mask[i]).mask), pr_mask_drawable,(rx - (mask[i]).off_x),0, rw, rh, FALSE, FALSE);
+						gimp_pixel_rgn_init ( &((ses->pr_mask[i]).mask), pr_mask_drawable,(rx - (ses->mask[i]).off_x),0, rw, rh, FALSE, FALSE);
 					}
 				}
 				//If Partial Overlap
-				else if(ry > (mask[i]).off_y)
+				else if(ry > (ses->mask[i]).off_y)
 				{
-					gimp_pixel_rgn_init ( &((pr_mask[i]).mask),pr_mask_drawable,0,(ry - (mask[i]).off_y), rw, rh, FALSE, FALSE);
+					gimp_pixel_rgn_init ( &((ses->pr_mask[i]).mask),pr_mask_drawable,0,(ry - (ses->mask[i]).off_y), rw, rh, FALSE, FALSE);
 				}
 				//If Complete Overlap || even Partial
 				else
 				{
-					gimp_pixel_rgn_init ( &((pr_mask[i]).mask), pr_mask_drawable, 0, 0, rw, rh, FALSE, FALSE);
+					gimp_pixel_rgn_init ( &((ses->pr_mask[i]).mask), pr_mask_drawable, 0, 0, rw, rh, FALSE, FALSE);
 				}
 				pr_mask_drawable++;
 			}
 			//If No overlap then ignore Layer(Drawable)
 			else
 			{
-				(pr_mask[i]).process = 0;
+				(ses->pr_mask[i]).process = 0;
+				gimp_drawable_detach(pr_mask_drawable);
 			}
 	}
 }
 
 //Calculates the layer code for each pixel in the image space
-static void extract_layer_code()
+static void extract_layer_code(LL_SESSION *ses)
 {
-	guchar		*pr_buf;
-	gint		rx, ry, rw, rh;
-	gdouble		l_opacity;
-	gint		y_off, x_off;
-	gint		m, n, i;
-	gint 		x, y;
-	gint 		bytes;
-	
+	LL_TRACE_BEGIN("extract_layer_code");
+
+	LL_STATS_BEGIN(LL_PHASE_LAYER_DETAILS);
+
 	//Get Details of all layers
-	layer_details();
+	layer_details(ses);
 
 	//Get layers as pixel regions
-	pr_details();
+	pr_details(ses);
+
+	LL_STATS_END(LL_PHASE_LAYER_DETAILS);
+	LL_STATS_SET(LL_COUNT_LAYERS, ses->layer_num);
+
+	LL_STATS_BEGIN(LL_PHASE_MASK_CREATION);
 
 	//need to verify position of this
 	//Make Details of all layers
-	create_masks_details();
+	create_masks_details(ses);
 
 	//Get masks as pixel regions
-	pr_mask_details();
+	pr_mask_details(ses);
 
 	//Adds masks to all layers
-	add_masks();
+	add_masks(ses);
+
+	LL_STATS_END(LL_PHASE_MASK_CREATION);
+
+	LL_STATS_BEGIN(LL_PHASE_LAYER_CODE);
+
+	//the layers are kept for the preview as they are read
+	preview_cache_new(ses);
+
+	//A recorded session keeps whole layers, else the layers go through the pipeline in strips
+	if(ses->record_file != NULL)
+		code_layers(ses);
+	else
+		pipe_layers(ses);
+
+	LL_STATS_END(LL_PHASE_LAYER_CODE);
+
+	LL_TRACE_END("extract_layer_code");
+}
+
+//Calculates the layer code for each pixel in the image space one whole layer after the other
+//(each layer is recorded as it is read)
+//The masks are left to mask_set_pixel
+static void code_layers(LL_SESSION *ses)
+{
+	guchar		*pr_buf;
+	gdouble		l_opacity;
+	gint		i;
+	gint 		bytes;
+	gboolean	present;
+
+	ses->masks_painted = FALSE;
 
 	//Make Pixel Map
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
+		if(!init_progress(ses, NULL, 0.7 * i / ses->layer_num))
+			break;
+
+		present = FALSE;
+
 	//If Pixel Region has been initialized for the ith Layer(Drawable)
 	//then process Pixel Region
-		if( (pr[i]).process == 1)
+		if( (ses->pr[i]).process == 1)
 		{
 			//Get Opacity of Pixel Region ie. Layer(Drawable) held by Pixel Region
-			l_opacity = gimp_layer_get_opacity( ((pr[i]).layer.drawable)->drawable_id);
+			l_opacity = gimp_layer_get_opacity( ((ses->pr[i]).layer.drawable)->drawable_id);
 
 			//Get bytes per pixel of Pixel Region (Layer)
-			bytes = (pr[i]).layer.bpp;
+			bytes = (ses->pr[i]).layer.bpp;
 
 			//If Opacity is 0 , assume Layer absent at all its Pixel Locations
 			if(l_opacity != 0.0)
 			{
-				//This Maps the Initial Pixel Location of the Pixel Region 
-				//to the corresponding Image Pixel Location 
+				//Pixel Region covers the part of the Layer (Drawable) inside the Image
+				//starting at Layer offset + Pixel Region offset in the Image space
+				pr_buf = ll_scratch_get ((gsize) (ses->pr[i]).layer.w * (ses->pr[i]).layer.h * bytes);
+				LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) (ses->pr[i]).layer.w * (ses->pr[i]).layer.h * bytes);
 
-				y_off = (layer[i]).off_y + (pr[i]).layer.y;
-				x_off = (layer[i]).off_x + (pr[i]).layer.x;
-
-				//Character Buffer to hold Pixel returned by gimp_pixel_rgn_get_pixel()
-				//pr_buf = (gchar *)malloc( (pr_layer[i]).bpp * sizeof(gchar) * pr_layer[i].w );
-				//pr_buf = g_new (guchar, (pr[i]).layer.w * bytes);
-				pr_buf = g_new (guchar, (pr[i]).layer.w * (pr[i]).layer.h * bytes);
+				gimp_pixel_rgn_get_rect( &((ses->pr[i]).layer), pr_buf, (ses->pr[i]).layer.x, (ses->pr[i]).layer.y, (ses->pr[i]).layer.w, (ses->pr[i]).layer.h);
 
-				gimp_pixel_rgn_get_rect( &((pr[i]).layer), pr_buf, 0, 0, (pr[i]).layer.w, (pr[i]).layer.h);
+				//Layer is Present wherever its Alpha Value is Non Zero
+				//or at all its Pixel Locations if it does not have an Alpha Channel
+				ll_map_add_layer(ses->ll_map, i, pr_buf, bytes, (ses->layer[i]).alpha,
+						 (ses->layer[i]).off_x + (ses->pr[i]).layer.x, (ses->layer[i]).off_y + (ses->pr[i]).layer.y,
+						 (ses->pr[i]).layer.w, (ses->pr[i]).layer.h);
 
-				for (y = 0; y < ( (pr[i]).layer.h ); y++)
-				{
-					//gimp_pixel_rgn_get_row( &((pr[i]).layer), pr_buf, 0, y, (pr[i]).layer.w);
-					
-					for (x = 0; x < ( (pr[i]).layer.w ); x++)
-					{
-						//Returns Pixel at an Offset x,y of the Pixel Region
-						//gimp_pixel_rgn_get_pixel (&pr_layer[i], pr_buf, x, y);
-
-						//If Pixel Region ie. Layer(Drawable) held by Pixel Region 
-						//has an Alpha Channel
-						if((layer[i]).alpha)
-						{
-							//If Alpha Value at Pixel is Non Zero
-							//Layer is Present at that Pixel
-							//if(*(pr_buf  +  (x * bytes) + (bytes - 1) ) != 0)
-							if(*(pr_buf  +  (y * ( (pr[i]).layer.w ) * bytes) + (x * bytes) + (bytes - 1) ) != 0)
-							{
-			 					//layer_present[y_off - (pr[i]).layer.y + y][x_off - (pr[i]).layer.x + x][i] = 1;
-								layer_code[y_off - (pr[i]).layer.y + y][x_off - (pr[i]).layer.x + x] += 1 << i;
-								//layer_code[y_off + y][x_off + x] += 1 << i;
-
-							}
-						}
-					//If Pixel Region ie. Layer(Drawable) held by Pixel Region does not 
-					//have an Alpha Channel assume Layer is Present at that Pixel
-						else
-						{
-		 					//layer_present[y_off + y][x_off + x][i] = 1;
-							layer_code[y_off  - (pr[i]).layer.y + y][x_off - (pr[i]).layer.x + x] += 1 << i;
-							//layer_code[y_off + y][x_off + x] += 1 << i;
-						}
-					}
+				preview_cache_rows(ses, i, pr_buf, 0, (ses->pr[i]).layer.h);
+
+				record_layer(ses, i, pr_buf, bytes, l_opacity / 100.0,
+					     (ses->layer[i]).off_x + (ses->pr[i]).layer.x, (ses->layer[i]).off_y + (ses->pr[i]).layer.y,
+					     (ses->pr[i]).layer.w, (ses->pr[i]).layer.h);
 
-			 	}
+				present = TRUE;
+
+				LL_STATS_FREE(LL_MEM_PIXELS, (gsize) (ses->pr[i]).layer.w * (ses->pr[i]).layer.h * bytes);
+				ll_scratch_put(pr_buf);
 			}
 		}
+
+		if(!present)
+		{
+			record_layer(ses, i, NULL, 4, 0.0, 0, 0, 0, 0);
+		}
 	}
-}
+}
 
-//Allocates memory for the tags array which holds the tags calculated for the present layers in extract_tags
-//Also allocate memory for old_tags which hold the tags from a previous run of local layering from the TAGS Parasite
-static void tags_mem_alloc()
-{
-	tags = (gint *)malloc(image_width * image_height * sizeof(gint));
-
-	old_tags = (gint *)malloc(image_height * image_width * sizeof(gint));
-}
-
-//Calculates the tags array for all the pixels in the images space
-//Calculates number of regions, List_Graph : Lists and Edges
-static void extract_tags()
-{
- LL_QUEUE	seeds,seeds1;
- LL_QUEUE	to_expand,to_expand1;
- LL_OFS		ofs[CONNECTIVITY] = {{-1,0},{1,0},{0,-1},{0,1}};
- gint		**tag_adj;
- gint		cur_tag, cur_tag1, *tags1;
- gint		seed, kind;
- gint		seed_temp, r, c;
- gint		n;
- gint		i,j,k,l,s;
- gint		px, py, rg_tag;
- gint		lfm;
-
-	tags1 = (gint *)malloc(image_height * image_width * sizeof(gint));	
-	for(i = 0; i < image_height * image_width; i++)
-		tags1[i] = 0;
-
-	//INITIALIZATION 1
- 	tags1[0] = -1;
- 	cur_tag1 = 0;
- 	queue_init(&seeds1);
- 	queue_push(&seeds1,0);
- 	queue_init(&to_expand1);
-	
-	//REGION GROWING ALGORITHM 1 : To calculate Number of Regions
-	while(!queue_isempty(&seeds1))
+//Rows y .. y + h - 1 of the image which are inside strip s, as *sy .. *sy + *sh - 1
+//Returns FALSE if there are none
+static gboolean strip_rows(gint y, gint h, const LL_STRIP *s, gint *sy, gint *sh)
+{
+	*sy = MAX(y, s->y);
+	*sh = MIN(y + h, s->y + s->h) - *sy;
+
+	return *sh > 0;
+}
+
+//Reads rows y .. y + h - 1 of the present layers from GIMP into a new strip
+//with room for the masks too if they are painted by the pipeline
+static LL_STRIP * strip_read(LL_SESSION *ses, gint y, gint h, const gboolean *present, gboolean paint)
+{
+ LL_STRIP	*s;
+ gint		i;
+ gint		ly, sy, sh;
+
+	LL_TRACE_BEGIN_ARG("strip_read", "row", y);
+
+	s = g_new0(LL_STRIP, 1);
+	s->y = y;
+	s->h = h;
+	s->pixels = g_new0(guchar *, ses->layer_num);
+	s->masks  = g_new0(guchar *, ses->layer_num);
+
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		//Get a seed from the seeds queue
- 		seed = queue_pop(&seeds1);
+		//Pixel Region covers the part of the Layer (Drawable) inside the Image
+		//starting at Layer offset + Pixel Region offset in the Image space
+		ly = (ses->layer[i]).off_y + (ses->pr[i]).layer.y;
 
- 		if(tags1[seed] != -1)
-		{//seed has been evaluated
- 			continue;
-		}
-		//Get Fresh Tag		
- 		cur_tag1++;
-
-		//Assign tag to tags1[seed]
- 		tags1[seed] = cur_tag1;
-
-		//Push seed into to_expand1 queue
- 		queue_push(&to_expand1,seed);
-
-		//Get Layer code for pixel
-		kind = layer_code[seed/image_width][seed%image_width];		
-
-		//while to_expand queue is not empty
-		while( !queue_isempty(&to_expand1) )
-		{
-			seed_temp = queue_pop(&to_expand1);
-			r = seed_temp / image_width;
-			c = seed_temp % image_width;
-			
-			for(i = 0; i < 4; i++)
-			{
-				if((r + ofs[i].y >= image_height) || (r + ofs[i].y < 0) )
-					continue;
-				
-				if((c + ofs[i].x >= image_width) || (c + ofs[i].x < 0) )
-					continue;
-				
-				n = (r + ofs[i].y)*image_width + c + ofs[i].x;
-				
-				if(layer_code[n/image_width][n%image_width] == kind)
-				{	
-					if(tags1[n] == cur_tag1)
-						continue;
-					
-					tags1[n] = cur_tag1;
-					
-					queue_push(&to_expand1,n);
-				}
-				else if (tags1[n] != 0)
-				{	
-					//if(tags1[n] != -1)
-					//{
-					//	tag_adj[cur_tag-1][tags[n]-1] = 1;
-					//}
-				}
-				else
-				{	
-					tags1[n] = -1;
-					queue_push(&seeds1,n);
-				}
-			}
+		if(present[i] && strip_rows(ly, (ses->pr[i]).layer.h, s, &sy, &sh))
+		{
+			s->pixels[i] = ll_scratch_get ((gsize) (ses->pr[i]).layer.w * sh * (ses->pr[i]).layer.bpp);
+			LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) (ses->pr[i]).layer.w * sh * (ses->pr[i]).layer.bpp);
+
+			gimp_pixel_rgn_get_rect( &((ses->pr[i]).layer), s->pixels[i], (ses->pr[i]).layer.x, (ses->pr[i]).layer.y + (sy - ly), (ses->pr[i]).layer.w, sh);
 		}
-	}
-
-	//REGION GROWING ALGORITHM 2 : To Calculate ListGraph
-
-	//Store number of regions present in GIMP Image
-	num_regions = cur_tag1;
-
-	//INITIALIZATION 2 : MEMORY ALLOCATION
-	graph_mem_alloc();
-
-	//Initialize the ListGraph Lists with 0 values
-	graph_lists_init();
-
-	//Initialize temporary lists values with -1
-	init_retrieval_list();
-
-	//Memory allocation and initialization for tag_adj array
-	tag_adj = (gint **)malloc(num_regions * sizeof(*tag_adj));
-	for(i = 0;i < num_regions; i++)
-	{
-		tag_adj[i] = (gint *)malloc(num_regions * sizeof(**tag_adj));
-		for(j = 0; j < cur_tag1; j++)
-			tag_adj[i][j] = 0;
-	}
-
-	
-	// INIT 2
-	for(i = 0; i < image_height * image_width; i++)
-		tags[i] = 0;
-
-
-	tags[0] = -1;
-	cur_tag = 0;
-	queue_init(&seeds);
-	queue_push(&seeds,0);
-	queue_init(&to_expand);
-
-	// ALGORITHM 2
-	while(!queue_isempty(&seeds))
-	{		
-		seed = queue_pop(&seeds);
 
-		if(tags[seed] != -1)		
-			continue;
+		//Every pixel of the mask is painted so the mask is not read
+		ly = (ses->mask[i]).off_y + (ses->pr_mask[i]).mask.y;
 
-		cur_tag++;			
-		tags[seed] = cur_tag;		
-
-		queue_push(&to_expand,seed);
-
-		kind = layer_code[seed/image_width][seed%image_width];
-		s = 1;
-
-		//Calculate layers present at that pixel and put it into ListGraph
-		for (l = 0; l < layer_num; l++)
-		{
-			if (kind & (1 << l))
-			{
-				lists[cur_tag-1][l] = 0;
-				graph->lists[cur_tag-1][l] = s;
-				s++;
-			}
-		}
-
-		while( !queue_isempty(&to_expand) )
-		{
-			seed_temp = queue_pop(&to_expand);
-			r = seed_temp / image_width;
-			c = seed_temp % image_width;
-		
-			for(i = 0; i < 4; i++)
-			{
-				if((r + ofs[i].y >= image_height) || (r + ofs[i].y < 0) )
-					continue;
-		
-				if((c + ofs[i].x >= image_width) || (c + ofs[i].x < 0) )
-					continue;
-		
-				n = (r + ofs[i].y)*image_width + c + ofs[i].x;
-			
-				if(layer_code[n/image_width][n%image_width] == kind)
-				{	
-					if(tags[n] == cur_tag)
-						continue;
-				
-					tags[n] = cur_tag;
-				
-					queue_push(&to_expand,n);
-				
-				}
-				else if (tags[n] != 0)
-				{	
-					if(tags[n] != -1)
-					{						
-						tag_adj[cur_tag-1][tags[n]-1] = 1;
-						tag_adj[tags[n]-1][cur_tag-1] = 1;
-					}
-				}
-				else
-				{	
-					tags[n] = -1;
-					queue_push(&seeds,n);
-				}
-			}	
+		if(paint && (ses->pr_mask[i]).process && strip_rows(ly, (ses->pr_mask[i]).mask.h, s, &sy, &sh))
+		{
+			s->masks[i] = ll_scratch_get ((gsize) (ses->pr_mask[i]).mask.w * sh);
+			LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) (ses->pr_mask[i]).mask.w * sh);
 		}
-	}
-
-	num_regions = cur_tag;
-
-	//Initialize the ListGraph Edges with 0 values
-	graph_edges_init();
+	}
+
+	LL_TRACE_END("strip_read");
+
+	return s;
+}
+
+//Adds the layers of strip s to the layer codes of its rows,
+//labels these rows (a map in tiles) and paints the masks of the strip from the layer codes
+static void strip_code(LL_SESSION *ses, LL_STRIP *s)
+{
+ gint		i;
+ gint		ly, sy, sh;
+
+	LL_TRACE_BEGIN_ARG("strip_code", "row", s->y);
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		ly = (ses->layer[i]).off_y + (ses->pr[i]).layer.y;
+
+		//Layer is Present wherever its Alpha Value is Non Zero
+		//or at all its Pixel Locations if it does not have an Alpha Channel
+		if(s->pixels[i] != NULL && strip_rows(ly, (ses->pr[i]).layer.h, s, &sy, &sh))
+			ll_map_add_layer(ses->ll_map, i, s->pixels[i], (ses->pr[i]).layer.bpp, (ses->layer[i]).alpha,
+					 (ses->layer[i]).off_x + (ses->pr[i]).layer.x, sy, (ses->pr[i]).layer.w, sh);
+	}
+
+	//every layer has been added to the rows of the strip
+	ll_map_label_rows(ses->ll_map, s->y + s->h);
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		ly = (ses->mask[i]).off_y + (ses->pr_mask[i]).mask.y;
+
+		if(s->masks[i] != NULL && strip_rows(ly, (ses->pr_mask[i]).mask.h, s, &sy, &sh))
+			ll_map_paint_codes(ses->ll_map, i, s->masks[i], (ses->mask[i]).off_x + (ses->pr_mask[i]).mask.x, sy, (ses->pr_mask[i]).mask.w, sh);
+	}
+
+	LL_TRACE_END("strip_code");
+}
+
+//Task of the pipeline on the pool : codes the strips in the order they are read
+//and hands them back to the main thread, until a strip of no rows ends the image
+//The task is the only user of the Region Map while the pipeline runs
+static void pipe_worker(gint first, gint last, gpointer data)
+{
+ LL_SESSION	*ses = data;
+ LL_STRIP	*s;
+
+	while((s = g_async_queue_pop(ses->pipe_todo))->h > 0)
+	{
+		strip_code(ses, s);
+		g_async_queue_push(ses->pipe_done, s);
+	}
+
+	g_free(s);
+}
+
+//Writes the masks of strip s back to GIMP and frees the strip
+static void strip_write(LL_SESSION *ses, LL_STRIP *s)
+{
+ gint		i;
+ gint		ly, sy, sh;
+
+	LL_TRACE_BEGIN_ARG("strip_write", "row", s->y);
+
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		ly = (ses->layer[i]).off_y + (ses->pr[i]).layer.y;
+
+		if(s->pixels[i] != NULL && strip_rows(ly, (ses->pr[i]).layer.h, s, &sy, &sh))
+		{
+			preview_cache_rows(ses, i, s->pixels[i], sy - ly, sh);
+
+			LL_STATS_FREE(LL_MEM_PIXELS, (gsize) (ses->pr[i]).layer.w * sh * (ses->pr[i]).layer.bpp);
+			ll_scratch_put(s->pixels[i]);
+		}
+
+		ly = (ses->mask[i]).off_y + (ses->pr_mask[i]).mask.y;
+
+		if(s->masks[i] != NULL && strip_rows(ly, (ses->pr_mask[i]).mask.h, s, &sy, &sh))
+		{
+			gimp_pixel_rgn_set_rect ( &((ses->pr_mask[i]).mask), s->masks[i], (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y + (sy - ly), (ses->pr_mask[i]).mask.w, sh);
+
+			LL_STATS_FREE(LL_MEM_PIXELS, (gsize) (ses->pr_mask[i]).mask.w * sh);
+			ll_scratch_put(s->masks[i]);
+		}
+	}
+
+	g_free(s->pixels);
+	g_free(s->masks);
+	g_free(s);
+
+	LL_TRACE_END("strip_write");
+}
+
+//Calculates the layer code for each pixel in the image space in strips of rows which overlap :
+//while the main thread reads the layers of a strip from GIMP, a task of the pool makes the layer codes
+//(and the first labels) of the strip before, and the masks of the strips it has done are written back
+//A pool of one thread codes every strip on the main thread as soon as it is read
+//The masks are painted by the pipeline when there is no earlier session to retrieve
+//since the first stacking follows from the layer codes alone (see ll_map_paint_codes)
+static void pipe_layers(LL_SESSION *ses)
+{
+ LL_POOL_GROUP	group = LL_POOL_GROUP_INIT;
+ LL_STRIP	*s;
+ gboolean	pipelined;
+ gboolean	*present;
+ gint		i, y, rows, tile, layers = 0, in_flight = 0;
+
+	present = g_new0(gboolean, ses->layer_num);
+
+	//If Opacity is 0 , assume Layer absent at all its Pixel Locations
+	for(i = 0; i < ses->layer_num; i++)
+	{
+		present[i] = (ses->pr[i]).process == 1 && gimp_layer_get_opacity( ((ses->pr[i]).layer.drawable)->drawable_id) != 0.0;
+
+		if(present[i])
+			layers++;
+	}
+
+	ses->masks_painted = !ll_parasite_exists(ses);
+
+	//strips of whole rows of GIMP tiles, the layers of a strip taking about PIPE_STRIP_BYTES
+	tile = gimp_tile_height();
+	rows = PIPE_STRIP_BYTES / ((gsize) ses->image_width * 4 * MAX(layers, 1));
+	rows = CLAMP(rows / tile * tile, tile, ses->image_height);
+
+	pipelined = ll_pool_threads() > 1;
+
+	if(pipelined)
+	{
+		ses->pipe_todo = g_async_queue_new();
+		ses->pipe_done = g_async_queue_new();
+		ll_pool_fork_long(&group, pipe_worker, ses);
+	}
+
+	LL_TRACE_BEGIN("pipe_layers");
+
+	for(y = 0; y < ses->image_height; y += rows)
+	{
+		if(!init_progress(ses, NULL, 0.7 * y / ses->image_height))
+			break;
+
+		s = strip_read(ses, y, MIN(rows, ses->image_height - y), present, ses->masks_painted);
+
+		if(!pipelined)
+		{
+			strip_code(ses, s);
+			strip_write(ses, s);
+			continue;
+		}
+
+		//the pipeline task takes the strips in the order they are pushed
+		g_async_queue_push(ses->pipe_todo, s);
+		in_flight++;
+
+		//write back the strips done, waiting for one when PIPE_DEPTH are on their way
+		while(in_flight > 0 && (s = (in_flight >= PIPE_DEPTH) ? g_async_queue_pop(ses->pipe_done) : g_async_queue_try_pop(ses->pipe_done)) != NULL)
+		{
+			strip_write(ses, s);
+			in_flight--;
+		}
+	}
+
+	if(pipelined)
+	{
+		while(in_flight > 0)
+		{
+			strip_write(ses, g_async_queue_pop(ses->pipe_done));
+			in_flight--;
+		}
+
+		g_async_queue_push(ses->pipe_todo, g_new0(LL_STRIP, 1));
+		ll_pool_join(&group);
+
+		g_async_queue_unref(ses->pipe_todo);
+		g_async_queue_unref(ses->pipe_done);
+		ses->pipe_todo = NULL;
+		ses->pipe_done = NULL;
+	}
+
+	if(ses->masks_painted)
+	{
+		for(i = 0; i < ses->layer_num; i++)
+		{
+			if( (ses->pr_mask[i]).process )
+				gimp_drawable_update ((ses->pr_mask[i]).mask.drawable->drawable_id, (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y, (ses->pr_mask[i]).mask.w, (ses->pr_mask[i]).mask.h);
+		}
+	}
+
+	LL_TRACE_END("pipe_layers");
+
+	g_free(present);
+}
+
+//Calculates the tags array for all the pixels in the images space
+//Calculates number of regions, List_Graph : Lists and Edges
+static void extract_tags(LL_SESSION *ses)
+{
+ LL_POOL_GROUP	group = LL_POOL_GROUP_INIT;
+
+	LL_TRACE_BEGIN("extract_tags");
+
+	init_progress(ses, "Labelling regions", 0.7);
+
+	//REGION GROWING : tags, number of regions and ListGraph
+	//on a worker of the pool while the main loop runs the dialog, until the end of the labelling is posted to it
+	//(a cancel stops the labelling, see init_response) ; with a single thread, at once
+	//A large image without a stacking is labelled at a coarse scale instead, the full Region Map in the background
+	ses->init_labelled = FALSE;
+
+	if(ll_parasite_exists(ses) || !refine_start(ses))
+	{
+		if(ll_pool_threads() > 1)
+		{
+			ll_pool_fork_long(&group, init_label_task, ses);
+
+			while(!ses->init_labelled)
+				g_main_context_iteration(NULL, TRUE);
+
+			ll_pool_join(&group);
+		}
+		else
+			ll_map_extract_tags(ses->ll_map);
+	}
 
-	for (i = 0; i < num_regions; i++)
-	{
-		for (j = 0; j < num_regions; j++) 
-		{
-			if ( tag_adj[i][j] ) 
-			{
-				graph->edges[j][i] = 1;
-				graph->edges[i][j] = 1;
-			}
-		}
-	}
+	ses->num_regions	= ses->ll_map->num_regions;
+	ses->graph		= ses->ll_map->graph;
+	ses->reg_affected	= ses->ll_map->reg_affected;
 
-	restart_LL = FALSE;
+	ses->restart_LL = FALSE;
+
+	if(!init_progress(ses, "Retrieving the stacking", 0.9))
+	{
+		LL_TRACE_END("extract_tags");
+		return;
+	}
 
-	if( ll_parasite_exists() )
+	if( ll_parasite_exists(ses) )
 	{
-		//undo and old_tags array initialized
-		ll_parasite_recover();
-		
-		//Check for any changes in calculated tags(tags1) and previously stored tags (old_tags)
-		for(i = 0; i < image_height; i++)
-		{
-			for(j = 0; j < image_width; j++)
-			{
-
-				//If any changes are made after atttaching the GimpParasite		
-				//restart Local Layering
-				if(old_tags[i * image_width + j] == tags[i * image_width + j])
-				{
-					//continue;
-				}
-				else
-				{
-					//Resart Local Layering
-					//ie. Reinitialize the ListGraph
-					restart_LL = TRUE;
-					break;			
-				}
-			}
-
-			if(j != image_width)
-				break;
+		//undo array recovered and the stored tags compared with the calculated tags
+		//If any changes are made after atttaching the GimpParasite
+		//restart Local Layering ie. Reinitialize the ListGraph
+		LL_STATS_BEGIN(LL_PHASE_PARASITE_RECOVER);
+		LL_TRACE_BEGIN("parasite_recover");
+
+		ses->restart_LL = !ll_parasite_recover(ses);
+
+		LL_TRACE_END("parasite_recover");
+		LL_STATS_END(LL_PHASE_PARASITE_RECOVER);
 
-		}
-		if(!restart_LL)				
+		if(!ses->restart_LL)				
 		{
-			lg_retrieval_mask();
+			LL_STATS_BEGIN(LL_PHASE_RETRIEVAL);
+			LL_TRACE_BEGIN("retrieval");
+
+			lg_retrieval_mask(ses);
+
+			LL_TRACE_END("retrieval");
+			LL_STATS_END(LL_PHASE_RETRIEVAL);
 		}
 
 	}
 
-	//Allocate memory for the reg_affected array
-	reg_affected_malloc();
-
 	//Set all regions to affected for the initial run of mask_set_pixel
-	set_reg_affected();
+	set_reg_affected(ses);
 
 	//Set Pixel values as per ListGraph values and reg_affected array
-	mask_set_pixel();
+	//unless the pipeline of extract_layer_code has painted the first stacking already
+	//(committed while the dialog runs)
+	if(!ses->masks_painted)
+		commit_start(ses);
+
+	init_progress(ses, NULL, 1.0);
 
 	//Flush the layers and masks
 	gimp_displays_flush();
 
+	LL_TRACE_END("extract_tags");
 }
 
 
+//Rows of the strips of the mask of layer i (see MASK_STRIP_BYTES)
+static gint mask_strip_rows(LL_SESSION *ses, gint i)
+{
+	return CLAMP(MASK_STRIP_BYTES / MAX((ses->pr_mask[i]).mask.w, 1), 1, MAX((ses->pr_mask[i]).mask.h, 1));
+}
+
+//Reads the rows y .. y + h - 1 of the pixel region of the mask of layer i from GIMP
+//(the pixels of the regions which are not affected are kept)
+static LL_MASK_STRIP * mask_strip_read(LL_SESSION *ses, const gint *top, gint i, gint y, gint h)
+{
+ LL_MASK_STRIP	*ms;
+ gint		w = (ses->pr_mask[i]).mask.w;
+
+	ms = g_new(LL_MASK_STRIP, 1);
+	ms->ses   = ses;
+	ms->top   = top;
+	ms->layer = i;
+	ms->y     = y;
+	ms->h     = h;
+	ms->buf   = ll_scratch_get ((gsize) w * h);
+	LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) w * h);
+
+	gimp_pixel_rgn_get_rect( &((ses->pr_mask[i]).mask), ms->buf, (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y + y, w, h);
+
+	return ms;
+}
+
+//Paints the strip ms of a mask as per the ListGraph
+//Pixel Region covers the part of the Mask inside the Image
+//starting at Mask offset + Pixel Region offset in the Image space
+static void mask_strip_paint(LL_MASK_STRIP *ms)
+{
+ LL_SESSION	*ses = ms->ses;
+ gint		i = ms->layer;
+
+	ll_map_paint_mask(ses->ll_map, ms->top, i, ms->buf,
+			  (ses->mask[i]).off_x + (ses->pr_mask[i]).mask.x, (ses->mask[i]).off_y + (ses->pr_mask[i]).mask.y + ms->y,
+			  (ses->pr_mask[i]).mask.w, ms->h);
+}
+
+//Task of mask_set_pixel on the pool : paints a strip and hands it back to the main thread
+static void mask_strip_task(gint first, gint last, gpointer data)
+{
+ LL_MASK_STRIP	*ms = data;
+
+	mask_strip_paint(ms);
+	g_async_queue_push(ms->ses->pipe_done, ms);
+
+	//the commit source checks the queue once the main loop wakes up
+	g_main_context_wakeup(NULL);
+}
+
+//Writes the strip ms back to GIMP and frees it
+//left counts the strips of every mask still to be written : the mask is updated once its last one is
+static void mask_strip_write(LL_SESSION *ses, LL_MASK_STRIP *ms, gint *left)
+{
+ gint		i = ms->layer;
+
+	LL_TRACE_BEGIN_ARG("mask_writeback", "layer", i);
+
+	gimp_pixel_rgn_set_rect ( &((ses->pr_mask[i]).mask), ms->buf, (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y + ms->y, (ses->pr_mask[i]).mask.w, ms->h);
+
+	if(--left[i] == 0)
+		gimp_drawable_update ((ses->pr_mask[i]).mask.drawable->drawable_id, (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y, (ses->pr_mask[i]).mask.w, (ses->pr_mask[i]).mask.h);
+
+	mask_strip_free(ses, ms);
+
+	LL_TRACE_END("mask_writeback");
+}
+
+//Frees the strip ms
+static void mask_strip_free(LL_SESSION *ses, LL_MASK_STRIP *ms)
+{
+	LL_STATS_FREE(LL_MEM_PIXELS, (gsize) (ses->pr_mask[ms->layer]).mask.w * ms->h);
+	ll_scratch_put(ms->buf);
+	g_free(ms);
+}
+
 //Function which does the Mask Painting
 //Sets the pixels based on contents of ListGraph and reg_affected array
 //Follows the principle that at any pixel (region) only the top most layer will have a white (fully opaque) value
 //and all layers below it will have a black (fully transparent) value
-static void mask_set_pixel()
-{		
- guchar		**pr_buf;
- gint		*y_off, *x_off;
- gint		m, n, i, k;
- gint 		x, y;
- gint		min, min_index;
+//The masks are committed at once (see commit_start)
+static void mask_set_pixel(LL_SESSION *ses)
+{
+	LL_TRACE_BEGIN("mask_set_pixel");
 
-	//if(layer_num != 1)
-	//{
-	y_off = (gint *)malloc(layer_num * sizeof(gint));
-	x_off = (gint *)malloc(layer_num * sizeof(gint));
+	commit_start(ses);
+	commit_finish(ses);
 
-	//pr_buf = g_new (guchar*, layer_num * (pr_mask[i]).mask.w * (pr_mask[i]).mask.h);
+	LL_TRACE_END("mask_set_pixel");
+}
 
-	pr_buf = (guchar **)malloc(layer_num * sizeof(*pr_buf));
+//TRUE if the commit can go on without waiting : a strip can be read (or is read and painted on the main thread),
+//a strip painted on the pool waits to be written back, or every strip is written back
+static gboolean commit_ready(LL_SESSION *ses)
+{
+	if(!ses->commit_pooled || ses->commit_in_flight == 0)
+		return TRUE;
 
+	if(ses->commit_in_flight < ses->commit_depth && ses->commit_layer < ses->layer_num)
+		return TRUE;
 
-	for(i = 0; i < layer_num; i++)
-	{
-
-		if( (pr_mask[i]).process ) 
-		{
-		//pr_buf[i] = g_new (guchar, (pr_mask[i]).mask.w * (pr_mask[i]).mask.h);
+	return g_async_queue_length(ses->pipe_done) > 0;
+}
 
-			pr_buf[i] = (guchar *)malloc((pr_mask[i]).mask.w * (pr_mask[i]).mask.h * sizeof(**pr_buf));
+static gboolean commit_source_prepare(GSource *source, gint *timeout)
+{
+	*timeout = -1;
 
-			gimp_pixel_rgn_get_rect( &((pr_mask[i]).mask), pr_buf[i], 0, 0, (pr_mask[i]).mask.w,(pr_mask[i]).mask.h);
+	return commit_ready(((LL_COMMIT_SOURCE *) source)->ses);
+}
 
-			y_off[i] = (mask[i]).off_y + (pr_mask[i]).mask.y;
-			x_off[i] = (mask[i]).off_x + (pr_mask[i]).mask.x;
+static gboolean commit_source_check(GSource *source)
+{
+	return commit_ready(((LL_COMMIT_SOURCE *) source)->ses);
+}
 
-		//g_free(pr_buf);
-
-		}
+static gboolean commit_source_dispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+	return callback(data);
+}
 
-	}
+static GSourceFuncs	commit_source_funcs =
+{
+	commit_source_prepare,
+	commit_source_check,
+	commit_source_dispatch,
+	NULL,
+	NULL,
+	NULL
+};
 
-	for(m = 0; m < image_height; m++)
-	{
-		for(n = 0; n < image_width; n++)
-		{
-			k = tags[m * image_width + n] - 1;
+//Starts the commit of the masks of the regions set in reg_affected, from an idle source (see commit_step)
+//so that the dialog answers while the masks are painted and written back
+//The regions of a commit cancelled by a newer flip or undo are committed along with these
+//(and set in reg_affected too)
+static void commit_start(LL_SESSION *ses)
+{
+ GSource	*source;
+ gint		i, l, h;
 
-			if(reg_affected[k])
-			{
-				min_index = -1;
-				min = layer_num;
-
-				for(i = 0; i < layer_num; i++)
-				{
-					if(graph->lists[k][i] != 0)
-					{
-						if(graph->lists[k][i] < min)
-						{
-							min = graph->lists[k][i];
-							min_index = i;
-						}
-					}
-				}
+	commit_cancel(ses);
 
+	if(ses->commit_pending == NULL)
+		ses->commit_pending = g_new0(gboolean, ses->num_regions);
 
-				for(i = 0; i < layer_num; i++)
-				{
-					if(m >= y_off[i] && n >=x_off[i] && m < (y_off[i] + (pr_mask[i]).mask.h) && n < (x_off[i] + (pr_mask[i]).mask.w))
-					{
-						if(min_index == i)
-						{
-							*(*(pr_buf + i)  + ( (m - y_off[i] + (pr_mask[i]).mask.y) * (pr_mask[i]).mask.w) + (n - x_off[i] + (pr_mask[i]).mask.x)) = 255;
-							//*(*(pr_buf + i)  + ( (m - y_off[i]) * (pr_mask[i]).mask.w) + (n - x_off[i])) = 255;
-
-						}
-						else
-						{
-							*(*(pr_buf + i)  + ( (m - y_off[i] + (pr_mask[i]).mask.y) * (pr_mask[i]).mask.w) + (n - x_off[i] + (pr_mask[i]).mask.x)) = 0;
-							//*(*(pr_buf + i)  + ( (m - y_off[i]) * (pr_mask[i]).mask.w) + (n - x_off[i])) = 0;
-						}
-					}
-				}
-			}
-		}
+	for(l = 0; l < ses->num_regions; l++)
+	{
+		ses->reg_affected[l] = ses->reg_affected[l] || ses->commit_pending[l];
+		ses->commit_pending[l] = ses->reg_affected[l];
 	}
 
+	//on a coarse map the masks are committed once the full Region Map is swapped in (see refine_swap) :
+	//the regions stay pending meanwhile, as the dialog shows
+	if(ses->map_scale > 1)
+	{
+		refine_status(ses);
+		return;
+	}
 
+	//Top most layer of every region as per the ListGraph
+	ses->commit_top = ll_map_top_layers(ses->ll_map);
+	ses->commit_left = g_new0(gint, ses->layer_num);
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		if( (pr_mask[i]).process ) 
-		{
-			gimp_pixel_rgn_set_rect ( &((pr_mask[i]).mask), pr_buf[i], 0, 0, (pr_mask[i]).mask.w, (pr_mask[i]).mask.h);
-
-			gimp_drawable_update ((pr_mask[i]).mask.drawable->drawable_id, 0, 0, (pr_mask[i]).mask.w, (pr_mask[i]).mask.h);
-		}
+		h = (ses->pr_mask[i]).mask.h;
 
+		if( (ses->pr_mask[i]).process )
+			ses->commit_left[i] = (h + mask_strip_rows(ses, i) - 1) / mask_strip_rows(ses, i);
 	}
-
-	//}
+
+	//strips painted or waiting to be written back, PIPE_DEPTH for every thread at most
+	ses->commit_pooled = ll_pool_threads() > 1 && ses->ll_map->tag_tiles == NULL;
+	ses->commit_depth = PIPE_DEPTH * ll_pool_threads();
+
+	if(ses->commit_pooled)
+		ses->pipe_done = g_async_queue_new();
+
+	ses->commit_layer = 0;
+	ses->commit_y = 0;
+	ses->commit_in_flight = 0;
+
+	source = g_source_new(&commit_source_funcs, sizeof(LL_COMMIT_SOURCE));
+	((LL_COMMIT_SOURCE *) source)->ses = ses;
+	g_source_set_priority(source, G_PRIORITY_DEFAULT_IDLE);
+	g_source_set_callback(source, (GSourceFunc) commit_step, ses, NULL);
+	ses->commit_source = g_source_attach(source, NULL);
+	g_source_unref(source);
 }
 
-//Add the masks which have been initialized as pixel regions to the respective layers
-//also checks if layer does not have any pre existing mask
-//if pre existing mask is there then it is not required to add it 
-//and modifications on it will be reflected
-static void add_masks()
+//Step of a commit : writes back the strips painted on the pool meanwhile, then reads the next strip of a mask
+//from GIMP and has it painted on the pool, unless commit_depth strips are on their way
+//Without wait, a step never blocks : it returns at once when the strips it needs are still being painted
+//With a single thread, or a map in tiles, the strip is painted on the main thread as it is read
+//Returns FALSE once every strip is written back and the displays are flushed
+static gboolean commit_advance(LL_SESSION *ses, gboolean wait)
 {
- gint	i;
+ LL_MASK_STRIP	*ms;
+ gint		i, h, strip;
+
+	LL_STATS_BEGIN(LL_PHASE_MASK_PAINT);
+	LL_TRACE_BEGIN("commit_step");
 
-	for(i = 0 ; i < layer_num ; i++)
+	while(ses->commit_pooled && ses->commit_in_flight > 0 && (ms = g_async_queue_try_pop(ses->pipe_done)) != NULL)
 	{
-		//if( (mask[i]).exists && gimp_layer_get_mask ((mask[i]).layer_id) == -1 )
-		if( (pr_mask[i]).process && gimp_layer_get_mask ((mask[i]).layer_id) == -1 )
+		mask_strip_write(ses, ms, ses->commit_left);
+		ses->commit_in_flight--;
+	}
+
+	//the next mask with strips to read
+	while(ses->commit_layer < ses->layer_num &&
+	      (!(ses->pr_mask[ses->commit_layer]).process || ses->commit_y >= (ses->pr_mask[ses->commit_layer]).mask.h))
+	{
+		ses->commit_layer++;
+		ses->commit_y = 0;
+	}
+
+	//waiting for a strip on the pool, before the next one is read or once all of them are
+	if(ses->commit_pooled && ses->commit_in_flight > 0 &&
+	   (ses->commit_in_flight >= ses->commit_depth || ses->commit_layer == ses->layer_num))
+	{
+		if(!wait)
 		{
-			{
-				gimp_layer_add_mask ( mask[i].layer_id, (pr_mask[i]).mask.drawable->drawable_id);
-			}
+			LL_TRACE_END("commit_step");
+			LL_STATS_END(LL_PHASE_MASK_PAINT);
+
+			return TRUE;
 		}
+
+		mask_strip_write(ses, g_async_queue_pop(ses->pipe_done), ses->commit_left);
+		ses->commit_in_flight--;
 	}
 
+	if(ses->commit_layer < ses->layer_num)
+	{
+		i = ses->commit_layer;
+		h = (ses->pr_mask[i]).mask.h;
+		strip = mask_strip_rows(ses, i);
 
-}
+		ms = mask_strip_read(ses, ses->commit_top, i, ses->commit_y, MIN(strip, h - ses->commit_y));
+		ses->commit_y += strip;
+
+		if(!ses->commit_pooled)
+		{
+			mask_strip_paint(ms);
+			mask_strip_write(ses, ms, ses->commit_left);
+		}
+		else
+		{
+			ll_pool_fork(&ses->commit_group, 0, 1, 1, mask_strip_task, ms);
+			ses->commit_in_flight++;
+		}
+
+		LL_TRACE_END("commit_step");
+		LL_STATS_END(LL_PHASE_MASK_PAINT);
 
-//Initializes the elements of the queue
-//allocates memory for the queue array
-static void queue_init(LL_QUEUE * queue_l)
-{
-	queue_l->front = 0;
-	queue_l->back = 0;
-	queue_l->data = (gint *)malloc(image_height * image_width * sizeof(gint));
-}
-
-//checks whether the queue is empty
-static gboolean queue_isempty(LL_QUEUE * queue_l)
-{
-	if( queue_l->front == queue_l->back)
-	{
-		//g_printf("QUEUE EMPTY");
 		return TRUE;
 	}
-	return FALSE; 
-}
 
-//Pushes the value passed as parameter to the back of the queue
-//increments back to point to space for next element
-static void queue_push(LL_QUEUE * queue_l, gint n)
-{
-	queue_l->data[queue_l->back] = n;
-	queue_l->back++;
-}
-
-//returns the front element from the queue passed as parameter
-//increments front to point to a next value in queue
-static gint queue_pop(LL_QUEUE * queue_l)
-{
- gint	n = -1;
-	if(!queue_isempty(queue_l))
+	if(ses->commit_in_flight > 0)
 	{
-		n = queue_l->data[queue_l->front];
-		queue_l->front++;
+		LL_TRACE_END("commit_step");
+		LL_STATS_END(LL_PHASE_MASK_PAINT);
+
+		return TRUE;
 	}
- return n;
-}
-
-/*
-static gint queue_fetch(LL_QUEUE * queue_l)
-{
- gint	n = -1;
 
-	if(!queue_isempty(queue_l))
+	//every strip is written back
+	if(ses->commit_pooled)
 	{
-		n = queue_l->data[queue_l->front];
+		ll_pool_join(&ses->commit_group);
+		g_async_queue_unref(ses->pipe_done);
+		ses->pipe_done = NULL;
 	}
- return n;
+
+	gimp_displays_flush ();
+
+	memset(ses->commit_pending, 0, ses->num_regions * sizeof(gboolean));
+
+	g_free(ses->commit_left);
+	g_free(ses->commit_top);
+	ses->commit_left = NULL;
+	ses->commit_top = NULL;
+	ses->commit_source = 0;
+
+	LL_TRACE_END("commit_step");
+	LL_STATS_END(LL_PHASE_MASK_PAINT);
+
+	return FALSE;
 }
-*/
-
-
-//Allocate memory for the ListGraph Lists and Edges
-static void graph_mem_alloc()
+
+//Step of the source of a commit (see commit_advance), which never blocks the dialog :
+//the source is only dispatched while commit_ready, and the strip tasks wake the main loop up
+static gboolean commit_step(LL_SESSION *ses)
 {
- gint	i;
-
-	graph = (LIST_GRAPH *)malloc(sizeof(LIST_GRAPH));
+	return commit_advance(ses, FALSE);
+}
 
-	graph->lists = (gint **)malloc( num_regions * sizeof(*(graph->lists)));
+//Cancels the commit on its way, before a newer flip or undo changes the ListGraph :
+//the strips on the pool are waited for and dropped, their regions staying in commit_pending
+static void commit_cancel(LL_SESSION *ses)
+{
+	if(ses->commit_source == 0)
+		return;
 
-	for(i = 0; i < num_regions; i++)
-	{
-		graph->lists[i] = (gint *)malloc(layer_num * sizeof(**(graph->lists)));
-	}
+	LL_TRACE_BEGIN("commit_cancel");
 
-	graph->edges = (gint **)malloc(num_regions * sizeof(*(graph->edges)));
+	g_source_remove(ses->commit_source);
+	ses->commit_source = 0;
 
-	for(i = 0; i < num_regions; i++)
+	if(ses->commit_pooled)
 	{
-		graph->edges[i] = (gint *)malloc(num_regions * sizeof(**(graph->edges)));
+		while(ses->commit_in_flight > 0)
+		{
+			mask_strip_free(ses, g_async_queue_pop(ses->pipe_done));
+			ses->commit_in_flight--;
+		}
+
+		ll_pool_join(&ses->commit_group);
+		g_async_queue_unref(ses->pipe_done);
+		ses->pipe_done = NULL;
 	}
 
+	g_free(ses->commit_left);
+	g_free(ses->commit_top);
+	ses->commit_left = NULL;
+	ses->commit_top = NULL;
+
+	LL_TRACE_END("commit_cancel");
 }
-
-
-//Initialize the ListGraph Lists to 0 values
-static void graph_lists_init()
+
+//Runs the commit on its way to its end at once
+static void commit_finish(LL_SESSION *ses)
 {
- gint	i, j;
+	if(ses->commit_source == 0)
+		return;
 
-	for (i = 0; i < num_regions; i++)
- 	{
-		for (j = 0; j < layer_num; j++) 
-		{
-			graph->lists[i][j] = 0;
-		}
-	}
+	g_source_remove(ses->commit_source);
 
+	while(commit_advance(ses, TRUE));
 }
-
-
-//Initialize the ListGraph Edges to 0 values
-static void graph_edges_init()
+
+//Add the masks which have been initialized as pixel regions to the respective layers
+//also checks if layer does not have any pre existing mask
+//if pre existing mask is there then it is not required to add it 
+//and modifications on it will be reflected
+static void add_masks(LL_SESSION *ses)
 {
- gint	i, j;
+ gint	i;
 
-	for (i = 0; i < num_regions; i++)
- 	{
-		for (j = 0; j < num_regions; j++) 
+	for(i = 0 ; i < ses->layer_num ; i++)
+	{
+		//if( (mask[i]).exists && gimp_layer_get_mask ((mask[i]).layer_id) == -1 )
+		if( (ses->pr_mask[i]).process && gimp_layer_get_mask ((ses->mask[i]).layer_id) == -1 )
 		{
-			graph->edges[i][j] = 0;
+			{
+				gimp_layer_add_mask ( ses->mask[i].layer_id, (ses->pr_mask[i]).mask.drawable->drawable_id);
+			}
 		}
 	}
 
+
 }
-
 
 //Flips the layer i1 over layer i2 in region l
 //Takes care of consistency of the layers in the adjacent regions
 //with the help of the list graph and recursive calls 
-void flip_up(gint i1, gint i2, gint l)
+//(recursive calls are made and stored in the UNDO array only for a fresh flip ie. undo_check)
+void flip_up(LL_SESSION *ses, gint i1, gint i2, gint l)
 {
- gint		i, i3, temp, l1, l2;
- gboolean 	check_affected = FALSE;
-
-
-	l1 = graph->lists[l][i1];
-	l2 = graph->lists[l][i2];
-
-	for(i = 0; i < layer_num; i++)
-	{
-		if( l1 == 0  || l2 == 0 )
-			return;
-	}
-
-	while(graph->lists[l][i1] > graph->lists[l][i2])
-	{	
-		for(i = 0; i < layer_num; i++)
-		{
-			if( graph->lists[l][i] == (graph->lists[l][i1]-1) ) // l1 = 1?
-				i3 = i;
-		}
-
-		temp = graph->lists[l][i3];
-		graph->lists[l][i3] = graph->lists[l][i1];
-		graph->lists[l][i1] = temp;
-
-		check_affected = TRUE;
-
-		for(i = 0; i < num_regions; i++)
-		{
-			if(graph->edges[l][i] == 1)
-			{
-
-				if(undo_check)
-				{
-					undo_array[undo_index].call_count++;
-
-					if( undo_array[undo_index].call_count >= UNDO_FLIP_COUNT)
-					{
-						print_warning();
-						exit(0);
-					}
-
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][1] = i1;
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][0] = i3;
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][2] = i;
-
-
-					flip_up(i1,i3,i);
-				}
-			}
-		}
-
-	}
-
-	if(check_affected == TRUE)
-	{
-		reg_affected[l] = TRUE;
-
-	}
-
+	ll_map_flip_up(ses->ll_map, i1, i2, l, ses->undo_check, undo_record, ses);
 }
 
 
 //Flips the layer i1 beanath layer i2 in region l
 //Takes care of consistency of the layers in the adjacent regions
 //with the help of the list graph and recursive calls 
-void flip_down(gint i1, gint i2, gint l)
+//(recursive calls are made and stored in the UNDO array only for a fresh flip ie. undo_check)
+void flip_down(LL_SESSION *ses, gint i1, gint i2, gint l)
 {
- gint		i, i3, temp, l1, l2;
- gboolean 	check_affected = FALSE;
+	ll_map_flip_down(ses->ll_map, i1, i2, l, ses->undo_check, undo_record, ses);
+}
 
+//Stores a recursive flip made by flip_up or flip_down in the UNDO array
+//Flip Up calls store {i2, i1, l} and Flip Down calls store {i1, i2, l}
+//ie. the lower layer first, as done for the flip made from the Flip Dialog
+static void undo_record(gint i1, gint i2, gint l, gpointer data)
+{
+ LL_SESSION	*ses = data;
 
-	l1 = graph->lists[l][i1];
-	l2 = graph->lists[l][i2];
+	ses->undo_array[ses->undo_index].call_count++;
 
-	for(i = 0; i < layer_num; i++)
+	if( ses->undo_array[ses->undo_index].call_count >= UNDO_FLIP_COUNT)
 	{
-		if( l1 == 0  || l2 == 0 )
-			return;
+		print_warning();
+		exit(0);
 	}
 
-	while(graph->lists[l][i1] < graph->lists[l][i2])
-	{	
-		for(i = 0; i < layer_num; i++)
-		{
-			if( graph->lists[l][i] == (graph->lists[l][i1]+1) ) // l1 = 1?
-				i3 = i;
-		}
-
-		temp = graph->lists[l][i3];
-		graph->lists[l][i3] = graph->lists[l][i1];
-		graph->lists[l][i1] = temp;
-
-		check_affected = TRUE;
-
-		for(i = 0; i < num_regions; i++)
-		{
-			if(graph->edges[l][i] == 1)
-			{
-
-				if(undo_check)
-				{
-
-					undo_array[undo_index].call_count++;
-
-					if( undo_array[undo_index].call_count >= UNDO_FLIP_COUNT)
-					{
-						print_warning();
-						exit(0);
-					}
-
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][1] = i3;
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][0] = i1;
-					undo_array[undo_index].flips[undo_array[undo_index].call_count][2] = i;
-
-					flip_down(i1,i3,i);
-				}
-			}
-		}
-
+	if(ses->undo_array[ses->undo_index].call_type == 0)
+	{
+		ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][1] = i1;
+		ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][0] = i2;
 	}
-
-	if(check_affected == TRUE)
+	else
 	{
-		reg_affected[l] = TRUE; 
+		ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][1] = i2;
+		ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][0] = i1;
 	}
-
-}
-
-//Allocates memory for the reg_affected array
-//This array indicates the regions affected due to a Flip Up or Down call
-//to maintain consistency in adjacent regions
-static void reg_affected_malloc()
-{
- gint	i;
-
-	reg_affected = (gboolean*)malloc(num_regions * sizeof(gboolean));
-
+	ses->undo_array[ses->undo_index].flips[ses->undo_array[ses->undo_index].call_count][2] = l;
 }
 
 //Clears the reg_affected array
-static void clear_reg_affected()
+static void clear_reg_affected(LL_SESSION *ses)
 {
- gint i;
-
-	for(i = 0; i < num_regions; i++)
-	{
-		reg_affected[i] = FALSE;
-	}
+	ll_map_set_affected(ses->ll_map, FALSE);
 }
 
 //Sets the reg_affected array
-static void set_reg_affected()
+static void set_reg_affected(LL_SESSION *ses)
 {
- gint i;
-
-	for(i = 0; i < num_regions; i++)
-	{
-		reg_affected[i] = TRUE;
-	}
+	ll_map_set_affected(ses->ll_map, TRUE);
 }
 
 //Gets the pixel postions frpm the cursor on the preview
-static void get_image_pos()
+static void get_image_pos(LL_SESSION *ses)
 {
-	pos_x = llvals.posx;
-	pos_y = llvals.posy;
+	ses->pos_x = ses->vals.posx;
+	ses->pos_y = ses->vals.posy;
 
 	//if the cursor goes out of bounds the cursor coordinates are rest to (0,0)
-	if(pos_y >= image_height || pos_x >= image_width || pos_y < 0 || pos_x < 0)
+	if(ses->pos_y >= ses->image_height || ses->pos_x >= ses->image_width || ses->pos_y < 0 || ses->pos_x < 0)
 	{
 		g_printf("\n\nCoordinates Out of Image bounds : Resetting to (0,0)\n");
 		//g_message("Coordinates Out of Image bounds : Resetting to (0,0)");
 		//gimp_message(("Coordinates Out of Image bounds : Resetting to (0,0)"));
-		pos_x = 0;
-		pos_y = 0;
+		ses->pos_x = 0;
+		ses->pos_y = 0;
 	}
 }
+
+//Opens the session trace if the LL_RECORD environment variable names a directory
+//The trace is a locallayer manifest (DIR/session.manifest) of the layers, dumped as raw pixels,
+//followed by the cursor moves and the UP / DOWN / UNDO clicks of the session
+//(replayed with locallayer --replay ; a new session overwrites the trace)
+static void record_open(LL_SESSION *ses)
+{
+ const gchar	*dir;
+ gchar		*file;
+
+	dir = g_getenv("LL_RECORD");
+
+	if(dir == NULL || *dir == '\0')
+		return;
+
+	g_mkdir_with_parents(dir, 0755);
+
+	ses->record_dir = g_strdup(dir);
+
+	file = g_build_filename(dir, "session.manifest", NULL);
+	ses->record_file = g_fopen(file, "w");
+
+	if(ses->record_file == NULL)
+	{
+		g_printf("\n\nCannot record the session to %s\n", file);
+	}
+	else
+	{
+		fprintf(ses->record_file, "# Local Layering session\nimage %d %d\n", ses->image_width, ses->image_height);
+	}
+
+	g_free(file);
+}
+
+//Dumps the part of layer i inside the image (w x h pixels of bpp bytes at x, y) to the trace
+//A layer absent from the image is kept as a transparent pixel with 0 opacity so the layer indices stay the same
+static void record_layer(LL_SESSION *ses, gint i, const guchar *buf, gint bpp, gdouble opacity, gint x, gint y, gint w, gint h)
+{
+ gchar		name[32], num[G_ASCII_DTOSTR_BUF_SIZE];
+ gchar		*file;
+ guchar		*empty = NULL;
+
+	if(ses->record_file == NULL)
+		return;
+
+	if(buf == NULL)
+	{
+		empty = g_new0(guchar, bpp);
+		buf = empty;
+		x = y = 0;
+		w = h = 1;
+		opacity = 0.0;
+	}
+
+	g_snprintf(name, sizeof(name), "layer-%02d.raw", i);
+	file = g_build_filename(ses->record_dir, name, NULL);
+
+	g_file_set_contents(file, (const gchar *) buf, (gssize) w * h * bpp, NULL);
+
+	fprintf(ses->record_file, "layer %s %d %d %s %d %d %d\n", name, x, y,
+		g_ascii_dtostr(num, sizeof(num), opacity), w, h, bpp);
+
+	g_free(file);
+	g_free(empty);
+}
+
+//Appends an event of the session to the trace : up / down of layer l or undo
+//at the current cursor position, or a cursor move (l = -1)
+static void record_event(LL_SESSION *ses, const gchar *event, gint l)
+{
+	if(ses->record_file == NULL)
+		return;
+
+	if(strcmp(event, "undo") == 0)
+		fprintf(ses->record_file, "undo\n");
+	else if(l < 0)
+		fprintf(ses->record_file, "%s %d %d\n", event, ses->pos_x, ses->pos_y);
+	else
+		fprintf(ses->record_file, "%s %d %d %d\n", event, ses->pos_x, ses->pos_y, l);
+
+	//Keep the trace usable if GIMP goes down with the plug-in
+	fflush(ses->record_file);
+}
+
+//Closes the session trace
+static void record_close(LL_SESSION *ses)
+{
+	if(ses->record_file == NULL)
+		return;
+
+	fclose(ses->record_file);
+	ses->record_file = NULL;
+
+	g_free(ses->record_dir);
+	ses->record_dir = NULL;
+}
 
 //Attaches a GimpParasite to the GimpImage
-static gboolean ll_parasite_attach()
+static gboolean ll_parasite_attach(LL_SESSION *ses)
 {
  //GimpParasite	*lg_l_parasite_attach, *lg_e_parasite_attach;
  GimpParasite	*undo_parasite_attach;
@@ -2284,15 +3657,24 @@ static gboolean ll_parasite_attach()
  //gint		*data_lg_l_attach, * temp_l;
  //gint		*data_lg_e_attach, * temp_e;
  gint		*data_undo_attach, * temp_undo;
- gint		*data_tags_attach, * temp_tags;
+ gpointer	data_tags_attach;
+ gsize		tags_size;
  gint		i,j;
  gint		undo_mem_count, temp_count;
+
+	//A parasite holds at most G_MAXUINT32 bytes : the layering is not kept with larger region maps
+	//(the next session starts from the default stacking)
+	if(ll_pixels(ses->image_width, ses->image_height) * ses->ll_map->tag_bytes > G_MAXUINT32)
+	{
+		g_message("Local Layering : the image is too large to keep its local layering");
+		return FALSE;
+	}
 
 
 	//lg_l_parasite_attach = (GimpParasite *)malloc(sizeof(GimpParasite));
 	//lg_e_parasite_attach = (GimpParasite *)malloc(sizeof(GimpParasite));
 	//undo_parasite_attach = (GimpParasite *)malloc(sizeof(GimpParasite));
-	tags_parasite_attach = (GimpParasite *)malloc(sizeof(GimpParasite));
+	//tags_parasite_attach = (GimpParasite *)malloc(sizeof(GimpParasite));
 
 	//data_lg_l_attach = (gint *)malloc(num_regions * layer_num * sizeof(gint));
 	//temp_l = (gint *)malloc(num_regions * layer_num * sizeof(gint));
@@ -2302,22 +3684,20 @@ static gboolean ll_parasite_attach()
 
 	undo_mem_count = 1; //1 for undo_index
 	temp_count = 0;
-	for(i = 0; i <= undo_index; i++)
+	for(i = 0; i <= ses->undo_index; i++)
 	{
 		//2 for for call_type and call_count
 		//undo_array[i].call_count * 3 for flips
-		temp_count = temp_count + 2 + (undo_array[i].call_count + 1) * 3;
+		temp_count = temp_count + 2 + (ses->undo_array[i].call_count + 1) * 3;
 	}
 	undo_mem_count = undo_mem_count + temp_count;
 
 	//1 for undo_mem_count
 	undo_mem_count = undo_mem_count + 1;
 
-	data_undo_attach = (gint *)malloc(undo_mem_count * sizeof(gint));
-	temp_undo = (gint *)malloc(undo_mem_count * sizeof(gint));
+	data_undo_attach = g_new(gint, undo_mem_count);
+	LL_STATS_ALLOC(LL_MEM_PARASITE, undo_mem_count * sizeof(gint));
 
-	data_tags_attach = (gint *)malloc(image_height * image_width * sizeof(gint));
-	temp_tags = (gint *)malloc(image_height * image_width * sizeof(gint));
 
 /*
 	temp_l = data_lg_l_attach;
@@ -2354,96 +3734,82 @@ static gboolean ll_parasite_attach()
 	*data_undo_attach = undo_mem_count;
 	data_undo_attach++;
 
-	*data_undo_attach = undo_index;
+	*data_undo_attach = ses->undo_index;
 	data_undo_attach++;
 
-	for(i = 0; i <= undo_index; i++)
+	for(i = 0; i <= ses->undo_index; i++)
 	{
-		*data_undo_attach = undo_array[i].call_type;
+		*data_undo_attach = ses->undo_array[i].call_type;
 		data_undo_attach++;
-		*data_undo_attach = undo_array[i].call_count;
+		*data_undo_attach = ses->undo_array[i].call_count;
 		data_undo_attach++;
-		for(j = 0; j <= undo_array[i].call_count; j++)
+		for(j = 0; j <= ses->undo_array[i].call_count; j++)
 		{
-			*data_undo_attach = undo_array[i].flips[j][0];
+			*data_undo_attach = ses->undo_array[i].flips[j][0];
 			data_undo_attach++;
-			*data_undo_attach = undo_array[i].flips[j][1];
+			*data_undo_attach = ses->undo_array[i].flips[j][1];
 			data_undo_attach++;
-			*data_undo_attach = undo_array[i].flips[j][2];
+			*data_undo_attach = ses->undo_array[i].flips[j][2];
 			data_undo_attach++;
 		}
 	}
 
 	undo_parasite_attach = gimp_parasite_new ("UNDO_ARRAY",TRUE,undo_mem_count * sizeof(gint), temp_undo);
 
-	temp_tags = data_tags_attach;
-
-	for(i = 0; i < image_height; i++)
-	{
-		for(j = 0; j < image_width; j++)
-		{        
-			*data_tags_attach = tags[i * image_width + j];
-			data_tags_attach++;
-		}
-	}
+	LL_STATS_FREE(LL_MEM_PARASITE, undo_mem_count * sizeof(gint));
+	g_free(temp_undo);
+
+	data_tags_attach = ll_map_tags_pack(ses->ll_map, &tags_size);
+	LL_STATS_ALLOC(LL_MEM_PARASITE, tags_size);
 
+	tags_parasite_attach = gimp_parasite_new ("TAGS",TRUE,tags_size, data_tags_attach);
 
-	tags_parasite_attach = gimp_parasite_new ("TAGS",TRUE,image_height * image_width * sizeof(gint), temp_tags);
+	LL_STATS_FREE(LL_MEM_PARASITE, tags_size);
+	g_free(data_tags_attach);
 
 
 	//gimp_image_parasite_attach (image_id,lg_l_parasite_attach);
 	//gimp_image_parasite_attach (image_id,lg_e_parasite_attach);
-	gimp_image_parasite_attach (image_id,undo_parasite_attach);
-	gimp_image_parasite_attach (image_id,tags_parasite_attach);
+	gimp_image_parasite_attach (ses->image_id,undo_parasite_attach);
+	gimp_image_parasite_attach (ses->image_id,tags_parasite_attach);
 
+	//the image keeps its own copies
+	gimp_parasite_free (undo_parasite_attach);
+	gimp_parasite_free (tags_parasite_attach);
+
+	return TRUE;
 }
 
 //Checks whether there is a preexisting parasite attached by a previous session of Local Layering 
-static gboolean ll_parasite_exists()
+static gboolean ll_parasite_exists(LL_SESSION *ses)
 {
  //GimpParasite * lg_l_parasite, * lg_e_parasite;
  GimpParasite * undo_parasite;
  GimpParasite * tags_parasite;
-
-
-	//lg_l_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	//lg_e_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	undo_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	tags_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));	
+ gboolean	exists;
 
 
 	//lg_l_parasite = gimp_image_parasite_find (image_id,"LIST_GRAPH_LISTS");
 	//lg_e_parasite = gimp_image_parasite_find (image_id,"LIST_GRAPH_EDGES");
-	undo_parasite = gimp_image_parasite_find (image_id,"UNDO_ARRAY");
-	tags_parasite = gimp_image_parasite_find (image_id,"TAGS");
+	undo_parasite = gimp_image_parasite_find (ses->image_id,"UNDO_ARRAY");
+	tags_parasite = gimp_image_parasite_find (ses->image_id,"TAGS");
 
-/*
-	if(lg_l_parasite == NULL)
-	{
-		return FALSE;
-	}
+	//gimp_image_parasite_find returns copies
+	exists = (undo_parasite != NULL && tags_parasite != NULL);
 
-	if(lg_e_parasite == NULL)
-	{
-		return FALSE;
-	}
-*/
-	if(undo_parasite == NULL)
-	{
-		return FALSE;
-	}
+	if(undo_parasite != NULL)
+		gimp_parasite_free (undo_parasite);
 
-	if(tags_parasite == NULL)
-	{
-		return FALSE;
-	}
+	if(tags_parasite != NULL)
+		gimp_parasite_free (tags_parasite);
 
-	return TRUE;
+	return exists;
 }
 
 
 //Recovers data attached from a preexisting parasite attached by a previous session of Local Layering
-static void ll_parasite_recover()
+//Returns TRUE if the tags stored in the parasite are the same as the calculated tags
+static gboolean ll_parasite_recover(LL_SESSION *ses)
 {
  //GimpParasite * lg_l_parasite, * lg_e_parasite;
  GimpParasite * undo_parasite;
@@ -2453,28 +3819,17 @@ static void ll_parasite_recover()
  //gint * data_lg_e_attach;
 
  gint * data_undo_attach;
- gint * data_tags_attach;
-
- gint i,j;
- gint undo_mem_count;
 
-
-	//lg_l_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	//lg_e_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	undo_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));
-	tags_parasite = (GimpParasite *)malloc(sizeof(GimpParasite));	
-
-
-	//data_lg_l_attach = (gint *)malloc(num_regions * layer_num * sizeof(gint));
-	//data_lg_e_attach = (gint *)malloc(num_regions * num_regions * sizeof(gint));
-	data_undo_attach = (gint *)malloc(1 * sizeof(gint));
-	data_tags_attach = (gint *)malloc(image_height * image_width * sizeof(gint));
+ gint i,j,k;
+ gint undo_mem_count, read;
+ gint *renumber;
+ gboolean unchanged, valid;
 
 
 	//lg_l_parasite = gimp_image_parasite_find (image_id,"LIST_GRAPH_LISTS");
 	//lg_e_parasite = gimp_image_parasite_find (image_id,"LIST_GRAPH_EDGES");
-	undo_parasite = gimp_image_parasite_find (image_id,"UNDO_ARRAY");
-	tags_parasite = gimp_image_parasite_find (image_id,"TAGS");
+	undo_parasite = gimp_image_parasite_find (ses->image_id,"UNDO_ARRAY");
+	tags_parasite = gimp_image_parasite_find (ses->image_id,"TAGS");
 
 /*
 	//g_printf("\n\nPARASITE LISTS : %s\n",lg_l_parasite->name);
@@ -2507,239 +3862,281 @@ static void ll_parasite_recover()
 
 	//g_printf("\n\nPARASITE UNDO_ARRAY : %s\n",undo_parasite->name);
 
-	data_undo_attach = undo_parasite->data;
-	undo_mem_count = *data_undo_attach;;
-
-	data_undo_attach = (gint *)malloc(undo_mem_count * sizeof(gint));
 	data_undo_attach = undo_parasite->data;
 
-	undo_mem_count = *data_undo_attach;;
+	//The UNDO_ARRAY parasite holds its own length in gints first : the entries are only read
+	//while they lie within that length and the undo array, and name layers and regions of the image
+	undo_mem_count = (undo_parasite->size >= 2 * sizeof(gint)) ? *data_undo_attach : 0;
 	data_undo_attach++;
 
-	undo_index = *data_undo_attach;
+	valid = (undo_mem_count >= 2 && undo_parasite->size == undo_mem_count * sizeof(gint));
+	read = 2;
+
+	ses->undo_index = valid ? *data_undo_attach : -1;
 	data_undo_attach++;
 
-	for(i = 0; i <= undo_index; i++)
+	valid = valid && ses->undo_index >= -1 && ses->undo_index < UNDO_COUNT;
+
+	for(i = 0; valid && i <= ses->undo_index; i++)
 	{
-		undo_array[i].call_type = *data_undo_attach;
+		valid = (read + 2 <= undo_mem_count);
+		if(!valid)
+			break;
+
+		ses->undo_array[i].call_type = *data_undo_attach;
 		data_undo_attach++;
 
-		undo_array[i].call_count = *data_undo_attach;
+		ses->undo_array[i].call_count = *data_undo_attach;
 		data_undo_attach++;
 
-		for(j = 0; j <= undo_array[i].call_count; j++)
+		read += 2;
+
+		valid = (ses->undo_array[i].call_count >= -1 && ses->undo_array[i].call_count < UNDO_FLIP_COUNT &&
+			 read + (ses->undo_array[i].call_count + 1) * 3 <= undo_mem_count);
+
+		for(j = 0; valid && j <= ses->undo_array[i].call_count; j++)
 		{
-			undo_array[i].flips[j][0] = *data_undo_attach;
+			ses->undo_array[i].flips[j][0] = *data_undo_attach;
 			data_undo_attach++;
 
-			undo_array[i].flips[j][1] = *data_undo_attach;
+			ses->undo_array[i].flips[j][1] = *data_undo_attach;
 			data_undo_attach++;
 
-			undo_array[i].flips[j][2] = *data_undo_attach;
+			ses->undo_array[i].flips[j][2] = *data_undo_attach;
 			data_undo_attach++;
+
+			read += 3;
+
+			for(k = 0; k < 2; k++)
+				valid = valid && ses->undo_array[i].flips[j][k] >= 0 && ses->undo_array[i].flips[j][k] < ses->layer_num;
+
+			valid = valid && ses->undo_array[i].flips[j][2] >= 0 && ses->undo_array[i].flips[j][2] < ses->num_regions;
 		}
 
 	}
+
+	valid = valid && read == undo_mem_count;
 	
 	//g_printf("\n\nPARASITE TAGS : %s\n",tags_parasite->name);
 
-	data_tags_attach = tags_parasite->data;
-
-	for(i = 0; i < image_height; i++)
+	unchanged = valid && ll_map_tags_unchanged(ses->ll_map, tags_parasite->data, tags_parasite->size, &renumber);
+
+	//A damaged undo array is dropped with the layering it belongs to
+	if(!valid)
+		init_undo(ses);
+
+	//The same regions numbered otherwise (by an earlier version) : the undo array follows the new numbers
+	if(unchanged && renumber != NULL)
 	{
-		for(j = 0; j < image_width; j++)
-		{        
-			old_tags[i * image_width +j] = *data_tags_attach;
-			data_tags_attach++;
-		}
-	}
-
-
-//return TRUE;
+		for(i = 0; i <= ses->undo_index; i++)
+			for(j = 0; j <= ses->undo_array[i].call_count; j++)
+				ses->undo_array[i].flips[j][2] = renumber[ses->undo_array[i].flips[j][2]];
+
+		g_free(renumber);
+	}
+
+	//gimp_image_parasite_find returns copies
+	gimp_parasite_free (undo_parasite);
+	gimp_parasite_free (tags_parasite);
+
+	return unchanged;
 }
 
 //Detaches the preexisting parasite attached by a previous session of Local Layering
 //this is required to be done prior to reattachment of a freshly modified parasite 
-static void ll_parasite_detach()
+static void ll_parasite_detach(LL_SESSION *ses)
 {
 	//gimp_image_parasite_detach (image_id,"LIST_GRAPH_LISTS");
 	//gimp_image_parasite_detach (image_id,"LIST_GRAPH_EDGES");
-	gimp_image_parasite_detach (image_id,"UNDO_ARRAY");
-	gimp_image_parasite_detach (image_id,"TAGS");
+	gimp_image_parasite_detach (ses->image_id,"UNDO_ARRAY");
+	gimp_image_parasite_detach (ses->image_id,"TAGS");
 }
 
 
 //Calculates and Selects a Region Boundary of the region the current cursor points to
-static void rg_boundary_rect()
+//ie. the pixels of the region, holes excluded, over the rectangle of its outer contour
+//(traced along it, see ll_map_region_outline) : the same selection a flip makes of it (see select_regions)
+static void rg_boundary_rect(LL_SESSION *ses)
 {
- gint	*rg_boungary, rg_tag_rb;
- gint	min_x, min_y, max_x, max_y;
- gint	i, j, k;
-	
-	rg_boundary = (gint *)malloc(image_height * image_width * sizeof(gint));
+ GArray		*points;
+ LL_POINT	*p;
+ LL_RECT	rect;
+ gint		x1, y1;
+ guint		k;
 
-	k = 0;
+	ses->boundary_region = region_at(ses, ses->pos_x, ses->pos_y);
 
-	rg_tag_rb = tags[pos_y * image_width + pos_x];
+	points = g_array_new(FALSE, FALSE, sizeof(LL_POINT));
 
-	for(i = 0; i < image_height; i++)
+	if(ll_map_region_outline(ses->ll_map, ses->boundary_region, points))
 	{
-		for(j = 0; j < image_width; j++)
-		{
-
-			if(tags[i * image_width + j] == rg_tag_rb)
-			{
+		//the corners of the outline bound the region in the Region Map
+		rect.x = ses->ll_map->width;
+		rect.y = ses->ll_map->height;
+		x1 = y1 = 0;
 
-				if((i == 0 || j == 0 || i == (image_height-1) || j == (image_width-1)) ||
-				   (tags[(i-1) * image_width + j] != rg_tag_rb || 
-				    tags[i * image_width + (j-1)] != rg_tag_rb ||
-				    tags[i * image_width + (j+1)] != rg_tag_rb ||
-				    tags[(i+1) * image_width + j] != rg_tag_rb ))
-				{
-					rg_boundary[k] = i;
-					rg_boundary[k+1] = j;
-					k = k + 2;
-				}
-			}
+		for(k = 0; k < points->len; k++)
+		{
+			p = &g_array_index(points, LL_POINT, k);
+			rect.x = MIN(rect.x, p->x);
+			rect.y = MIN(rect.y, p->y);
+			x1 = MAX(x1, p->x);
+			y1 = MAX(y1, p->y);
 		}
 
-	}
-
-	min_x = image_width;
+		rect.w = x1 - rect.x;
+		rect.h = y1 - rect.y;
+		map_rect_scale(ses, &rect.x, &rect.y, &rect.w, &rect.h);
 
-	min_y = image_height;
+		if(rect.w > 0 && rect.h > 0)
+			select_regions(ses, &rect, ses->boundary_region);
+	}
 
-	max_x = 0;
+	g_array_free(points, TRUE);
+}
+
+//Calculates and Selects a Region Boundary of the regions affected by a Flip up or Flip Down call
+//as per the contents of reg_affected array
+static void rg_boundary_rect_regions(LL_SESSION *ses)
+{
+ LL_RECT	*rects, bounds;
+ gint		l, x1, y1;
 
-	max_y = 0;
+	LL_STATS_BEGIN(LL_PHASE_BOUNDARY);
+	LL_TRACE_BEGIN("rg_boundary_rect_regions");
 
-	for(i = 0; i < k; i = i + 2)
+	if(ses->rg_boundary_call != 0)
+	{
+		rg_boundary_rect(ses);
+	}
+	else
 	{
+		//the rectangles are traced in parallel, then the regions are selected at once over their union
+		rects = g_new0(LL_RECT, ses->num_regions);
+		ll_map_boundary_rects(ses->ll_map, ses->reg_affected, rects);
 
-		if(rg_boundary[i] < min_y)
-		{
-			min_y = rg_boundary[i];
-		}
+		bounds.x = ses->image_width;
+		bounds.y = ses->image_height;
+		x1 = y1 = 0;
 
-		if(rg_boundary[i+1] < min_x)
+		for(l = 0; l < ses->num_regions; l++)
 		{
-			min_x = rg_boundary[i+1];
-		}
+			if(ses->reg_affected[l] && rects[l].w > 0)
+			{
+				map_rect_scale(ses, &rects[l].x, &rects[l].y, &rects[l].w, &rects[l].h);
 
-		if(rg_boundary[i] > max_y)
-		{
-			max_y = rg_boundary[i];
+				bounds.x = MIN(bounds.x, rects[l].x);
+				bounds.y = MIN(bounds.y, rects[l].y);
+				x1 = MAX(x1, rects[l].x + rects[l].w);
+				y1 = MAX(y1, rects[l].y + rects[l].h);
+			}
 		}
 
-		if(rg_boundary[i+1] > max_x)
+		g_free(rects);
+
+		if(x1 > bounds.x && y1 > bounds.y)
 		{
-			max_x = rg_boundary[i+1];
+			bounds.w = x1 - bounds.x;
+			bounds.h = y1 - bounds.y;
+
+			select_regions(ses, &bounds, -1);
 		}
-	}
 
-	gimp_rect_select (image_id, min_x, min_y, max_x - min_x + 1, max_y - min_y + 1, GIMP_CHANNEL_OP_REPLACE, FALSE,0);
+		ses->boundary_region = -1;
+		ses->rg_boundary_call++;
+
+	}
 
+	LL_TRACE_END("rg_boundary_rect_regions");
+	LL_STATS_END(LL_PHASE_BOUNDARY);
 }
-
-//Calculates and Selects a Region Boundary of the regions affected by a Flip up or Flip Down call
-//as per the contents of reg_affected array
-static void rg_boundary_rect_regions()
-{
- gint	rg_tag_rb;
- gint	min_x, min_y, max_x, max_y;
- gint	i, j, k, l;
 
+//Selects the regions set in reg_affected, or region alone unless it is -1,
+//painting the selection channel over rect (their union in the image space)
+//in one pass of strips of rows : a single change of the selection instead of one per region
+//The clearing of the selection and the painting are grouped, so that they are one undo step
+//The regions are selected as they are, not their rectangles
+static void select_regions(LL_SESSION *ses, const LL_RECT *rect, gint region)
+{
+ GimpDrawable	*sel;
+ GimpPixelRgn	pr;
+ guchar		*buf, *row;
+ gint		*regions;
+ gint		strip, y, h, m, n, r;
+ gint		mx, mw, my, last_my;
 
-	if(rg_boundary_call != 0)
-	{
-		rg_boundary_rect();
-	}
-	else
-	{
-		for(l = 0; l < num_regions; l++)
-		{
-			if(reg_affected[l])
-			{
-		
-				rg_boundary = (gint *)malloc(image_height * image_width * sizeof(gint));
-	
-				rg_tag_rb = l + 1;
+	LL_TRACE_BEGIN("select_regions");
 
-				k = 0;
-				for(i = 0; i < image_height; i++)
-				{
-					for(j = 0; j < image_width; j++)
-					{
-	
-						if(tags[i * image_width + j] == rg_tag_rb)
-						{
-
-					if((i == 0 || j == 0 || i == (image_height-1) || j == (image_width-1)) ||
-					   (tags[(i-1) * image_width + j] != rg_tag_rb || 
-					    tags[i * image_width + (j-1)] != rg_tag_rb ||
-					    tags[i * image_width + (j+1)] != rg_tag_rb ||
-					    tags[(i+1) * image_width + j] != rg_tag_rb ))
-							{
-								rg_boundary[k] = i;
-								rg_boundary[k+1] = j;
-								k = k + 2;
-							}
-						}
-					}
+	gimp_image_undo_group_start (ses->image_id);
 
-				}
+	gimp_selection_none (ses->image_id);
 
+	sel = gimp_drawable_get (gimp_image_get_selection (ses->image_id));
+	gimp_pixel_rgn_init (&pr, sel, rect->x, rect->y, rect->w, rect->h, TRUE, TRUE);
 
+	strip = CLAMP(MASK_STRIP_BYTES / rect->w, 1, rect->h);
+	buf = ll_scratch_get ((gsize) rect->w * strip);
+	LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) rect->w * strip);
 
-				min_x = image_width;
-				min_y = image_height;
-				max_x = 0;
-				max_y = 0;
+	//the columns of the Region Map under the rectangle (a column of a coarse map spans map_scale pixels)
+	mx = rect->x / ses->map_scale;
+	mw = (rect->x + rect->w - 1) / ses->map_scale - mx + 1;
+	regions = g_new(gint, mw);
+	last_my = -1;
 
-				for(i = 0; i < k; i = i + 2)
-				{
-					if(rg_boundary[i] < min_y)
-					{
-						min_y = rg_boundary[i];
-					}
+	for(y = 0; y < rect->h; y += h)
+	{
+		h = MIN(strip, rect->h - y);
 
-					if(rg_boundary[i+1] < min_x)
-					{
-						min_x = rg_boundary[i+1];
-					}
-	
-					if(rg_boundary[i] > max_y)
-					{
-						max_y = rg_boundary[i];
-					}
+		for(m = 0; m < h; m++)
+		{
+			row = buf + (gsize) m * rect->w;
+			my = (rect->y + y + m) / ses->map_scale;
 
-					if(rg_boundary[i+1] > max_x)
-					{
-						max_x = rg_boundary[i+1];
-					}
-				}
+			//a row of a coarse map spans map_scale rows of the image
+			if(m > 0 && my == last_my)
+			{
+				memcpy(row, row - rect->w, rect->w);
+				continue;
+			}
 
-				gimp_rect_select (image_id, min_x, min_y, max_x - min_x + 1, max_y - min_y + 1, GIMP_CHANNEL_OP_ADD, FALSE,0);
+			ll_map_region_row(ses->ll_map, my, mx, mw, regions);
+			last_my = my;
 
+			for(n = 0; n < rect->w; n++)
+			{
+				r = regions[(rect->x + n) / ses->map_scale - mx];
+				row[n] = (r >= 0 && ((region == -1) ? ses->reg_affected[r] : r == region)) ? 255 : 0;
 			}
 		}
 
-		rg_boundary_call++;
+		gimp_pixel_rgn_set_rect (&pr, buf, rect->x, rect->y + y, rect->w, h);
+	}
+
+	gimp_drawable_flush (sel);
+	gimp_drawable_merge_shadow (sel->drawable_id, TRUE);
+	gimp_drawable_update (sel->drawable_id, rect->x, rect->y, rect->w, rect->h);
+	gimp_drawable_detach (sel);
+
+	gimp_image_undo_group_end (ses->image_id);
 
-	}
+	g_free(regions);
+	LL_STATS_FREE(LL_MEM_PIXELS, (gsize) rect->w * strip);
+	ll_scratch_put(buf);
 
+	LL_TRACE_END("select_regions");
 }
 
 // Destroys the masks ie. removes the masks from the layers
-static void destroy_masks()
+static void destroy_masks(LL_SESSION *ses)
 {
 	gint i;
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		if(gimp_layer_get_mask ((layer[i]).id) != -1)
+		if(gimp_layer_get_mask ((ses->layer[i]).id) != -1)
 		{
-			gimp_layer_remove_mask((layer[i]).id, GIMP_MASK_DISCARD);
+			gimp_layer_remove_mask((ses->layer[i]).id, GIMP_MASK_DISCARD);
 			//gimp_layer_remove_mask(mask[i].layer_id, GIMP_MASK_DISCARD);
 		}
 	}
@@ -2766,652 +4163,108 @@ static void print_warning()
 }
 
 //Prints the 2D layer_code array
-static void print_layer_code()
+static void print_layer_code(LL_SESSION *ses)
 {
  gint	i, j;
-	for(i = 0; i < image_height; i++)
+	for(i = 0; i < ses->image_height; i++)
 	 {
 		g_printf("\n");
-		for(j = 0; j < image_width; j++)
+		for(j = 0; j < ses->image_width; j++)
 		 {        
-			g_printf("%d",layer_code[i][j]);
+			g_printf("%u",ll_map_code_row(ses->ll_map, i)[j]);
 		 }
 	 }
 
 }
 
 //Prints the tags array
-static void print_tags()
+static void print_tags(LL_SESSION *ses)
 {
  gint	i, j;
-	for(i = 0; i < image_height; i++)
+	for(i = 0; i < ses->image_height; i++)
 	{
 		g_printf("\n");
-		for(j = 0; j < image_width; j++)
+		for(j = 0; j < ses->image_width; j++)
 		{        
-			g_printf("%d",tags[i * image_width + j]);
+			g_printf("%d",region_at(ses, j, i) + 1);
 		}
 	}
 }
 
 //prints the contents of ListGraph Lists
-static void print_graph_lists()
+static void print_graph_lists(LL_SESSION *ses)
 {
  gint	i, j;
 
 	g_printf("\n\nGraph->Lists");	
 
-	for(i = 0; i < num_regions; i++)
-		for(j = 0 ; j < layer_num ; j++)
-			if(graph->lists[i][j] != 0)
-				g_printf("\nRegion %2d --> Layer %2d - %2d ",i+1,j+1,graph->lists[i][j]);
+	for(i = 0; i < ses->num_regions; i++)
+		for(j = 0 ; j < ses->layer_num ; j++)
+			if(ses->graph->lists[i][j] != 0)
+				g_printf("\nRegion %2d --> Layer %2d - %2d ",i+1,j+1,ses->graph->lists[i][j]);
 }
 
 //prints the contents of ListGraph Edges
-static void print_graph_edges()
-{
- gint	i, j;
-	for(i = 0; i < num_regions; i++)
-		for(j = 0 ; j < num_regions; j++)
-			if(graph->edges[i][j] == 1)
-				g_printf("\nRegion %2d --> Region %2d  (Edge)",i+1,j+1);
-}
-
-static void print_retrieved_lists()
+static void print_graph_edges(LL_SESSION *ses)
 {
- gint	i, j;
-
-	g_printf("\n\nRetrieved Lists");	
-
-	for(i = 0; i < num_regions; i++)
-		for(j = 0 ; j < layer_num ; j++)
-			if(lists[i][j] != -1)
-				g_printf("\nRegion %2d --> Layer %2d - %2d ",i+1,j+1,lists[i][j]);
+ gint	i, e;
+	for(i = 0; i < ses->num_regions; i++)
+		for(e = ses->graph->edge_start[i]; e < ses->graph->edge_start[i + 1]; e++)
+			g_printf("\nRegion %2d --> Region %2d  (Edge)",i+1,ses->graph->edges[e]+1);
 }
 
-static void init_retrieval_list()
-{
-	int i, j;
-	lists = (gint **)malloc( num_regions * sizeof(*lists));
-	for(i = 0; i < num_regions; i++)
-	{
-		lists[i] = (gint *)malloc(layer_num * sizeof(**lists));
-	}
-
-	for (i = 0; i < num_regions; i++)
- 	{
-		for (j = 0; j < layer_num; j++) 
-		{
-			lists[i][j] = -1;
-		}
-	}	
-}
-
-static void init_pair_lists()
-{
-	int i, j, c;
-	
-	pair_total_count = (gint *)malloc(num_regions * sizeof(gint));
-
-	pair_count = (gint *)malloc(num_regions * sizeof(gint));
-
-	for(i = 0; i < num_regions; i++)
-	{	
-		pair_count[i] = 0;
-	} 
-	
-	pair_lists = (gint ***) malloc( num_regions * sizeof(gint*));
-	for(i = 0;i < num_regions; i++)
-	{
-		c = count_layers[i] * (count_layers[i]-1) / 2;
-		pair_total_count[i] = c;
-
-		pair_lists[i] = (gint **)malloc( c * sizeof(gint **));
-	
-		for(j = 0; j < c; j++)
-		{	
-			pair_lists[i][j] = (gint *)malloc(2 * sizeof(gint ***));
-		}
-	}
-
-
-}
-
-static void count_layers_init()
-{
-	gint i, j;
-	count_layers = (gint *)malloc(num_regions * sizeof(gint));
-
-	for(i = 0; i < num_regions; i++)
-		count_layers[i] = 0;
-
-	for(i = 0; i < num_regions; i++)
-	{
-		for(j = 0 ; j < layer_num ; j++)
-		{
-			if(lists[i][j] == 0)
-			{
-				count_layers[i]++;
-			}	
-		}
-	}
-}
-
-static void print_count_layers()
-{
-	gint i;
-	g_printf("\nCOUNT_LAYERS : \n");
-
-	for(i = 0; i < num_regions; i++)
-		g_printf("\n\nRegion %d : %d \n",i+1,count_layers[i]);
-}
-	
-
-static void list_retrieve_second()
-{
-	gint i, j;
-	for(i = 0; i < num_regions ; i++)
-	{	
-		if( count_layers[i] == 2)
-		{
-			for(j=0;j<layer_num;j++)
-			{
-				if( lists[i][j] == 0)
-				{
-					lists[i][j] = 2; 	
-				}
-			}
-		}
-	}
-}
-
-static gboolean check_pair_list(gint l, gint m, gint n)
-{
-	int i;
-	for(i = 0; i < pair_count[l]; i++)
-	{
-		if( (pair_lists[l][i][0] == m) && (pair_lists[l][i][1] == n) )
-		{
-			return TRUE;
-		}
-	}
-	return FALSE;
-}		 
-
-static void print_pair_list()
-{
-	int i, j;
-	for(i = 0; i < num_regions;i++)
-	{
-		g_printf("Region %2d\n",i+1);
-		for(j = 0;j < pair_count[i]; j++)
-		{	
-			g_printf("%2d %2d\n",pair_lists[i][j][0],pair_lists[i][j][1]);
-		}	
-	}
-}
-
-static void p_queue_fill()
-{
-	gint i,j,n[3];
-	
-	for(i = 0; i < num_regions; i++)
-	{
-		if( count_layers[i] == 2)
-		{
-			for( j = 0; j < layer_num; j++)
-			{
-				if(lists[i][j] == 1)
-					n[1] = j;
-				if(lists[i][j] == 2)
-					n[2] = j;
-			}
-
-			n[0] = i;
-			pair_lists[i][pair_count[i]][0] = n[1];
-			pair_lists[i][pair_count[i]][1] = n[2];	
-			pair_count[i]++;
-			t_queue_push(&t_queue,&n[0]);
-
-		}
-	}
-
-	//t_queue_print(&t_queue);
-	
-	for(i = 0;i < num_regions; i++)
-	{
-		if( count_layers[i] > 2)
-		{
-			n[0] = i;
-			for( j = 0;j < layer_num; j++)
-			{
-				if(lists[i][j] == 1)
-					n[1] = j;
-			}
-			
-			for(j = 0;j < layer_num; j++)
-			{
-				if(lists[i][j] == 0)
-				{
-					n[2] = j;
-					pair_lists[i][pair_count[i]][0] = n[1];
-					pair_lists[i][pair_count[i]][1] = n[2];			
-					pair_count[i]++;
-					t_queue_push(&t_queue,&n[0]);
-				}
-
-			}
-			//t_queue_push(&t_queue,&n);
-			
-		}
-	}
-}
-
-static void p_queue_process()
-{
-	gint i;
-	gint *pair, reg, lay1, lay2, n[3];
-	
-	pair = (gint *)malloc( 3 * sizeof(gint));
-	
-	while(!t_queue_isempty(&t_queue))
-	{
-		pair = t_queue_pop(&t_queue);
-		reg = pair[0];
-		lay1 = pair[1];	
-		lay2 = pair[2];
-		for(i=0; i < num_regions; i++)
-		{
-			if(graph->edges[reg][i] == 1)
-			{
-				if( (lists[i][lay1] != -1) && (lists[i][lay2] != -1) )
-				{
-					if( check_pair_list(i,lay1,lay2) )
-					{	
-					}
-					else
-					{
-						n[0]=i;
-						n[1]=lay1;
-						n[2]=lay2;
-						pair_lists[i][pair_count[i]][0] = n[1];
-						pair_lists[i][pair_count[i]][1] = n[2];			
-						pair_count[i]++;
-						t_queue_push(&t_queue,&n[0]);
-					}
-				}
-			}			
-		}
-	}		
-}
-
-static void pair_lists_process()
-{
-	gint i, j, c, k;
-
-	for(i = 0; i < num_regions; i++)
-	{	
-		if( count_layers[i] > 2)
-		{
-			for(j = 0;j < layer_num; j++)
-			{
-				c = 0;
-				for(k = 0; k < pair_total_count[i]; k++)
-				{
-					if(c_pair_lists[i][k][0] == j)
-					{
-						c++;
-					}
-				}
-				g_printf("%2d %2d %2d %2d\n",i,j,c,count_layers[i]); 
-				lists[i][j] = count_layers[i] - c;
-			}
-		}
-	}
-}
-
-static void complete_pair_lists()
-{
-	gint i,j,k,c,lay1,lay2,temp;
-	
-	//Initialize Complete Pair Lists
-	c_pair_lists = (gint ***) malloc( num_regions * sizeof(gint*));
-	for(i = 0;i < num_regions; i++)
-	{
-		c = pair_total_count[i];
-
-		c_pair_lists[i] = (gint **)malloc( c * sizeof(gint **));
-	
-		for(j = 0;j < c; j++)
-		{	
-			c_pair_lists[i][j] = (gint *)malloc(3 * sizeof(gint ***));
-		}
-	}	
-	
-	// Find all pairs for all regions with layer count >= 2, whether correct or not
-	for(i = 0;i < num_regions; i++)
-	{
-		if(count_layers[i] >= 2)
-		{
-			c = 0;
-			for(j = 0; j < layer_num; j++)
-			{
-				if(lists[i][j] != -1)
-				{
-					for(k = j+1; k < layer_num; k++)
-					{
-						if(lists[i][k] != -1)
-						{
-							c_pair_lists[i][c][0] = j;
-							c_pair_lists[i][c][1] = k;
-							c_pair_lists[i][c][2] = 0;
-							c++;
-						}
-					}
-				}
-			}	
-		}
-	}
-	
-	print_c_pair_lists();
-
-	// Find all the pairs which are present in pair queue, ie, which are known and correct.
-	for(i = 0; i < num_regions; i++)
-	{
-		c = pair_total_count[i];
-		for(j = 0;j < c;j++)
-		{
-			lay1 = c_pair_lists[i][j][0];
-			lay2 = c_pair_lists[i][j][1];
-			if(check_pair_list(i,lay1,lay2))	
-			{
-				c_pair_lists[i][j][2] = 1;
-			}
-			else if(check_pair_list(i,lay2,lay1))
-			{		
-				c_pair_lists[i][j][1] = lay1;
-				c_pair_lists[i][j][0] = lay2;
-				c_pair_lists[i][j][2] = 1;
-			}
-			else
-			{
-			}
-		}
-	}
-
-	print_c_pair_lists_unsolved();
-
-	// This part need not be done, it will never invoked. But what it does is to enforce the global ordering for the unsolved pairs, 
-	// which is already done by the way we fill up c_pair_lists 
-	for(i = 0; i < num_regions; i++)
-	{
-		c = pair_total_count[i];
-		for(j = 0; j < c; j++)
-		{
-			if (c_pair_lists[i][j][2] == 0)
-			{
-				if(c_pair_lists[i][j][0] > c_pair_lists[i][j][1])
-				{
-					temp = c_pair_lists[i][j][0];
-					c_pair_lists[i][j][1] = c_pair_lists[i][j][0];
-					c_pair_lists[i][j][0] = temp;
-				}
-			}
-		}
-	}
-	
-	print_c_pair_lists();
-
-}
-
-static void print_c_pair_lists_unsolved()
-{
-	int i,j,c;
-
-	g_printf("\n\nC_PAIR_LISTS  : //(only unsolved pairs)\n");
-
-	for(i = 0;i < num_regions; i++)
-	{
-		g_printf("Region %2d\n",i+1);
-		c = pair_total_count[i];
-		for(j = 0; j < c; j++)
-		{	
-			if(c_pair_lists[i][j][2] == 0)
-			{
-				g_printf("%2d %2d %2d\n",c_pair_lists[i][j][0],c_pair_lists[i][j][1],c_pair_lists[i][j][2]);
-			}
-		}	
-	}
-}
-
-static void print_c_pair_lists()
-{
-	int i,j,c;
-	g_printf("\n\nC_PAIR_LISTS  :\n");
-	for(i = 0;i < num_regions; i++)
-	{
-		g_printf("Region %2d\n",i+1);
-		c = pair_total_count[i];
-		for(j = 0;j < c; j++)
-		{	
-			g_printf("%2d %2d %2d\n",c_pair_lists[i][j][0],c_pair_lists[i][j][1],c_pair_lists[i][j][2]);
-		}	
-	}
-}
-
-//
-static void assign_lists_to_graph_lists()
+//Restores the ListGraph Lists retrieved from the masks at the start of the session
+static void assign_lists_to_graph_lists(LL_SESSION *ses)
 {
  gint	i, j;
 
-	for(i = 0; i < num_regions; i++)
-		for(j = 0 ; j < layer_num ; j++)
-			if(lists[i][j] != -1)
-			 {
-				graph->lists[i][j] = lists[i][j];
-			 }
-			else
-				graph->lists[i][j] = 0;
-
-}
-
-//
-static void lg_retrieval_mask()
-{
-
-	g_printf("RETRIEVE_MASK_ENTER \n");
-
-	print_retrieved_lists();
-	
-	count_layers_init();	
-	
-	init_pair_lists();
-
-	masks_retrieve_top();
-
-	list_retrieve_second();
-
-	print_retrieved_lists();
-	g_printf("\n\n");
-
-	t_queue_init(&t_queue);
-
-	p_queue_fill();
-
-	//t_queue_print(&t_queue);
-	
-	p_queue_process();
-
-	print_pair_list();
-	g_printf("\n\n");
-
-	//t_queue_print(&t_queue);
-	g_printf("\n\n");
-
-	complete_pair_lists();
-	g_printf("\n\n");	
-
-	pair_lists_process();
-	g_printf("\n\n");
-
-	print_retrieved_lists();
-	g_printf("\n\n");
-
-	print_graph_lists();
-	g_printf("\n\n");
-
-	assign_lists_to_graph_lists();
+	for(i = 0; i < ses->num_regions; i++)
+		for(j = 0 ; j < ses->layer_num ; j++)
+			ses->graph->lists[i][j] = ses->lists[i][j];
 
 }
 
-static void masks_retrieve_top()
+//Retrieves the ListGraph Lists from the masks painted by a previous session of Local Layering
+//and keeps a copy of them in lists (restored if the session is cancelled)
+static void lg_retrieval_mask(LL_SESSION *ses)
 {
-		
- guchar		**pr_buf;
- gint		*y_off, *x_off;
- gint		m, n, i, k;
- gint 		x, y;
- gint		*regions_covered;
-
-	//if(layer_num != 1)
-	//{
+ LL_PLANE	*planes;
+ gint		*rows;
+ gint		i;
 
-	regions_covered = (gint *)malloc(num_regions * sizeof(gint));
-	for(i = 0; i < num_regions; i++)
-	{
-		regions_covered[i] = 0;
-	}
-
-	y_off = (gint *)malloc(layer_num * sizeof(gint));
-	x_off = (gint *)malloc(layer_num * sizeof(gint));
-
-	//pr_buf = g_new (guchar*, layer_num * (pr_mask[i]).mask.w * (pr_mask[i]).mask.h);
-
-	pr_buf = (guchar **)malloc(layer_num * sizeof(*pr_buf));
+	planes = g_new0(LL_PLANE, ses->layer_num);
 
-	for(i = 0; i < layer_num; i++)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-
-		if( (pr_mask[i]).process ) 
+		if( (ses->pr_mask[i]).process )
 		{
-		//pr_buf[i] = g_new (guchar, (pr_mask[i]).mask.w * (pr_mask[i]).mask.h);
-
-			pr_buf[i] = (guchar *)malloc((pr_mask[i]).mask.w * (pr_mask[i]).mask.h * sizeof(**pr_buf));
-
-			gimp_pixel_rgn_get_rect( &((pr_mask[i]).mask), pr_buf[i], 0, 0, (pr_mask[i]).mask.w,(pr_mask[i]).mask.h);
-
-			y_off[i] = (mask[i]).off_y + (pr_mask[i]).mask.y;
-			x_off[i] = (mask[i]).off_x + (pr_mask[i]).mask.x;
-
-		//g_free(pr_buf);
-
+			planes[i].x = (ses->mask[i]).off_x + (ses->pr_mask[i]).mask.x;
+			planes[i].y = (ses->mask[i]).off_y + (ses->pr_mask[i]).mask.y;
+			planes[i].w = (ses->pr_mask[i]).mask.w;
+			planes[i].h = (ses->pr_mask[i]).mask.h;
+			planes[i].buf = ll_scratch_get ((gsize) planes[i].w * planes[i].h);
+			LL_STATS_ALLOC(LL_MEM_PIXELS, (gsize) planes[i].w * planes[i].h);
+
+			gimp_pixel_rgn_get_rect( &((ses->pr_mask[i]).mask), planes[i].buf, (ses->pr_mask[i]).mask.x, (ses->pr_mask[i]).mask.y, planes[i].w, planes[i].h);
 		}
-
 	}
 
+	ll_map_retrieve(ses->ll_map, planes);
 
-	for(m = 0; m < image_height; m++)
-	{
-		for(n = 0; n < image_width; n++)
-		{
-			k = tags[m * image_width + n] - 1;
-
-			//g_printf("\n%d",k);
-
-			if(regions_covered[k] == 0)
-			{
-
-				//g_printf("\n%d",k);
-
-				for(i = 0; i < layer_num; i++)
-				{
-					if(m >= y_off[i] && n >=x_off[i] && m < (y_off[i] + (pr_mask[i]).mask.h) && n < (x_off[i] + (pr_mask[i]).mask.w))
-					{
-//						//*(*(pr_buf + i)  + ( (m - y_off[i]) * (pr_mask[i]).mask.w) + (n - x_off[i])) = 255;
-
-						//g_printf("\n%d %d %d",*(*(pr_buf + i)  + ( (m - y_off[i] + (pr_mask[i]).mask.y) * (pr_mask[i]).mask.w) + (n - x_off[i] + (pr_mask[i]).mask.x)),k,i);
-
-						if( *(*(pr_buf + i)  + ( (m - y_off[i] + (pr_mask[i]).mask.y) * (pr_mask[i]).mask.w) + (n - x_off[i] + (pr_mask[i]).mask.x))  == 255 )
-						{
-							lists[k][i] = 1;
-							regions_covered[k] = 1;
-						}	
-//						*(*(pr_buf + i)  + ( (m - y_off[i] + (pr_mask[i]).mask.y) * (pr_mask[i]).mask.w) + (n - x_off[i] + (pr_mask[i]).mask.x)) = 0;
-						//*(*(pr_buf + i)  + ( (m - y_off[i]) * (pr_mask[i]).mask.w) + (n - x_off[i])) = 0;
-
-					}
-				}
-
-			}
-		}
-	}
-//	}
-}
-
-//Initializes the elements of the queue
-//allocates memory for the queue array
-static void t_queue_init(LL_T_QUEUE * t_queue)
-{
-	int i;
-	t_queue->front = 0;
-	t_queue->back = 0;
-
-	t_queue->data = (gint **)malloc( QUEUE_ARRAY_SIZE * sizeof(gint*));
-	for(i = 0; i < QUEUE_ARRAY_SIZE; i++)
-	{
-		t_queue->data[i] = (gint *)malloc(3 * sizeof(gint**));
-	}
-}
-
-//checks whether the queue is empty
-static gboolean t_queue_isempty(LL_T_QUEUE *t_queue)
-{
-	if( t_queue->front == t_queue->back)
+	for(i = 0; i < ses->layer_num; i++)
 	{
-		//g_printf("QUEUE EMPTY");
-		return TRUE;
+		LL_STATS_FREE(LL_MEM_PIXELS, (gsize) planes[i].w * planes[i].h);
+		ll_scratch_put(planes[i].buf);
 	}
-	return FALSE; 
-}
-
-//Pushes the value passed as parameter to the back of the queue
-//increments back to point to space for next element
-static void t_queue_push(LL_T_QUEUE *t_queue, gint *n)
-{
-	t_queue->data[t_queue->back][0] = n[0];
-	t_queue->data[t_queue->back][1] = n[1];
-	t_queue->data[t_queue->back][2] = n[2];
-	t_queue->back++;
-}
 
-//returns the front element from the queue passed as parameter
-//increments front to point to a next value in queue
-static gint* t_queue_pop(LL_T_QUEUE *t_queue)
-{
- 	gint	*n;
-	n = (gint *)malloc(3 * sizeof(gint));
-	n[0] = n[1] = n[2] = -1;
+	g_free(planes);
+
+	ses->lists = LL_ARENA_NEW(ses->session_arena, gint *, ses->num_regions);
+	rows = LL_ARENA_NEW(ses->session_arena, gint, (gsize) ses->num_regions * ses->layer_num);
 
-	if(!t_queue_isempty(t_queue))
+	for(i = 0; i < ses->num_regions; i++)
 	{
-		n = t_queue->data[t_queue->front];
-		t_queue->front++;
+		ses->lists[i] = rows + (gsize) i * ses->layer_num;
+		memcpy(ses->lists[i], ses->graph->lists[i], ses->layer_num * sizeof(gint));
 	}
- 	return n;
 }
-
-static void t_queue_print(LL_T_QUEUE *t_queue)
-{
-	gint i;
-
-	g_printf("\nPRINT T_QUEUE : \n");
-	for(i=t_queue->front;i<t_queue->back;i++)
-	{
-		g_printf("%2d %2d %2d \n",t_queue->data[i][0]+1,t_queue->data[i][1],t_queue->data[i][2]);
-	}
-	g_printf("\n");
-}
-
-
-
-
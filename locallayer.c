@@ -0,0 +1,1220 @@
+/*
+ * locallayer : Local Layering of layered images outside GIMP
+ *
+ * Copyright (C) 2009-2010 SNS :)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Reads a manifest of layer images, builds the Region Map, applies the flips
+ * of the manifest (or of a flip script) and writes the layer masks painted
+ * exactly as the plug-in does, and optionally the composite image.
+ *
+ * Manifest format, one directive per line ('#' starts a comment),
+ * layers are listed top most first as in the GIMP layers dialog :
+ *
+ *	image	WIDTH HEIGHT
+ *	layer	FILE OFF_X OFF_Y [OPACITY [WIDTH HEIGHT CHANNELS]]
+ *	up	X Y LAYER
+ *	down	X Y LAYER
+ *	undo
+ *	cursor	X Y
+ *	script	FILE
+ *
+ * FILE is a PNG image, or raw 8 bit pixels when WIDTH HEIGHT CHANNELS are given.
+ * OPACITY is 0.0 - 1.0 (default 1.0), a layer with 0 opacity is absent everywhere.
+ * The image size defaults to the extent of the layers.
+ * up / down flip LAYER (index in the manifest, 0 is the top most) above / beneath
+ * the layer next to it in the region at X, Y, like the UP / DOWN buttons of the plug-in.
+ * cursor moves the cursor of the plug-in to X, Y (the flip dialog and the region boundary
+ * are updated) ; it only matters to --replay.
+ * script reads up / down / undo / cursor lines from another file.
+ *
+ * Outputs are written to OUTPUT/NAME/ where NAME is the manifest name without
+ * its .manifest suffix : mask-NN.png for every layer and composite.png.
+ *
+ * The plug-in records its sessions in this format when LL_RECORD is set (see local_layering.c).
+ * With --replay N the commands of every job are replayed N times, running after each command
+ * what the plug-in runs after a click : flip, mask painting, preview (composite), flip dialog
+ * (local stacking at the cursor) and region boundaries. The latency of every stage is reported
+ * as JSON on stdout (p50 / p95 / p99 and a histogram of the click to ready latency).
+ *
+ * When LL_TRACE is set the stages of every job are written as a trace (see ll_trace.c),
+ * each worker thread on its own track.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+#include <png.h>
+
+#include "ll_core.h"
+#include "ll_pool.h"
+#include "ll_scratch.h"
+#include "ll_trace.h"
+
+#define LL_ERROR		g_quark_from_static_string ("locallayer")
+
+#define MANIFEST_SUFFIX		".manifest"
+
+enum
+{
+	LL_CMD_UP,
+	LL_CMD_DOWN,
+	LL_CMD_UNDO,
+	LL_CMD_CURSOR
+};
+
+//Stages timed by --replay, in the order the plug-in runs them after a click
+enum
+{
+	REPLAY_FLIP,
+	REPLAY_MASK,
+	REPLAY_PREVIEW,
+	REPLAY_DIALOG,
+	REPLAY_BOUNDARY,
+	REPLAY_TOTAL,
+	REPLAY_STAGES
+};
+
+static const gchar	*replay_stages[REPLAY_STAGES] =
+{
+	"flip",
+	"mask_set_pixel",
+	"update_preview",
+	"create_flip_dialog",
+	"rg_boundary_rect_regions",
+	"click_to_ready"
+};
+
+//Holds one layer of a job : placement, opacity, RGBA pixels and mask
+typedef struct ll_job_layer
+{
+	gchar		*file;
+	gint		off_x;
+	gint		off_y;
+	gint		width;
+	gint		height;
+	gint		channels;
+	gdouble		opacity;
+	guchar		*pixels;
+	guchar		*mask;
+}LL_JOB_LAYER;
+
+//Holds one command of the flip script
+typedef struct ll_command
+{
+	gint		type;
+	gint		x;
+	gint		y;
+	gint		layer;
+}LL_COMMAND;
+
+//Holds the flips made by one UP or DOWN command so that it can be undone
+//flips holds {lower layer, higher layer, region} triples as in the plug-in's UNDO array
+typedef struct ll_undo
+{
+	gint		call_type;
+	GArray		*flips;
+}LL_UNDO;
+
+//Holds one job ie. one manifest
+typedef struct ll_job
+{
+	gchar		*manifest;
+	gchar		*name;
+	gint		width;
+	gint		height;
+	GArray		*layers;
+	GArray		*commands;
+}LL_JOB;
+
+//Holds the masks of a job being painted on the pool
+typedef struct ll_job_paint
+{
+	LL_JOB		*job;
+	LL_MAP		*map;
+	const gint	*top;
+}LL_JOB_PAINT;
+
+//Holds the options shared by all the jobs of a run
+typedef struct ll_batch
+{
+	gchar		*out_dir;
+	gboolean	composite;
+	gint		replay;
+	gint		failed;
+}LL_BATCH;
+
+//Holds the latencies (in ms) of every stage of the replayed clicks and cursor moves
+typedef struct ll_latency
+{
+	GArray		*clicks[REPLAY_STAGES];
+	GArray		*cursor[REPLAY_STAGES];
+}LL_LATENCY;
+
+static gint		n_workers = 1;
+static gchar		*out_dir = NULL;
+static gboolean		composite = FALSE;
+static gboolean		verbose = FALSE;
+static gint		replay = 0;
+
+static GOptionEntry	entries[] =
+{
+	{ "jobs",	'j', 0, G_OPTION_ARG_INT,	&n_workers,	"Number of jobs processed in parallel", "N" },
+	{ "output",	'o', 0, G_OPTION_ARG_FILENAME,	&out_dir,	"Directory for the outputs (default .)", "DIR" },
+	{ "composite",	'c', 0, G_OPTION_ARG_NONE,	&composite,	"Also write the composite image", NULL },
+	{ "verbose",	'v', 0, G_OPTION_ARG_NONE,	&verbose,	"Print the regions and flips of every job", NULL },
+	{ "replay",	'r', 0, G_OPTION_ARG_INT,	&replay,	"Replay the commands N times and report the latency of every stage", "N" },
+	{ NULL }
+};
+
+//Reads a PNG image as RGBA pixels
+static guchar * load_png(const gchar *file, gint *width, gint *height, GError **error)
+{
+ png_image	image;
+ guchar		*pixels;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+
+	if(!png_image_begin_read_from_file(&image, file))
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: %s", file, image.message);
+		return NULL;
+	}
+
+	image.format = PNG_FORMAT_RGBA;
+	pixels = g_new(guchar, PNG_IMAGE_SIZE(image));
+
+	if(!png_image_finish_read(&image, NULL, pixels, 0, NULL))
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: %s", file, image.message);
+		g_free(pixels);
+		return NULL;
+	}
+
+	*width  = image.width;
+	*height = image.height;
+
+	return pixels;
+}
+
+//Reads raw 8 bit pixels (gray, gray + alpha, RGB or RGBA) as RGBA pixels
+static guchar * load_raw(const gchar *file, gint width, gint height, gint channels, GError **error)
+{
+ gchar		*data;
+ gsize		length;
+ guchar		*pixels, *src, *dest;
+ gsize		i, pixels_num;
+
+	if(!g_file_get_contents(file, &data, &length, error))
+		return NULL;
+
+	if(length != (gsize) width * height * channels)
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: expected %d x %d x %d bytes, found %lu",
+			    file, width, height, channels, (gulong) length);
+		g_free(data);
+		return NULL;
+	}
+
+	pixels_num = (gsize) width * height;
+	pixels = g_new(guchar, pixels_num * 4);
+
+	src  = (guchar *) data;
+	dest = pixels;
+	for(i = 0; i < pixels_num; i++)
+	{
+		dest[0] = src[0];
+		dest[1] = (channels >= 3) ? src[1] : src[0];
+		dest[2] = (channels >= 3) ? src[2] : src[0];
+		dest[3] = (channels == 2 || channels == 4) ? src[channels - 1] : 255;
+
+		src  += channels;
+		dest += 4;
+	}
+
+	g_free(data);
+
+	return pixels;
+}
+
+//Writes w x h pixels of 1 (gray) or 4 (RGBA) bytes as a PNG image
+static gboolean save_png(const gchar *file, const guchar *pixels, gint w, gint h, gint bpp, GError **error)
+{
+ png_image	image;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width   = w;
+	image.height  = h;
+	image.format  = (bpp == 1) ? PNG_FORMAT_GRAY : PNG_FORMAT_RGBA;
+
+	if(!png_image_write_to_file(&image, file, 0, pixels, 0, NULL))
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: %s", file, image.message);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Makes a path relative to the directory of the manifest
+static gchar * job_path(const gchar *manifest, const gchar *file)
+{
+ gchar	*dir, *path;
+
+	if(g_path_is_absolute(file))
+		return g_strdup(file);
+
+	dir  = g_path_get_dirname(manifest);
+	path = g_build_filename(dir, file, NULL);
+	g_free(dir);
+
+	return path;
+}
+
+//Parses an integer field of a manifest line
+static gboolean parse_int(const gchar *field, gint *value)
+{
+ gchar	*end;
+
+	if(field == NULL)
+		return FALSE;
+
+	*value = (gint) g_ascii_strtoll(field, &end, 10);
+
+	return (end != field && *end == '\0');
+}
+
+//Parses one up / down / undo line into a command
+//Returns FALSE if the line is not a flip command
+static gboolean parse_command(gchar **fields, guint n, LL_COMMAND *cmd)
+{
+	if(strcmp(fields[0], "undo") == 0 && n == 1)
+	{
+		cmd->type = LL_CMD_UNDO;
+		cmd->x = cmd->y = cmd->layer = -1;
+		return TRUE;
+	}
+
+	if(strcmp(fields[0], "cursor") == 0 && n == 3)
+	{
+		cmd->type = LL_CMD_CURSOR;
+		cmd->layer = -1;
+		return parse_int(fields[1], &cmd->x) && parse_int(fields[2], &cmd->y);
+	}
+
+	if(n != 4)
+		return FALSE;
+
+	if(strcmp(fields[0], "up") == 0)
+		cmd->type = LL_CMD_UP;
+	else if(strcmp(fields[0], "down") == 0)
+		cmd->type = LL_CMD_DOWN;
+	else
+		return FALSE;
+
+	return parse_int(fields[1], &cmd->x) && parse_int(fields[2], &cmd->y) && parse_int(fields[3], &cmd->layer);
+}
+
+//Splits a manifest line into its blank separated fields, dropping the comment
+static gchar ** split_fields(gchar *line, guint *n)
+{
+ gchar		**parts, **fields;
+ guint		i;
+
+	if(strchr(line, '#') != NULL)
+		*strchr(line, '#') = '\0';
+
+	parts  = g_strsplit_set(g_strstrip(line), " \t\r", -1);
+	fields = g_new0(gchar *, g_strv_length(parts) + 1);
+
+	*n = 0;
+	for(i = 0; parts[i] != NULL; i++)
+	{
+		if(*parts[i] != '\0')
+			fields[(*n)++] = g_strdup(parts[i]);
+	}
+
+	g_strfreev(parts);
+
+	return fields;
+}
+
+//Reads a manifest (or a flip script if script is set) into the job
+static gboolean job_read(LL_JOB *job, const gchar *file, gboolean script, GError **error)
+{
+ gchar		*data, **lines, **fields;
+ LL_JOB_LAYER	lay;
+ LL_COMMAND	cmd;
+ gchar		*path;
+ guint		i, n;
+ gboolean	ok = TRUE;
+
+	if(!g_file_get_contents(file, &data, NULL, error))
+		return FALSE;
+
+	lines = g_strsplit(data, "\n", -1);
+	g_free(data);
+
+	for(i = 0; ok && lines[i] != NULL; i++)
+	{
+		fields = split_fields(lines[i], &n);
+
+		if(n == 0)
+		{
+			g_strfreev(fields);
+			continue;
+		}
+
+		if(parse_command(fields, n, &cmd))
+		{
+			g_array_append_val(job->commands, cmd);
+		}
+		else if(!script && strcmp(fields[0], "image") == 0 && n == 3)
+		{
+			ok = parse_int(fields[1], &job->width) && parse_int(fields[2], &job->height);
+		}
+		else if(!script && strcmp(fields[0], "layer") == 0 && (n == 4 || n == 5 || n == 8))
+		{
+			memset(&lay, 0, sizeof(lay));
+			lay.opacity = 1.0;
+
+			ok = parse_int(fields[2], &lay.off_x) && parse_int(fields[3], &lay.off_y);
+
+			if(ok && n >= 5)
+				lay.opacity = CLAMP(g_ascii_strtod(fields[4], NULL), 0.0, 1.0);
+
+			if(ok && n == 8)
+				ok = parse_int(fields[5], &lay.width) && parse_int(fields[6], &lay.height) &&
+				     parse_int(fields[7], &lay.channels) && lay.channels >= 1 && lay.channels <= 4;
+
+			lay.file = job_path(file, fields[1]);
+			g_array_append_val(job->layers, lay);
+		}
+		else if(!script && strcmp(fields[0], "script") == 0 && n == 2)
+		{
+			path = job_path(file, fields[1]);
+			ok = job_read(job, path, TRUE, error);
+			g_free(path);
+
+			if(!ok)
+			{
+				g_strfreev(fields);
+				break;
+			}
+		}
+		else
+		{
+			ok = FALSE;
+		}
+
+		if(!ok)
+			g_set_error(error, LL_ERROR, 0, "%s:%u: cannot parse '%s'", file, i + 1, fields[0]);
+
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+
+	return ok;
+}
+
+//Allocates a job for a manifest
+static LL_JOB * job_new(const gchar *manifest)
+{
+ LL_JOB	*job;
+ gchar	*base;
+
+	job = g_new0(LL_JOB, 1);
+
+	job->manifest = g_strdup(manifest);
+	job->layers   = g_array_new(FALSE, TRUE, sizeof(LL_JOB_LAYER));
+	job->commands = g_array_new(FALSE, TRUE, sizeof(LL_COMMAND));
+
+	base = g_path_get_basename(manifest);
+	if(g_str_has_suffix(base, MANIFEST_SUFFIX))
+		base[strlen(base) - strlen(MANIFEST_SUFFIX)] = '\0';
+	job->name = base;
+
+	return job;
+}
+
+//Frees the job and the pixels of its layers
+static void job_free(LL_JOB *job)
+{
+ LL_JOB_LAYER	*lay;
+ guint		i;
+
+	for(i = 0; i < job->layers->len; i++)
+	{
+		lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+		g_free(lay->file);
+		g_free(lay->pixels);
+		g_free(lay->mask);
+	}
+
+	g_array_free(job->layers, TRUE);
+	g_array_free(job->commands, TRUE);
+	g_free(job->manifest);
+	g_free(job->name);
+	g_free(job);
+}
+
+//Loads the pixels of all the layers of the job
+//and initializes their masks from their alpha (like GIMP_ADD_ALPHA_MASK)
+static gboolean job_load_layers(LL_JOB *job, GError **error)
+{
+ LL_JOB_LAYER	*lay;
+ guint		i;
+ gsize		p;
+
+	for(i = 0; i < job->layers->len; i++)
+	{
+		lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+
+		if(lay->channels != 0)
+		{
+			lay->pixels = load_raw(lay->file, lay->width, lay->height, lay->channels, error);
+		}
+		else
+		{
+			lay->pixels = load_png(lay->file, &lay->width, &lay->height, error);
+		}
+
+		if(lay->pixels == NULL)
+			return FALSE;
+
+		lay->mask = g_new(guchar, (gsize) lay->width * lay->height);
+		for(p = 0; p < (gsize) lay->width * lay->height; p++)
+			lay->mask[p] = lay->pixels[p * 4 + 3];
+	}
+
+	//image size defaults to the extent of the layers
+	if(job->width == 0 || job->height == 0)
+	{
+		job->width  = 0;
+		job->height = 0;
+
+		for(i = 0; i < job->layers->len; i++)
+		{
+			lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+			job->width  = MAX(job->width, lay->off_x + lay->width);
+			job->height = MAX(job->height, lay->off_y + lay->height);
+		}
+	}
+
+	if(job->width <= 0 || job->height <= 0)
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: empty image", job->manifest);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Gets the part of a layer inside the image, in image and in layer coordinates
+//Returns FALSE if the layer does not intersect the image
+static gboolean layer_overlap(LL_JOB *job, LL_JOB_LAYER *lay, gint *x, gint *y, gint *w, gint *h)
+{
+	*x = MAX(lay->off_x, 0);
+	*y = MAX(lay->off_y, 0);
+	*w = MIN(lay->off_x + lay->width, job->width) - *x;
+	*h = MIN(lay->off_y + lay->height, job->height) - *y;
+
+	return (*w > 0 && *h > 0);
+}
+
+//Copies the w x h rectangle at x, y (image space) between a layer plane of bpp bytes
+//and a packed buffer ; to_buf selects the direction
+static void layer_copy_rect(LL_JOB_LAYER *lay, guchar *plane, gint bpp, guchar *buf, gint x, gint y, gint w, gint h, gboolean to_buf)
+{
+ guchar	*row;
+ gint	m;
+
+	for(m = 0; m < h; m++)
+	{
+		row = plane + ((gsize) (y - lay->off_y + m) * lay->width + (x - lay->off_x)) * bpp;
+
+		if(to_buf)
+			memcpy(buf + (gsize) m * w * bpp, row, (gsize) w * bpp);
+		else
+			memcpy(row, buf + (gsize) m * w * bpp, (gsize) w * bpp);
+	}
+}
+
+//Stores a recursive flip in the undo entry of the command
+static void job_record(gint i1, gint i2, gint l, gpointer data)
+{
+ LL_UNDO	*undo = data;
+ gint		flip[3];
+
+	flip[0] = (undo->call_type == 0) ? i2 : i1;
+	flip[1] = (undo->call_type == 0) ? i1 : i2;
+	flip[2] = l;
+
+	g_array_append_val(undo->flips, flip);
+}
+
+//Frees the undo entries of the commands
+static void undos_free(GPtrArray *undos)
+{
+ LL_UNDO	*undo;
+ guint		i;
+
+	for(i = 0; i < undos->len; i++)
+	{
+		undo = g_ptr_array_index(undos, i);
+		g_array_free(undo->flips, TRUE);
+		g_free(undo);
+	}
+	g_ptr_array_free(undos, TRUE);
+}
+
+//Applies one up / down / undo command to the Region Map
+//undos holds the undo entries of the previous commands
+//Returns the number of flips (including the recursive ones) made
+static gint job_command(LL_JOB *job, LL_MAP *map, GPtrArray *undos, LL_COMMAND *cmd)
+{
+ LL_UNDO	*undo;
+ gint		flip[3];
+ gint		region, other, count;
+
+	if(cmd->type == LL_CMD_CURSOR)
+		return 0;
+
+	if(cmd->type == LL_CMD_UNDO)
+	{
+		if(undos->len == 0)
+			return 0;
+
+		undo = g_ptr_array_index(undos, undos->len - 1);
+		g_ptr_array_remove_index(undos, undos->len - 1);
+
+		ll_map_undo_flips(map, undo->call_type, (gint (*)[3]) undo->flips->data, undo->flips->len - 1);
+
+		count = undo->flips->len;
+		g_array_free(undo->flips, TRUE);
+		g_free(undo);
+		return count;
+	}
+
+	region = ll_map_region_at(map, cmd->x, cmd->y);
+
+	if(region < 0 || cmd->layer < 0 || cmd->layer >= map->layer_num)
+	{
+		g_printerr("%s: flip at %d,%d of layer %d is out of bounds\n", job->name, cmd->x, cmd->y, cmd->layer);
+		return 0;
+	}
+
+	if(cmd->type == LL_CMD_UP)
+		other = ll_map_layer_above(map, region, cmd->layer);
+	else
+		other = ll_map_layer_below(map, region, cmd->layer);
+
+	//Layer already at the top (bottom) or absent from the region
+	if(other == -1)
+		return 0;
+
+	undo = g_new(LL_UNDO, 1);
+	undo->call_type = cmd->type;
+	undo->flips = g_array_new(FALSE, FALSE, sizeof(flip));
+
+	flip[0] = (cmd->type == LL_CMD_UP) ? other : cmd->layer;
+	flip[1] = (cmd->type == LL_CMD_UP) ? cmd->layer : other;
+	flip[2] = region;
+	g_array_append_val(undo->flips, flip);
+
+	if(cmd->type == LL_CMD_UP)
+		ll_map_flip_up(map, cmd->layer, other, region, TRUE, job_record, undo);
+	else
+		ll_map_flip_down(map, cmd->layer, other, region, TRUE, job_record, undo);
+
+	g_ptr_array_add(undos, undo);
+
+	return undo->flips->len;
+}
+
+//Applies the flip script of the job to the Region Map
+//Returns the number of flips (including the recursive ones) made
+static gint job_flip(LL_JOB *job, LL_MAP *map)
+{
+ GPtrArray	*undos;
+ gint		count = 0;
+ guint		i;
+
+	undos = g_ptr_array_new();
+
+	for(i = 0; i < job->commands->len; i++)
+		count += job_command(job, map, undos, &g_array_index(job->commands, LL_COMMAND, i));
+
+	undos_free(undos);
+
+	return count;
+}
+
+//Paints the masks of the layers first to last - 1 (each layer has its own mask)
+static void job_paint_layers(gint first, gint last, gpointer data)
+{
+ LL_JOB_PAINT	*p = data;
+ LL_JOB_LAYER	*lay;
+ guchar		*buf;
+ gint		x, y, w, h;
+ gint		i;
+
+	for(i = first; i < last; i++)
+	{
+		lay = &g_array_index(p->job->layers, LL_JOB_LAYER, i);
+
+		if(!layer_overlap(p->job, lay, &x, &y, &w, &h))
+			continue;
+
+		buf = ll_scratch_get((gsize) w * h);
+		layer_copy_rect(lay, lay->mask, 1, buf, x, y, w, h, TRUE);
+		ll_map_paint_mask(p->map, p->top, i, buf, x, y, w, h);
+		layer_copy_rect(lay, lay->mask, 1, buf, x, y, w, h, FALSE);
+		ll_scratch_put(buf);
+	}
+}
+
+//Paints the masks of all the layers for the regions set in the reg_affected array
+//The layers are painted in parallel on the pool (one at a time for a map in tiles)
+static void job_paint_masks(LL_JOB *job, LL_MAP *map)
+{
+ LL_JOB_PAINT	p;
+ gint		*top;
+
+	top = ll_map_top_layers(map);
+
+	p.job = job;
+	p.map = map;
+	p.top = top;
+
+	if(map->tag_tiles != NULL)
+		job_paint_layers(0, job->layers->len, &p);
+	else
+		ll_pool_for(0, job->layers->len, 1, job_paint_layers, &p);
+
+	g_free(top);
+}
+
+//Composites the layers, bottom most first, with their opacity and masks
+//(GIMP normal mode)
+static guchar * job_composite(LL_JOB *job)
+{
+ LL_JOB_LAYER	*lay;
+ guchar		*image, *src, *dest;
+ gdouble	a, da, oa;
+ gint		x, y, w, h, m, n, k;
+ gsize		c;
+ gint		i;
+
+	image = g_new0(guchar, (gsize) job->width * job->height * 4);
+
+	for(i = job->layers->len - 1; i >= 0; i--)
+	{
+		lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+
+		if(lay->opacity == 0.0 || !layer_overlap(job, lay, &x, &y, &w, &h))
+			continue;
+
+		for(m = y; m < y + h; m++)
+		{
+			for(n = x; n < x + w; n++)
+			{
+				c    = (gsize) (m - lay->off_y) * lay->width + (n - lay->off_x);
+				src  = lay->pixels + c * 4;
+				dest = image + ((gsize) m * job->width + n) * 4;
+
+				a  = src[3] / 255.0 * lay->opacity * lay->mask[c] / 255.0;
+				da = dest[3] / 255.0;
+				oa = a + da * (1.0 - a);
+
+				if(oa <= 0.0)
+					continue;
+
+				for(k = 0; k < 3; k++)
+					dest[k] = (guchar) ((src[k] * a + dest[k] * da * (1.0 - a)) / oa + 0.5);
+
+				dest[3] = (guchar) (oa * 255.0 + 0.5);
+			}
+		}
+	}
+
+	return image;
+}
+
+//Gets the local stacking of the layers of region l, top most first, as listed by the flip dialog
+//order holds one entry per layer, -1 after the layers present in the region
+static void region_stack(LL_MAP *map, gint l, gint *order)
+{
+ gint	j;
+
+	for(j = 0; j < map->layer_num; j++)
+		order[j] = -1;
+
+	for(j = 0; j < map->layer_num; j++)
+	{
+		if(map->graph->lists[l][j] != 0)
+			order[map->graph->lists[l][j] - 1] = j;
+	}
+}
+
+//Adds the time elapsed on the timer (in ms) to the samples of a stage
+static void latency_add(GArray *samples, GTimer *timer)
+{
+ gdouble	ms;
+
+	ms = g_timer_elapsed(timer, NULL) * 1000;
+	g_array_append_val(samples, ms);
+}
+
+//Replays the commands of the job, runs times, from the initial stacking of the layers
+//After every command the stages the plug-in runs after a click (or a cursor move) are timed
+//Returns the number of flips made by the last replay
+static gint job_replay(LL_JOB *job, LL_MAP *map, gint runs, LL_LATENCY *lat)
+{
+ GPtrArray	*undos;
+ GTimer		*timer, *total;
+ GArray		**samples;
+ LL_COMMAND	*cmd;
+ LL_RECT	*rects;
+ gint		*order;
+ gint		run, region, x, y, w, h, cur_x, cur_y;
+ gint		count = 0;
+ guint		i;
+
+	timer = g_timer_new();
+	total = g_timer_new();
+	order = g_new(gint, map->layer_num);
+
+	for(run = 0; run < runs; run++)
+	{
+		//Region growing again resets the ListGraph
+		ll_map_extract_tags(map);
+
+		undos = g_ptr_array_new();
+		cur_x = cur_y = 0;
+		count = 0;
+
+		for(i = 0; i < job->commands->len; i++)
+		{
+			cmd = &g_array_index(job->commands, LL_COMMAND, i);
+
+			if(cmd->type != LL_CMD_UNDO)
+			{
+				cur_x = cmd->x;
+				cur_y = cmd->y;
+			}
+
+			//Like the plug-in, a cursor out of the image is reset to (0,0)
+			region = ll_map_region_at(map, cur_x, cur_y);
+			if(region < 0)
+				region = ll_map_region_at(map, 0, 0);
+
+			samples = (cmd->type == LL_CMD_CURSOR) ? lat->cursor : lat->clicks;
+
+			g_timer_start(total);
+
+			if(cmd->type != LL_CMD_CURSOR)
+			{
+				ll_map_set_affected(map, FALSE);
+
+				g_timer_start(timer);
+				count += job_command(job, map, undos, cmd);
+				latency_add(samples[REPLAY_FLIP], timer);
+
+				g_timer_start(timer);
+				job_paint_masks(job, map);
+				latency_add(samples[REPLAY_MASK], timer);
+
+				g_timer_start(timer);
+				g_free(job_composite(job));
+				latency_add(samples[REPLAY_PREVIEW], timer);
+			}
+
+			g_timer_start(timer);
+			region_stack(map, region, order);
+			latency_add(samples[REPLAY_DIALOG], timer);
+
+			//Boundary of the regions affected by a click, or of the region under the cursor
+			g_timer_start(timer);
+			if(cmd->type == LL_CMD_CURSOR)
+			{
+				ll_map_boundary_rect(map, region, &x, &y, &w, &h);
+			}
+			else
+			{
+				rects = g_new(LL_RECT, map->num_regions);
+				ll_map_boundary_rects(map, map->reg_affected, rects);
+				g_free(rects);
+			}
+			latency_add(samples[REPLAY_BOUNDARY], timer);
+
+			latency_add(samples[REPLAY_TOTAL], total);
+		}
+
+		undos_free(undos);
+	}
+
+	g_free(order);
+	g_timer_destroy(timer);
+	g_timer_destroy(total);
+
+	return count;
+}
+
+static gint latency_compare(gconstpointer a, gconstpointer b)
+{
+ gdouble	x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+	return (x > y) - (x < y);
+}
+
+//Returns the p-th percentile (nearest rank) of sorted samples
+static gdouble latency_percentile(GArray *samples, gdouble p)
+{
+ gint	k;
+
+	k = (gint) ceil(p / 100 * samples->len) - 1;
+
+	return g_array_index(samples, gdouble, CLAMP(k, 0, (gint) samples->len - 1));
+}
+
+//Appends the p50 / p95 / p99 of every stage of one kind of event to the report
+static void latency_stages(GString *out, const gchar *name, GArray **samples)
+{
+ gint	s;
+
+	g_string_append_printf(out, ", \"%s\": {\"count\": %u", name, samples[REPLAY_TOTAL]->len);
+
+	for(s = 0; s < REPLAY_STAGES && samples[REPLAY_TOTAL]->len > 0; s++)
+	{
+		if(samples[s]->len == 0)
+			continue;
+
+		g_array_sort(samples[s], latency_compare);
+		g_string_append_printf(out, ", \"%s\": {\"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f}",
+				       replay_stages[s], latency_percentile(samples[s], 50),
+				       latency_percentile(samples[s], 95), latency_percentile(samples[s], 99));
+	}
+
+	g_string_append(out, "}");
+}
+
+//Prints the latency report of a replayed job as one line of JSON
+//with a histogram of the click to ready latency in power of 2 buckets of ms (le : upper bound)
+static void latency_print(LL_JOB *job, LL_MAP *map, gint runs, LL_LATENCY *lat)
+{
+ GString	*out;
+ GArray		*total = lat->clicks[REPLAY_TOTAL];
+ gdouble	bound;
+ gint		count;
+ guint		i;
+
+	out = g_string_new(NULL);
+
+	g_string_append_printf(out, "{\"job\": \"%s\", \"width\": %d, \"height\": %d, \"layers\": %d, \"regions\": %d, \"replays\": %d",
+			       job->name, job->width, job->height, map->layer_num, map->num_regions, runs);
+
+	latency_stages(out, "clicks", lat->clicks);
+	latency_stages(out, "cursor", lat->cursor);
+
+	//total is sorted by latency_stages
+	g_string_append(out, ", \"click_to_ready_histogram\": [");
+
+	i = 0;
+	for(bound = 1; i < total->len; bound *= 2)
+	{
+		count = 0;
+		while(i < total->len && g_array_index(total, gdouble, i) <= bound)
+		{
+			count++;
+			i++;
+		}
+
+		g_string_append_printf(out, "%s{\"le_ms\": %g, \"count\": %d}", (bound == 1) ? "" : ", ", bound, count);
+	}
+
+	g_string_append(out, "]}\n");
+
+	g_print("%s", out->str);
+	g_string_free(out, TRUE);
+}
+
+//Processes one job : Region Map, flips, masks and composite
+static gboolean job_run(LL_JOB *job, LL_BATCH *batch, GError **error)
+{
+ LL_MAP		*map;
+ LL_JOB_LAYER	*lay;
+ LL_LATENCY	lat;
+ guchar		*buf;
+ gchar		*dir, *file, *name;
+ gint		x, y, w, h;
+ gint		flips, s;
+ guint		i;
+ gboolean	ok = TRUE;
+
+	LL_TRACE_BEGIN("job_load");
+	ok = job_read(job, job->manifest, FALSE, error) && job_load_layers(job, error);
+	LL_TRACE_END("job_load");
+
+	if(!ok)
+		return FALSE;
+
+	if(job->layers->len == 0)
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: no layers", job->manifest);
+		return FALSE;
+	}
+
+	if(ll_pixels(job->width, job->height) == 0)
+	{
+		g_set_error(error, LL_ERROR, 0, "%s: %d x %d image too large", job->manifest, job->width, job->height);
+		return FALSE;
+	}
+
+	LL_TRACE_BEGIN("extract_layer_code");
+
+	map = ll_map_new(job->width, job->height, job->layers->len);
+
+	//Layer code of every pixel
+	for(i = 0; i < job->layers->len; i++)
+	{
+		lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+
+		//If Opacity is 0 , assume Layer absent at all its Pixel Locations
+		if(lay->opacity == 0.0 || !layer_overlap(job, lay, &x, &y, &w, &h))
+			continue;
+
+		buf = ll_scratch_get((gsize) w * h * 4);
+		layer_copy_rect(lay, lay->pixels, 4, buf, x, y, w, h, TRUE);
+		ll_map_add_layer(map, i, buf, 4, TRUE, x, y, w, h);
+		ll_scratch_put(buf);
+	}
+
+	LL_TRACE_END("extract_layer_code");
+
+	LL_TRACE_BEGIN("extract_tags");
+	ll_map_extract_tags(map);
+	LL_TRACE_END("extract_tags");
+
+	if(batch->replay > 0)
+	{
+		for(s = 0; s < REPLAY_STAGES; s++)
+		{
+			lat.clicks[s] = g_array_new(FALSE, FALSE, sizeof(gdouble));
+			lat.cursor[s] = g_array_new(FALSE, FALSE, sizeof(gdouble));
+		}
+
+		flips = job_replay(job, map, batch->replay, &lat);
+		latency_print(job, map, batch->replay, &lat);
+
+		for(s = 0; s < REPLAY_STAGES; s++)
+		{
+			g_array_free(lat.clicks[s], TRUE);
+			g_array_free(lat.cursor[s], TRUE);
+		}
+	}
+	else
+	{
+		LL_TRACE_BEGIN("job_flip");
+		flips = job_flip(job, map);
+		LL_TRACE_END("job_flip");
+	}
+
+	//Mask Painting of all the regions
+	LL_TRACE_BEGIN("job_paint_masks");
+	ll_map_set_affected(map, TRUE);
+	job_paint_masks(job, map);
+	LL_TRACE_END("job_paint_masks");
+
+	LL_TRACE_BEGIN("job_save");
+
+	dir = g_build_filename(batch->out_dir, job->name, NULL);
+	g_mkdir_with_parents(dir, 0755);
+
+	for(i = 0; ok && i < job->layers->len; i++)
+	{
+		lay = &g_array_index(job->layers, LL_JOB_LAYER, i);
+
+		name = g_strdup_printf("mask-%02u.png", i);
+		file = g_build_filename(dir, name, NULL);
+		ok = save_png(file, lay->mask, lay->width, lay->height, 1, error);
+		g_free(file);
+		g_free(name);
+	}
+
+	if(ok && batch->composite)
+	{
+		buf  = job_composite(job);
+		file = g_build_filename(dir, "composite.png", NULL);
+		ok = save_png(file, buf, job->width, job->height, 4, error);
+		g_free(file);
+		g_free(buf);
+	}
+
+	LL_TRACE_END("job_save");
+
+	if(ok && verbose)
+		g_printerr("%s: %d x %d, %u layers, %d regions, %d flips\n",
+			   job->name, job->width, job->height, job->layers->len, map->num_regions, flips);
+
+	g_free(dir);
+	ll_map_free(map);
+
+	return ok;
+}
+
+//Thread pool worker : runs one job and reports its failure
+static void job_worker(gpointer data, gpointer user_data)
+{
+ LL_JOB		*job = data;
+ LL_BATCH	*batch = user_data;
+ GError		*error = NULL;
+
+	ll_trace_thread("worker");
+	LL_TRACE_BEGIN("job");
+
+	if(!job_run(job, batch, &error))
+	{
+		g_printerr("%s: %s\n", job->name, error ? error->message : "failed");
+		g_clear_error(&error);
+		g_atomic_int_inc(&batch->failed);
+	}
+
+	job_free(job);
+
+	LL_TRACE_END("job");
+}
+
+//Orders the manifests of a jobs directory by name
+static gint manifest_compare(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+//Collects the manifests of a jobs directory, sorted by name
+static GPtrArray * jobs_list(const gchar *path, GError **error)
+{
+ GPtrArray	*jobs;
+ GDir		*dir;
+ const gchar	*name;
+
+	jobs = g_ptr_array_new();
+
+	if(!g_file_test(path, G_FILE_TEST_IS_DIR))
+	{
+		g_ptr_array_add(jobs, g_strdup(path));
+		return jobs;
+	}
+
+	dir = g_dir_open(path, 0, error);
+	if(dir == NULL)
+	{
+		g_ptr_array_free(jobs, TRUE);
+		return NULL;
+	}
+
+	while((name = g_dir_read_name(dir)) != NULL)
+	{
+		if(g_str_has_suffix(name, MANIFEST_SUFFIX))
+			g_ptr_array_add(jobs, g_build_filename(path, name, NULL));
+	}
+
+	g_dir_close(dir);
+
+	g_ptr_array_sort(jobs, manifest_compare);
+
+	return jobs;
+}
+
+int main(int argc, char **argv)
+{
+ GOptionContext	*context;
+ GThreadPool	*pool;
+ GPtrArray	*manifests;
+ GError		*error = NULL;
+ LL_BATCH	batch;
+ gint		i;
+ guint		j;
+
+	context = g_option_context_new("MANIFEST|JOBDIR... - Local Layering of layered images");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error) || argc < 2)
+	{
+		g_printerr("%s\nUsage: %s [-j N] [-o DIR] [-c] [-r N] MANIFEST|JOBDIR...\n",
+			   error ? error->message : "No manifest given", argv[0]);
+		return 2;
+	}
+	g_option_context_free(context);
+
+	if(!g_thread_supported())
+		g_thread_init(NULL);
+
+	ll_trace_init("locallayer");
+
+	batch.out_dir   = out_dir ? out_dir : ".";
+	batch.composite = composite;
+	batch.replay    = replay;
+	batch.failed    = 0;
+
+	//Replayed jobs are timed one at a time
+	if(replay > 0)
+		n_workers = 1;
+
+	pool = g_thread_pool_new(job_worker, &batch, MAX(n_workers, 1), TRUE, &error);
+	if(pool == NULL)
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	for(i = 1; i < argc; i++)
+	{
+		manifests = jobs_list(argv[i], &error);
+		if(manifests == NULL)
+		{
+			g_printerr("%s\n", error->message);
+			g_clear_error(&error);
+			batch.failed++;
+			continue;
+		}
+
+		for(j = 0; j < manifests->len; j++)
+		{
+			g_thread_pool_push(pool, job_new(g_ptr_array_index(manifests, j)), NULL);
+			g_free(g_ptr_array_index(manifests, j));
+		}
+
+		g_ptr_array_free(manifests, TRUE);
+	}
+
+	//Wait for all the jobs
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	ll_trace_write();
+
+	ll_scratch_trim();
+
+	return (batch.failed == 0) ? 0 : 1;
+}